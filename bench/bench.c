@@ -0,0 +1,558 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the core. Microbenchmarks time single handlers through
+ * ch8_exec, sprite drawing, the disassembler and ROM loading in batches,
+ * macro benchmarks run whole programs headless on every engine. Every
+ * benchmark is timed over many samples and reported as operations per
+ * second at the slowest sample, the median and the 99th percentile, then
+ * written as JSON and compared against an earlier run if one is given.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../chip8.h"
+#include "../file.h"
+
+#define BENCH_SAMPLES       301
+#define BENCH_MACRO_SAMPLES 15
+#define BENCH_MAX_RESULTS   256
+#define BENCH_NAME_MAX      64
+
+/* instructions per ch8_exec batch, and per macro benchmark sample */
+#define MICRO_BATCH         1024
+#define MACRO_CYCLES        200000
+/* instructions between timer ticks in macro benchmarks, like -f 1000 */
+#define MACRO_FRAME         1000
+
+/* a change in median beyond this is called out in the comparison */
+#define BENCH_NOISE_PCT     5.0
+
+typedef struct {
+    char name[BENCH_NAME_MAX];
+    /* what one operation is */
+    const char *unit;
+    uint64_t ops;
+    double min;
+    double median;
+    double p99;
+} result_t;
+
+static result_t results[BENCH_MAX_RESULTS];
+static uint32_t result_count;
+
+static double samples[BENCH_SAMPLES];
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Turn sample times of ops operations each into rates. The slowest sample
+ * gives min, p99 is the rate 99% of the samples reached.
+ */
+static void record(const char *name, const char *unit, uint64_t ops, double *t, uint32_t n)
+{
+    if(result_count == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "Too many results, dropping %s\n", name);
+        return;
+    }
+
+    qsort(t, n, sizeof(t[0]), cmp_double);
+    uint32_t p99 = (n * 99 + 99) / 100 - 1;
+    if(p99 >= n) {
+        p99 = n - 1;
+    }
+
+    result_t *r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    r->ops = ops;
+    r->min = ops / t[n - 1];
+    r->median = ops / t[n / 2];
+    r->p99 = ops / t[p99];
+
+    printf("%-28s %14.0f %14.0f %14.0f  %s/s\n", r->name, r->min, r->median, r->p99, unit);
+}
+
+/* --- Microbenchmarks --- */
+
+typedef struct {
+    const char *name;
+    uint16_t opcode;
+    /* executed after opcode in the same batch, to keep CALL balanced */
+    uint16_t pair;
+} micro_op_t;
+
+static const micro_op_t micro_ops[] = {
+    { "0nnn NOP",       0x0000, 0 },
+    { "00E0 CLS",       0x00E0, 0 },
+    { "2nnn CALL+RET",  0x2300, 0x00EE },
+    { "1nnn JP",        0x1300, 0 },
+    { "3xkk SE",        0x3001, 0 },
+    { "4xkk SNE",       0x4001, 0 },
+    { "5xy0 SE",        0x5010, 0 },
+    { "6xkk LD",        0x6A12, 0 },
+    { "7xkk ADD",       0x7A01, 0 },
+    { "8xy0 LD",        0x8010, 0 },
+    { "8xy1 OR",        0x8011, 0 },
+    { "8xy2 AND",       0x8012, 0 },
+    { "8xy3 XOR",       0x8013, 0 },
+    { "8xy4 ADD",       0x8014, 0 },
+    { "8xy5 SUB",       0x8015, 0 },
+    { "8xy6 SHR",       0x8016, 0 },
+    { "8xy7 SUBN",      0x8017, 0 },
+    { "8xyE SHL",       0x801E, 0 },
+    { "9xy0 SNE",       0x9010, 0 },
+    { "Annn LD I",      0xA300, 0 },
+    { "Bnnn JP V0",     0xB300, 0 },
+    { "Cxkk RND",       0xC2FF, 0 },
+    { "Ex9E SKP",       0xE09E, 0 },
+    { "ExA1 SKNP",      0xE0A1, 0 },
+    { "Fx07 LD DT",     0xF007, 0 },
+    { "Fx0A LD K",      0xF00A, 0 },
+    { "Fx15 LD DT",     0xF015, 0 },
+    { "Fx18 LD ST",     0xF018, 0 },
+    { "Fx1E ADD I",     0xF01E, 0 },
+    { "Fx29 LD F",      0xF029, 0 },
+    { "Fx33 LD B",      0xF033, 0 },
+    { "Fx55 LD [I]",    0xFF55, 0 },
+    { "Fx65 LD [I]",    0xFF65, 0 }
+};
+
+static const uint8_t drw_heights[] = { 1, 2, 4, 8, 15 };
+
+/* state every batch starts from, registers nonzero so nothing is trivial */
+static void micro_state(ch8_t *vm)
+{
+    ch8_init(vm);
+    for(uint8_t r = 0; r < 16; ++r) {
+        vm->v[r] = 0x11 * r + 3;
+    }
+    vm->i = 0x300;
+    for(uint16_t a = 0x300; a < 0x400; ++a) {
+        vm->ram[a] = a * 37;
+    }
+}
+
+static void bench_op(const char *name, uint16_t opcode, uint16_t pair)
+{
+    static ch8_t base, vm;
+    char full[BENCH_NAME_MAX];
+
+    micro_state(&base);
+    for(uint32_t s = 0; s <= BENCH_SAMPLES; ++s) {
+        memcpy(&vm, &base, sizeof(vm));
+        double t = now_s();
+        if(pair) {
+            for(uint32_t k = 0; k < MICRO_BATCH / 2; ++k) {
+                ch8_exec(&vm, opcode);
+                ch8_exec(&vm, pair);
+            }
+        } else {
+            for(uint32_t k = 0; k < MICRO_BATCH; ++k) {
+                ch8_exec(&vm, opcode);
+            }
+        }
+        /* the first batch warms up the caches and is not counted */
+        if(s > 0) {
+            samples[s - 1] = now_s() - t;
+        }
+    }
+
+    snprintf(full, sizeof(full), "op/%s", name);
+    record(full, "insn", MICRO_BATCH, samples, BENCH_SAMPLES);
+}
+
+static void bench_micro(void)
+{
+    for(size_t k = 0; k < sizeof(micro_ops) / sizeof(micro_ops[0]); ++k) {
+        bench_op(micro_ops[k].name, micro_ops[k].opcode, micro_ops[k].pair);
+    }
+
+    for(size_t k = 0; k < sizeof(drw_heights); ++k) {
+        char name[BENCH_NAME_MAX];
+        snprintf(name, sizeof(name), "Dxyn DRW n=%u", drw_heights[k]);
+        bench_op(name, 0xD010 | drw_heights[k], 0);
+    }
+}
+
+static void bench_disasm(void)
+{
+    const uint32_t batch = 4096;
+    char buf[CH8_DISASM_MAX];
+    uint32_t opcode = 0;
+
+    for(uint32_t s = 0; s <= BENCH_SAMPLES; ++s) {
+        double t = now_s();
+        for(uint32_t k = 0; k < batch; ++k) {
+            ch8_disassemble_r(opcode++ & 0xFFFF, buf, sizeof(buf));
+        }
+        if(s > 0) {
+            samples[s - 1] = now_s() - t;
+        }
+    }
+
+    record("disasm/ch8_disassemble", "insn", batch, samples, BENCH_SAMPLES);
+}
+
+static void bench_load(void)
+{
+    static ch8_t vm;
+    static uint8_t rom[VM_RAM_SIZE - VM_EXEC_START_ADDR];
+    char path[] = "/tmp/hnc8_bench_XXXXXX";
+
+    for(size_t k = 0; k < sizeof(rom); ++k) {
+        rom[k] = k * 13;
+    }
+    int fd = mkstemp(path);
+    if(fd < 0 || write(fd, rom, sizeof(rom)) != (ssize_t)sizeof(rom)) {
+        fprintf(stderr, "Could not write a ROM to load, skipping load benchmarks\n");
+        if(fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return;
+    }
+    close(fd);
+
+    for(uint32_t s = 0; s <= BENCH_SAMPLES; ++s) {
+        uint16_t *mem;
+        size_t sz;
+        double t = now_s();
+        if(load_file(path, &mem, &sz) != 0) {
+            break;
+        }
+        ch8_load(&vm, mem, sz);
+        unload_file(mem, sz);
+        if(s > 0) {
+            samples[s - 1] = now_s() - t;
+        }
+    }
+    record("load/load_file+ch8_load", "rom", 1, samples, BENCH_SAMPLES);
+
+    for(uint32_t s = 0; s <= BENCH_SAMPLES; ++s) {
+        double t = now_s();
+        ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+        if(s > 0) {
+            samples[s - 1] = now_s() - t;
+        }
+    }
+    record("load/ch8_load", "rom", 1, samples, BENCH_SAMPLES);
+
+    unlink(path);
+}
+
+/* --- Macro benchmarks --- */
+
+/* registers change every iteration, so no loop is idle */
+static const uint8_t rom_alu[] = {
+    0x60, 0x01, // 0x200 LD V0, 1
+    0x71, 0x01, // 0x202 ADD V1, 1
+    0x82, 0x04, // 0x204 ADD V2, V0
+    0x83, 0x12, // 0x206 OR V3, V1
+    0x84, 0x23, // 0x208 XOR V4, V2
+    0x85, 0x15, // 0x20A SUB V5, V1
+    0x36, 0x00, // 0x20C SE V6, 0
+    0x00, 0x00, // 0x20E skipped
+    0x12, 0x02  // 0x210 JP 0x202
+};
+
+static const uint8_t rom_draw[] = {
+    0xA2, 0x10, // 0x200 LD I, 0x210
+    0xD0, 0x15, // 0x202 DRW V0, V1, 5
+    0x70, 0x03, // 0x204 ADD V0, 3
+    0x71, 0x05, // 0x206 ADD V1, 5
+    0xD0, 0x1F, // 0x208 DRW V0, V1, 15
+    0x72, 0x07, // 0x20A ADD V2, 7
+    0x12, 0x02, // 0x20C JP 0x202
+    0x00, 0x00, // 0x20E
+    0xF0, 0x90, 0x90, 0x90, 0xF0, 0x18, 0x3C, 0x7E,
+    0xFF, 0x7E, 0x3C, 0x18, 0x81, 0x42, 0x24 // 0x210 sprite
+};
+
+static const uint8_t rom_calls[] = {
+    0x22, 0x06, // 0x200 CALL 0x206
+    0x73, 0x01, // 0x202 ADD V3, 1
+    0x12, 0x00, // 0x204 JP 0x200
+    0x80, 0x14, // 0x206 ADD V0, V1
+    0xA3, 0x00, // 0x208 LD I, 0x300
+    0xF2, 0x33, // 0x20A LD B, V2
+    0xF2, 0x65, // 0x20C LD V2, [I]
+    0x72, 0x01, // 0x20E ADD V2, 1
+    0x00, 0xEE  // 0x210 RET
+};
+
+/* spins on the delay timer, the engines can skip most of it */
+static const uint8_t rom_idle[] = {
+    0x60, 0x05, // 0x200 LD V0, 5
+    0xF0, 0x15, // 0x202 LD DT, V0
+    0xF1, 0x07, // 0x204 LD V1, DT
+    0x31, 0x00, // 0x206 SE V1, 0
+    0x12, 0x04, // 0x208 JP 0x204
+    0x12, 0x00  // 0x20A JP 0x200
+};
+
+static const char *const engine_names[] = {
+    [CH8_ENGINE_INTERP] = "interp",
+    [CH8_ENGINE_CACHED] = "cache",
+    [CH8_ENGINE_THREADED] = "threaded",
+    [CH8_ENGINE_JIT] = "jit"
+};
+
+static ch8_t macro_vm;
+static ch8_dcache_t macro_dcache;
+static ch8_jit_t macro_jit;
+static bool jit_ok;
+
+/* run cycles instructions in frames, the way the emulator does */
+static void macro_run(ch8_t *vm, ch8_engine_e engine, uint32_t cycles)
+{
+    uint64_t end = vm->cycles + cycles;
+
+    while(vm->cycles < end) {
+        uint64_t frame_end = vm->cycles + MACRO_FRAME;
+        if(frame_end > end) {
+            frame_end = end;
+        }
+        ch8_tick_timers(vm);
+
+        if(engine == CH8_ENGINE_INTERP) {
+            while(vm->cycles < frame_end) {
+                ch8_tick(vm);
+            }
+        } else if(engine == CH8_ENGINE_CACHED) {
+            while(vm->cycles < frame_end) {
+                ch8_tick_cached(vm);
+            }
+        } else {
+            while(vm->cycles < frame_end) {
+                if(ch8_run(vm, frame_end - vm->cycles) == CH8_EXIT_KEYWAIT) {
+                    vm->idle_cycles += frame_end - vm->cycles;
+                    vm->cycles = frame_end;
+                }
+            }
+        }
+    }
+}
+
+static void bench_rom(const char *name, const uint16_t *rom, uint16_t rom_sz)
+{
+    for(ch8_engine_e engine = CH8_ENGINE_INTERP; engine <= CH8_ENGINE_JIT; ++engine) {
+        if(engine == CH8_ENGINE_JIT && !jit_ok) {
+            continue;
+        }
+
+        ch8_t *vm = &macro_vm;
+        ch8_load(vm, rom, rom_sz);
+        ch8_seed(vm, 1);
+        if(engine == CH8_ENGINE_CACHED || engine == CH8_ENGINE_THREADED) {
+            ch8_dcache_attach(vm, &macro_dcache);
+        } else if(engine == CH8_ENGINE_JIT) {
+            ch8_jit_attach(vm, &macro_jit);
+        }
+
+        /* warm up, the caches and recompiler fill during this run */
+        macro_run(vm, engine, MACRO_CYCLES);
+        for(uint32_t s = 0; s < BENCH_MACRO_SAMPLES; ++s) {
+            double t = now_s();
+            macro_run(vm, engine, MACRO_CYCLES);
+            samples[s] = now_s() - t;
+        }
+
+        char full[BENCH_NAME_MAX];
+        snprintf(full, sizeof(full), "rom/%s/%s", name, engine_names[engine]);
+        record(full, "insn", MACRO_CYCLES, samples, BENCH_MACRO_SAMPLES);
+    }
+}
+
+static void bench_macro(char **roms, int rom_count)
+{
+    jit_ok = ch8_jit_init(&macro_jit) == 0;
+
+    bench_rom("alu", (const uint16_t *)rom_alu, sizeof(rom_alu));
+    bench_rom("draw", (const uint16_t *)rom_draw, sizeof(rom_draw));
+    bench_rom("calls", (const uint16_t *)rom_calls, sizeof(rom_calls));
+    bench_rom("idle", (const uint16_t *)rom_idle, sizeof(rom_idle));
+
+    for(int k = 0; k < rom_count; ++k) {
+        uint16_t *mem;
+        size_t sz;
+        if(load_file(roms[k], &mem, &sz) != 0) {
+            continue;
+        }
+        if(sz > VM_RAM_SIZE - VM_EXEC_START_ADDR) {
+            sz = VM_RAM_SIZE - VM_EXEC_START_ADDR;
+        }
+        const char *base = strrchr(roms[k], '/');
+        bench_rom(base != NULL ? base + 1 : roms[k], mem, sz);
+        unload_file(mem, sz);
+    }
+
+    if(jit_ok) {
+        ch8_jit_free(&macro_jit);
+    }
+}
+
+/* --- Output --- */
+
+static int write_json(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        fprintf(stderr, "Could not open \"%s\"\n", path);
+        return -1;
+    }
+
+    /* one result per line, read_baseline depends on it */
+    fprintf(f, "{\n  \"version\": 1,\n  \"results\": [\n");
+    for(uint32_t k = 0; k < result_count; ++k) {
+        const result_t *r = &results[k];
+        fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, "
+                   "\"min\": %.0f, \"median\": %.0f, \"p99\": %.0f}%s\n",
+                r->name, r->unit, (unsigned long long)r->ops, r->min, r->median, r->p99,
+                k + 1 < result_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    int ret = ferror(f) ? -1 : 0;
+    if(fclose(f) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* median of name in a file written by write_json, 0 if it isn't there */
+static double baseline_median(FILE *f, const char *name)
+{
+    char line[256];
+    size_t len = strlen(name);
+
+    rewind(f);
+    while(fgets(line, sizeof(line), f) != NULL) {
+        const char *p = strstr(line, "{\"name\": \"");
+        if(p == NULL) {
+            continue;
+        }
+        p += strlen("{\"name\": \"");
+        if(strncmp(p, name, len) != 0 || p[len] != '"') {
+            continue;
+        }
+        const char *m = strstr(p, "\"median\": ");
+        return m != NULL ? strtod(m + strlen("\"median\": "), NULL) : 0.0;
+    }
+    return 0.0;
+}
+
+static int compare(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Could not open baseline \"%s\"\n", path);
+        return -1;
+    }
+
+    uint32_t slower = 0, faster = 0;
+    printf("\n%-28s %14s %14s %8s\n", "compared to baseline", "median", "baseline", "change");
+    for(uint32_t k = 0; k < result_count; ++k) {
+        const result_t *r = &results[k];
+        double base = baseline_median(f, r->name);
+        if(base <= 0.0) {
+            printf("%-28s %14.0f %14s\n", r->name, r->median, "-");
+            continue;
+        }
+        double pct = (r->median / base - 1.0) * 100.0;
+        const char *mark = "";
+        if(pct < -BENCH_NOISE_PCT) {
+            mark = "  slower";
+            slower += 1;
+        } else if(pct > BENCH_NOISE_PCT) {
+            mark = "  faster";
+            faster += 1;
+        }
+        printf("%-28s %14.0f %14.0f %+7.1f%%%s\n", r->name, r->median, base, pct, mark);
+    }
+    printf("%u slower and %u faster by more than %.0f%%\n", slower, faster, BENCH_NOISE_PCT);
+
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *exe)
+{
+    printf("Usage: %s [-o FILE] [-b BASELINE] [ROM]...\n\n"
+           "\t-o FILE\t\twrite the results as JSON (default: bench.json)\n"
+           "\t-b FILE\t\tcompare the medians against an earlier JSON result\n"
+           "\tROM\t\textra programs to run as macro benchmarks\n", exe);
+}
+
+int main(int argc, char **argv)
+{
+    const char *out = "bench.json";
+    const char *baseline = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "ho:b:")) != -1) {
+        switch(opt) {
+            case 'o':
+                out = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("%-28s %14s %14s %14s\n", "benchmark", "min", "median", "p99");
+    bench_micro();
+    bench_disasm();
+    bench_load();
+    bench_macro(argv + optind, argc - optind);
+
+    if(write_json(out) != 0) {
+        return 1;
+    }
+    printf("\nWrote %u results to \"%s\"\n", result_count, out);
+
+    if(baseline != NULL && compare(baseline) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -20,7 +20,6 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
 
 #define FONT_SZ 16 * VM_FONT_H
 
@@ -53,10 +52,14 @@ void ch8_init(ch8_t *vm)
     memcpy(vm->ram, builtin_font, FONT_SZ);
 
     vm->pc = VM_EXEC_START_ADDR;
-    vm->vram_updated = false;
+    vm->vram_dirty = 0;
+}
 
-    /* Seed rand() for RND opcode */
-    srand(time(NULL));
+void ch8_seed(ch8_t *vm, uint64_t seed)
+{
+    assert(vm != NULL);
+
+    vm->rng = seed;
 }
 
 inline uint16_t ch8_get_op(ch8_t *vm)
@@ -82,6 +85,117 @@ void ch8_tick(ch8_t *vm)
     ch8_exec(vm, opcode);
 
     vm->pc += 2;
+    vm->cycles += 1;
+}
+
+void ch8_tick_cached(ch8_t *vm)
+{
+    assert(vm != NULL);
+
+    if(vm->dcache == NULL || vm->pc >= VM_RAM_SIZE) {
+        ch8_tick(vm);
+        return;
+    }
+
+    ch8_dop_t *op = &vm->dcache->ops[vm->pc];
+    if(op->fn == NULL) {
+        ch8_decode_op(ch8_get_op(vm), op);
+    }
+    op->fn(vm, op);
+
+    vm->pc += 2;
+    vm->cycles += 1;
+}
+
+ch8_exit_e ch8_run(ch8_t *vm, uint32_t cycles)
+{
+    assert(vm != NULL);
+
+    if(vm->jit != NULL) {
+        return ch8_run_jit(vm, cycles);
+    }
+    return ch8_run_threaded(vm, cycles);
+}
+
+void ch8_dcache_attach(ch8_t *vm, ch8_dcache_t *dcache)
+{
+    assert(vm != NULL);
+
+    vm->dcache = dcache;
+    ch8_invalidate(vm, 0, VM_RAM_SIZE);
+}
+
+void ch8_invalidate(ch8_t *vm, uint16_t addr, uint16_t len)
+{
+    assert(vm != NULL);
+
+    if(vm->dcache == NULL && vm->jit == NULL) {
+        return;
+    }
+
+    /* the opcode starting one byte before addr covers it too */
+    uint16_t start = addr > 0 ? addr - 1 : 0;
+    uint32_t end = (uint32_t)addr + len;
+    if(end > VM_RAM_SIZE) {
+        end = VM_RAM_SIZE;
+    }
+    if(start >= end) {
+        return;
+    }
+
+    if(vm->dcache != NULL) {
+        memset(&vm->dcache->ops[start], 0, (end - start) * sizeof(ch8_dop_t));
+    }
+
+    if(vm->jit != NULL) {
+        uint64_t pages = 0;
+        for(uint32_t p = start >> JIT_PAGE_SHIFT; p <= (end - 1) >> JIT_PAGE_SHIFT; ++p) {
+            pages |= (uint64_t)1 << p;
+        }
+        /* self modifying code is rare, start over instead of tracking blocks */
+        if(vm->jit->code_pages & pages) {
+            ch8_jit_flush(vm->jit);
+        }
+    }
+}
+
+/* pixel bytes for every 4 bit pattern, leftmost pixel first */
+static const uint8_t unpack_lut[16][4] = {
+    { 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00, 0xFF },
+    { 0x00, 0x00, 0xFF, 0x00 }, { 0x00, 0x00, 0xFF, 0xFF },
+    { 0x00, 0xFF, 0x00, 0x00 }, { 0x00, 0xFF, 0x00, 0xFF },
+    { 0x00, 0xFF, 0xFF, 0x00 }, { 0x00, 0xFF, 0xFF, 0xFF },
+    { 0xFF, 0x00, 0x00, 0x00 }, { 0xFF, 0x00, 0x00, 0xFF },
+    { 0xFF, 0x00, 0xFF, 0x00 }, { 0xFF, 0x00, 0xFF, 0xFF },
+    { 0xFF, 0xFF, 0x00, 0x00 }, { 0xFF, 0xFF, 0x00, 0xFF },
+    { 0xFF, 0xFF, 0xFF, 0x00 }, { 0xFF, 0xFF, 0xFF, 0xFF }
+};
+
+void ch8_vram_unpack(const ch8_t *vm, uint8_t *out)
+{
+    ch8_vram_unpack_rows(vm, out, 0, VM_SCREEN_HEIGHT);
+}
+
+void ch8_vram_unpack_rows(const ch8_t *vm, uint8_t *out, uint8_t first, uint8_t count)
+{
+    assert(vm != NULL);
+
+    ch8_vram_unpack_copy(vm->vram, out, first, count);
+}
+
+void ch8_vram_unpack_copy(const uint64_t *vram, uint8_t *out, uint8_t first, uint8_t count)
+{
+    assert(vram != NULL);
+    assert(out != NULL);
+    assert(first + count <= VM_SCREEN_HEIGHT);
+
+    for(uint8_t y = first; y < first + count; ++y) {
+        uint64_t row = vram[y];
+        for(int8_t shift = VM_SCREEN_WIDTH - 4; shift >= 0; shift -= 4) {
+            memcpy(out, unpack_lut[(row >> shift) & 0xF], 4);
+            out += 4;
+        }
+    }
 }
 
 void ch8_tick_timers(ch8_t *vm)
@@ -96,3 +210,49 @@ void ch8_tick_timers(ch8_t *vm)
     }
 }
 
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x100000001B3ULL
+
+/* hash a value of size bytes, least significant byte first */
+static uint64_t hash_val(uint64_t h, uint64_t val, uint8_t size)
+{
+    for(uint8_t i = 0; i < size; ++i) {
+        h = (h ^ ((val >> (8 * i)) & 0xFF)) * FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t hash_buf(uint64_t h, const uint8_t *buf, size_t len)
+{
+    for(size_t i = 0; i < len; ++i) {
+        h = (h ^ buf[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t ch8_hash(const ch8_t *vm)
+{
+    assert(vm != NULL);
+
+    uint64_t h = FNV_OFFSET;
+
+    h = hash_buf(h, vm->v, sizeof(vm->v));
+    h = hash_val(h, vm->i, 2);
+    h = hash_val(h, vm->pc, 2);
+    h = hash_val(h, vm->sp, 1);
+    for(uint8_t i = 0; i < VM_STACK_SIZE; ++i) {
+        h = hash_val(h, vm->stack[i], 2);
+    }
+    h = hash_buf(h, vm->keys, sizeof(vm->keys));
+    h = hash_val(h, vm->tim_delay, 1);
+    h = hash_val(h, vm->tim_sound, 1);
+    h = hash_val(h, vm->cycles, 8);
+    h = hash_val(h, vm->rng, 8);
+    for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+        h = hash_val(h, vm->vram[y], 8);
+    }
+    h = hash_buf(h, vm->ram, sizeof(vm->ram));
+
+    return h;
+}
+
@@ -20,7 +20,9 @@
 #define CHIP8_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 
 #define VM_EXEC_START_ADDR  0x200
@@ -30,6 +32,87 @@
 #define VM_STACK_SIZE       16
 #define VM_KEY_COUNT        16
 #define VM_FONT_H           5
+#define VM_BPOINTS_SZ       (VM_RAM_SIZE / 8)
+#define VM_TIMER_HZ         60
+
+/* Snapshot header size, the largest snapshot also stores all of RAM */
+#define CH8_SNAPSHOT_HDR    392
+#define CH8_SNAPSHOT_MAX    (CH8_SNAPSHOT_HDR + VM_RAM_SIZE)
+
+/* Buffer size for ch8_disassemble, and the longest ch8_disassemble_block line */
+#define CH8_DISASM_MAX      32
+#define CH8_DISASM_LINE_MAX 64
+
+/* ch8_disassemble_block flags */
+#define CH8_DISASM_ADDR     (1 << 0)    // prefix lines with the address
+#define CH8_DISASM_BYTES    (1 << 1)    // prefix lines with the opcode bytes
+
+/*
+ * Fully decoded opcode forms, as returned by ch8_decode.
+ */
+typedef enum {
+    CH8_OP_INVALID,
+    CH8_OP_NOP,     // 0nnn, ignored
+    CH8_OP_CLS,     // 00E0
+    CH8_OP_RET,     // 00EE
+    CH8_OP_JP,      // 1nnn
+    CH8_OP_CALL,    // 2nnn
+    CH8_OP_SE_VI,   // 3xkk
+    CH8_OP_SNE_VI,  // 4xkk
+    CH8_OP_SE_VV,   // 5xy0
+    CH8_OP_LD_VI,   // 6xkk
+    CH8_OP_ADD_VI,  // 7xkk
+    CH8_OP_LD_VV,   // 8xy0
+    CH8_OP_OR,      // 8xy1
+    CH8_OP_AND,     // 8xy2
+    CH8_OP_XOR,     // 8xy3
+    CH8_OP_ADD_VV,  // 8xy4
+    CH8_OP_SUB,     // 8xy5
+    CH8_OP_SHR,     // 8xy6
+    CH8_OP_SUBN,    // 8xy7
+    CH8_OP_SHL,     // 8xyE
+    CH8_OP_SNE_VV,  // 9xy0
+    CH8_OP_LD_I,    // Annn
+    CH8_OP_JP_V0,   // Bnnn
+    CH8_OP_RND,     // Cxkk
+    CH8_OP_DRW,     // Dxyn
+    CH8_OP_SKP,     // Ex9E
+    CH8_OP_SKNP,    // ExA1
+    CH8_OP_LD_VDT,  // Fx07
+    CH8_OP_LD_VK,   // Fx0A
+    CH8_OP_LD_DTV,  // Fx15
+    CH8_OP_LD_STV,  // Fx18
+    CH8_OP_ADD_IV,  // Fx1E
+    CH8_OP_LD_FV,   // Fx29
+    CH8_OP_LD_BV,   // Fx33
+    CH8_OP_LD_MEMV, // Fx55
+    CH8_OP_LD_VMEM, // Fx65
+    CH8_OP_COUNT
+} ch8_form_e;
+
+/*
+ * Selectable instruction execution engines.
+ */
+typedef enum {
+    CH8_ENGINE_INTERP,  // ch8_tick, decodes every instruction
+    CH8_ENGINE_CACHED,  // ch8_tick_cached, decoded instruction cache
+    CH8_ENGINE_THREADED,// ch8_run_threaded, computed goto dispatch
+    CH8_ENGINE_JIT      // ch8_run_jit, x86-64 basic block recompiler
+} ch8_engine_e;
+
+/*
+ * Reasons for ch8_run to return.
+ */
+typedef enum {
+    CH8_EXIT_CYCLES,     // cycle budget exhausted
+    CH8_EXIT_BREAKPOINT, // PC reached an address set in vm->bpoints
+    CH8_EXIT_VRAM,       // CLS or DRW changed the framebuffer
+    CH8_EXIT_KEYWAIT,    // Fx0A is waiting for a key press
+    CH8_EXIT_INVALID     // an invalid opcode was skipped
+} ch8_exit_e;
+
+struct ch8_dcache;
+struct ch8_jit;
 
 typedef struct {
     /* Registers */
@@ -42,12 +125,237 @@ typedef struct {
     /* Timers */
     uint8_t tim_delay;
     uint8_t tim_sound;
+    /* Instructions executed since ch8_init */
+    uint64_t cycles;
+    /* Part of cycles that was skipped over in idle loops */
+    uint64_t idle_cycles;
+    /* RND generator state, see ch8_seed */
+    uint64_t rng;
     /* Memory */
-    bool vram_updated;
-    uint8_t vram[VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT];
+    /* Rows changed since the consumer last cleared this, bit n is row n */
+    uint32_t vram_dirty;
+    /* One row per word, bit 63 is the leftmost pixel */
+    uint64_t vram[VM_SCREEN_HEIGHT];
     uint8_t ram[VM_RAM_SIZE];
+    /* Decoded instruction cache, NULL if not attached */
+    struct ch8_dcache *dcache;
+    /* Recompiled block cache, NULL if not attached */
+    struct ch8_jit *jit;
+    /* Breakpoint bitmap of VM_BPOINTS_SZ bytes, NULL if not attached */
+    const uint8_t *bpoints;
 } ch8_t;
 
+/*
+ * Decoded instruction, operands are pre-extracted from the opcode.
+ */
+typedef struct ch8_dop {
+    void (*fn)(ch8_t *vm, const struct ch8_dop *op);
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t form;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;
+} ch8_dop_t;
+
+/*
+ * Per-address cache of decoded instructions. An entry with a NULL
+ * handler has not been decoded yet.
+ */
+typedef struct ch8_dcache {
+    ch8_dop_t ops[VM_RAM_SIZE];
+} ch8_dcache_t;
+
+#define JIT_CODE_SZ     (256 * 1024)
+#define JIT_PAGE_SHIFT  6
+#define JIT_MAX_BLOCK   64
+#define JIT_NO_BLOCK    0xFF
+
+/*
+ * Recompiled native code blocks, indexed by CHIP-8 start address.
+ * A block returns the amount of instructions it executed.
+ */
+typedef struct ch8_jit {
+    uint8_t *code;
+    uint32_t code_used;
+    uint32_t (*blocks[VM_RAM_SIZE])(ch8_t *vm);
+    /* instructions per block, JIT_NO_BLOCK if PC has to be interpreted */
+    uint8_t block_len[VM_RAM_SIZE];
+    /* RAM pages (1 << JIT_PAGE_SHIFT bytes) that blocks were built from */
+    uint64_t code_pages;
+    /* blocks writing a timer, by start address */
+    uint8_t block_impure[VM_BPOINTS_SZ];
+} ch8_jit_t;
+
+#define CH8_BATCH_MAX   256
+
+/*
+ * Structure-of-arrays view over lanes VMs running in lockstep, one
+ * array per register so a vector instruction updates many lanes.
+ * The register arrays are only valid during ch8_batch_run, the VMs
+ * hold the state between calls.
+ */
+typedef struct ch8_batch {
+    ch8_t *vms;
+    uint32_t lanes;
+    uint32_t leader;
+    /* all lanes share PC and group[] selects every lane */
+    bool converged;
+    /* Lane-instructions executed by the vector kernels and one lane at a time */
+    uint64_t lockstep;
+    uint64_t scalar;
+    uint8_t v[16][CH8_BATCH_MAX];
+    uint16_t i[CH8_BATCH_MAX];
+    uint16_t pc[CH8_BATCH_MAX];
+    uint8_t tim_delay[CH8_BATCH_MAX];
+    uint8_t tim_sound[CH8_BATCH_MAX];
+    /* 0xFF for lanes executing the leader's instruction */
+    uint8_t group[CH8_BATCH_MAX];
+    uint16_t group16[CH8_BATCH_MAX];
+    uint64_t start[CH8_BATCH_MAX];
+    /* addresses whose opcode is known to be the same in every lane */
+    uint8_t verified[VM_BPOINTS_SZ];
+} ch8_batch_t;
+
+/* encoded deltas are never much larger than the snapshots they cover */
+#define CH8_REWIND_DELTA_MAX    (2 * CH8_SNAPSHOT_MAX)
+
+/*
+ * History of per-frame snapshots for stepping backwards, bounded by a
+ * memory budget. Older frames are stored as compressed deltas.
+ */
+typedef struct ch8_rewind {
+    uint8_t *ring;
+    uint32_t ring_sz;
+    /* deltas are stored in [tail, head) of ring, newest last */
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+    /* amount of frames that can be stepped back */
+    uint32_t count;
+    /* frames[cur] holds the newest frame once valid is set */
+    bool valid;
+    uint8_t cur;
+    uint8_t frames[2][CH8_SNAPSHOT_MAX];
+    uint8_t delta[CH8_REWIND_DELTA_MAX];
+} ch8_rewind_t;
+
+#define CH8_TIMELINE_CKPTS  1024
+
+/*
+ * Keypad change made from outside the VM, before instruction number
+ * cycles + 1 is executed.
+ */
+typedef struct {
+    uint64_t cycles;
+    uint8_t key;
+    uint8_t state;
+} ch8_key_event_t;
+
+typedef struct {
+    uint64_t cycles;
+    /* malloc'd snapshot, RAM is a delta against the timeline base */
+    uint8_t *snap;
+    uint16_t len;
+    /* made by an edit, can't be rebuilt by re-execution */
+    bool pinned;
+} ch8_checkpoint_t;
+
+/*
+ * Recorded execution history of a VM for stepping backwards, see
+ * chip8_timeline.c.
+ */
+typedef struct ch8_timeline {
+    uint8_t base[VM_RAM_SIZE];
+    ch8_checkpoint_t ckpts[CH8_TIMELINE_CKPTS];
+    uint32_t ckpt_count;
+    /* ordered by cycles */
+    ch8_key_event_t *events;
+    uint32_t event_count;
+    uint32_t event_cap;
+    uint8_t snap[CH8_SNAPSHOT_MAX];
+} ch8_timeline_t;
+
+/* ch8_cfg_t map flags, one set per byte of RAM */
+#define CH8_CFG_INSN        (1 << 0)    // a reachable instruction starts here
+#define CH8_CFG_CODE        (1 << 1)    // byte of a reachable instruction
+#define CH8_CFG_LEADER      (1 << 2)    // a basic block starts here
+#define CH8_CFG_SUB         (1 << 3)    // CALL target
+#define CH8_CFG_REF         (1 << 4)    // loaded into I by Annn
+#define CH8_CFG_SPRITE      (1 << 5)    // drawn by DRW
+#define CH8_CFG_DATA        (1 << 6)    // read or written by Fx33, Fx55 or Fx65
+#define CH8_CFG_WRITE       (1 << 7)    // written by Fx33 or Fx55
+
+/* ch8_block_t flags, how a block ends */
+#define CH8_BLOCK_RET       (1 << 0)    // RET
+#define CH8_BLOCK_CALL      (1 << 1)    // CALL, returns to succ[0]
+#define CH8_BLOCK_SKIP      (1 << 2)    // skip, succ[1] is taken on a skip
+#define CH8_BLOCK_INDIRECT  (1 << 3)    // Bnnn, the targets are not known
+#define CH8_BLOCK_INVALID   (1 << 4)    // invalid opcode, most likely data
+
+typedef struct {
+    uint16_t start;
+    /* address after the last instruction */
+    uint16_t end;
+    uint16_t succ[2];
+    uint8_t succ_count;
+    uint8_t flags;
+    /* subroutine entered by a CALL at the end */
+    uint16_t call;
+} ch8_block_t;
+
+/*
+ * Control flow graph of a program, see chip8_cfg.c.
+ */
+typedef struct {
+    uint16_t entry;
+    /* end of the program image, nothing at or after it is followed */
+    uint16_t end;
+    uint8_t map[VM_RAM_SIZE];
+    /* ordered by start address */
+    ch8_block_t blocks[VM_RAM_SIZE - VM_EXEC_START_ADDR];
+    uint16_t block_count;
+    uint16_t insn_count;
+    uint16_t sub_count;
+} ch8_cfg_t;
+
+#define CH8_PROFILE_STACKS  4096
+
+/* ch8_profile_t.interval that counts every instruction */
+#define CH8_PROFILE_EXACT   1
+
+/*
+ * Distinct call stack seen by the profiler, as the subroutines entered
+ * from the outermost call in.
+ */
+typedef struct {
+    uint64_t count;
+    uint32_t hash;
+    uint8_t depth;
+    uint16_t frames[VM_STACK_SIZE];
+} ch8_profile_stack_t;
+
+/*
+ * Execution profile of a VM, see chip8_profile.c. Counts are in
+ * samples, which are instructions when interval is CH8_PROFILE_EXACT.
+ */
+typedef struct {
+    /* a sample is taken every interval instructions */
+    uint32_t interval;
+    /* vm->cycles at which the next sample is due */
+    uint64_t next;
+    uint64_t samples;
+    /* samples by the address of the instruction about to execute */
+    uint64_t hits[VM_RAM_SIZE];
+    /* samples by the form of that instruction */
+    uint64_t forms[CH8_OP_COUNT];
+    /* open addressed on the stack hash */
+    ch8_profile_stack_t stacks[CH8_PROFILE_STACKS];
+    uint32_t stack_count;
+    /* samples whose stack didn't fit in stacks */
+    uint64_t stacks_lost;
+} ch8_profile_t;
+
 /*
  * Initialize the VM core
  */
@@ -67,30 +375,497 @@ uint16_t ch8_get_op(ch8_t *vm);
  */
 void ch8_load(ch8_t *vm, const uint16_t *rom, uint16_t rom_sz);
 
+/*
+ * Seed the generator used by the RND opcode. The sequence depends only
+ * on the seed, ch8_init and ch8_load reset the VM to seed 0.
+ *
+ * Params:
+ *  seed    - any value, including 0.
+ */
+void ch8_seed(ch8_t *vm, uint64_t seed);
+
 /*
  * Execute a single instruction
  */
 void ch8_tick(ch8_t *vm);
 
+/*
+ * Execute a single instruction through the decoded instruction cache.
+ * Falls back to ch8_tick if no cache is attached.
+ */
+void ch8_tick_cached(ch8_t *vm);
+
+/*
+ * Execute up to cycles instructions, returning early if something the
+ * caller may want to react to happens. Check vm->cycles for the amount
+ * of instructions that were executed.
+ *
+ * The instruction that caused the early return has been executed and
+ * PC points past it, except for a key wait where PC stays on Fx0A.
+ * If the new PC is a breakpoint then CH8_EXIT_BREAKPOINT is returned
+ * regardless of other reasons.
+ *
+ * Uses the recompiler if one is attached, the threaded core otherwise.
+ *
+ * A loop that only reads registers, RAM, timers and keys and comes back
+ * to its backward jump with the same registers would spin until the
+ * timers or keys change, which can't happen during the call. Its
+ * remaining whole iterations are skipped and counted in both
+ * vm->cycles and vm->idle_cycles.
+ *
+ * Params:
+ *  cycles  - maximum amount of instructions to execute.
+ */
+ch8_exit_e ch8_run(ch8_t *vm, uint32_t cycles);
+
+/*
+ * ch8_run on the threaded interpreter core.
+ * Uses the decoded instruction cache if one is attached.
+ */
+ch8_exit_e ch8_run_threaded(ch8_t *vm, uint32_t cycles);
+
+/*
+ * ch8_run on the basic block recompiler. Instructions that end a block
+ * are executed by the threaded core, as is everything if no recompiler
+ * is attached.
+ */
+ch8_exit_e ch8_run_jit(ch8_t *vm, uint32_t cycles);
+
+/*
+ * Test whether addr is set in a breakpoint bitmap.
+ */
+static inline bool ch8_bpoint_test(const uint8_t *bpoints, uint16_t addr)
+{
+    return addr < VM_RAM_SIZE && (bpoints[addr >> 3] & (1 << (addr & 7)));
+}
+
+/*
+ * Set or clear addr in a breakpoint bitmap.
+ */
+static inline void ch8_bpoint_set(uint8_t *bpoints, uint16_t addr, bool state)
+{
+    if(addr >= VM_RAM_SIZE) {
+        return;
+    }
+    if(state) {
+        bpoints[addr >> 3] |= 1 << (addr & 7);
+    } else {
+        bpoints[addr >> 3] &= ~(1 << (addr & 7));
+    }
+}
+
+/*
+ * Allocate executable memory for the recompiler.
+ *
+ * Returns
+ *  0 on success, nonzero if the host is not supported.
+ */
+int ch8_jit_init(ch8_jit_t *jit);
+
+/*
+ * Release memory allocated by ch8_jit_init.
+ */
+void ch8_jit_free(ch8_jit_t *jit);
+
+/*
+ * Drop all recompiled blocks.
+ */
+void ch8_jit_flush(ch8_jit_t *jit);
+
+/*
+ * Attach a recompiler to the VM and flush its blocks.
+ *
+ * NOTE: like ch8_dcache_attach, attach it again after (re)loading a ROM.
+ */
+void ch8_jit_attach(ch8_t *vm, ch8_jit_t *jit);
+
+/*
+ * Set up a batch over an array of VMs.
+ *
+ * Params:
+ *  vms     - lanes loaded VMs, attachments are ignored,
+ *  lanes   - 1 to CH8_BATCH_MAX.
+ *
+ * Returns
+ *  0 on success, nonzero if lanes is out of range.
+ */
+int ch8_batch_init(ch8_batch_t *batch, ch8_t *vms, uint32_t lanes);
+
+/*
+ * Run every VM of the batch for frames frames, each frame ticks the
+ * timers and then executes cycles instructions. The result is the same
+ * as calling ch8_tick_timers and ch8_tick on every VM on its own.
+ *
+ * Lanes at the same PC with the same opcode execute it together in the
+ * vector kernels, lanes that diverge are stepped one at a time.
+ *
+ * Params:
+ *  frames  - amount of timer ticks,
+ *  cycles  - instructions per frame.
+ */
+void ch8_batch_run(ch8_batch_t *batch, uint32_t frames, uint32_t cycles);
+
+/*
+ * Attach a decoded instruction cache to the VM and flush it.
+ *
+ * NOTE: ch8_init and ch8_load detach the cache, attach it again after
+ * (re)loading a ROM.
+ */
+void ch8_dcache_attach(ch8_t *vm, ch8_dcache_t *dcache);
+
+/*
+ * Notify attached caches that RAM contents have been modified.
+ * Anything writing to vm->ram outside of the core MUST call this.
+ *
+ * Params:
+ *  addr    - first modified byte,
+ *  len     - amount of modified bytes.
+ */
+void ch8_invalidate(ch8_t *vm, uint16_t addr, uint16_t len);
+
+/*
+ * Unpack the framebuffer into one byte per pixel, 0xFF for set pixels
+ * and 0x00 for clear ones.
+ *
+ * Params:
+ *  out     - buffer of VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT bytes.
+ */
+void ch8_vram_unpack(const ch8_t *vm, uint8_t *out);
+
+/*
+ * Unpack a range of framebuffer rows like ch8_vram_unpack.
+ *
+ * Params:
+ *  out     - buffer of VM_SCREEN_WIDTH * count bytes,
+ *  first   - first row to unpack,
+ *  count   - amount of rows to unpack.
+ */
+void ch8_vram_unpack_rows(const ch8_t *vm, uint8_t *out, uint8_t first, uint8_t count);
+
+/*
+ * Unpack a range of rows of a copy of the framebuffer, for frames handed
+ * to another thread.
+ *
+ * Params:
+ *  vram    - VM_SCREEN_HEIGHT rows copied from vm->vram.
+ */
+void ch8_vram_unpack_copy(const uint64_t *vram, uint8_t *out, uint8_t first, uint8_t count);
+
+/*
+ * Remove the first span of consecutive rows from a dirty row mask.
+ *
+ * Params:
+ *  dirty   - mask taken from vm->vram_dirty,
+ *  first   - set to the first row of the span,
+ *  count   - set to the amount of rows in the span.
+ *
+ * Returns
+ *  false if there are no dirty rows left.
+ */
+static inline bool ch8_vram_next_span(uint32_t *dirty, uint8_t *first, uint8_t *count)
+{
+    if(*dirty == 0) {
+        return false;
+    }
+
+    uint8_t row = 0;
+    while(!(*dirty & ((uint32_t)1 << row))) {
+        row += 1;
+    }
+    *first = row;
+    while(row < VM_SCREEN_HEIGHT && (*dirty & ((uint32_t)1 << row))) {
+        *dirty &= ~((uint32_t)1 << row);
+        row += 1;
+    }
+    *count = row - *first;
+
+    return true;
+}
+
+/*
+ * Return the state of a single pixel
+ */
+static inline bool ch8_vram_pixel(const ch8_t *vm, uint8_t x, uint8_t y)
+{
+    return (vm->vram[y] >> (VM_SCREEN_WIDTH - 1 - x)) & 1;
+}
+
 /*
  * Increment timer registers
  *
- * NOTE: this function MUST be called at a frequency of 60hz
+ * NOTE: this function MUST be called at a frequency of VM_TIMER_HZ
  */
 void ch8_tick_timers(ch8_t *vm);
 
+/*
+ * Hash the architectural state of the VM: registers, stack, keys,
+ * timers, cycle count, RND state, framebuffer and RAM. Attachments,
+ * vram_dirty and idle_cycles are not included. The result is the same on every host.
+ *
+ * Returns
+ *  64-bit FNV-1a hash of the state.
+ */
+uint64_t ch8_hash(const ch8_t *vm);
+
+/*
+ * Serialize the VM state into a versioned, checksummed snapshot, see
+ * chip8_snapshot.c for the layout. Attachments are not saved.
+ *
+ * Params:
+ *  base    - VM_RAM_SIZE bytes of RAM to store a delta against, usually
+ *            a copy of vm->ram right after ch8_load. NULL stores all RAM,
+ *  buf     - output buffer, CH8_SNAPSHOT_MAX bytes is always enough,
+ *  buf_sz  - size of buf.
+ *
+ * Returns
+ *  size of the snapshot, 0 if it does not fit in buf.
+ */
+size_t ch8_snapshot_save(const ch8_t *vm, const uint8_t *base, void *buf, size_t buf_sz);
+
+/*
+ * Restore the VM state from a snapshot. buf may point straight into a
+ * mapped file and does not need to be aligned. Attachments are kept and
+ * only notified about RAM blocks that changed, every framebuffer row is
+ * marked dirty. The VM is left untouched if the snapshot is rejected.
+ *
+ * Params:
+ *  base    - the RAM image the snapshot was saved against, ignored
+ *            for full snapshots,
+ *  buf     - snapshot from ch8_snapshot_save,
+ *  buf_sz  - amount of readable bytes at buf.
+ *
+ * Returns
+ *  0 on success, nonzero if the snapshot is truncated, corrupt, of
+ *  another version or saved against a different base.
+ */
+int ch8_snapshot_load(ch8_t *vm, const uint8_t *base, const void *buf, size_t buf_sz);
+
+/*
+ * Allocate a rewind history.
+ *
+ * Params:
+ *  budget  - bytes of memory for the deltas, nonzero.
+ *
+ * Returns
+ *  0 on success, nonzero if the memory could not be allocated.
+ */
+int ch8_rewind_init(ch8_rewind_t *rw, uint32_t budget);
+
+/*
+ * Release memory allocated by ch8_rewind_init.
+ */
+void ch8_rewind_free(ch8_rewind_t *rw);
+
+/*
+ * Record the VM state as the newest frame of the history. The oldest
+ * frames are dropped when the budget runs out.
+ */
+void ch8_rewind_push(ch8_rewind_t *rw, const ch8_t *vm);
+
+/*
+ * Step the history back one frame and restore the VM to it, like
+ * ch8_snapshot_load. The frame stepped back from is forgotten.
+ *
+ * Returns
+ *  0 on success, nonzero if there is no older frame.
+ */
+int ch8_rewind_pop(ch8_rewind_t *rw, ch8_t *vm);
+
+/*
+ * Start recording the history of a VM from its current state, usually
+ * right after ch8_load. The VM must only be changed through the
+ * ch8_timeline functions from here on.
+ *
+ * Returns
+ *  0 on success, nonzero if memory could not be allocated.
+ */
+int ch8_timeline_init(ch8_timeline_t *tl, const ch8_t *vm);
+
+/*
+ * Release memory allocated by the timeline.
+ */
+void ch8_timeline_free(ch8_timeline_t *tl);
+
+/*
+ * ch8_run that records the history. After stepping backwards it goes
+ * over the recorded history again, key changes and edits included.
+ */
+ch8_exit_e ch8_timeline_run(ch8_timeline_t *tl, ch8_t *vm, uint32_t cycles);
+
+/*
+ * Set a key and log the change. Anything recorded after the current
+ * point is forgotten.
+ *
+ * Returns
+ *  0 on success, nonzero if memory could not be allocated.
+ */
+int ch8_timeline_key(ch8_timeline_t *tl, ch8_t *vm, uint8_t key, uint8_t state);
+
+/*
+ * Record a change made directly to the VM state, such as a register
+ * write. Anything recorded after the current point is forgotten.
+ *
+ * Returns
+ *  0 on success, nonzero if memory could not be allocated.
+ */
+int ch8_timeline_edit(ch8_timeline_t *tl, const ch8_t *vm);
+
+/*
+ * Bring the VM to the state it had after cycles instructions. Costs at
+ * most the instructions between two checkpoints.
+ *
+ * Params:
+ *  cycles  - instruction count no later than what has been executed.
+ *
+ * Returns
+ *  0 on success, nonzero if cycles is before the start of the history.
+ */
+int ch8_timeline_seek(ch8_timeline_t *tl, ch8_t *vm, uint64_t cycles);
+
+/*
+ * Go back to the last point before the current one where PC was on a
+ * breakpoint of vm->bpoints.
+ *
+ * Returns
+ *  0 if a breakpoint was found, nonzero if the VM went back to the
+ *  start of the history instead.
+ */
+int ch8_timeline_reverse_continue(ch8_timeline_t *tl, ch8_t *vm);
+
 /*
  * Disassemble opcode into mnemonics and operands.
  *
  * Params
- *  opcode  - 2 byte opcode to disassemble.
+ *  opcode  - 2 byte opcode to disassemble,
+ *  buf     - room for CH8_DISASM_MAX characters.
+ *
+ * Returns
+ *  buf, holding a zero terminated string.
+ */
+const char *ch8_disassemble(uint16_t opcode, char *buf);
+
+/*
+ * Disassemble opcode into a buffer of any size, cutting the text short
+ * if it does not fit.
+ *
+ * Params
+ *  opcode  - 2 byte opcode to disassemble,
+ *  buf     - output, always zero terminated unless len is 0,
+ *  len     - size of buf.
+ *
+ * Returns
+ *  amount of characters written, not counting the terminator.
+ */
+size_t ch8_disassemble_r(uint16_t opcode, char *buf, size_t len);
+
+/*
+ * Disassemble a run of big endian opcodes into text, one instruction
+ * per line. Stops early rather than cutting a line when out fills up,
+ * a trailing odd byte is left over.
+ *
+ * Params
+ *  code        - opcodes to disassemble,
+ *  code_sz     - size of code in bytes,
+ *  addr        - address of code[0], for CH8_DISASM_ADDR,
+ *  flags       - CH8_DISASM_ADDR and CH8_DISASM_BYTES,
+ *  out         - output buffer, not zero terminated,
+ *  out_sz      - size of out,
+ *  consumed    - if not NULL, set to the amount of code bytes done.
+ *
+ * Returns
+ *  amount of bytes written to out.
+ */
+size_t ch8_disassemble_block(const uint8_t *code, size_t code_sz, uint16_t addr,
+                             unsigned flags, char *out, size_t out_sz, size_t *consumed);
+
+/*
+ * Short name of an opcode form for reports, pattern and mnemonic,
+ * like "8xy4 ADD".
+ */
+const char *ch8_form_name(ch8_form_e form);
+
+/*
+ * Find the code of a program by following every path from its entry,
+ * and split it into basic blocks. Data the code draws as sprites or
+ * reaches through I is marked as well, as far as I is known from a
+ * preceding Annn.
+ *
+ * Params
+ *  ram     - RAM image with the program loaded,
+ *  entry   - where execution starts, usually VM_EXEC_START_ADDR,
+ *  end     - end of the program in RAM.
+ */
+void ch8_cfg_build(ch8_cfg_t *cfg, const uint8_t *ram, uint16_t entry, uint16_t end);
+
+/*
+ * Write the program as assembly with labels on blocks, subroutines and
+ * data, and data as db lines, sprites drawn out in the comments.
  *
  * Returns
- *  pointer to zero terminated string.
- * NOTE: the string pointed to is only guaranteed to be valid until the
- * next call to ch8_disassemble, at which point it may be overwritten.
+ *  0 on success, nonzero on a write error.
  */
-const char *ch8_disassemble(uint16_t opcode);
+int ch8_cfg_write_asm(const ch8_cfg_t *cfg, const uint8_t *ram, FILE *f);
+
+/*
+ * Write the control flow graph in Graphviz DOT format.
+ *
+ * Params
+ *  name    - name of the graph.
+ *
+ * Returns
+ *  0 on success, nonzero on a write error.
+ */
+int ch8_cfg_write_dot(const ch8_cfg_t *cfg, const uint8_t *ram, const char *name, FILE *f);
+
+/*
+ * Start a new profile of vm, the first sample is taken at its current
+ * cycle count.
+ *
+ * Params:
+ *  interval    - instructions per sample, CH8_PROFILE_EXACT for all.
+ */
+void ch8_profile_init(ch8_profile_t *prof, const ch8_t *vm, uint32_t interval);
+
+/*
+ * Take the samples that are due at vm->cycles, if any. When the VM
+ * skipped over several sample points at once, like in an idle loop,
+ * they are all attributed to the current PC and call stack.
+ */
+void ch8_profile_sample(ch8_profile_t *prof, const ch8_t *vm);
+
+/*
+ * Amount of instructions vm can execute before the next sample is due,
+ * at most cycles. Call after ch8_profile_sample, the result is then
+ * never 0 unless cycles is.
+ */
+uint32_t ch8_profile_span(const ch8_profile_t *prof, const ch8_t *vm, uint32_t cycles);
+
+/*
+ * ch8_run that takes samples along the way. Returns at the same points
+ * as ch8_run would.
+ */
+ch8_exit_e ch8_profile_run(ch8_profile_t *prof, ch8_t *vm, uint32_t cycles);
+
+/*
+ * Find the addresses with the most samples.
+ *
+ * Params:
+ *  addrs   - output, hottest first, ties by address,
+ *  max     - room in addrs.
+ *
+ * Returns
+ *  amount of addresses written, less than max if fewer were sampled.
+ */
+uint32_t ch8_profile_hot(const ch8_profile_t *prof, uint16_t *addrs, uint32_t max);
+
+/*
+ * Write the sampled call stacks in the collapsed format taken by
+ * flamegraph.pl, one "start;sub_2A0;sub_310 COUNT" line per stack.
+ *
+ * Returns
+ *  0 on success, nonzero on a write error.
+ */
+int ch8_profile_write_collapsed(const ch8_profile_t *prof, FILE *f);
 
 /*
  * Execute a single instruction in VM
@@ -100,4 +875,14 @@ const char *ch8_disassemble(uint16_t opcode);
  */
 void ch8_exec(ch8_t *vm, uint16_t opcode);
 
+/*
+ * Classify an opcode into its fully decoded form.
+ */
+ch8_form_e ch8_decode(uint16_t opcode);
+
+/*
+ * Decode opcode into a cache entry, including the handler pointer.
+ */
+void ch8_decode_op(uint16_t opcode, ch8_dop_t *op);
+
 #endif // CHIP8_H
@@ -0,0 +1,560 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lockstep execution of many VMs. Each step the lanes sitting at the
+ * leader lane's PC with the same opcode form a group. If the opcode is
+ * one of the register, skip, jump or timer forms the group executes it
+ * in the vector kernels, everything else goes through ch8_tick one lane
+ * at a time. When most lanes have diverged the batch falls back to
+ * short scalar bursts until they meet again.
+ *
+ * The kernels use GCC vector extensions, on x86-64 Linux they are built
+ * for both AVX2 and the SSE2 baseline and picked at load time.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_ops.h"
+
+/* instructions per lane in a scalar burst */
+#define BATCH_BURST     16
+
+#if defined(__GNUC__) && !defined(HNC8_NO_SIMD)
+
+#define BATCH_VEC       32
+#define BATCH_VEC16     (BATCH_VEC / 2)
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#   if __has_attribute(target_clones)
+#       define BATCH_KERNEL __attribute__((target_clones("avx2", "default")))
+#   endif
+#endif
+#ifndef BATCH_KERNEL
+#   define BATCH_KERNEL
+#endif
+
+typedef uint8_t u8v __attribute__((vector_size(BATCH_VEC)));
+typedef uint16_t u16v __attribute__((vector_size(BATCH_VEC)));
+
+/* unaligned views of the register arrays */
+typedef u8v u8v_u __attribute__((aligned(1), may_alias));
+typedef u16v u16v_u __attribute__((aligned(1), may_alias));
+
+#define load8(p)        (*(const u8v_u *)(p))
+#define store8(p, x)    (*(u8v_u *)(p) = (x))
+#define load16(p)       (*(const u16v_u *)(p))
+#define store16(p, x)   (*(u16v_u *)(p) = (x))
+
+#define BLEND(old, new, m) (((new) & (m)) | ((old) & ~(m)))
+
+static bool is_vector_form(ch8_form_e form)
+{
+    switch(form) {
+        case CH8_OP_NOP:
+        case CH8_OP_JP:
+        case CH8_OP_SE_VI:
+        case CH8_OP_SNE_VI:
+        case CH8_OP_SE_VV:
+        case CH8_OP_SNE_VV:
+        case CH8_OP_LD_VI:
+        case CH8_OP_ADD_VI:
+        case CH8_OP_LD_VV:
+        case CH8_OP_OR:
+        case CH8_OP_AND:
+        case CH8_OP_XOR:
+        case CH8_OP_ADD_VV:
+        case CH8_OP_SUB:
+        case CH8_OP_SHR:
+        case CH8_OP_SUBN:
+        case CH8_OP_SHL:
+        case CH8_OP_LD_I:
+        case CH8_OP_LD_VDT:
+        case CH8_OP_LD_DTV:
+        case CH8_OP_LD_STV:
+        case CH8_OP_ADD_IV:
+        case CH8_OP_LD_FV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Byte register kernels. Flag setting forms write VF before the result
+ * and re-read their operands, the same order as the op_* primitives so
+ * VF as an operand behaves identically.
+ *
+ * Returns
+ *  false if a skip was taken by only some of the lanes.
+ */
+BATCH_KERNEL
+static bool kernel_regs(ch8_batch_t *b, ch8_form_e form, uint16_t opcode, uint8_t *skip)
+{
+    uint8_t *vx = b->v[OP_X(opcode)];
+    uint8_t *vy = b->v[OP_Y(opcode)];
+    uint8_t *vf = b->v[0xF];
+    const u8v zero = { 0 };
+    const u8v kk = zero + (uint8_t)OP_KK(opcode);
+    u8v any = zero, all = ~zero;
+
+    for(uint32_t c = 0; c < b->lanes; c += BATCH_VEC) {
+        u8v m = load8(b->group + c);
+        u8v x = load8(vx + c);
+        u8v f;
+
+        switch(form) {
+            case CH8_OP_SE_VI:
+                store8(skip + c, (u8v)(x == kk) & m);
+                break;
+            case CH8_OP_SNE_VI:
+                store8(skip + c, (u8v)(x != kk) & m);
+                break;
+            case CH8_OP_SE_VV:
+                store8(skip + c, (u8v)(x == load8(vy + c)) & m);
+                break;
+            case CH8_OP_SNE_VV:
+                store8(skip + c, (u8v)(x != load8(vy + c)) & m);
+                break;
+            case CH8_OP_LD_VI:
+                store8(vx + c, BLEND(x, kk, m));
+                break;
+            case CH8_OP_ADD_VI:
+                store8(vx + c, BLEND(x, x + kk, m));
+                break;
+            case CH8_OP_LD_VV:
+                store8(vx + c, BLEND(x, load8(vy + c), m));
+                break;
+            case CH8_OP_OR:
+                store8(vx + c, BLEND(x, x | load8(vy + c), m));
+                break;
+            case CH8_OP_AND:
+                store8(vx + c, BLEND(x, x & load8(vy + c), m));
+                break;
+            case CH8_OP_XOR:
+                store8(vx + c, BLEND(x, x ^ load8(vy + c), m));
+                break;
+            case CH8_OP_ADD_VV: {
+                u8v r = x + load8(vy + c);
+                f = load8(vf + c);
+                store8(vf + c, BLEND(f, (u8v)(r < x) & 1, m));
+                store8(vx + c, BLEND(load8(vx + c), r, m));
+                break;
+            }
+            case CH8_OP_SUB:
+                f = load8(vf + c);
+                store8(vf + c, BLEND(f, (u8v)(x > load8(vy + c)) & 1, m));
+                x = load8(vx + c);
+                store8(vx + c, BLEND(x, x - load8(vy + c), m));
+                break;
+            case CH8_OP_SHR:
+                f = load8(vf + c);
+                store8(vf + c, BLEND(f, x & 1, m));
+                x = load8(vx + c);
+                store8(vx + c, BLEND(x, x >> 1, m));
+                break;
+            case CH8_OP_SUBN:
+                f = load8(vf + c);
+                store8(vf + c, BLEND(f, (u8v)(load8(vy + c) > x) & 1, m));
+                x = load8(vx + c);
+                store8(vx + c, BLEND(x, load8(vy + c) - x, m));
+                break;
+            case CH8_OP_SHL:
+                f = load8(vf + c);
+                store8(vf + c, BLEND(f, x >> 7, m));
+                x = load8(vx + c);
+                store8(vx + c, BLEND(x, x << 1, m));
+                break;
+            case CH8_OP_LD_VDT:
+                store8(vx + c, BLEND(x, load8(b->tim_delay + c), m));
+                break;
+            case CH8_OP_LD_DTV:
+                store8(b->tim_delay + c, BLEND(load8(b->tim_delay + c), x, m));
+                break;
+            case CH8_OP_LD_STV:
+                store8(b->tim_sound + c, BLEND(load8(b->tim_sound + c), x, m));
+                break;
+            default:
+                break;
+        }
+        if(form == CH8_OP_SE_VI || form == CH8_OP_SNE_VI ||
+           form == CH8_OP_SE_VV || form == CH8_OP_SNE_VV) {
+            u8v s = load8(skip + c);
+            any |= s;
+            all &= s | ~m;
+        }
+    }
+
+    /* a skip keeps the lanes together if none or all of them took it */
+    uint8_t took_any = 0, took_all = 0xFF;
+    for(uint32_t k = 0; k < BATCH_VEC; ++k) {
+        took_any |= any[k];
+        took_all &= all[k];
+    }
+
+    return took_any == 0 || took_all == 0xFF;
+}
+
+/*
+ * PC and I kernels, the 16-bit arrays hold half as many lanes per vector.
+ */
+BATCH_KERNEL
+static void kernel_pc(ch8_batch_t *b, ch8_form_e form, uint16_t opcode, const uint8_t *skip)
+{
+    const u16v zero = { 0 };
+    const u16v nnn = zero + (uint16_t)OP_NNN(opcode);
+
+    switch(form) {
+        case CH8_OP_LD_I:
+            for(uint32_t c = 0; c < b->lanes; c += BATCH_VEC16) {
+                u16v m = load16(b->group16 + c);
+                store16(b->i + c, BLEND(load16(b->i + c), nnn, m));
+            }
+            break;
+        case CH8_OP_ADD_IV:
+        case CH8_OP_LD_FV: {
+            const uint8_t *vx = b->v[OP_X(opcode)];
+            for(uint32_t l = 0; l < b->lanes; ++l) {
+                if(b->group[l]) {
+                    b->i[l] = form == CH8_OP_LD_FV ? vx[l] * VM_FONT_H : b->i[l] + vx[l];
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    if(form == CH8_OP_JP) {
+        for(uint32_t c = 0; c < b->lanes; c += BATCH_VEC16) {
+            u16v m = load16(b->group16 + c);
+            store16(b->pc + c, BLEND(load16(b->pc + c), nnn, m));
+        }
+        return;
+    }
+
+    for(uint32_t c = 0; c < b->lanes; c += BATCH_VEC16) {
+        u16v m = load16(b->group16 + c);
+        store16(b->pc + c, load16(b->pc + c) + (m & 2));
+    }
+    if(skip != NULL) {
+        for(uint32_t l = 0; l < b->lanes; ++l) {
+            b->pc[l] += skip[l] & 2;
+        }
+    }
+}
+
+BATCH_KERNEL
+static void kernel_timers(ch8_batch_t *b)
+{
+    for(uint32_t c = 0; c < b->lanes; c += BATCH_VEC) {
+        u8v d = load8(b->tim_delay + c);
+        u8v s = load8(b->tim_sound + c);
+        /* the comparison is -1 for nonzero timers */
+        store8(b->tim_delay + c, d + (u8v)(d != 0));
+        store8(b->tim_sound + c, s + (u8v)(s != 0));
+    }
+}
+
+static void gather_lane(ch8_batch_t *b, uint32_t l)
+{
+    const ch8_t *vm = &b->vms[l];
+
+    for(uint8_t r = 0; r < 16; ++r) {
+        b->v[r][l] = vm->v[r];
+    }
+    b->i[l] = vm->i;
+    b->pc[l] = vm->pc;
+    b->tim_delay[l] = vm->tim_delay;
+    b->tim_sound[l] = vm->tim_sound;
+}
+
+static void scatter_lane(ch8_batch_t *b, uint32_t l)
+{
+    ch8_t *vm = &b->vms[l];
+
+    for(uint8_t r = 0; r < 16; ++r) {
+        vm->v[r] = b->v[r][l];
+    }
+    vm->i = b->i[l];
+    vm->pc = b->pc[l];
+    vm->tim_delay = b->tim_delay[l];
+    vm->tim_sound = b->tim_sound[l];
+}
+
+static inline bool writes_ram(uint16_t opcode)
+{
+    return (opcode & 0xF0FF) == 0xF033 || (opcode & 0xF0FF) == 0xF055;
+}
+
+/*
+ * Step one lane through ch8_tick, whatever it executes.
+ */
+static void tick_lane(ch8_batch_t *b, uint32_t l)
+{
+    ch8_t *vm = &b->vms[l];
+
+    scatter_lane(b, l);
+    if(vm->pc < VM_RAM_SIZE - 1 && writes_ram(ch8_get_op(vm))) {
+        memset(b->verified, 0, sizeof(b->verified));
+    }
+    ch8_tick(vm);
+    gather_lane(b, l);
+}
+
+/*
+ * Group instructions that need the rest of the VM state, executed lane
+ * by lane. CLS, RND and DRW only sync the registers they use, anything
+ * else goes through tick_lane.
+ *
+ * Returns
+ *  true if every lane of a full group still shares PC.
+ */
+static bool group_lanes(ch8_batch_t *b, ch8_form_e form, uint16_t opcode)
+{
+    uint8_t x = OP_X(opcode), y = OP_Y(opcode);
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        ch8_t *vm = &b->vms[l];
+
+        if(!b->group[l]) {
+            continue;
+        }
+
+        switch(form) {
+            case CH8_OP_CLS:
+                op_cls(vm);
+                break;
+            case CH8_OP_RND:
+                op_rnd(vm, x, OP_KK(opcode));
+                b->v[x][l] = vm->v[x];
+                break;
+            case CH8_OP_DRW:
+                vm->v[x] = b->v[x][l];
+                vm->v[y] = b->v[y][l];
+                vm->i = b->i[l];
+                op_drw(vm, x, y, OP_N(opcode));
+                b->v[0xF][l] = vm->v[0xF];
+                break;
+            default:
+                tick_lane(b, l);
+                continue;
+        }
+        b->pc[l] += 2;
+    }
+
+    switch(form) {
+        case CH8_OP_RET:
+        case CH8_OP_JP_V0:
+        case CH8_OP_SKP:
+        case CH8_OP_SKNP:
+        case CH8_OP_LD_VK:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Mark the lanes sitting at the leader's PC with the leader's opcode.
+ *
+ * Returns
+ *  amount of lanes in the group, 0 if the leader can't be grouped.
+ */
+static uint32_t make_group(ch8_batch_t *b, uint16_t *opcode)
+{
+    uint16_t pc = b->pc[b->converged ? 0 : b->leader];
+    uint32_t count = 0;
+
+    if(pc >= VM_RAM_SIZE - 1) {
+        b->converged = false;
+        return 0;
+    }
+
+    /* the VMs' own PCs are stale while the batch runs */
+    const uint8_t *code = b->vms[b->converged ? 0 : b->leader].ram + pc;
+    uint8_t hi = code[0], lo = code[1];
+    *opcode = (hi << 8) | lo;
+
+    if(b->converged && ch8_bpoint_test(b->verified, pc)) {
+        return b->lanes;
+    }
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        const uint8_t *ram = b->vms[l].ram;
+        bool in = b->pc[l] == pc && ram[pc] == hi && ram[pc + 1] == lo;
+        b->group[l] = in ? 0xFF : 0;
+        b->group16[l] = in ? 0xFFFF : 0;
+        count += in;
+    }
+
+    b->converged = count == b->lanes;
+    if(b->converged) {
+        ch8_bpoint_set(b->verified, pc, true);
+    }
+
+    return count;
+}
+
+/*
+ * Pick the lane whose PC most lanes share, if there is a majority.
+ */
+static uint32_t pick_leader(const ch8_batch_t *b)
+{
+    uint32_t leader = 0, votes = 0;
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        if(votes == 0) {
+            leader = l;
+            votes = 1;
+        } else if(b->pc[l] == b->pc[leader]) {
+            votes += 1;
+        } else {
+            votes -= 1;
+        }
+    }
+
+    return leader;
+}
+
+int ch8_batch_init(ch8_batch_t *batch, ch8_t *vms, uint32_t lanes)
+{
+    assert(batch != NULL);
+    assert(vms != NULL);
+
+    if(lanes == 0 || lanes > CH8_BATCH_MAX) {
+        return 1;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+    batch->vms = vms;
+    batch->lanes = lanes;
+
+    return 0;
+}
+
+void ch8_batch_run(ch8_batch_t *b, uint32_t frames, uint32_t cycles)
+{
+    assert(b != NULL);
+
+    uint8_t skip[CH8_BATCH_MAX];
+
+    /* RAM may have been changed since the last run */
+    memset(b->verified, 0, sizeof(b->verified));
+    b->converged = false;
+    b->leader = 0;
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        gather_lane(b, l);
+        b->start[l] = b->vms[l].cycles;
+    }
+
+    for(uint32_t frame = 0; frame < frames; ++frame) {
+        kernel_timers(b);
+
+        uint32_t left = cycles;
+        while(left > 0) {
+            uint16_t opcode = 0;
+            uint32_t count = make_group(b, &opcode);
+
+            if(count * 4 < b->lanes || count < 2) {
+                /* mostly diverged, run everything scalar for a while */
+                uint32_t burst = left < BATCH_BURST ? left : BATCH_BURST;
+                for(uint32_t l = 0; l < b->lanes; ++l) {
+                    scatter_lane(b, l);
+                    for(uint32_t n = 0; n < burst; ++n) {
+                        ch8_tick(&b->vms[l]);
+                    }
+                    gather_lane(b, l);
+                }
+                memset(b->verified, 0, sizeof(b->verified));
+                b->scalar += (uint64_t)burst * b->lanes;
+                b->leader = pick_leader(b);
+                b->converged = false;
+                left -= burst;
+                continue;
+            }
+
+            ch8_form_e form = ch8_decode(opcode);
+            bool same_pc;
+            if(is_vector_form(form)) {
+                bool skips = form == CH8_OP_SE_VI || form == CH8_OP_SNE_VI ||
+                             form == CH8_OP_SE_VV || form == CH8_OP_SNE_VV;
+                same_pc = kernel_regs(b, form, opcode, skip);
+                kernel_pc(b, form, opcode, skips ? skip : NULL);
+            } else {
+                same_pc = group_lanes(b, form, opcode);
+            }
+
+            if(count < b->lanes) {
+                for(uint32_t l = 0; l < b->lanes; ++l) {
+                    if(!b->group[l]) {
+                        tick_lane(b, l);
+                    }
+                }
+                b->leader = pick_leader(b);
+            }
+            b->converged = b->converged && same_pc;
+            b->lockstep += count;
+            b->scalar += b->lanes - count;
+            left -= 1;
+        }
+    }
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        scatter_lane(b, l);
+        b->vms[l].cycles = b->start[l] + (uint64_t)frames * cycles;
+    }
+}
+
+#else
+
+int ch8_batch_init(ch8_batch_t *batch, ch8_t *vms, uint32_t lanes)
+{
+    assert(batch != NULL);
+    assert(vms != NULL);
+
+    if(lanes == 0 || lanes > CH8_BATCH_MAX) {
+        return 1;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+    batch->vms = vms;
+    batch->lanes = lanes;
+
+    return 0;
+}
+
+/* no vector extensions, step the lanes one after another */
+void ch8_batch_run(ch8_batch_t *b, uint32_t frames, uint32_t cycles)
+{
+    assert(b != NULL);
+
+    for(uint32_t l = 0; l < b->lanes; ++l) {
+        for(uint32_t frame = 0; frame < frames; ++frame) {
+            ch8_tick_timers(&b->vms[l]);
+            for(uint32_t n = 0; n < cycles; ++n) {
+                ch8_tick(&b->vms[l]);
+            }
+        }
+    }
+    b->scalar += (uint64_t)b->lanes * frames * cycles;
+}
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Recursive traversal disassembly. Starting from the entry point every
+ * path is followed through jumps, calls and both sides of skips, so
+ * only bytes that can be executed end up as code, and the rest of the
+ * image is data. Bnnn jumps to a register dependent address and ends a
+ * path, as does an invalid opcode since that is most likely data that
+ * was reached through a skip over it.
+ *
+ * I is tracked along each path from Annn to the next instruction that
+ * changes it in a way that isn't known, which finds the sprites used
+ * by DRW and the buffers of Fx33, Fx55 and Fx65.
+ */
+
+#include "chip8.h"
+#include <assert.h>
+#include <string.h>
+
+#define LABEL_MAX 16
+
+/* I at a point of a path, if it is known */
+#define I_UNKNOWN -1
+
+typedef struct {
+    uint16_t stack[VM_RAM_SIZE];
+    uint32_t top;
+    uint8_t queued[VM_RAM_SIZE];
+} cfg_work_t;
+
+static inline uint16_t read_op(const uint8_t *ram, uint16_t addr)
+{
+    return (ram[addr] << 8) | ram[addr + 1];
+}
+
+static inline bool in_image(const ch8_cfg_t *cfg, uint32_t addr)
+{
+    return addr >= VM_EXEC_START_ADDR && addr + 1 < cfg->end;
+}
+
+/* flag a branch target and queue it to be followed */
+static void target(ch8_cfg_t *cfg, cfg_work_t *work, uint16_t addr, uint8_t flags)
+{
+    if(addr >= VM_RAM_SIZE) {
+        return;
+    }
+    cfg->map[addr] |= flags;
+    if(in_image(cfg, addr) && !work->queued[addr]) {
+        work->queued[addr] = 1;
+        work->stack[work->top++] = addr;
+    }
+}
+
+static void mark(ch8_cfg_t *cfg, int32_t addr, uint32_t len, uint8_t flags)
+{
+    for(uint32_t k = 0; k < len && addr + k < VM_RAM_SIZE; ++k) {
+        cfg->map[addr + k] |= flags;
+    }
+}
+
+/* follow one path until it ends or joins code that was already found */
+static void walk(ch8_cfg_t *cfg, cfg_work_t *work, const uint8_t *ram, uint16_t pc)
+{
+    int32_t i = I_UNKNOWN;
+
+    while(in_image(cfg, pc)) {
+        if(cfg->map[pc] & CH8_CFG_INSN) {
+            cfg->map[pc] |= CH8_CFG_LEADER;
+            return;
+        }
+
+        uint16_t op = read_op(ram, pc);
+        uint16_t next = pc + 2;
+        uint16_t nnn = op & 0x0FFF;
+        uint8_t x = (op >> 8) & 0xF;
+
+        cfg->map[pc] |= CH8_CFG_INSN | CH8_CFG_CODE;
+        cfg->map[pc + 1] |= CH8_CFG_CODE;
+        cfg->insn_count += 1;
+
+        switch(ch8_decode(op)) {
+            case CH8_OP_RET:
+            case CH8_OP_JP_V0:
+            case CH8_OP_INVALID:
+                return;
+            case CH8_OP_JP:
+                target(cfg, work, nnn, CH8_CFG_LEADER);
+                return;
+            case CH8_OP_CALL:
+                target(cfg, work, nnn, CH8_CFG_LEADER | CH8_CFG_SUB);
+                mark(cfg, next, 1, CH8_CFG_LEADER);
+                /* the subroutine may change I */
+                i = I_UNKNOWN;
+                break;
+            case CH8_OP_SE_VI:
+            case CH8_OP_SNE_VI:
+            case CH8_OP_SE_VV:
+            case CH8_OP_SNE_VV:
+            case CH8_OP_SKP:
+            case CH8_OP_SKNP:
+                target(cfg, work, next, CH8_CFG_LEADER);
+                target(cfg, work, next + 2, CH8_CFG_LEADER);
+                return;
+            case CH8_OP_LD_I:
+                i = nnn;
+                cfg->map[nnn] |= CH8_CFG_REF;
+                break;
+            case CH8_OP_ADD_IV:
+            case CH8_OP_LD_FV:
+                i = I_UNKNOWN;
+                break;
+            case CH8_OP_DRW:
+                if(i != I_UNKNOWN) {
+                    mark(cfg, i, op & 0xF, CH8_CFG_SPRITE);
+                }
+                break;
+            case CH8_OP_LD_BV:
+                if(i != I_UNKNOWN) {
+                    mark(cfg, i, 3, CH8_CFG_DATA | CH8_CFG_WRITE);
+                }
+                break;
+            case CH8_OP_LD_MEMV:
+                if(i != I_UNKNOWN) {
+                    mark(cfg, i, x + 1, CH8_CFG_DATA | CH8_CFG_WRITE);
+                }
+                i = I_UNKNOWN;
+                break;
+            case CH8_OP_LD_VMEM:
+                if(i != I_UNKNOWN) {
+                    mark(cfg, i, x + 1, CH8_CFG_DATA);
+                }
+                i = I_UNKNOWN;
+                break;
+            default:
+                break;
+        }
+
+        pc = next;
+    }
+}
+
+/* collect the block starting at a leader */
+static void build_block(ch8_cfg_t *cfg, const uint8_t *ram, ch8_block_t *b, uint16_t pc)
+{
+    memset(b, 0, sizeof(*b));
+    b->start = pc;
+
+    for(;;) {
+        uint16_t op = read_op(ram, pc);
+        uint16_t next = pc + 2;
+
+        b->end = next;
+        switch(ch8_decode(op)) {
+            case CH8_OP_RET:
+                b->flags |= CH8_BLOCK_RET;
+                return;
+            case CH8_OP_JP_V0:
+                b->flags |= CH8_BLOCK_INDIRECT;
+                return;
+            case CH8_OP_INVALID:
+                b->flags |= CH8_BLOCK_INVALID;
+                return;
+            case CH8_OP_JP:
+                b->succ[b->succ_count++] = op & 0x0FFF;
+                return;
+            case CH8_OP_CALL:
+                b->flags |= CH8_BLOCK_CALL;
+                b->call = op & 0x0FFF;
+                b->succ[b->succ_count++] = next;
+                return;
+            case CH8_OP_SE_VI:
+            case CH8_OP_SNE_VI:
+            case CH8_OP_SE_VV:
+            case CH8_OP_SNE_VV:
+            case CH8_OP_SKP:
+            case CH8_OP_SKNP:
+                b->flags |= CH8_BLOCK_SKIP;
+                b->succ[b->succ_count++] = next;
+                b->succ[b->succ_count++] = next + 2;
+                return;
+            default:
+                break;
+        }
+
+        if(!in_image(cfg, next) || !(cfg->map[next] & CH8_CFG_INSN)) {
+            /* runs off the end of the image */
+            return;
+        }
+        if(cfg->map[next] & CH8_CFG_LEADER) {
+            b->succ[b->succ_count++] = next;
+            return;
+        }
+        pc = next;
+    }
+}
+
+void ch8_cfg_build(ch8_cfg_t *cfg, const uint8_t *ram, uint16_t entry, uint16_t end)
+{
+    assert(cfg != NULL);
+    assert(ram != NULL);
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->entry = entry;
+    cfg->end = end > VM_RAM_SIZE ? VM_RAM_SIZE : end;
+
+    cfg_work_t work;
+    work.top = 0;
+    memset(work.queued, 0, sizeof(work.queued));
+
+    target(cfg, &work, entry, CH8_CFG_LEADER);
+    while(work.top > 0) {
+        walk(cfg, &work, ram, work.stack[--work.top]);
+    }
+
+    for(uint32_t a = VM_EXEC_START_ADDR; a < cfg->end; ++a) {
+        uint8_t m = cfg->map[a];
+        if((m & CH8_CFG_INSN) && (m & CH8_CFG_LEADER)) {
+            build_block(cfg, ram, &cfg->blocks[cfg->block_count++], a);
+        }
+        if((m & CH8_CFG_INSN) && (m & CH8_CFG_SUB)) {
+            cfg->sub_count += 1;
+        }
+    }
+}
+
+/* label of an address, or NULL if nothing refers to it */
+static const char *label(const ch8_cfg_t *cfg, uint16_t addr, char *buf)
+{
+    if(addr >= VM_RAM_SIZE) {
+        return NULL;
+    }
+
+    uint8_t m = cfg->map[addr];
+    if(addr == cfg->entry) {
+        return "start";
+    } else if((m & CH8_CFG_SUB) && (m & CH8_CFG_INSN)) {
+        snprintf(buf, LABEL_MAX, "sub_%03X", addr);
+    } else if((m & CH8_CFG_LEADER) && (m & CH8_CFG_INSN)) {
+        snprintf(buf, LABEL_MAX, "loc_%03X", addr);
+    } else if((m & CH8_CFG_REF) && (m & CH8_CFG_SPRITE)) {
+        snprintf(buf, LABEL_MAX, "spr_%03X", addr);
+    } else if(m & CH8_CFG_REF) {
+        snprintf(buf, LABEL_MAX, "dat_%03X", addr);
+    } else {
+        return NULL;
+    }
+    return buf;
+}
+
+/* what an instruction jumps to or points I to, or NULL */
+static const char *insn_comment(const ch8_cfg_t *cfg, uint16_t op, char *buf)
+{
+    switch(ch8_decode(op)) {
+        case CH8_OP_JP:
+        case CH8_OP_CALL:
+        case CH8_OP_LD_I:
+            return label(cfg, op & 0x0FFF, buf);
+        case CH8_OP_JP_V0:
+            return "indirect";
+        default:
+            return NULL;
+    }
+}
+
+static void write_sprite_row(uint8_t row, FILE *f)
+{
+    char bits[9];
+    for(int b = 0; b < 8; ++b) {
+        bits[b] = (row & (0x80 >> b)) ? '#' : '.';
+    }
+    bits[8] = '\0';
+    fprintf(f, "; %s", bits);
+}
+
+int ch8_cfg_write_asm(const ch8_cfg_t *cfg, const uint8_t *ram, FILE *f)
+{
+    assert(cfg != NULL);
+    assert(ram != NULL);
+    assert(f != NULL);
+
+    fprintf(f, "; %u instructions in %u blocks, %u subroutines\n",
+            cfg->insn_count, cfg->block_count, cfg->sub_count);
+
+    uint32_t addr = VM_EXEC_START_ADDR;
+    while(addr < cfg->end) {
+        char buf[LABEL_MAX];
+        const char *name = label(cfg, addr, buf);
+        uint8_t m = cfg->map[addr];
+
+        if(name != NULL) {
+            fprintf(f, "\n%s:\n", name);
+        }
+
+        if((m & CH8_CFG_INSN) && addr + 1 < cfg->end) {
+            uint16_t op = read_op(ram, addr);
+            char dis[CH8_DISASM_MAX];
+            ch8_disassemble_r(op, dis, sizeof(dis));
+            const char *comment = insn_comment(cfg, op, buf);
+            if(comment != NULL) {
+                fprintf(f, "%04X:    %-24s; %s\n", addr, dis, comment);
+            } else {
+                fprintf(f, "%04X:    %s\n", addr, dis);
+            }
+            addr += 2;
+        } else if(m & CH8_CFG_SPRITE) {
+            char db[CH8_DISASM_MAX];
+            snprintf(db, sizeof(db), "db 0x%02X", ram[addr]);
+            fprintf(f, "%04X:    %-24s", addr, db);
+            write_sprite_row(ram[addr], f);
+            fputc('\n', f);
+            addr += 1;
+        } else {
+            /* run of data up to the next label, instruction or sprite */
+            uint32_t n = 0;
+            fprintf(f, "%04X:    db", addr);
+            do {
+                fprintf(f, "%s0x%02X", n == 0 ? " " : ", ", ram[addr + n]);
+                n += 1;
+            } while(n < 8 && addr + n < cfg->end &&
+                    !(cfg->map[addr + n] & (CH8_CFG_INSN | CH8_CFG_SPRITE)) &&
+                    label(cfg, addr + n, buf) == NULL);
+            if(m & CH8_CFG_DATA) {
+                fprintf(f, "  ; data");
+            }
+            fputc('\n', f);
+            addr += n;
+        }
+    }
+
+    return ferror(f);
+}
+
+int ch8_cfg_write_dot(const ch8_cfg_t *cfg, const uint8_t *ram, const char *name, FILE *f)
+{
+    assert(cfg != NULL);
+    assert(ram != NULL);
+    assert(f != NULL);
+
+    fprintf(f, "digraph \"%s\" {\n", name != NULL ? name : "hnc8");
+    fprintf(f, "    node [shape=box fontname=monospace];\n");
+
+    for(uint32_t k = 0; k < cfg->block_count; ++k) {
+        const ch8_block_t *b = &cfg->blocks[k];
+        char buf[LABEL_MAX];
+        const char *bname = label(cfg, b->start, buf);
+
+        fprintf(f, "    b%04X [label=\"%s:\\l", b->start, bname != NULL ? bname : "");
+        for(uint16_t a = b->start; a < b->end; a += 2) {
+            char dis[CH8_DISASM_MAX];
+            ch8_disassemble_r(read_op(ram, a), dis, sizeof(dis));
+            fprintf(f, "%04X  %s\\l", a, dis);
+        }
+        fprintf(f, "\"%s];\n", (cfg->map[b->start] & CH8_CFG_SUB) ? " style=bold" : "");
+
+        for(uint8_t s = 0; s < b->succ_count; ++s) {
+            const char *attr = "";
+            if(b->flags & CH8_BLOCK_SKIP) {
+                attr = s == 0 ? " [label=\"no skip\"]" : " [label=\"skip\"]";
+            }
+            fprintf(f, "    b%04X -> b%04X%s;\n", b->start, b->succ[s], attr);
+        }
+        if(b->flags & CH8_BLOCK_CALL) {
+            fprintf(f, "    b%04X -> b%04X [style=dashed label=\"call\"];\n", b->start, b->call);
+        }
+    }
+
+    fprintf(f, "}\n");
+
+    return ferror(f);
+}
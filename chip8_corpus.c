@@ -0,0 +1,564 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Corpus analysis. Analysing a ROM takes microseconds, so instead of the
+ * per-worker deques of the farm the workers take small batches of ROMs
+ * from a shared cursor. Every worker has its own RAM image, graph and
+ * counters, the counters are only added up once the workers are done.
+ *
+ * Output to an archive is written to a scratch file of the worker first
+ * and copied into the archive under a lock, so a slow ROM never holds up
+ * the others.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_corpus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // sysconf()
+#include <dirent.h>     // opendir()
+#include <sys/stat.h>   // stat()
+
+#include "chip8.h"
+#include "file.h"
+#include "log.h"
+
+#define CORPUS_PATH_MAX 512
+/* ROMs taken from the cursor at a time */
+#define CORPUS_BATCH 8
+#define CORPUS_BUF_SZ 65536
+
+typedef struct {
+    char path[CORPUS_PATH_MAX];
+    /* Results */
+    bool ok;
+    uint32_t size;
+    uint16_t insns;
+    uint16_t blocks;
+    uint16_t subs;
+    uint32_t unknown;
+    uint32_t smc_bytes;
+    /* where the output is in the archive */
+    long offset;
+    long out_size;
+} corpus_rom_t;
+
+typedef struct {
+    corpus_rom_t *roms;
+    uint32_t rom_count;
+    pthread_mutex_t lock;
+    uint32_t next;
+    int workers;
+    corpus_format_e format;
+    unsigned flags;
+    /* Output, if any */
+    const char *out_path;
+    bool out_dir;
+    FILE *archive;
+    pthread_mutex_t archive_lock;
+} corpus_t;
+
+typedef struct {
+    corpus_t *corpus;
+    pthread_t thread;
+    uint8_t ram[VM_RAM_SIZE];
+    ch8_cfg_t cfg;
+    uint64_t hist[CH8_OP_COUNT];
+    /* scratch file for archive output */
+    FILE *tmp;
+    char buf[CORPUS_BUF_SZ];
+} corpus_worker_t;
+
+static double time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+/*
+ * Write the output of the ROM in the worker's RAM image.
+ *
+ * Returns
+ *  0 on success, nonzero on a write error.
+ */
+static int write_rom(corpus_worker_t *w, const corpus_rom_t *rom, FILE *f)
+{
+    corpus_t *c = w->corpus;
+
+    switch(c->format) {
+        case CORPUS_ASM:
+            return ch8_cfg_write_asm(&w->cfg, w->ram, f);
+        case CORPUS_DOT:
+            return ch8_cfg_write_dot(&w->cfg, w->ram, base_name(rom->path), f);
+        case CORPUS_DISASM:
+            break;
+    }
+
+    const uint8_t *code = w->ram + VM_EXEC_START_ADDR;
+    size_t done = 0;
+    while(done + 2 <= rom->size) {
+        size_t consumed;
+        size_t len = ch8_disassemble_block(code + done, rom->size - done,
+                                           VM_EXEC_START_ADDR + done, c->flags,
+                                           w->buf, sizeof(w->buf), &consumed);
+        fwrite(w->buf, 1, len, f);
+        done += consumed;
+    }
+
+    return ferror(f);
+}
+
+static int write_file(corpus_worker_t *w, corpus_rom_t *rom)
+{
+    corpus_t *c = w->corpus;
+    char path[2 * CORPUS_PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s.%s", c->out_path, base_name(rom->path),
+             c->format == CORPUS_DOT ? "dot" : "asm");
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        LOG_ERROR("Could not open \"%s\" for writing\n", path);
+        return 1;
+    }
+    setvbuf(f, NULL, _IOFBF, CORPUS_BUF_SZ);
+
+    int ret = write_rom(w, rom, f);
+    if(fclose(f) != 0 || ret != 0) {
+        LOG_ERROR("Error writing \"%s\"\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int write_archive(corpus_worker_t *w, corpus_rom_t *rom)
+{
+    corpus_t *c = w->corpus;
+
+    /* the scratch file is reused, only the start of it is this ROM's */
+    rewind(w->tmp);
+    if(write_rom(w, rom, w->tmp) != 0 || fflush(w->tmp) != 0) {
+        LOG_ERROR("Error writing the output of \"%s\"\n", rom->path);
+        return 1;
+    }
+    long size = ftell(w->tmp);
+    rewind(w->tmp);
+
+    pthread_mutex_lock(&c->archive_lock);
+    rom->offset = ftell(c->archive);
+    long left = size;
+    while(left > 0) {
+        size_t chunk = left < (long)sizeof(w->buf) ? (size_t)left : sizeof(w->buf);
+        if(fread(w->buf, 1, chunk, w->tmp) != chunk) {
+            break;
+        }
+        fwrite(w->buf, 1, chunk, c->archive);
+        left -= chunk;
+    }
+    int ret = left != 0 || ferror(c->archive);
+    pthread_mutex_unlock(&c->archive_lock);
+
+    if(ret != 0) {
+        LOG_ERROR("Error writing the output of \"%s\" to the archive\n", rom->path);
+        return 1;
+    }
+    rom->out_size = size;
+
+    return 0;
+}
+
+static void analyse_rom(corpus_worker_t *w, corpus_rom_t *rom)
+{
+    corpus_t *c = w->corpus;
+    uint16_t *data;
+    size_t size;
+
+    if(load_file(rom->path, &data, &size) != 0) {
+        LOG_ERROR("Could not load ROM \"%s\"\n", rom->path);
+        return;
+    }
+    if(size > VM_RAM_SIZE - VM_EXEC_START_ADDR) {
+        LOG_ERROR("ROM \"%s\" does not fit in memory\n", rom->path);
+        unload_file(data, size);
+        return;
+    }
+    memset(w->ram, 0, sizeof(w->ram));
+    memcpy(w->ram + VM_EXEC_START_ADDR, data, size);
+    unload_file(data, size);
+    rom->size = size;
+
+    ch8_cfg_t *cfg = &w->cfg;
+    ch8_cfg_build(cfg, w->ram, VM_EXEC_START_ADDR, VM_EXEC_START_ADDR + size);
+    rom->insns = cfg->insn_count;
+    rom->blocks = cfg->block_count;
+    rom->subs = cfg->sub_count;
+    for(uint32_t a = VM_EXEC_START_ADDR; a < cfg->end; ++a) {
+        uint8_t m = cfg->map[a];
+        if(m & CH8_CFG_INSN) {
+            ch8_form_e form = ch8_decode((w->ram[a] << 8) | w->ram[a + 1]);
+            w->hist[form] += 1;
+            rom->unknown += form == CH8_OP_INVALID;
+        }
+        if((m & CH8_CFG_CODE) && (m & CH8_CFG_WRITE)) {
+            rom->smc_bytes += 1;
+        }
+    }
+
+    if(c->out_path != NULL) {
+        int ret = c->out_dir ? write_file(w, rom) : write_archive(w, rom);
+        if(ret != 0) {
+            return;
+        }
+    }
+
+    rom->ok = true;
+}
+
+static bool next_batch(corpus_t *c, uint32_t *first, uint32_t *last)
+{
+    pthread_mutex_lock(&c->lock);
+    *first = c->next;
+    *last = c->next + CORPUS_BATCH < c->rom_count ? c->next + CORPUS_BATCH : c->rom_count;
+    c->next = *last;
+    pthread_mutex_unlock(&c->lock);
+
+    return *first < *last;
+}
+
+static void *worker_main(void *arg)
+{
+    corpus_worker_t *w = arg;
+    corpus_t *c = w->corpus;
+    uint32_t first, last;
+
+    while(next_batch(c, &first, &last)) {
+        for(uint32_t i = first; i < last; ++i) {
+            analyse_rom(w, &c->roms[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static int add_rom(corpus_t *c, uint32_t *cap, const char *path)
+{
+    if(strlen(path) >= CORPUS_PATH_MAX) {
+        LOG_ERROR("Path too long: \"%s\"\n", path);
+        return 1;
+    }
+    if(c->rom_count == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        corpus_rom_t *grown = realloc(c->roms, *cap * sizeof(*grown));
+        if(grown == NULL) {
+            LOG_ERROR("Error allocating memory\n");
+            return 1;
+        }
+        c->roms = grown;
+    }
+
+    corpus_rom_t *rom = &c->roms[c->rom_count++];
+    memset(rom, 0, sizeof(*rom));
+    strcpy(rom->path, path);
+    rom->out_size = -1;
+
+    return 0;
+}
+
+static bool is_dir(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+    return strcmp(((const corpus_rom_t *)a)->path, ((const corpus_rom_t *)b)->path);
+}
+
+/*
+ * Collect the regular files of a directory, sorted so the summary and
+ * archive index come out in the same order on every run.
+ */
+static int load_dir(corpus_t *c, const char *dir_path)
+{
+    DIR *dir = opendir(dir_path);
+    if(dir == NULL) {
+        LOG_ERROR("Could not open directory \"%s\"\n", dir_path);
+        return 1;
+    }
+
+    uint32_t cap = 0;
+    struct dirent *ent;
+    char path[2 * CORPUS_PATH_MAX];
+    int ret = 0;
+
+    while(ret == 0 && (ent = readdir(dir)) != NULL) {
+        struct stat st;
+        if(ent->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+        if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        ret = add_rom(c, &cap, path);
+    }
+    closedir(dir);
+
+    if(ret == 0 && c->rom_count > 1) {
+        qsort(c->roms, c->rom_count, sizeof(*c->roms), cmp_path);
+    }
+
+    return ret;
+}
+
+static int load_list(corpus_t *c, const char *list_path)
+{
+    FILE *f = fopen(list_path, "r");
+    if(f == NULL) {
+        LOG_ERROR("Could not open ROM list \"%s\"\n", list_path);
+        return 1;
+    }
+
+    uint32_t cap = 0;
+    char line[CORPUS_PATH_MAX + 2];
+    int ret = 0;
+
+    while(ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char *p = line;
+        while(*p == ' ' || *p == '\t') {
+            p += 1;
+        }
+        size_t len = strlen(p);
+        while(len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r' ||
+                          p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            p[--len] = '\0';
+        }
+        if(len == 0 || p[0] == '#') {
+            continue;
+        }
+        ret = add_rom(c, &cap, p);
+    }
+    fclose(f);
+
+    return ret;
+}
+
+typedef struct {
+    uint64_t count;
+    int form;
+} hist_entry_t;
+
+static int cmp_hist(const void *a, const void *b)
+{
+    const hist_entry_t *ha = a, *hb = b;
+    if(ha->count != hb->count) {
+        return ha->count < hb->count ? 1 : -1;
+    }
+    return ha->form - hb->form;
+}
+
+static void print_summary(corpus_t *c, corpus_worker_t *workers, double ms)
+{
+    uint32_t failed = 0, with_unknown = 0, with_smc = 0;
+    hist_entry_t hist[CH8_OP_COUNT];
+    uint64_t insns = 0;
+
+    printf("%-6s %6s %6s %6s %5s %7s %5s  %s\n", "rom", "size", "insns", "blocks", "subs",
+           "unknown", "smc", "path");
+    for(uint32_t i = 0; i < c->rom_count; ++i) {
+        corpus_rom_t *rom = &c->roms[i];
+        if(!rom->ok) {
+            printf("%-6u %6s %6s %6s %5s %7s %5s  %s\n", i, "FAILED", "-", "-", "-", "-", "-",
+                   rom->path);
+            failed += 1;
+            continue;
+        }
+        printf("%-6u %6u %6u %6u %5u %7u %5u  %s\n", i, rom->size, rom->insns, rom->blocks,
+               rom->subs, rom->unknown, rom->smc_bytes, rom->path);
+        with_unknown += rom->unknown != 0;
+        with_smc += rom->smc_bytes != 0;
+    }
+
+    for(int f = 0; f < CH8_OP_COUNT; ++f) {
+        hist[f].form = f;
+        hist[f].count = 0;
+        for(int i = 0; i < c->workers; ++i) {
+            hist[f].count += workers[i].hist[f];
+        }
+        insns += hist[f].count;
+    }
+    qsort(hist, CH8_OP_COUNT, sizeof(*hist), cmp_hist);
+
+    printf("\n%-12s %12s %7s\n", "form", "count", "share");
+    for(int f = 0; f < CH8_OP_COUNT && hist[f].count > 0; ++f) {
+        printf("%-12s %12llu %6.2f%%\n", ch8_form_name(hist[f].form),
+               (unsigned long long)hist[f].count, 100.0 * hist[f].count / insns);
+    }
+
+    printf("\n%u roms, %u failed, %llu instructions, %u with unknown opcodes, "
+           "%u self-modifying, %d workers, %.3f ms, %.0f roms/s\n",
+           c->rom_count, failed, (unsigned long long)insns, with_unknown, with_smc, c->workers,
+           ms, ms > 0 ? c->rom_count * 1000.0 / ms : 0.0);
+}
+
+/*
+ * Write the index of the archive after the output of the ROMs.
+ *
+ * Returns
+ *  0 on success, nonzero on a write error.
+ */
+static int write_index(corpus_t *c)
+{
+    long index = ftell(c->archive);
+
+    for(uint32_t i = 0; i < c->rom_count; ++i) {
+        corpus_rom_t *rom = &c->roms[i];
+        if(rom->ok) {
+            fprintf(c->archive, "%ld %ld %s\n", rom->offset, rom->out_size, rom->path);
+        } else {
+            fprintf(c->archive, "0 - %s\n", rom->path);
+        }
+    }
+    fprintf(c->archive, "index %ld %u\n", index, c->rom_count);
+
+    return ferror(c->archive);
+}
+
+int corpus_loop(const char *source, int threads, const char *out_path,
+                corpus_format_e format, unsigned flags)
+{
+    corpus_t corpus = {
+        .format = format,
+        .flags = flags,
+        .out_path = out_path
+    };
+    corpus_t *c = &corpus;
+    corpus_worker_t *workers = NULL;
+    int ret = 1;
+
+    if((is_dir(source) ? load_dir(c, source) : load_list(c, source)) != 0) {
+        goto done;
+    }
+    if(c->rom_count == 0) {
+        LOG_ERROR("No ROMs in \"%s\"\n", source);
+        goto done;
+    }
+
+    c->workers = threads > 0 ? threads : cpu_count();
+    if((uint32_t)c->workers > c->rom_count) {
+        c->workers = c->rom_count;
+    }
+    workers = calloc(c->workers, sizeof(*workers));
+    if(workers == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        goto done;
+    }
+
+    if(out_path != NULL) {
+        c->out_dir = is_dir(out_path);
+        if(!c->out_dir) {
+            c->archive = fopen(out_path, "wb");
+            if(c->archive == NULL) {
+                LOG_ERROR("Could not open \"%s\" for writing\n", out_path);
+                goto done;
+            }
+            setvbuf(c->archive, NULL, _IOFBF, CORPUS_BUF_SZ);
+            fprintf(c->archive, "hnc8-corpus 1\n");
+        }
+    }
+    for(int i = 0; i < c->workers; ++i) {
+        workers[i].corpus = c;
+        if(c->archive != NULL && (workers[i].tmp = tmpfile()) == NULL) {
+            LOG_ERROR("Could not create a scratch file\n");
+            goto done;
+        }
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_init(&c->archive_lock, NULL);
+
+    double t_start = time_ms();
+
+    int started = 0;
+    for(int i = 0; i < c->workers; ++i) {
+        if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            LOG_ERROR("Could not start worker %d\n", i);
+            break;
+        }
+        started += 1;
+    }
+    if(started == 0) {
+        /* run everything on this thread rather than giving up */
+        worker_main(&workers[0]);
+    }
+    for(int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    double t_total = time_ms() - t_start;
+
+    pthread_mutex_destroy(&c->archive_lock);
+    pthread_mutex_destroy(&c->lock);
+
+    ret = 0;
+    if(c->archive != NULL && write_index(c) != 0) {
+        ret = 1;
+    }
+    print_summary(c, workers, t_total);
+    for(uint32_t i = 0; i < c->rom_count; ++i) {
+        ret |= !c->roms[i].ok;
+    }
+
+done:
+    if(c->archive != NULL && fclose(c->archive) != 0) {
+        LOG_ERROR("Error writing \"%s\"\n", out_path);
+        ret = 1;
+    }
+    for(int i = 0; workers != NULL && i < c->workers; ++i) {
+        if(workers[i].tmp != NULL) {
+            fclose(workers[i].tmp);
+        }
+    }
+    free(workers);
+    free(c->roms);
+
+    return ret;
+}
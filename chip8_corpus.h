@@ -0,0 +1,65 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_CORPUS_H
+#define CHIP8_CORPUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    CORPUS_DISASM,  // linear disassembly, as in disassembler mode
+    CORPUS_ASM,     // recursive traversal, labelled assembly
+    CORPUS_DOT      // recursive traversal, control flow graph
+} corpus_format_e;
+
+/*
+ * Analyse a set of ROMs on a pool of worker threads and print a summary
+ * of every ROM and of the whole set: reachable instructions, blocks and
+ * subroutines, unknown opcodes reached by the code, bytes of code written
+ * through a known I by Fx33 or Fx55, and a histogram of the instruction
+ * forms found.
+ *
+ * The ROMs are every regular file of a directory or the paths listed in
+ * a file, one per line, empty lines and lines starting with # are
+ * ignored.
+ *
+ * Output of the ROMs goes to out_path, if given. When it is a directory
+ * every ROM gets its own file there, named after the ROM with .asm or
+ * .dot appended. Otherwise out_path is a single archive:
+ *  hnc8-corpus 1
+ *  output of the ROMs, in the order they finished
+ *  OFFSET SIZE ROM         one line per ROM in input order
+ *  index OFFSET COUNT      offset of the first index line
+ * where OFFSET counts from the start of the archive, and a ROM that
+ * failed has the size -.
+ *
+ * Params:
+ *  source      - directory or file list,
+ *  threads     - amount of worker threads, 0 for one per CPU,
+ *  out_path    - output directory or archive, NULL for the summary only,
+ *  format      - what is written of each ROM,
+ *  flags       - CH8_DISASM_* flags for CORPUS_DISASM.
+ *
+ * Returns
+ *  0 if every ROM was analysed, nonzero otherwise.
+ */
+int corpus_loop(const char *source, int threads, const char *out_path,
+                corpus_format_e format, unsigned flags);
+
+#endif // CHIP8_CORPUS_H
@@ -24,240 +24,633 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef __linux__
 #   include <netinet/in.h>
+#   include <sys/socket.h>
+#   include <sys/epoll.h>
+#   include <fcntl.h>
+/* a peer that went away must not take the server down with SIGPIPE */
+#   define SEND_FLAGS MSG_NOSIGNAL
 #elif defined(_WIN32)
 #   include <winsock2.h>
+#   define poll WSAPoll
+#   define SEND_FLAGS 0
 #endif
 
 #include "log.h"
 #include "chip8.h"
+#include "chip8_replay.h"
 #include "file.h"
 
 #define MAX_PACKET_SZ 512
 #define MAX_TOKENS    16
 #define MAX_STRARG_SZ 64
 #define MAX_BPOINTS   16
+#define MAX_CLIENTS   64
+/* a session can outlive its clients until its job stops */
+#define MAX_SESSIONS  (2 * MAX_CLIENTS)
+#define MAX_WORKERS   64
+/* output queued for a client that isn't reading it, it is dropped past this */
+#define MAX_OUTPUT_SZ (1024 * 1024)
+
+/* instructions a continue runs before letting other jobs have its worker */
+#define CONTINUE_SLICE (1 << 20)
+
+/* command flags */
+#define CMD_JOB     (1 << 0) /* runs on a worker, it can take long */
+#define CMD_ANYTIME (1 << 1) /* allowed while the session runs a job */
+
+/* returned by a job command that wants to be run again after the others */
+#define CMD_AGAIN   1
 
 #define EXAMINE_BYTES_PER_ROW 16
+#define PROFILE_HOT_ROWS      16
 
 #define MSG_CURSOR      ">"
 #define MSG_HELLO       "hnc8 debug server " HNC8_VERSION "\nType \"help\" for help or \"commands\" for a listing of commands.\n"
 #define MSG_HELP        "TODO :)\n"
-#define MSG_SHUTDOWN    "The server will shut down after client disconnect.\n"
+#define MSG_SHUTDOWN    "The server will shut down after all clients disconnect.\n"
 
 #define MSG_ERR_FN              "Error executing function\n"
 #define MSG_ERR_NO_FILE         "No file has been loaded.\nUse command \"load filename\" to load a program.\n"
 #define MSG_ERR_ARGS_INVALID    "Invalid arguments for function\n"
 #define MSG_ERR_ARGS_MISSING    "Too few arguments to call function\n"
+#define MSG_ERR_OUTPUT_CUT      "Output cut short, it was too long\n"
 
-#define tx_msg(msg) write(sockfd, msg, sizeof(msg))
+#define tx_msg_to(cl, msg) tx_write(cl, msg, sizeof(msg) - 1)
+#define tx_msg(msg) tx_msg_to(cl, msg)
 
 typedef struct {
-    uint8_t len;
+    uint16_t len;
     char *str;
 } lex_t;
 
+struct dbg_server;
+struct dbg_session;
+struct dbg_job;
+
+/*
+ * A connected client. Bytes are gathered in in until a newline ends a
+ * command, replies queue in out until the socket takes them, so neither
+ * a partial line nor a peer that reads slowly holds up anyone else.
+ */
+typedef struct {
+    int fd;
+    char in[MAX_PACKET_SZ];
+    uint32_t in_len;
+    /* the current line didn't fit in, skip it up to its newline */
+    bool in_overflow;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    /* waiting for the socket to take more output */
+    bool out_blocked;
+    /* disconnected, or too far behind to keep */
+    bool closing;
+
+    struct dbg_server *srv;
+    /* session the commands go to */
+    struct dbg_session *ses;
+} dbg_client_t;
+
+/*
+ * State the commands work on. Every client starts in a session of its
+ * own and can attach to another one. Only the job's worker touches the
+ * machine while job is set, the rest belongs to the server loop.
+ */
+typedef struct dbg_session {
+    uint32_t id;
+    uint32_t clients;
+    struct dbg_job *job;
+    /* set to end the job early, read by the worker */
+    int stop;
+
+    ch8_t vm;
+    ch8_timeline_t timeline;
+
+    uint16_t bpoints[MAX_BPOINTS];
+    uint8_t bpoints_count;
+    uint8_t bpoints_map[VM_BPOINTS_SZ];
+
+    uint16_t *file;
+    size_t file_sz;
+
+    /* forward execution is sampled into prof while profiling is set */
+    ch8_profile_t prof;
+    bool profiling;
+} dbg_session_t;
+
 typedef struct {
     const char *cmd;
     const uint8_t cmd_len;
     const char *cmd_short;
     const uint8_t cmd_short_len;
-    int (*fn)(int, lex_t *, int);
+    int (*fn)(dbg_session_t *, dbg_client_t *, lex_t *, int);
+    const uint8_t flags;
     const char *help_text;
 } command_t;
 
-static ch8_t g_vm;
-static bool g_running = true;
+/*
+ * A command line run by a worker. Its output goes to out and is handed
+ * to cl by the server loop once the command is done.
+ */
+typedef struct dbg_job {
+    struct dbg_job *next;
+    dbg_session_t *ses;
+    /* NULL once the client that asked is gone */
+    dbg_client_t *cl;
+    const command_t *cmd;
+    char line[MAX_PACKET_SZ];
+    uint32_t len;
+    dbg_client_t out;
+} dbg_job_t;
+
+/*
+ * Workers take jobs from the queue in order and put them on done when
+ * they finish. A byte written to wake gets the server loop to collect
+ * them.
+ */
+typedef struct {
+    pthread_t threads[MAX_WORKERS];
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dbg_job_t *head;
+    dbg_job_t *tail;
+    dbg_job_t *done;
+    bool quit;
+#ifdef __linux__
+    int wake[2];
+#endif
+} dbg_pool_t;
+
+typedef struct dbg_server {
+    bool running;
+    int listenfd;
+#ifdef __linux__
+    int epfd;
+#endif
+    dbg_client_t *clients[MAX_CLIENTS];
+    uint32_t client_count;
+    dbg_session_t *sessions[MAX_SESSIONS];
+    uint32_t session_count;
+    uint32_t next_id;
+    /* sessions with a job out */
+    uint32_t busy;
+    dbg_pool_t pool;
+} dbg_server_t;
+
+/*
+ * Make room for len more bytes of output. A client with more than
+ * MAX_OUTPUT_SZ waiting is not reading and gets disconnected.
+ */
+static bool tx_reserve(dbg_client_t *cl, size_t len)
+{
+    if(cl->closing) {
+        return false;
+    }
+    if(cl->out_len + len <= cl->out_cap) {
+        return true;
+    }
+
+    /* move what is still unsent to the front before growing */
+    memmove(cl->out, cl->out + cl->out_sent, cl->out_len - cl->out_sent);
+    cl->out_len -= cl->out_sent;
+    cl->out_sent = 0;
+    if(cl->out_len + len <= cl->out_cap) {
+        return true;
+    }
+
+    size_t cap = cl->out_cap ? cl->out_cap : MAX_PACKET_SZ;
+    while(cap < cl->out_len + len) {
+        cap *= 2;
+    }
+    char *out = cap <= MAX_OUTPUT_SZ ? realloc(cl->out, cap) : NULL;
+    if(out == NULL) {
+        if(cl->fd >= 0) {
+            LOG("Dropping client %d, %zu bytes of output are waiting for it\n", cl->fd, cl->out_len);
+        }
+        cl->closing = true;
+        return false;
+    }
+    cl->out = out;
+    cl->out_cap = cap;
 
-static uint16_t g_bpoints[MAX_BPOINTS] = { 0 };
-static uint8_t g_bpoints_count = 0;
+    return true;
+}
 
-static uint16_t *g_file = NULL;
-static size_t g_file_sz = 0;
+static void tx_write(dbg_client_t *cl, const char *buf, size_t len)
+{
+    if(tx_reserve(cl, len)) {
+        memcpy(cl->out + cl->out_len, buf, len);
+        cl->out_len += len;
+    }
+}
 
-static void tx_printf(int sockfd, const char *fmt, ...)
+static void tx_printf(dbg_client_t *cl, const char *fmt, ...)
 {
-    char buf[MAX_PACKET_SZ];
-    size_t len = 0;
     va_list arg;
 
     va_start(arg, fmt);
-    len = vsprintf(buf, fmt, arg);
+    int len = vsnprintf(NULL, 0, fmt, arg);
+    va_end(arg);
+
+    if(len < 0 || !tx_reserve(cl, len + 1)) {
+        return;
+    }
+
+    va_start(arg, fmt);
+    vsnprintf(cl->out + cl->out_len, len + 1, fmt, arg);
     va_end(arg);
+    cl->out_len += len;
+}
+
+/*
+ * Rebuild the breakpoint bitmap used by ch8_run from the list
+ */
+static void update_bpoints(dbg_session_t *ses)
+{
+    memset(ses->bpoints_map, 0, sizeof(ses->bpoints_map));
+    for(uint8_t i = 0; i < ses->bpoints_count; ++i) {
+        ch8_bpoint_set(ses->bpoints_map, ses->bpoints[i], true);
+    }
+    ses->vm.bpoints = ses->bpoints_map;
+}
+
+/*
+ * Run forward through the timeline, sampling into the profile if one
+ * is being taken.
+ */
+static ch8_exit_e dbg_run(dbg_session_t *ses, uint32_t cycles)
+{
+    if(!ses->profiling) {
+        return ch8_timeline_run(&ses->timeline, &ses->vm, cycles);
+    }
+
+    uint64_t end = ses->vm.cycles + cycles;
+    ch8_exit_e ret = CH8_EXIT_CYCLES;
+
+    while(ses->vm.cycles < end) {
+        ch8_profile_sample(&ses->prof, &ses->vm);
+        uint32_t span = ch8_profile_span(&ses->prof, &ses->vm, end - ses->vm.cycles);
+        ret = ch8_timeline_run(&ses->timeline, &ses->vm, span);
+        if(ret != CH8_EXIT_CYCLES) {
+            break;
+        }
+    }
 
-    write(sockfd, buf, len);
+    return ret;
+}
+
+static dbg_session_t *session_new(dbg_server_t *srv)
+{
+    if(srv->session_count == MAX_SESSIONS) {
+        return NULL;
+    }
+    dbg_session_t *ses = calloc(1, sizeof(*ses));
+    if(ses == NULL) {
+        return NULL;
+    }
+    ses->id = ++srv->next_id;
+    ch8_init(&ses->vm);
+    srv->sessions[srv->session_count++] = ses;
+
+    return ses;
+}
+
+static void session_free(dbg_server_t *srv, dbg_session_t *ses)
+{
+    for(uint32_t k = 0; k < srv->session_count; ++k) {
+        if(srv->sessions[k] == ses) {
+            srv->sessions[k] = srv->sessions[--srv->session_count];
+            break;
+        }
+    }
+    if(ses->file != NULL) {
+        unload_file(ses->file, ses->file_sz);
+        ch8_timeline_free(&ses->timeline);
+    }
+    free(ses);
+}
+
+static dbg_session_t *session_find(dbg_server_t *srv, uint32_t id)
+{
+    for(uint32_t k = 0; k < srv->session_count; ++k) {
+        if(srv->sessions[k]->id == id) {
+            return srv->sessions[k];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Move cl over to ses, or only detach it if ses is NULL. A session left
+ * without clients is freed, after its job stops if it has one.
+ */
+static void session_attach(dbg_client_t *cl, dbg_session_t *ses)
+{
+    dbg_session_t *old = cl->ses;
+
+    if(ses != NULL) {
+        ses->clients += 1;
+    }
+    cl->ses = ses;
+
+    if(old == NULL || --old->clients > 0) {
+        return;
+    }
+    if(old->job != NULL) {
+        __atomic_store_n(&old->stop, 1, __ATOMIC_RELEASE);
+    } else {
+        session_free(cl->srv, old);
+    }
+}
+
+static inline bool session_stopping(dbg_session_t *ses)
+{
+    return __atomic_load_n(&ses->stop, __ATOMIC_ACQUIRE) != 0;
 }
 
 /* --- COMMANDS --- */
 
-static int cmd_help(int sockfd, lex_t *argv, int argc)
+static int cmd_help(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     tx_msg(MSG_HELP);
     return 0;
 }
 
-static int cmd_shutdown(int sockfd, lex_t *argv, int argc)
+static int cmd_shutdown(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     tx_msg(MSG_SHUTDOWN);
-    g_running = false;
+    cl->srv->running = false;
     return 0;
 }
 
-static int cmd_load(int sockfd, lex_t *argv, int argc)
+static int cmd_load(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     if(argc < 2) {
         tx_msg(MSG_ERR_ARGS_MISSING);
         return -1;
     }
 
-    if(g_file != NULL) {
-        unload_file(g_file, g_file_sz);
-        g_file = NULL;
-        g_file_sz = 0;
+    if(ses->file != NULL) {
+        unload_file(ses->file, ses->file_sz);
+        ch8_timeline_free(&ses->timeline);
+        ses->file = NULL;
+        ses->file_sz = 0;
     }
 
-    if(load_file(argv[1].str, &g_file, &g_file_sz) != 0) {
-        tx_printf(sockfd, "Could not load file \"%.*s\"\n", argv[1].len, argv[1].str);
+    if(load_file(argv[1].str, &ses->file, &ses->file_sz) != 0) {
+        tx_printf(cl, "Could not load file \"%.*s\"\n", argv[1].len, argv[1].str);
         return -1;
     }
 
-    ch8_load(&g_vm, g_file, g_file_sz);
+    ch8_load(&ses->vm, ses->file, ses->file_sz);
+    update_bpoints(ses);
+    ses->profiling = false;
+    if(ch8_timeline_init(&ses->timeline, &ses->vm) != 0) {
+        tx_printf(cl, "Could not allocate the execution history\n");
+        unload_file(ses->file, ses->file_sz);
+        ses->file = NULL;
+        ses->file_sz = 0;
+        return -1;
+    }
 
-    tx_printf(sockfd, "Loaded \"%s\".\n", argv[1].str);
+    tx_printf(cl, "Loaded \"%s\".\n", argv[1].str);
 
     return 0;
 }
 
-static int cmd_break(int sockfd, lex_t *argv, int argc)
+static int cmd_break(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
 
-    if(g_bpoints_count < MAX_BPOINTS) {
+    if(ses->bpoints_count < MAX_BPOINTS) {
         int br_addr = 0;
 
         if(argc == 1) {
-            br_addr = g_vm.pc;
+            br_addr = ses->vm.pc;
         } else {
             char *endptr = NULL;
             br_addr = strtol(argv[1].str, &endptr, 0);
         }
 
-        g_bpoints[g_bpoints_count++] = br_addr;
+        ses->bpoints[ses->bpoints_count++] = br_addr;
+        update_bpoints(ses);
 
-        tx_printf(sockfd, "Set breakpoint %i on 0x%x\n", g_bpoints_count-1, br_addr);
+        tx_printf(cl, "Set breakpoint %i on 0x%x\n", ses->bpoints_count-1, br_addr);
 
         return 0;
     } else {
-        tx_printf(sockfd, "Maximum number of breakpoints reached (%d)\n", MAX_BPOINTS);
+        tx_printf(cl, "Maximum number of breakpoints reached (%d)\n", MAX_BPOINTS);
 
         return -1;
     }
 }
 
-static int cmd_lsbreak(int sockfd, lex_t *argv, int argc)
+static int cmd_lsbreak(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_bpoints_count == 0) {
-        tx_printf(sockfd, "No breakpoints\n");
+    if(ses->bpoints_count == 0) {
+        tx_printf(cl, "No breakpoints\n");
         return 0;
     }
-    for(uint8_t i = 0; i < g_bpoints_count; ++i) {
-        tx_printf(sockfd, "%i - 0x%x\n", i, g_bpoints[i]);
+    for(uint8_t i = 0; i < ses->bpoints_count; ++i) {
+        tx_printf(cl, "%i - 0x%x\n", i, ses->bpoints[i]);
     }
     return 0;
 }
 
-static int cmd_rmbreak(int sockfd, lex_t *argv, int argc)
+static int cmd_rmbreak(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_bpoints_count == 0) {
-        tx_printf(sockfd, "No breakpoints\n");
+    if(ses->bpoints_count == 0) {
+        tx_printf(cl, "No breakpoints\n");
         return 0;
     }
     int num = 0;
     if(argc == 1) {
-        num = --g_bpoints_count;
-        g_bpoints[num] = 0;
+        num = --ses->bpoints_count;
+        ses->bpoints[num] = 0;
     } else {
         char *endptr = NULL;
         num = strtol(argv[1].str, &endptr, 0);
-        if(num > g_bpoints_count || num < 0) {
+        if(num > ses->bpoints_count || num < 0) {
           tx_msg(MSG_ERR_ARGS_INVALID);
           return -1;
         }
-        g_bpoints[num] = g_bpoints[--g_bpoints_count];
+        ses->bpoints[num] = ses->bpoints[--ses->bpoints_count];
     }
+    update_bpoints(ses);
 
-    tx_printf(sockfd, "Removed breakpoint %i\n", num);
+    tx_printf(cl, "Removed breakpoint %i\n", num);
 
     return 0;
 }
 
-static int cmd_continue(int sockfd, lex_t *argv, int argc)
+/*
+ * Runs on a worker, a slice at a time. Between slices the job goes to
+ * the back of the queue so other sessions get their turn.
+ */
+static int cmd_continue(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
 
-    for(;;) {
-        ch8_tick(&g_vm);
+    if(session_stopping(ses)) {
+        tx_printf(cl, "Interrupted at 0x%x\n", ses->vm.pc);
+        return 0;
+    }
 
-        for(uint8_t i = 0; i < g_bpoints_count; ++i) {
-            if(g_vm.pc == g_bpoints[i]) {
-                tx_printf(sockfd, "Breakpoint %i hit at 0x%x\n", i, g_bpoints[i]);
-                return 0;
-            }
+    uint64_t end = ses->vm.cycles + CONTINUE_SLICE;
+
+    while(ses->vm.cycles < end) {
+        switch(dbg_run(ses, end - ses->vm.cycles)) {
+            case CH8_EXIT_BREAKPOINT:
+                for(uint8_t i = 0; i < ses->bpoints_count; ++i) {
+                    if(ses->vm.pc == ses->bpoints[i]) {
+                        tx_printf(cl, "Breakpoint %i hit at 0x%x\n", i, ses->bpoints[i]);
+                        break;
+                    }
+                }
+                break;
+            case CH8_EXIT_KEYWAIT:
+                tx_printf(cl, "Waiting for a key press at 0x%x\n", ses->vm.pc);
+                break;
+            case CH8_EXIT_INVALID:
+                tx_printf(cl, "Invalid opcode at 0x%x\n", ses->vm.pc - 2);
+                break;
+            default:
+                continue;
         }
+        return 0;
     }
 
+    return CMD_AGAIN;
+}
+
+static int cmd_interrupt(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(ses->job == NULL) {
+        tx_printf(cl, "Not running\n");
+        return 0;
+    }
+
+    /* the job reports where it stopped to whoever started it */
+    __atomic_store_n(&ses->stop, 1, __ATOMIC_RELEASE);
+    tx_printf(cl, "Interrupting session %u\n", ses->id);
+
     return 0;
 }
 
-static int cmd_backtrace(int sockfd, lex_t *argv, int argc)
+static int cmd_backtrace(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
 
-    uint8_t sp = g_vm.sp;
+    uint8_t sp = ses->vm.sp;
 
     if(sp) {
-        tx_printf(sockfd, "Stack trace:\n");
+        tx_printf(cl, "Stack trace:\n");
 
         while(sp--) {
-            tx_printf(sockfd, "0: 0x%04X\n", g_vm.stack[sp]);
+            tx_printf(cl, "0: 0x%04X\n", ses->vm.stack[sp]);
         }
     } else {
-        tx_printf(sockfd, "No addresses on stack\n");
+        tx_printf(cl, "No addresses on stack\n");
     }
 
     return 0;
 }
 
-static int cmd_stepi(int sockfd, lex_t *argv, int argc)
+static int cmd_stepi(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
 
-    uint16_t opcode = ch8_get_op(&g_vm);
-    ch8_exec(&g_vm, opcode);
-    tx_printf(sockfd, "%s\n", ch8_disassemble(opcode));
+    uint32_t count = 1;
+    if(argc == 2) {
+        char *endptr = NULL;
+        count = strtoul(argv[1].str, &endptr, 0);
+        if(endptr == argv[1].str) {
+            return -1;
+        }
+    }
 
-    g_vm.pc += 2;
+    char dis[CH8_DISASM_MAX];
+    for(uint32_t i = 0; i < count && !cl->closing; ++i) {
+        if(session_stopping(ses)) {
+            tx_printf(cl, "Interrupted at 0x%x\n", ses->vm.pc);
+            break;
+        }
+        uint16_t opcode = ch8_get_op(&ses->vm);
+        dbg_run(ses, 1);
+        tx_printf(cl, "%s\n", ch8_disassemble(opcode, dis));
+    }
 
     return 0;
 }
 
-static int cmd_examine(int sockfd, lex_t *argv, int argc)
+static int cmd_reverse_stepi(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
+        tx_msg(MSG_ERR_NO_FILE);
+        return -1;
+    }
+
+    uint64_t count = 1;
+    if(argc == 2) {
+        char *endptr = NULL;
+        count = strtoull(argv[1].str, &endptr, 0);
+        if(endptr == argv[1].str) {
+            return -1;
+        }
+    }
+
+    if(count > ses->vm.cycles || ch8_timeline_seek(&ses->timeline, &ses->vm, ses->vm.cycles - count) != 0) {
+        tx_printf(cl, "Not that far back in the history\n");
+        return -1;
+    }
+    char dis[CH8_DISASM_MAX];
+    tx_printf(cl, "%X %s\n", ses->vm.pc, ch8_disassemble(ch8_get_op(&ses->vm), dis));
+
+    return 0;
+}
+
+static int cmd_reverse_continue(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(ses->file == NULL) {
+        tx_msg(MSG_ERR_NO_FILE);
+        return -1;
+    }
+
+    if(ch8_timeline_reverse_continue(&ses->timeline, &ses->vm) != 0) {
+        tx_printf(cl, "Reached the start of the history at 0x%x\n", ses->vm.pc);
+        return 0;
+    }
+    for(uint8_t i = 0; i < ses->bpoints_count; ++i) {
+        if(ses->vm.pc == ses->bpoints[i]) {
+            tx_printf(cl, "Breakpoint %i hit at 0x%x\n", i, ses->bpoints[i]);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int cmd_examine(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
@@ -287,21 +680,21 @@ static int cmd_examine(int sockfd, lex_t *argv, int argc)
     }
 
     for(uint8_t x = 0; x < rows; ++x) {
-        tx_printf(sockfd, "%04x: ", addr + (x * EXAMINE_BYTES_PER_ROW));
+        tx_printf(cl, "%04x: ", addr + (x * EXAMINE_BYTES_PER_ROW));
         for(uint8_t y = 0;
             y < EXAMINE_BYTES_PER_ROW &&
             y + (x * EXAMINE_BYTES_PER_ROW) < count;
             ++y) {
-            tx_printf(sockfd, "%02x ",
-                g_vm.ram[addr + (x * EXAMINE_BYTES_PER_ROW) + y]);
+            tx_printf(cl, "%02x ",
+                ses->vm.ram[addr + (x * EXAMINE_BYTES_PER_ROW) + y]);
         }
-        tx_printf(sockfd, "\n");
+        tx_printf(cl, "\n");
     }
 
     return 0;
 }
 
-static int cmd_registers(int sockfd, lex_t *argv, int argc)
+static int cmd_registers(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     const char *v_reg_lut[] = {
         "v0", "v1", "v2", "v3", "v4",
@@ -314,13 +707,13 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
 
     if(argc == 1) { /* display registers */
         for(uint8_t i = 0; i < 16; ++i) {
-            tx_printf(sockfd, fmt_str_v, v_reg_lut[i], g_vm.v[i], g_vm.v[i]);
+            tx_printf(cl, fmt_str_v, v_reg_lut[i], ses->vm.v[i], ses->vm.v[i]);
         }
-        tx_printf(sockfd, fmt_str, "i", g_vm.i, g_vm.i);
-        tx_printf(sockfd, fmt_str, "pc", g_vm.pc, g_vm.pc);
-        tx_printf(sockfd, fmt_str_v, "sp", g_vm.sp, g_vm.sp);
-        tx_printf(sockfd, fmt_str_v, "dt", g_vm.tim_delay, g_vm.tim_delay);
-        tx_printf(sockfd, fmt_str_v, "st", g_vm.tim_sound, g_vm.tim_sound);
+        tx_printf(cl, fmt_str, "i", ses->vm.i, ses->vm.i);
+        tx_printf(cl, fmt_str, "pc", ses->vm.pc, ses->vm.pc);
+        tx_printf(cl, fmt_str_v, "sp", ses->vm.sp, ses->vm.sp);
+        tx_printf(cl, fmt_str_v, "dt", ses->vm.tim_delay, ses->vm.tim_delay);
+        tx_printf(cl, fmt_str_v, "st", ses->vm.tim_sound, ses->vm.tim_sound);
         return 0;
     }
 
@@ -351,27 +744,27 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
                 fmt = fmt_str_v;
                 if(argc == 3) {
                     val = val > 0xFF ? 0xFF : val;
-                    g_vm.v[vreg] = val;
+                    ses->vm.v[vreg] = val;
                 } else {
-                    val = g_vm.v[vreg];
+                    val = ses->vm.v[vreg];
                 }
                 break;
             case 'i':
             case 'I':
                 name = "i";
                 if(argc == 3) {
-                    g_vm.i = val;
+                    ses->vm.i = val;
                 } else {
-                    val = g_vm.i;
+                    val = ses->vm.i;
                 }
                 break;
             case 'p':
             case 'P':
                 name = "pc";
                 if(argc == 3) {
-                    g_vm.pc = val;
+                    ses->vm.pc = val;
                 } else {
-                    val = g_vm.pc;
+                    val = ses->vm.pc;
                 }
                 break;
             case 's':
@@ -380,17 +773,17 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
                     name = "sp";
                     if(argc == 3) {
                         val = val > 0xFF ? 0xFF : val;
-                        g_vm.sp = val;
+                        ses->vm.sp = val;
                     } else {
-                        val = g_vm.sp;
+                        val = ses->vm.sp;
                     }
                 } else if(argv[1].str[1] == 't') {
                     name = "st";
                     if(argc == 3) {
                         val = val > 0xFF ? 0xFF : val;
-                        g_vm.tim_sound = val;
+                        ses->vm.tim_sound = val;
                     } else {
-                        val = g_vm.tim_sound;
+                        val = ses->vm.tim_sound;
                     }
                 } else {
                     tx_msg("Invalid register name\n");
@@ -402,9 +795,9 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
                 name = "dt";
                 if(argc == 3) {
                     val = val > 0xFF ? 0xFF : val;
-                    g_vm.tim_delay = val;
+                    ses->vm.tim_delay = val;
                 } else {
-                    val = g_vm.tim_delay;
+                    val = ses->vm.tim_delay;
                 }
                 break;
             default:
@@ -413,9 +806,12 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
         }
 
         if(argc == 3) {
-            tx_printf(sockfd, "Set %s to 0x%04x (%u)\n", name, val, val);
+            if(ses->file != NULL && ch8_timeline_edit(&ses->timeline, &ses->vm) != 0) {
+                return -1;
+            }
+            tx_printf(cl, "Set %s to 0x%04x (%u)\n", name, val, val);
         } else {
-            tx_printf(sockfd, fmt, name, val, val);
+            tx_printf(cl, fmt, name, val, val);
         }
 
         return 0;
@@ -424,7 +820,7 @@ static int cmd_registers(int sockfd, lex_t *argv, int argc)
     return -1;
 }
 
-static int cmd_setkey(int sockfd, lex_t *argv, int argc)
+static int cmd_setkey(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     if(argc < 2) {
         return -1;
@@ -434,24 +830,77 @@ static int cmd_setkey(int sockfd, lex_t *argv, int argc)
     if(keyvalue > 15 || keyvalue < 0) {
         return -1;
     }
-    g_vm.keys[keyvalue] = !g_vm.keys[keyvalue];
+    if(ses->file != NULL) {
+        return ch8_timeline_key(&ses->timeline, &ses->vm, keyvalue, !ses->vm.keys[keyvalue]) != 0 ? -1 : 0;
+    }
+    ses->vm.keys[keyvalue] = !ses->vm.keys[keyvalue];
+    return 0;
+}
+
+static int cmd_seed(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(argc < 2) {
+        tx_printf(cl, "RND state 0x%016llx\n", (unsigned long long)ses->vm.rng);
+        return 0;
+    }
+    char *endptr = NULL;
+    uint64_t seed = strtoull(argv[1].str, &endptr, 0);
+    if(endptr == argv[1].str) {
+        return -1;
+    }
+    ch8_seed(&ses->vm, seed);
+    if(ses->file != NULL && ch8_timeline_edit(&ses->timeline, &ses->vm) != 0) {
+        return -1;
+    }
     return 0;
 }
 
-static int cmd_keys(int sockfd, lex_t *argv, int argc)
+static int cmd_keys(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    uint8_t *k = g_vm.keys;
+    uint8_t *k = ses->vm.keys;
 
     for(uint8_t i = 0; i < 4; ++i) {
-        tx_printf(sockfd, "%i %i %i %i\n", k[4*i], k[4*i+1], k[4*i+2], k[4*i+3]);
+        tx_printf(cl, "%i %i %i %i\n", k[4*i], k[4*i+1], k[4*i+2], k[4*i+3]);
     }
 
     return 0;
 }
 
-static int cmd_disassemble(int sockfd, lex_t *argv, int argc)
+static int cmd_savelog(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(argc < 2) {
+        tx_msg(MSG_ERR_ARGS_MISSING);
+        return -1;
+    }
+    if(ses->file == NULL) {
+        tx_msg(MSG_ERR_NO_FILE);
+        return -1;
+    }
+
+    char path[MAX_STRARG_SZ];
+    snprintf(path, sizeof(path), "%.*s", argv[1].len, argv[1].str);
+
+    input_log_t log;
+    if(input_log_from_timeline(&log, &ses->timeline, ses->vm.cycles) != 0) {
+        tx_printf(cl, "Only key presses since the load can be replayed\n");
+        return -1;
+    }
+    input_log_end(&log, &ses->vm);
+    int ret = input_log_save(&log, path);
+    if(ret == 0) {
+        tx_printf(cl, "Wrote %u key changes over %llu instructions to \"%s\"\n",
+                  log.key_count, (unsigned long long)ses->vm.cycles, path);
+    } else {
+        tx_printf(cl, "Could not write \"%s\"\n", path);
+    }
+    input_log_free(&log);
+
+    return ret != 0 ? -1 : 0;
+}
+
+static int cmd_disassemble(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    if(g_file == NULL) {
+    if(ses->file == NULL) {
         tx_msg(MSG_ERR_NO_FILE);
         return -1;
     }
@@ -460,8 +909,9 @@ static int cmd_disassemble(int sockfd, lex_t *argv, int argc)
      * lazy hack, save old PC and then increment PC and use
      * ch8_get_op to handle the opcode decoding
      */
-    uint16_t old_pc = g_vm.pc;
+    uint16_t old_pc = ses->vm.pc;
     uint16_t count = 6;
+    char dis[CH8_DISASM_MAX];
 
     if(argc == 2) {
         char *endptr = NULL;
@@ -469,41 +919,218 @@ static int cmd_disassemble(int sockfd, lex_t *argv, int argc)
     }
     if(argc == 3) {
         char *endptr = NULL;
-        g_vm.pc = strtol(argv[2].str, &endptr, 0);
+        ses->vm.pc = strtol(argv[2].str, &endptr, 0);
     }
 
     for(uint16_t i = 0; i < count; ++i) {
-        uint16_t op = ch8_get_op(&g_vm);
-        const char *disstr = ch8_disassemble(op);
-        tx_printf(sockfd, "%X %s\n", g_vm.pc, disstr);
+        uint16_t op = ch8_get_op(&ses->vm);
+        const char *disstr = ch8_disassemble(op, dis);
+        tx_printf(cl, "%X %s\n", ses->vm.pc, disstr);
 
-        g_vm.pc += 2;
+        ses->vm.pc += 2;
     }
 
-    g_vm.pc = old_pc;
+    ses->vm.pc = old_pc;
 
     return 0;
 }
 
-static int cmd_screen(int sockfd, lex_t *argv, int argc)
+static void tx_screen_row(dbg_session_t *ses, dbg_client_t *cl, uint8_t y)
+{
+    char line[VM_SCREEN_WIDTH + 1];
+    uint64_t row = ses->vm.vram[y];
+
+    for(uint8_t x = 0; x < VM_SCREEN_WIDTH; ++x) {
+        line[x] = (row >> (VM_SCREEN_WIDTH - 1 - x)) & 1 ? 'X' : ' ';
+    }
+    line[VM_SCREEN_WIDTH] = '\0';
+
+    tx_printf(cl, "║%s║\n", line);
+}
+
+static int cmd_screen(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
     const char *border = "════════════════════════════════════════════════════════════════";
-    for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
-        if(y == 0) {
-            tx_printf(sockfd, "╔%s╗\n", border);
+
+    if(argc == 2) { /* only rows changed since the last screen command */
+        uint32_t dirty = ses->vm.vram_dirty;
+        uint8_t first, count;
+
+        if(dirty == 0) {
+            tx_printf(cl, "No changes\n");
+        }
+        while(ch8_vram_next_span(&dirty, &first, &count)) {
+            tx_printf(cl, "Rows %u-%u:\n", first, first + count - 1);
+            for(uint8_t y = first; y < first + count; ++y) {
+                tx_screen_row(ses, cl, y);
+            }
+        }
+    } else {
+        tx_printf(cl, "╔%s╗\n", border);
+        for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+            tx_screen_row(ses, cl, y);
+        }
+        tx_printf(cl, "╚%s╝\n", border);
+    }
+
+    ses->vm.vram_dirty = 0;
+
+    return 0;
+}
+
+static void tx_profile(dbg_session_t *ses, dbg_client_t *cl, uint32_t rows)
+{
+    const ch8_profile_t *prof = &ses->prof;
+    uint16_t hot[VM_RAM_SIZE];
+    char dis[CH8_DISASM_MAX];
+
+    if(prof->samples == 0) {
+        tx_printf(cl, "No samples\n");
+        return;
+    }
+
+    tx_printf(cl, "%llu samples, one every %u instructions\n",
+              (unsigned long long)prof->samples, prof->interval);
+
+    uint32_t count = ch8_profile_hot(prof, hot, rows);
+    for(uint32_t i = 0; i < count; ++i) {
+        uint16_t addr = hot[i];
+        uint16_t opcode = addr + 1 < VM_RAM_SIZE ?
+                          (ses->vm.ram[addr] << 8) | ses->vm.ram[addr + 1] : 0;
+        tx_printf(cl, "0x%04X %12llu %6.2f%%  %s\n", addr,
+                  (unsigned long long)prof->hits[addr],
+                  100.0 * prof->hits[addr] / prof->samples, ch8_disassemble(opcode, dis));
+    }
+
+    tx_printf(cl, "By opcode:\n");
+    for(uint8_t f = 0; f < CH8_OP_COUNT; ++f) {
+        if(prof->forms[f] == 0) {
+            continue;
         }
-        tx_printf(sockfd, "║");
+        tx_printf(cl, "  %-12s %12llu %6.2f%%\n", ch8_form_name(f),
+                  (unsigned long long)prof->forms[f], 100.0 * prof->forms[f] / prof->samples);
+    }
+}
+
+static int cmd_profile(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(ses->file == NULL) {
+        tx_msg(MSG_ERR_NO_FILE);
+        return -1;
+    }
+
+    if(argc == 1 || strncmp(argv[1].str, "show", argv[1].len) == 0) {
+        uint32_t rows = PROFILE_HOT_ROWS;
+        if(argc == 3) {
+            char *endptr = NULL;
+            rows = strtoul(argv[2].str, &endptr, 0);
+            if(endptr == argv[2].str || rows > VM_RAM_SIZE) {
+                tx_msg(MSG_ERR_ARGS_INVALID);
+                return -1;
+            }
+        }
+        tx_profile(ses, cl, rows);
+        return 0;
+    }
+
+    if(strncmp(argv[1].str, "start", argv[1].len) == 0) {
+        uint32_t interval = CH8_PROFILE_EXACT;
+        if(argc == 3) {
+            char *endptr = NULL;
+            interval = strtoul(argv[2].str, &endptr, 0);
+            if(endptr == argv[2].str || interval == 0) {
+                tx_msg(MSG_ERR_ARGS_INVALID);
+                return -1;
+            }
+        }
+        ch8_profile_init(&ses->prof, &ses->vm, interval);
+        ses->profiling = true;
+        tx_printf(cl, "Profiling, one sample every %u instructions\n", interval);
+        return 0;
+    }
+
+    if(strncmp(argv[1].str, "stop", argv[1].len) == 0) {
+        ses->profiling = false;
+        tx_printf(cl, "Stopped profiling after %llu samples\n",
+                  (unsigned long long)ses->prof.samples);
+        return 0;
+    }
+
+    if(strncmp(argv[1].str, "stacks", argv[1].len) == 0) {
+        if(argc < 3) {
+            tx_msg(MSG_ERR_ARGS_MISSING);
+            return -1;
+        }
+
+        char path[MAX_STRARG_SZ];
+        snprintf(path, sizeof(path), "%.*s", argv[2].len, argv[2].str);
+
+        FILE *f = fopen(path, "w");
+        int ret = f == NULL ? -1 : ch8_profile_write_collapsed(&ses->prof, f);
+        if(f != NULL && fclose(f) != 0) {
+            ret = -1;
+        }
+        if(ret == 0) {
+            tx_printf(cl, "Wrote %u call stacks to \"%s\"\n", ses->prof.stack_count, path);
+        } else {
+            tx_printf(cl, "Could not write \"%s\"\n", path);
+        }
+        return ret;
+    }
+
+    tx_msg(MSG_ERR_ARGS_INVALID);
+    return -1;
+}
 
+static int cmd_sessions(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    dbg_server_t *srv = cl->srv;
+
+    for(uint32_t k = 0; k < srv->session_count; ++k) {
+        dbg_session_t *s = srv->sessions[k];
+        char mark = s == ses ? '*' : ' ';
 
-        for(uint8_t x = 0; x < VM_SCREEN_WIDTH; ++x) {
-            uint8_t value = g_vm.vram[x + (y * VM_SCREEN_WIDTH)];
-            char val = value > 0 ? 'X' : ' ';
-            tx_printf(sockfd, "%c", val);
+        tx_printf(cl, "%c %u\t%u clients\t", mark, s->id, s->clients);
+        if(s->job != NULL) {
+            tx_printf(cl, "running\n");
+        } else if(s->file == NULL) {
+            tx_printf(cl, "no file\n");
+        } else {
+            tx_printf(cl, "at 0x%x after %llu instructions\n", s->vm.pc,
+                      (unsigned long long)s->vm.cycles);
         }
+    }
+
+    return 0;
+}
+
+static int cmd_session(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
+{
+    if(argc == 1) {
+        tx_printf(cl, "Session %u, %u clients\n", ses->id, ses->clients);
+        return 0;
+    }
 
-        tx_printf(sockfd, "║\n");
+    dbg_session_t *to = NULL;
+    if(strncmp(argv[1].str, "new", argv[1].len) == 0) {
+        to = session_new(cl->srv);
+        if(to == NULL) {
+            tx_printf(cl, "Too many sessions (%d)\n", MAX_SESSIONS);
+            return -1;
+        }
+    } else {
+        char *endptr = NULL;
+        uint32_t id = strtoul(argv[1].str, &endptr, 0);
+        to = endptr != argv[1].str ? session_find(cl->srv, id) : NULL;
+        if(to == NULL) {
+            tx_printf(cl, "No session \"%.*s\"\n", argv[1].len, argv[1].str);
+            return -1;
+        }
     }
-    tx_printf(sockfd, "╚%s╝\n", border);
+
+    /* ses is freed here if cl was the last one in it */
+    session_attach(cl, to);
+    tx_printf(cl, "Attached to session %u\n", to->id);
 
     return 0;
 }
@@ -512,58 +1139,61 @@ static int cmd_screen(int sockfd, lex_t *argv, int argc)
  * only one prototyped because we need to read the list we are pointing
  * to this from :)
  */
-static int cmd_commands(int sockfd, lex_t *argv, int argc);
+static int cmd_commands(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc);
 
-#define DEF_CMD(cmd, shortcmd, fn, help_text) \
-{ cmd, sizeof(cmd) - 1, shortcmd, shortcmd == NULL ? 0: sizeof(shortcmd) - 1, fn, help_text }
+#define DEF_CMD(cmd, shortcmd, fn, flags, help_text) \
+{ cmd, sizeof(cmd) - 1, shortcmd, shortcmd == NULL ? 0: sizeof(shortcmd) - 1, fn, flags, help_text }
 
 static const command_t commands[] = {
-    /*       NAME        SHORT     FUNC               HELP */
-    DEF_CMD("help",         "h",    cmd_help,         "- Display help message"),
-    DEF_CMD("shutdown",     NULL,   cmd_shutdown,     "- Shut down the server"),
-    DEF_CMD("load",         "l",    cmd_load,         "filename - Load ROM into VM"),
-    DEF_CMD("break",        "b",    cmd_break,        "[address] - Add a breakpoint"),
-    DEF_CMD("lsbreak",      "lb",   cmd_lsbreak,      "- List breakpoints"),
-    DEF_CMD("rmbreak",      "rb",   cmd_rmbreak,      "[index] - Remove breakpoint at address, or latest"),
-    DEF_CMD("continue",     "c",    cmd_continue,     "- Continue execution until breakpoint"),
-    DEF_CMD("backtrace",    "bt",   cmd_backtrace,    "- Display the stack trace"),
-    DEF_CMD("stepi",        "si",   cmd_stepi,        "[count] - Step forward"),
-    DEF_CMD("examine",      "x",    cmd_examine,      "address [count] - Examine memory"),
-    DEF_CMD("commands",     NULL,   cmd_commands,     "- Display this info about commands"),
-    DEF_CMD("registers",    "r",    cmd_registers,    "[register] [value] - Display and edit VM registers"),
-    DEF_CMD("setkey",       "sk",   cmd_setkey,       "keynum - Toggle a keypad key state"),
-    DEF_CMD("keys",         "k",    cmd_keys,         "- Display keypad state"),
-    DEF_CMD("disassemble",  "da",   cmd_disassemble,  "[count] [address] - Disassemble opcodes"),
-    DEF_CMD("screen",       "scr",  cmd_screen,       "- Display screen contents")
+    /*       NAME        SHORT     FUNC               FLAGS        HELP */
+    DEF_CMD("help",         "h",    cmd_help,         CMD_ANYTIME, "- Display help message"),
+    DEF_CMD("shutdown",     NULL,   cmd_shutdown,     CMD_ANYTIME, "- Shut down the server"),
+    DEF_CMD("load",         "l",    cmd_load,         0,           "filename - Load ROM into VM"),
+    DEF_CMD("break",        "b",    cmd_break,        0,           "[address] - Add a breakpoint"),
+    DEF_CMD("lsbreak",      "lb",   cmd_lsbreak,      0,           "- List breakpoints"),
+    DEF_CMD("rmbreak",      "rb",   cmd_rmbreak,      0,           "[index] - Remove breakpoint at address, or latest"),
+    DEF_CMD("continue",     "c",    cmd_continue,     CMD_JOB,     "- Continue execution until breakpoint"),
+    DEF_CMD("interrupt",    "int",  cmd_interrupt,    CMD_ANYTIME, "- Stop the command the session is running"),
+    DEF_CMD("backtrace",    "bt",   cmd_backtrace,    0,           "- Display the stack trace"),
+    DEF_CMD("stepi",        "si",   cmd_stepi,        CMD_JOB,     "[count] - Step forward"),
+    DEF_CMD("reverse-stepi",    "rsi",  cmd_reverse_stepi,    CMD_JOB,     "[count] - Step backward"),
+    DEF_CMD("reverse-continue", "rc",   cmd_reverse_continue, CMD_JOB,     "- Run backward to the previous breakpoint hit"),
+    DEF_CMD("examine",      "x",    cmd_examine,      0,           "address [count] - Examine memory"),
+    DEF_CMD("commands",     NULL,   cmd_commands,     CMD_ANYTIME, "- Display this info about commands"),
+    DEF_CMD("registers",    "r",    cmd_registers,    0,           "[register] [value] - Display and edit VM registers"),
+    DEF_CMD("setkey",       "sk",   cmd_setkey,       0,           "keynum - Toggle a keypad key state"),
+    DEF_CMD("keys",         "k",    cmd_keys,         0,           "- Display keypad state"),
+    DEF_CMD("seed",         NULL,   cmd_seed,         0,           "[seed] - Seed the RND generator, or display its state"),
+    DEF_CMD("savelog",      "sl",   cmd_savelog,      0,           "filename - Write the key presses so far as an input log"),
+    DEF_CMD("disassemble",  "da",   cmd_disassemble,  0,           "[count] [address] - Disassemble opcodes"),
+    DEF_CMD("screen",       "scr",  cmd_screen,       0,           "[changed] - Display screen contents, or rows changed since last call"),
+    DEF_CMD("profile",      "prof", cmd_profile,      0,           "[start [interval] | stop | show [count] | stacks filename] - Profile execution"),
+    DEF_CMD("sessions",     "ss",   cmd_sessions,     CMD_ANYTIME, "- List the sessions"),
+    DEF_CMD("session",      "se",   cmd_session,      CMD_ANYTIME, "[new | id] - Show the session, or move to a new or another one")
 };
 #define commands_count (sizeof(commands) / sizeof(commands[0]))
 
-static int cmd_commands(int sockfd, lex_t *argv, int argc)
+static int cmd_commands(dbg_session_t *ses, dbg_client_t *cl, lex_t *argv, int argc)
 {
-    tx_printf(sockfd, "Available commands:\n");
+    tx_printf(cl, "Available commands:\n");
     for(uint8_t i = 0; i < commands_count; ++i) {
-        tx_printf(sockfd, "  %s %s\n", commands[i].cmd, commands[i].help_text);
+        tx_printf(cl, "  %s %s\n", commands[i].cmd, commands[i].help_text);
     }
     return 0;
 }
 
-static inline void decode_msg(int sockfd, char *msg, size_t len)
+/*
+ * Split a command line into lexemes, the last one takes the rest.
+ * Returns the lexeme count.
+ */
+static int lex_split(char *msg, size_t len, lex_t *lex)
 {
     uint8_t lex_i = 0;
-    lex_t lex[MAX_TOKENS] = { 0 };
-
-    /* clean the newline */
-    if(msg[len - 1] == '\n') {
-        msg[len - 1] = '\0';
-        len -= 1;
-    }
-
-    /* split the message we got into lexemes */
     char *start = msg;
     char *end;
 
-    while((end = memchr(start, ' ', len)) != NULL && end < msg + len) {
-        uint8_t word_len = end - start;
+    while(lex_i < MAX_TOKENS - 1 && (end = memchr(start, ' ', (msg + len) - start)) != NULL) {
+        uint16_t word_len = end - start;
         if(word_len == 0) {
             start = end + 1;
             continue;
@@ -583,7 +1213,11 @@ static inline void decode_msg(int sockfd, char *msg, size_t len)
     }
 #endif
 
-    const lex_t *net_cmd = &lex[0];
+    return lex_i;
+}
+
+static const command_t *find_command(const lex_t *net_cmd)
+{
     for(uint8_t i = 0; i < commands_count; ++i) {
         const command_t *cmd = &commands[i];
         bool cmd_match = net_cmd->len == cmd->cmd_len;
@@ -593,43 +1227,557 @@ static inline void decode_msg(int sockfd, char *msg, size_t len)
         (cmd_match && strncmp(net_cmd->str, cmd->cmd, cmd->cmd_len) == 0) ||
         (short_match && strncmp(net_cmd->str, cmd->cmd_short, cmd->cmd_short_len) == 0)
         ) {
-            if((*cmd->fn)(sockfd, lex, lex_i) < 0) {
-                tx_msg(MSG_ERR_FN);
+            return cmd;
+        }
+    }
+
+    return NULL;
+}
+
+static int set_nonblocking(int fd)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode);
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static inline bool would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* pool->lock must be held */
+static void pool_push(dbg_pool_t *pool, dbg_job_t *job)
+{
+    job->next = NULL;
+    if(pool->tail != NULL) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+}
+
+static int job_run(dbg_job_t *job)
+{
+    lex_t lex[MAX_TOKENS] = { 0 };
+    int argc = lex_split(job->line, job->len, lex);
+
+    int ret = (*job->cmd->fn)(job->ses, &job->out, lex, argc);
+    if(ret < 0) {
+        tx_msg_to(&job->out, MSG_ERR_FN);
+    }
+
+    return ret;
+}
+
+static void *worker_main(void *arg)
+{
+    dbg_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->head == NULL && !pool->quit) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        dbg_job_t *job = pool->head;
+        if(job == NULL) {
+            break;
+        }
+        pool->head = job->next;
+        if(pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = job_run(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if(ret == CMD_AGAIN) {
+            pool_push(pool, job);
+            continue;
+        }
+        job->next = pool->done;
+        pool->done = job;
+#ifdef __linux__
+        /* a full pipe has already woken the loop up */
+        ssize_t sz = write(pool->wake[1], "", 1);
+        (void)sz;
+#endif
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static int pool_start(dbg_pool_t *pool, int workers)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+#ifdef __linux__
+    if(pipe(pool->wake) != 0) {
+        pool->wake[0] = pool->wake[1] = -1;
+        return -1;
+    }
+    if(set_nonblocking(pool->wake[0]) != 0 || set_nonblocking(pool->wake[1]) != 0) {
+        return -1;
+    }
+#endif
+
+    for(int i = 0; i < workers; ++i) {
+        if(pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            LOG_ERROR("Could not start worker %d\n", i);
+            break;
+        }
+        pool->count += 1;
+    }
+
+    return pool->count > 0 ? 0 : -1;
+}
+
+/*
+ * Let the workers finish what is queued and join them. Jobs that run
+ * long should have been told to stop first.
+ */
+static void pool_stop(dbg_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->count = 0;
+
+#ifdef __linux__
+    for(int i = 0; i < 2; ++i) {
+        if(pool->wake[i] >= 0) {
+            close(pool->wake[i]);
+        }
+    }
+#endif
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Hand a command to the workers. The session is busy until the job is
+ * collected.
+ */
+static int pool_submit(dbg_server_t *srv, dbg_client_t *cl, const command_t *cmd,
+                       const char *line, size_t len)
+{
+    dbg_session_t *ses = cl->ses;
+    dbg_job_t *job = calloc(1, sizeof(*job));
+    if(job == NULL) {
+        return -1;
+    }
+    job->ses = ses;
+    job->cl = cl;
+    job->cmd = cmd;
+    memcpy(job->line, line, len);
+    job->line[len] = '\0';
+    job->len = len;
+    job->out.fd = -1;
+
+    ses->job = job;
+    __atomic_store_n(&ses->stop, 0, __ATOMIC_RELEASE);
+    srv->busy += 1;
+
+    pthread_mutex_lock(&srv->pool.lock);
+    pool_push(&srv->pool, job);
+    pthread_mutex_unlock(&srv->pool.lock);
+
+    return 0;
+}
+
+/*
+ * Pass the output of finished jobs on to the clients that asked for it
+ * and free the sessions nobody is in any more.
+ */
+static void pool_collect(dbg_server_t *srv)
+{
+    pthread_mutex_lock(&srv->pool.lock);
+    dbg_job_t *job = srv->pool.done;
+    srv->pool.done = NULL;
+    pthread_mutex_unlock(&srv->pool.lock);
+
+    while(job != NULL) {
+        dbg_job_t *next = job->next;
+        dbg_session_t *ses = job->ses;
+        dbg_client_t *cl = job->cl;
+
+        ses->job = NULL;
+        srv->busy -= 1;
+        if(cl != NULL) {
+            tx_write(cl, job->out.out, job->out.out_len);
+            if(job->out.closing) {
+                tx_msg(MSG_ERR_OUTPUT_CUT);
             }
-            return;
+            tx_msg(MSG_CURSOR);
+        }
+        if(ses->clients == 0) {
+            session_free(srv, ses);
         }
+
+        free(job->out.out);
+        free(job);
+        job = next;
+    }
+}
+
+/*
+ * Ask for writability only while output is waiting, so an idle client
+ * doesn't wake the loop up.
+ */
+static void client_watch(dbg_server_t *srv, dbg_client_t *cl)
+{
+    bool blocked = cl->out_sent < cl->out_len;
+    if(blocked == cl->out_blocked) {
+        return;
     }
+    cl->out_blocked = blocked;
 
-    tx_printf(sockfd, "Unknown command \"%s\"\n", net_cmd->str);
+#ifdef __linux__
+    struct epoll_event ev = { .events = EPOLLIN | (blocked ? EPOLLOUT : 0), .data.ptr = cl };
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+#endif
 }
 
-static void client_handler(int sockfd)
+static void client_flush(dbg_client_t *cl)
 {
-    char buf[MAX_PACKET_SZ];
+    while(cl->out_sent < cl->out_len && !cl->closing) {
+        ssize_t sz = send(cl->fd, cl->out + cl->out_sent, cl->out_len - cl->out_sent, SEND_FLAGS);
+        if(sz < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(!would_block()) {
+                cl->closing = true;
+            }
+            break;
+        }
+        cl->out_sent += sz;
+    }
 
-    tx_msg(MSG_HELLO);
+    if(cl->out_sent == cl->out_len) {
+        cl->out_sent = 0;
+        cl->out_len = 0;
+    }
+}
 
+/*
+ * Run a command line from cl. Returns true if it went to a worker, its
+ * output comes when the job is collected.
+ */
+static bool client_command(dbg_server_t *srv, dbg_client_t *cl, char *line, size_t len)
+{
+    dbg_session_t *ses = cl->ses;
+    lex_t lex[MAX_TOKENS] = { 0 };
+    int argc = lex_split(line, len, lex);
+
+    const command_t *cmd = find_command(&lex[0]);
+    if(cmd == NULL) {
+        tx_printf(cl, "Unknown command \"%.*s\"\n", lex[0].len, lex[0].str);
+        return false;
+    }
+
+    if(ses->job != NULL && !(cmd->flags & CMD_ANYTIME)) {
+        tx_printf(cl, "Session %u is busy, \"interrupt\" stops it\n", ses->id);
+        return false;
+    }
+
+    if(cmd->flags & CMD_JOB) {
+        if(pool_submit(srv, cl, cmd, line, len) == 0) {
+            return true;
+        }
+        LOG_ERROR("Error allocating memory\n");
+        tx_msg(MSG_ERR_FN);
+        return false;
+    }
+
+    if((*cmd->fn)(ses, cl, lex, argc) < 0) {
+        tx_msg(MSG_ERR_FN);
+    }
+
+    return false;
+}
+
+static void client_line(dbg_server_t *srv, dbg_client_t *cl, char *line, size_t len)
+{
+    if(len > 0 && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+
+    bool deferred = false;
+    if(len > 0) {
+        printf("Got: %s\n", line);
+        deferred = client_command(srv, cl, line, len);
+    }
+
+    /* a job prompts again once it is done */
+    if(!deferred) {
+        tx_msg(MSG_CURSOR);
+    }
+}
+
+/*
+ * Read what the client sent and run every complete line in it. One read
+ * can hold part of a command or several of them.
+ */
+static void client_read(dbg_server_t *srv, dbg_client_t *cl)
+{
+    ssize_t sz = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - 1 - cl->in_len, 0);
+    if(sz == 0 || (sz < 0 && errno != EINTR && !would_block())) {
+        cl->closing = true;
+        return;
+    }
+    if(sz < 0) {
+        return;
+    }
+    cl->in_len += sz;
+
+    char *start = cl->in;
+    char *end = cl->in + cl->in_len;
+    char *nl;
+    while(!cl->closing && (nl = memchr(start, '\n', end - start)) != NULL) {
+        *nl = '\0';
+        if(!cl->in_overflow) {
+            client_line(srv, cl, start, nl - start);
+        }
+        cl->in_overflow = false;
+        start = nl + 1;
+    }
+    cl->in_len = end - start;
+    memmove(cl->in, start, cl->in_len);
+
+    if(cl->in_len == sizeof(cl->in) - 1) {
+        if(!cl->in_overflow) {
+            tx_printf(cl, "Lines are limited to %d characters\n", MAX_PACKET_SZ - 1);
+            tx_msg(MSG_CURSOR);
+        }
+        cl->in_overflow = true;
+        cl->in_len = 0;
+    }
+}
+
+static void client_close(dbg_server_t *srv, uint32_t k)
+{
+    dbg_client_t *cl = srv->clients[k];
+
+    /* nobody is left to report to */
+    for(uint32_t i = 0; i < srv->session_count; ++i) {
+        dbg_job_t *job = srv->sessions[i]->job;
+        if(job != NULL && job->cl == cl) {
+            job->cl = NULL;
+        }
+    }
+    session_attach(cl, NULL);
+
+#ifdef __linux__
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+#endif
+    close(cl->fd);
+    free(cl->out);
+    free(cl);
+
+    srv->clients[k] = srv->clients[--srv->client_count];
+
+    LOG("Client disconnected\n");
+}
+
+static void server_accept(dbg_server_t *srv)
+{
     for(;;) {
+        int fd = accept(srv->listenfd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(!would_block()) {
+                LOG_ERROR("Error accepting client\n");
+            }
+            return;
+        }
+
+        dbg_client_t *cl = srv->client_count < MAX_CLIENTS ? calloc(1, sizeof(*cl)) : NULL;
+        dbg_session_t *ses = cl != NULL ? session_new(srv) : NULL;
+        if(ses == NULL || set_nonblocking(fd) != 0) {
+            LOG_ERROR("Turning away a client, %u are connected\n", srv->client_count);
+            if(ses != NULL) {
+                session_free(srv, ses);
+            }
+            free(cl);
+            close(fd);
+            continue;
+        }
+        cl->fd = fd;
+        cl->srv = srv;
+        session_attach(cl, ses);
+
+        /* notice peers that vanished without closing the connection */
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const void *)&on, sizeof(on));
+
+#ifdef __linux__
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+        if(epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            LOG_ERROR("Error watching client\n");
+            session_attach(cl, NULL);
+            free(cl);
+            close(fd);
+            continue;
+        }
+#endif
+        srv->clients[srv->client_count++] = cl;
+
+        LOG("Client connected to session %u\n", ses->id);
+        tx_msg(MSG_HELLO);
+        tx_printf(cl, "Session %u\n", ses->id);
         tx_msg(MSG_CURSOR);
+    }
+}
 
-        memset(buf, 0, MAX_PACKET_SZ);
+static void server_event(dbg_server_t *srv, dbg_client_t *cl, bool readable, bool writable)
+{
+#ifdef __linux__
+    if((void *)cl == &srv->pool) {
+        /* pool_collect takes the jobs after every round */
+        char buf[64];
+        while(read(srv->pool.wake[0], buf, sizeof(buf)) > 0);
+        return;
+    }
+#endif
+    if(cl == NULL) {
+        server_accept(srv);
+        return;
+    }
+    if(readable) {
+        client_read(srv, cl);
+    }
+    if(writable) {
+        client_flush(cl);
+    }
+}
 
-        size_t sz = read(sockfd, buf, MAX_PACKET_SZ);
-        if(sz == 0) break;
+/*
+ * Wait up to timeout ms for the listening socket or a client to become
+ * ready and handle what is.
+ */
+static int server_wait(dbg_server_t *srv, int timeout)
+{
+#ifdef __linux__
+    struct epoll_event events[MAX_CLIENTS + 2];
 
-        printf("Got: %s", buf);
+    int n = epoll_wait(srv->epfd, events, MAX_CLIENTS + 2, timeout);
+    for(int k = 0; k < n; ++k) {
+        uint32_t e = events[k].events;
+        server_event(srv, events[k].data.ptr, e & (EPOLLIN | EPOLLHUP | EPOLLERR), e & EPOLLOUT);
+    }
+#else
+    struct pollfd fds[MAX_CLIENTS + 1];
+    dbg_client_t *owners[MAX_CLIENTS + 1];
+    uint32_t count = 0;
+
+    if(srv->listenfd >= 0) {
+        fds[count].fd = srv->listenfd;
+        fds[count].events = POLLIN;
+        owners[count++] = NULL;
+    }
+    for(uint32_t k = 0; k < srv->client_count; ++k) {
+        dbg_client_t *cl = srv->clients[k];
+        fds[count].fd = cl->fd;
+        fds[count].events = POLLIN | (cl->out_blocked ? POLLOUT : 0);
+        owners[count++] = cl;
+    }
 
-        decode_msg(sockfd, buf, sz);
+    int n = poll(fds, count, timeout);
+    for(uint32_t k = 0; n > 0 && k < count; ++k) {
+        short e = fds[k].revents;
+        if(e) {
+            server_event(srv, owners[k], e & (POLLIN | POLLHUP | POLLERR), e & POLLOUT);
+        }
     }
+#endif
+    return n < 0 && errno != EINTR ? -1 : 0;
+}
+
+static void server_stop_listening(dbg_server_t *srv)
+{
+#ifdef __linux__
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, srv->listenfd, NULL);
+#endif
+    close(srv->listenfd);
+    srv->listenfd = -1;
 }
 
-void dbg_server_loop(uint16_t port)
+/*
+ * Serve every client from one thread. Commands that can run long go to
+ * the worker pool, so a session running one doesn't hold up the others,
+ * and output goes out as each socket takes it.
+ */
+static void server_loop(dbg_server_t *srv)
 {
-    int sockfd;
-    struct sockaddr_in servaddr, cli;
+    while(srv->running || srv->client_count > 0) {
+        if(!srv->running && srv->listenfd >= 0) {
+            server_stop_listening(srv);
+        }
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd == -1) {
+        int timeout = -1;
+#ifndef __linux__
+        /* nothing wakes poll up when a job is done */
+        timeout = srv->busy > 0 ? 10 : -1;
+#endif
+        if(server_wait(srv, timeout) != 0) {
+            LOG_ERROR("Error waiting for clients\n");
+            break;
+        }
+
+        pool_collect(srv);
+
+        for(uint32_t k = 0; k < srv->client_count;) {
+            dbg_client_t *cl = srv->clients[k];
+            client_flush(cl);
+            if(cl->closing) {
+                client_close(srv, k);
+                continue;
+            }
+            client_watch(srv, cl);
+            k += 1;
+        }
+    }
+
+    /* sessions left without clients stop their jobs */
+    while(srv->client_count > 0) {
+        client_close(srv, srv->client_count - 1);
+    }
+}
+
+void dbg_server_loop(uint16_t port, int workers)
+{
+    dbg_server_t srv = { .running = true, .listenfd = -1 };
+    struct sockaddr_in servaddr;
+
+    srv.listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(srv.listenfd == -1) {
         LOG_ERROR("Error creating socket\n");
         return;
     }
@@ -639,46 +1787,68 @@ void dbg_server_loop(uint16_t port)
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
 
-    if((bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr))) != 0) {
+    int on = 1;
+    setsockopt(srv.listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof(on));
+
+    if((bind(srv.listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr))) != 0) {
         LOG_ERROR("Error binding to socket\n");
+        close(srv.listenfd);
         return;
     }
 
-    if((listen(sockfd, 5)) != 0) {
+    if((listen(srv.listenfd, 5)) != 0 || set_nonblocking(srv.listenfd) != 0) {
         LOG_ERROR("Error listening on socket\n");
+        close(srv.listenfd);
         return;
     }
 
-    LOG("Debug server listening on localhost:%i\n", port);
+    if(workers <= 0) {
+        workers = cpu_count();
+    }
+    if(workers > MAX_WORKERS) {
+        workers = MAX_WORKERS;
+    }
+    if(pool_start(&srv.pool, workers) != 0) {
+        LOG_ERROR("Error starting the workers\n");
+        pool_stop(&srv.pool);
+        close(srv.listenfd);
+        return;
+    }
 
 #ifdef __linux__
-    unsigned int len = sizeof(cli);
-#elif defined(_WIN32)
-    int len = sizeof(cli);
+    srv.epfd = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = &srv.pool };
+    if(srv.epfd < 0 || epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listenfd, &ev) != 0 ||
+       epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.pool.wake[0], &wake) != 0) {
+        LOG_ERROR("Error setting up epoll\n");
+        if(srv.epfd >= 0) {
+            close(srv.epfd);
+        }
+        pool_stop(&srv.pool);
+        close(srv.listenfd);
+        return;
+    }
 #endif
 
-    /* reset emu */
-    ch8_init(&g_vm);
+    LOG("Debug server listening on localhost:%i with %d workers\n", port, srv.pool.count);
 
-    while(g_running) {
-        int connfd = accept(sockfd, (struct sockaddr *)&cli, &len);
-        if(connfd < 0) {
-            LOG_ERROR("Error accepting client\n");
-            return;
-        } else {
-            LOG("Client connected\n");
-        }
+    server_loop(&srv);
 
-        client_handler(connfd);
-
-        close(connfd);
+    LOG("Shutting down\n");
 
-        LOG("Client disconnected\n");
+    pool_stop(&srv.pool);
+    pool_collect(&srv);
+    while(srv.session_count > 0) {
+        session_free(&srv, srv.sessions[srv.session_count - 1]);
     }
 
-    LOG("Shutting down\n");
-
-    close(sockfd);
+    if(srv.listenfd >= 0) {
+        close(srv.listenfd);
+    }
+#ifdef __linux__
+    close(srv.epfd);
+#endif
 
     return;
 }
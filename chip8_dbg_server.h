@@ -21,6 +21,6 @@
 
 #include <stdint.h>
 
-void dbg_server_loop(uint16_t port);
+void dbg_server_loop(uint16_t port, int workers);
 
 #endif // CHIP8_DBG_SERVER_H
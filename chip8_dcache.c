@@ -0,0 +1,117 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Handlers for the decoded instruction cache. Each handler implements
+ * exactly one opcode form and takes its operands from the cache entry,
+ * so there is no decoding left to do at execution time.
+ */
+
+#include <stdint.h>
+#include "chip8.h"
+#include "chip8_ops.h"
+
+#define DEF_DOP(name, ...) \
+static void dop_##name(ch8_t *vm, const ch8_dop_t *op) { __VA_ARGS__; }
+
+DEF_DOP(invalid,  UNKNOWN_OP(op->opcode))
+DEF_DOP(nop,      (void)vm; (void)op)
+DEF_DOP(cls,      op_cls(vm))
+DEF_DOP(ret,      op_ret(vm))
+DEF_DOP(jp,       op_jp(vm, op->nnn))
+DEF_DOP(call,     op_call(vm, op->nnn))
+DEF_DOP(se_vi,    op_se_vi(vm, op->x, op->kk))
+DEF_DOP(sne_vi,   op_sne_vi(vm, op->x, op->kk))
+DEF_DOP(se_vv,    op_se_vv(vm, op->x, op->y))
+DEF_DOP(ld_vi,    op_ld_vi(vm, op->x, op->kk))
+DEF_DOP(add_vi,   op_add_vi(vm, op->x, op->kk))
+DEF_DOP(ld_vv,    op_ld_vv(vm, op->x, op->y))
+DEF_DOP(or,       op_or(vm, op->x, op->y))
+DEF_DOP(and,      op_and(vm, op->x, op->y))
+DEF_DOP(xor,      op_xor(vm, op->x, op->y))
+DEF_DOP(add_vv,   op_add_vv(vm, op->x, op->y))
+DEF_DOP(sub,      op_sub(vm, op->x, op->y))
+DEF_DOP(shr,      op_shr(vm, op->x))
+DEF_DOP(subn,     op_subn(vm, op->x, op->y))
+DEF_DOP(shl,      op_shl(vm, op->x))
+DEF_DOP(sne_vv,   op_sne_vv(vm, op->x, op->y))
+DEF_DOP(ld_i,     op_ld_i(vm, op->nnn))
+DEF_DOP(jp_v0,    op_jp_v0(vm, op->nnn))
+DEF_DOP(rnd,      op_rnd(vm, op->x, op->kk))
+DEF_DOP(drw,      op_drw(vm, op->x, op->y, op->kk & 0xF))
+DEF_DOP(skp,      op_skp(vm, op->x))
+DEF_DOP(sknp,     op_sknp(vm, op->x))
+DEF_DOP(ld_vdt,   op_ld_vdt(vm, op->x))
+DEF_DOP(ld_vk,    op_ld_vk(vm, op->x))
+DEF_DOP(ld_dtv,   op_ld_dtv(vm, op->x))
+DEF_DOP(ld_stv,   op_ld_stv(vm, op->x))
+DEF_DOP(add_iv,   op_add_iv(vm, op->x))
+DEF_DOP(ld_fv,    op_ld_fv(vm, op->x))
+DEF_DOP(ld_bv,    op_ld_bv(vm, op->x))
+DEF_DOP(ld_memv,  op_ld_memv(vm, op->x))
+DEF_DOP(ld_vmem,  op_ld_vmem(vm, op->x))
+
+static void (*const dop_lut[CH8_OP_COUNT])(ch8_t *vm, const ch8_dop_t *op) = {
+    [CH8_OP_INVALID] = dop_invalid,
+    [CH8_OP_NOP]     = dop_nop,
+    [CH8_OP_CLS]     = dop_cls,
+    [CH8_OP_RET]     = dop_ret,
+    [CH8_OP_JP]      = dop_jp,
+    [CH8_OP_CALL]    = dop_call,
+    [CH8_OP_SE_VI]   = dop_se_vi,
+    [CH8_OP_SNE_VI]  = dop_sne_vi,
+    [CH8_OP_SE_VV]   = dop_se_vv,
+    [CH8_OP_LD_VI]   = dop_ld_vi,
+    [CH8_OP_ADD_VI]  = dop_add_vi,
+    [CH8_OP_LD_VV]   = dop_ld_vv,
+    [CH8_OP_OR]      = dop_or,
+    [CH8_OP_AND]     = dop_and,
+    [CH8_OP_XOR]     = dop_xor,
+    [CH8_OP_ADD_VV]  = dop_add_vv,
+    [CH8_OP_SUB]     = dop_sub,
+    [CH8_OP_SHR]     = dop_shr,
+    [CH8_OP_SUBN]    = dop_subn,
+    [CH8_OP_SHL]     = dop_shl,
+    [CH8_OP_SNE_VV]  = dop_sne_vv,
+    [CH8_OP_LD_I]    = dop_ld_i,
+    [CH8_OP_JP_V0]   = dop_jp_v0,
+    [CH8_OP_RND]     = dop_rnd,
+    [CH8_OP_DRW]     = dop_drw,
+    [CH8_OP_SKP]     = dop_skp,
+    [CH8_OP_SKNP]    = dop_sknp,
+    [CH8_OP_LD_VDT]  = dop_ld_vdt,
+    [CH8_OP_LD_VK]   = dop_ld_vk,
+    [CH8_OP_LD_DTV]  = dop_ld_dtv,
+    [CH8_OP_LD_STV]  = dop_ld_stv,
+    [CH8_OP_ADD_IV]  = dop_add_iv,
+    [CH8_OP_LD_FV]   = dop_ld_fv,
+    [CH8_OP_LD_BV]   = dop_ld_bv,
+    [CH8_OP_LD_MEMV] = dop_ld_memv,
+    [CH8_OP_LD_VMEM] = dop_ld_vmem
+};
+
+void ch8_decode_op(uint16_t opcode, ch8_dop_t *op)
+{
+    op->form = ch8_decode(opcode);
+    op->fn = dop_lut[op->form];
+    op->opcode = opcode;
+    op->nnn = OP_NNN(opcode);
+    op->x = OP_X(opcode);
+    op->y = OP_Y(opcode);
+    op->kk = OP_KK(opcode);
+}
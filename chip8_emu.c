@@ -19,211 +19,627 @@
 #include "chip8_emu.h"
 #include <stdbool.h>
 #include <stdio.h>
-#define __USE_MISC
-#include <unistd.h> // usleep()
-#undef __USE_MISC
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <GLFW/glfw3.h>
 
 #include "chip8.h"
+#include "chip8_mailbox.h"
+#include "chip8_pacer.h"
+#include "chip8_replay.h"
+#include "chip8_trace.h"
 #include "log.h"
 
-#define FPS 60
-#define FPS_FRAMETIME (1000 / FPS)
+/* addresses listed in the profile printed at exit */
+#define PROFILE_HOT_ROWS 16
 
-static GLFWwindow *g_win;
-static GLuint g_fb_id;
-static uint16_t g_w, g_h;
-static ch8_t g_vm;
+/*
+ * The window, input and rendering stay on the main thread as GLFW
+ * requires, the core runs on its own thread. Frames go to the main thread
+ * through a triple buffer and input comes back through a queue, so a
+ * slow buffer swap never holds up emulation and the other way around.
+ */
+typedef struct {
+    /* Main thread */
+    GLFWwindow *win;
+    GLuint fb_id;
+    uint16_t w, h;
+    uint8_t fb[VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT];
+    uint64_t shown[VM_SCREEN_HEIGHT];
+    bool redraw;
+    uint32_t dropped_events;
+
+    /* Shared */
+    mailbox_tbuf_t frames;
+    mailbox_queue_t input;
+    int running;
+
+    /* Emulation thread */
+    pthread_t thread;
+    const uint16_t *rom;
+    uint16_t rom_sz;
+    ch8_engine_e engine;
+    uint64_t seed;
+    uint32_t ips;
+    bool rewind_on;
+    ch8_t vm;
+    ch8_dcache_t dcache;
+    ch8_jit_t jit;
+    ch8_rewind_t rewind;
+    input_log_t log;
+    trace_t trace;
+    bool tracing;
+    ch8_profile_t prof;
+    bool profiling;
+    uint64_t frame;
+    uint64_t published[VM_SCREEN_HEIGHT];
+    double t_rewind;
+    uint64_t rewind_frames;
+
+    bool turbo_mode;
+    bool rewinding;
+    bool recording;
+} emu_t;
+
+static void record_failed(emu_t *emu)
+{
+    LOG_ERROR("Could not record input, recording stopped\n");
+    emu->recording = false;
+}
+
+static void set_key(emu_t *emu, uint8_t i, uint8_t state)
+{
+    if(emu->vm.keys[i] == state) {
+        return;
+    }
+    emu->vm.keys[i] = state;
+    if(emu->recording && input_log_key(&emu->log, emu->vm.cycles, i, state) != 0) {
+        record_failed(emu);
+    }
+}
+
+static void post_event(emu_t *emu, mailbox_event_e type, uint8_t key, uint8_t state)
+{
+    mailbox_event_t ev = { .type = type, .key = key, .state = state };
 
-static bool g_turbo_mode = false;
-static bool g_reset = false;
+    /* the core drains the queue every frame, it only fills up if it hangs */
+    if(!mailbox_queue_push(&emu->input, &ev)) {
+        emu->dropped_events += 1;
+    }
+}
 
-static void set_key(uint8_t i, uint8_t state)
+static inline void post_key(emu_t *emu, uint8_t key, uint8_t state)
 {
-    g_vm.keys[i] = state;
+    post_event(emu, MAILBOX_KEY, key, state);
 }
 
 static void win_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    emu_t *emu = glfwGetWindowUserPointer(window);
     uint8_t state = action == GLFW_RELEASE ? 0 : 1;
     switch(key) {
         case GLFW_KEY_1:
-            set_key(1, state);
+            post_key(emu, 1, state);
             break;
         case GLFW_KEY_2:
-            set_key(2, state);
+            post_key(emu, 2, state);
             break;
         case GLFW_KEY_3:
-            set_key(3, state);
+            post_key(emu, 3, state);
             break;
         case GLFW_KEY_4:
-            set_key(0xC, state);
+            post_key(emu, 0xC, state);
             break;
 
         case GLFW_KEY_Q:
-            set_key(4, state);
+            post_key(emu, 4, state);
             break;
         case GLFW_KEY_W:
-            set_key(5, state);
+            post_key(emu, 5, state);
             break;
         case GLFW_KEY_E:
-            set_key(6, state);
+            post_key(emu, 6, state);
             break;
         case GLFW_KEY_R:
-            set_key(0xD, state);
+            post_key(emu, 0xD, state);
             break;
 
         case GLFW_KEY_A:
-            set_key(7, state);
+            post_key(emu, 7, state);
             break;
         case GLFW_KEY_S:
-            set_key(8, state);
+            post_key(emu, 8, state);
             break;
         case GLFW_KEY_D:
-            set_key(9, state);
+            post_key(emu, 9, state);
             break;
         case GLFW_KEY_F:
-            set_key(0xE, state);
+            post_key(emu, 0xE, state);
             break;
 
         case GLFW_KEY_Z:
-            set_key(0xA, state);
+            post_key(emu, 0xA, state);
             break;
         case GLFW_KEY_X:
-            set_key(0, state);
+            post_key(emu, 0, state);
             break;
         case GLFW_KEY_C:
-            set_key(0xB, state);
+            post_key(emu, 0xB, state);
             break;
         case GLFW_KEY_V:
-            set_key(0xF, state);
+            post_key(emu, 0xF, state);
             break;
 
         case GLFW_KEY_TAB:
-            g_turbo_mode = state;
+            post_event(emu, MAILBOX_TURBO, 0, state);
             break;
         case GLFW_KEY_ESCAPE:
-            glfwSetWindowShouldClose(g_win, 1);
+            glfwSetWindowShouldClose(emu->win, 1);
             break;
         case GLFW_KEY_F5:
-            g_reset = true;
+            if(state) {
+                post_event(emu, MAILBOX_RESET, 0, state);
+            }
+            break;
+        case GLFW_KEY_BACKSPACE:
+            post_event(emu, MAILBOX_REWIND, 0, state);
             break;
         default:
             break;
     }
 }
 
-static void win_init(uint16_t w, uint16_t h)
+static void win_refresh_callback(GLFWwindow *window)
+{
+    emu_t *emu = glfwGetWindowUserPointer(window);
+    emu->redraw = true;
+}
+
+static void win_init(emu_t *emu, uint16_t w, uint16_t h)
 {
     if (!glfwInit()) {
         LOG_ERROR("Failed to init glfw\n");
         return;
     }
 
-    g_win = glfwCreateWindow(w, h, "hnc8", NULL, NULL);
-    if (!g_win) {
+    emu->win = glfwCreateWindow(w, h, "hnc8", NULL, NULL);
+    if (!emu->win) {
         LOG_ERROR("Failed to create window\n");
         glfwTerminate();
         return;
     }
 
-    glfwSetKeyCallback(g_win, win_key_callback);
-    glfwMakeContextCurrent(g_win);
+    glfwSetWindowUserPointer(emu->win, emu);
+    glfwSetKeyCallback(emu->win, win_key_callback);
+    glfwSetWindowRefreshCallback(emu->win, win_refresh_callback);
+    glfwMakeContextCurrent(emu->win);
+    /* the core has its own thread, waiting for vblank doesn't slow it down */
+    glfwSwapInterval(1);
 
     /* Generate framebuffer texture for output */
-    glGenTextures(1, &g_fb_id);
-    glBindTexture(GL_TEXTURE_2D, g_fb_id);
+    glGenTextures(1, &emu->fb_id);
+    glBindTexture(GL_TEXTURE_2D, emu->fb_id);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, VM_SCREEN_WIDTH,
-                 VM_SCREEN_HEIGHT, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+                 VM_SCREEN_HEIGHT, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, emu->fb);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     glClearColor(0xFF, 0xFF, 0xFF, 0xFF);
 }
 
-static void win_destroy(void)
+static void win_destroy(emu_t *emu)
 {
-    glDeleteTextures(1, &g_fb_id);
-    glfwDestroyWindow(g_win);
+    glDeleteTextures(1, &emu->fb_id);
+    glfwDestroyWindow(emu->win);
     glfwTerminate();
 }
 
-static void win_render(void)
+static void win_render(emu_t *emu)
 {
-    glViewport(0, 0, g_w, g_h);
+    glViewport(0, 0, emu->w, emu->h);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    glOrtho(0, g_w, 0, g_h, -1, 1);
+    glOrtho(0, emu->w, 0, emu->h, -1, 1);
     glMatrixMode(GL_MODELVIEW);
 
     glClear(GL_COLOR_BUFFER_BIT);
 
-    glBindTexture(GL_TEXTURE_2D, g_fb_id);
+    glBindTexture(GL_TEXTURE_2D, emu->fb_id);
     glEnable(GL_TEXTURE_2D);
     glBegin(GL_QUADS);
     glTexCoord2i(0, 1); glVertex2i(0, 0);
-    glTexCoord2i(0, 0); glVertex2i(0, g_h);
-    glTexCoord2i(1, 0); glVertex2i(g_w, g_h);
-    glTexCoord2i(1, 1); glVertex2i(g_w, 0);
+    glTexCoord2i(0, 0); glVertex2i(0, emu->h);
+    glTexCoord2i(1, 0); glVertex2i(emu->w, emu->h);
+    glTexCoord2i(1, 1); glVertex2i(emu->w, 0);
     glEnd();
     glDisable(GL_TEXTURE_2D);
 
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    glfwSwapBuffers(g_win);
+    glfwSwapBuffers(emu->win);
 }
 
-void emu_loop(const uint16_t *rom, uint16_t rom_sz, double scale, int freq_mult)
+static void emu_reset(emu_t *emu)
+{
+    ch8_load(&emu->vm, emu->rom, emu->rom_sz);
+    ch8_seed(&emu->vm, emu->seed);
+
+    if(emu->engine == CH8_ENGINE_CACHED || emu->engine == CH8_ENGINE_THREADED) {
+        ch8_dcache_attach(&emu->vm, &emu->dcache);
+    }
+    if(emu->engine == CH8_ENGINE_JIT) {
+        ch8_jit_attach(&emu->vm, &emu->jit);
+    }
+}
+
+static void emu_run(emu_t *emu, ch8_engine_e engine, uint32_t cycles)
+{
+    if(engine == CH8_ENGINE_INTERP || engine == CH8_ENGINE_CACHED) {
+        void (*tick)(ch8_t *vm) = engine == CH8_ENGINE_CACHED ? ch8_tick_cached : ch8_tick;
+        for(uint32_t i = 0; i < cycles; ++i) {
+            tick(&emu->vm);
+        }
+        return;
+    }
+
+    uint64_t end = emu->vm.cycles + cycles;
+    while(emu->vm.cycles < end) {
+        /* nothing can change before a key is pressed, skip rest of the frame */
+        if(ch8_run(&emu->vm, end - emu->vm.cycles) == CH8_EXIT_KEYWAIT) {
+            emu->vm.idle_cycles += end - emu->vm.cycles;
+            emu->vm.cycles = end;
+        }
+    }
+}
+
+/*
+ * Run a frame one instruction at a time and trace every instruction. Only
+ * used when tracing, so the engines themselves carry no tracing code.
+ */
+static void emu_run_traced(emu_t *emu, uint32_t cycles)
+{
+    ch8_t *vm = &emu->vm;
+    uint64_t end = vm->cycles + cycles;
+
+    while(vm->cycles < end) {
+        uint16_t pc = vm->pc;
+        uint16_t op = ch8_get_op(vm);
+        ch8_tick_cached(vm);
+        if(vm->pc == pc && ch8_decode(op) == CH8_OP_LD_VK) {
+            /* waiting for a key, account the rest of the frame like ch8_run */
+            vm->idle_cycles += end - vm->cycles;
+            vm->cycles = end;
+        }
+        trace_insn(&emu->trace, vm, pc, op);
+    }
+}
+
+/*
+ * Run a frame in spans between profiler samples. ch8_run is used on every
+ * engine, the profile is of the program and comes out the same.
+ */
+static void emu_run_profiled(emu_t *emu, uint32_t cycles)
+{
+    ch8_t *vm = &emu->vm;
+    uint64_t end = vm->cycles + cycles;
+
+    /* a reset or rewind moved the VM back, carry on sampling from there */
+    if(emu->prof.next > vm->cycles + emu->prof.interval) {
+        emu->prof.next = vm->cycles;
+    }
+
+    while(vm->cycles < end) {
+        if(ch8_profile_run(&emu->prof, vm, end - vm->cycles) == CH8_EXIT_KEYWAIT) {
+            vm->idle_cycles += end - vm->cycles;
+            vm->cycles = end;
+        }
+    }
+}
+
+/*
+ * Print where the program spent its time, hottest addresses first.
+ */
+static void emu_profile_report(emu_t *emu, const char *stacks_file)
+{
+    const ch8_profile_t *prof = &emu->prof;
+    uint16_t hot[PROFILE_HOT_ROWS];
+    char dis[CH8_DISASM_MAX];
+
+    if(prof->samples == 0) {
+        return;
+    }
+
+    LOG("Profile: %llu samples, one every %u instructions\n",
+        (unsigned long long)prof->samples, prof->interval);
+    uint32_t count = ch8_profile_hot(prof, hot, PROFILE_HOT_ROWS);
+    for(uint32_t i = 0; i < count; ++i) {
+        uint16_t addr = hot[i];
+        uint16_t opcode = addr + 1 < VM_RAM_SIZE ?
+                          (emu->vm.ram[addr] << 8) | emu->vm.ram[addr + 1] : 0;
+        LOG("  0x%04X %12llu %6.2f%%  %s\n", addr, (unsigned long long)prof->hits[addr],
+            100.0 * prof->hits[addr] / prof->samples, ch8_disassemble(opcode, dis));
+    }
+    LOG("By opcode:\n");
+    for(uint8_t f = 0; f < CH8_OP_COUNT; ++f) {
+        if(prof->forms[f] > 0) {
+            LOG("  %-12s %12llu %6.2f%%\n", ch8_form_name(f),
+                (unsigned long long)prof->forms[f], 100.0 * prof->forms[f] / prof->samples);
+        }
+    }
+
+    if(stacks_file == NULL) {
+        return;
+    }
+    FILE *f = fopen(stacks_file, "w");
+    int ret = f == NULL ? -1 : ch8_profile_write_collapsed(prof, f);
+    if(f != NULL && fclose(f) != 0) {
+        ret = -1;
+    }
+    if(ret != 0) {
+        LOG_ERROR("Error writing call stacks to \"%s\"\n", stacks_file);
+    } else {
+        LOG("Wrote %u call stacks to \"%s\"\n", prof->stack_count, stacks_file);
+    }
+}
+
+/*
+ * Step back one frame, the keypad keeps its current state so keys
+ * released while rewinding don't come back pressed.
+ */
+static void emu_rewind(emu_t *emu)
 {
-    g_w = VM_SCREEN_WIDTH * scale;
-    g_h = VM_SCREEN_HEIGHT * scale;
+    uint8_t keys[VM_KEY_COUNT];
 
-    win_init(g_w, g_h);
+    memcpy(keys, emu->vm.keys, sizeof(keys));
+    if(ch8_rewind_pop(&emu->rewind, &emu->vm) != 0) {
+        return;
+    }
 
-    ch8_load(&g_vm, rom, rom_sz);
+    if(emu->recording) {
+        /* the log continues from the frame we went back to */
+        input_log_truncate(&emu->log, emu->vm.cycles);
+    }
+    for(uint8_t i = 0; i < VM_KEY_COUNT; ++i) {
+        set_key(emu, i, keys[i]);
+    }
+}
+
+/*
+ * Run one frame, or step back one if rewinding.
+ */
+static void emu_frame(emu_t *emu, uint32_t cycles)
+{
+    if(emu->rewinding && emu->rewind_on) {
+        emu_rewind(emu);
+        return;
+    }
 
-    double t_d = 0.0;
-    double t_start = glfwGetTime() * 1000000.0;
-    double t_end = 0.0;
-    do {
-        t_d = t_end - t_start;
+    if(emu->turbo_mode) {
+        cycles *= 10;
+    }
+    if(emu->recording && input_log_frame(&emu->log, emu->vm.cycles, cycles) != 0) {
+        record_failed(emu);
+    }
+    ch8_tick_timers(&emu->vm);
+    if(emu->tracing) {
+        trace_frame(&emu->trace, emu->frame);
+        emu_run_traced(emu, cycles);
+    } else if(emu->profiling) {
+        emu_run_profiled(emu, cycles);
+    } else {
+        emu_run(emu, emu->engine, cycles);
+    }
+    emu->frame += 1;
 
-        glfwPollEvents();
+    if(emu->rewind_on) {
+        double t = glfwGetTime();
+        ch8_rewind_push(&emu->rewind, &emu->vm);
+        emu->t_rewind += glfwGetTime() - t;
+        emu->rewind_frames += 1;
+    }
+}
 
-        if(g_reset) {
-            ch8_load(&g_vm, rom, rom_sz);
-            g_reset = false;
+/*
+ * Apply the input that arrived since the last frame.
+ */
+static void emu_input(emu_t *emu)
+{
+    mailbox_event_t ev;
+
+    while(mailbox_queue_pop(&emu->input, &ev)) {
+        switch(ev.type) {
+            case MAILBOX_KEY:
+                set_key(emu, ev.key, ev.state);
+                break;
+            case MAILBOX_TURBO:
+                emu->turbo_mode = ev.state;
+                break;
+            case MAILBOX_REWIND:
+                emu->rewinding = ev.state;
+                break;
+            case MAILBOX_RESET:
+                emu_reset(emu);
+                if(emu->recording) {
+                    input_log_truncate(&emu->log, 0);
+                }
+                break;
         }
+    }
+}
 
-        uint16_t op = ch8_get_op(&g_vm);
-        printf("%s\n", ch8_disassemble(op));
+/*
+ * Hand the screen to the main thread if it changed since the last frame
+ * that was handed over, and wake the main thread up to draw it.
+ */
+static void emu_publish(emu_t *emu)
+{
+    emu->vm.vram_dirty = 0;
+    if(memcmp(emu->published, emu->vm.vram, sizeof(emu->published)) == 0) {
+        return;
+    }
+    memcpy(emu->published, emu->vm.vram, sizeof(emu->published));
 
-        ch8_tick_timers(&g_vm);
-        for(uint8_t i = 0; i < (freq_mult * (g_turbo_mode ? 10 : 1)); ++i) {
-            ch8_tick(&g_vm);
+    mailbox_frame_t *frame = mailbox_tbuf_back(&emu->frames);
+    memcpy(frame->vram, emu->vm.vram, sizeof(frame->vram));
+    mailbox_tbuf_publish(&emu->frames);
+    glfwPostEmptyEvent();
+}
+
+static void *emu_thread(void *arg)
+{
+    emu_t *emu = arg;
+    pacer_t pacer;
+
+    pacer_init(&pacer, VM_TIMER_HZ, emu->ips);
+    uint32_t due = 1;
+    while(__atomic_load_n(&emu->running, __ATOMIC_ACQUIRE)) {
+        emu_input(emu);
+
+        /* frames the host fell behind on are run without showing them */
+        for(uint32_t f = 0; f < due; ++f) {
+            emu_frame(emu, pacer_cycles(&pacer));
         }
+        emu_publish(emu);
 
-        if(g_vm.vram_updated) {
-            /* update framebuffer */
-            glBindTexture(GL_TEXTURE_2D, g_fb_id);
-            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, VM_SCREEN_WIDTH, VM_SCREEN_HEIGHT,
-                             GL_LUMINANCE, GL_UNSIGNED_BYTE, g_vm.vram);
-            glBindTexture(GL_TEXTURE_2D, 0);
+        due = pacer_wait(&pacer);
+    }
+
+    pacer_report(&pacer);
+
+    return NULL;
+}
 
-            g_vm.vram_updated = false;
+/*
+ * Upload the rows of a frame that differ from what is on screen.
+ */
+static void win_upload(emu_t *emu, const mailbox_frame_t *frame)
+{
+    uint32_t dirty = 0;
+    uint8_t first, count;
+
+    for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+        if(frame->vram[y] != emu->shown[y]) {
+            dirty |= (uint32_t)1 << y;
         }
+    }
+    memcpy(emu->shown, frame->vram, sizeof(emu->shown));
+
+    glBindTexture(GL_TEXTURE_2D, emu->fb_id);
+    while(ch8_vram_next_span(&dirty, &first, &count)) {
+        uint8_t *rows = emu->fb + first * VM_SCREEN_WIDTH;
+        ch8_vram_unpack_copy(frame->vram, rows, first, count);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, VM_SCREEN_WIDTH, count,
+                        GL_LUMINANCE, GL_UNSIGNED_BYTE, rows);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void emu_loop(const uint16_t *rom, uint16_t rom_sz, double scale, uint32_t ips,
+              ch8_engine_e engine, uint64_t seed, uint32_t rewind_budget,
+              const char *record_file, const char *trace_file,
+              uint32_t profile_interval, const char *stacks_file)
+{
+    emu_t *emu = calloc(1, sizeof(*emu));
+    if(emu == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        return;
+    }
+
+    if(engine == CH8_ENGINE_JIT && ch8_jit_init(&emu->jit) != 0) {
+        LOG_ERROR("Falling back to the threaded core\n");
+        engine = CH8_ENGINE_THREADED;
+    }
+
+    emu->w = VM_SCREEN_WIDTH * scale;
+    emu->h = VM_SCREEN_HEIGHT * scale;
+    emu->rom = rom;
+    emu->rom_sz = rom_sz;
+    emu->engine = engine;
+    emu->seed = seed;
+    emu->ips = ips;
+
+    if(rewind_budget > 0 && ch8_rewind_init(&emu->rewind, rewind_budget) != 0) {
+        LOG_ERROR("Could not allocate %u bytes for rewinding\n", rewind_budget);
+        rewind_budget = 0;
+    }
+    emu->rewind_on = rewind_budget > 0;
+
+    emu->tracing = trace_file != NULL && trace_open(&emu->trace, trace_file) == 0;
+    emu->profiling = profile_interval > 0;
 
-        win_render();
+    win_init(emu, emu->w, emu->h);
+    mailbox_tbuf_init(&emu->frames);
+    mailbox_queue_init(&emu->input);
 
-        if(t_d < FPS_FRAMETIME) {
-            usleep(FPS_FRAMETIME - t_d);
+    emu_reset(emu);
+    if(emu->profiling) {
+        ch8_profile_init(&emu->prof, &emu->vm, profile_interval);
+    }
+    if(record_file != NULL) {
+        input_log_init(&emu->log, &emu->vm, seed);
+        emu->recording = true;
+    }
+
+    emu->running = 1;
+    if(pthread_create(&emu->thread, NULL, emu_thread, emu) != 0) {
+        LOG_ERROR("Could not start the emulation thread\n");
+        emu->running = 0;
+    }
+
+    while(emu->running && !glfwWindowShouldClose(emu->win)) {
+        const mailbox_frame_t *frame = mailbox_tbuf_latest(&emu->frames);
+        if(frame != NULL) {
+            win_upload(emu, frame);
         }
+        if(frame != NULL || emu->redraw) {
+            win_render(emu);
+            emu->redraw = false;
+        }
+        /* woken up by input or by the core publishing a frame */
+        glfwWaitEvents();
+    }
 
-        t_start = t_end;
-        t_end = glfwGetTime() * 1000000.0;
-    } while(!glfwWindowShouldClose(g_win));
+    if(emu->running) {
+        __atomic_store_n(&emu->running, 0, __ATOMIC_RELEASE);
+        pthread_join(emu->thread, NULL);
+    }
+    if(emu->dropped_events > 0) {
+        LOG_ERROR("%u input events were dropped\n", emu->dropped_events);
+    }
+
+    if(engine == CH8_ENGINE_JIT) {
+        ch8_jit_free(&emu->jit);
+    }
+    if(emu->tracing) {
+        if(trace_close(&emu->trace) != 0) {
+            LOG_ERROR("Error writing trace \"%s\"\n", trace_file);
+        } else {
+            LOG("Traced %llu frames to \"%s\", the core waited for the writer %llu times\n",
+                (unsigned long long)emu->frame, trace_file,
+                (unsigned long long)emu->trace.stalls);
+        }
+    }
+    if(emu->rewind_on) {
+        LOG("Rewind: %u frames held in %u KiB, %.2f us per frame to record\n",
+            emu->rewind.count, emu->rewind.used / 1024,
+            emu->rewind_frames > 0 ? emu->t_rewind * 1000000.0 / emu->rewind_frames : 0.0);
+        ch8_rewind_free(&emu->rewind);
+    }
+    if(record_file != NULL) {
+        input_log_end(&emu->log, &emu->vm);
+        if(emu->recording && input_log_save(&emu->log, record_file) == 0) {
+            LOG("Recorded %u key changes over %llu instructions to \"%s\"\n", emu->log.key_count,
+                (unsigned long long)emu->vm.cycles, record_file);
+        }
+        input_log_free(&emu->log);
+    }
+    if(emu->profiling) {
+        emu_profile_report(emu, stacks_file);
+    }
 
-    win_destroy();
+    win_destroy(emu);
+    free(emu);
 }
@@ -20,7 +20,24 @@
 #define CHIP8_EMU_H
 
 #include <stdint.h>
+#include "chip8.h"
 
-void emu_loop(const uint16_t *rom, uint16_t rom_sz, double scale, int freq_mult);
+/*
+ * Run a ROM in a window until it is closed.
+ *
+ * Params:
+ *  scale           - window size as a multiple of the screen,
+ *  ips             - instructions per second, spread over 60 Hz frames,
+ *  rewind_budget   - bytes of frame history for rewinding, 0 for none,
+ *  record_file     - where to save an input log of the session, or NULL,
+ *  trace_file      - where to write an instruction trace, or NULL,
+ *  profile_interval - instructions per profiler sample, 0 to not profile,
+ *                    the profile is printed when the window is closed,
+ *  stacks_file     - where to write the profiled call stacks, or NULL.
+ */
+void emu_loop(const uint16_t *rom, uint16_t rom_sz, double scale, uint32_t ips,
+              ch8_engine_e engine, uint64_t seed, uint32_t rewind_budget,
+              const char *record_file, const char *trace_file,
+              uint32_t profile_interval, const char *stacks_file);
 
 #endif // CHIP8_EMU_H
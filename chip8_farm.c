@@ -0,0 +1,544 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Headless batch runner. Jobs are dealt round-robin into per-worker
+ * deques, a worker takes jobs from the front of its own deque and when
+ * it runs dry steals from the back of the others. Every worker owns its
+ * VM and caches, nothing is shared between jobs.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_farm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // sysconf()
+
+#include "chip8.h"
+#include "file.h"
+#include "log.h"
+
+#define FARM_PATH_MAX 256
+#define FARM_LINE_MAX (4 * FARM_PATH_MAX + 32)
+
+typedef struct {
+    uint32_t frame;
+    uint16_t keys;
+} farm_input_t;
+
+typedef struct {
+    char rom[FARM_PATH_MAX];
+    char input[FARM_PATH_MAX];
+    char start[FARM_PATH_MAX];
+    char save[FARM_PATH_MAX];
+    uint32_t frames;
+    /* Results */
+    bool ok;
+    uint64_t hash;
+    uint64_t cycles;
+    uint64_t idle_cycles;
+    double ms;
+} farm_job_t;
+
+/* jobs [head, tail) of the job array */
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+} farm_deque_t;
+
+typedef struct {
+    farm_job_t *jobs;
+    uint32_t job_count;
+    farm_deque_t *deques;
+    int workers;
+    int freq_mult;
+    ch8_engine_e engine;
+    uint64_t seed;
+} farm_t;
+
+typedef struct {
+    farm_t *farm;
+    int id;
+    pthread_t thread;
+    uint32_t steals;
+    ch8_engine_e engine;
+    ch8_t vm;
+    ch8_dcache_t dcache;
+    ch8_jit_t jit;
+    /* RAM right after loading the ROM, snapshots are deltas against it */
+    uint8_t base[VM_RAM_SIZE];
+    uint8_t snap[CH8_SNAPSHOT_MAX];
+} farm_worker_t;
+
+static double time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Parse an input script into a malloc'd array of keypad changes.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+static int load_inputs(const char *path, farm_input_t **out, uint32_t *count)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        LOG_ERROR("Could not open input script \"%s\"\n", path);
+        return 1;
+    }
+
+    farm_input_t *inputs = NULL;
+    uint32_t n = 0, cap = 0;
+    char line[FARM_LINE_MAX];
+    uint32_t lineno = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        unsigned long frame, keys;
+        char *p = line, *end;
+
+        lineno += 1;
+        while(*p == ' ' || *p == '\t') {
+            p += 1;
+        }
+        if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+
+        frame = strtoul(p, &end, 0);
+        if(end == p) {
+            goto bad_line;
+        }
+        p = end;
+        keys = strtoul(p, &end, 0);
+        if(end == p || keys > 0xFFFF || (n > 0 && frame < inputs[n - 1].frame)) {
+            goto bad_line;
+        }
+
+        if(n == cap) {
+            cap = cap ? cap * 2 : 64;
+            farm_input_t *grown = realloc(inputs, cap * sizeof(*inputs));
+            if(grown == NULL) {
+                LOG_ERROR("Error allocating memory\n");
+                goto fail;
+            }
+            inputs = grown;
+        }
+        inputs[n].frame = frame;
+        inputs[n].keys = keys;
+        n += 1;
+    }
+
+    fclose(f);
+    *out = inputs;
+    *count = n;
+    return 0;
+
+bad_line:
+    LOG_ERROR("%s:%u: expected \"FRAME KEYMASK\" in ascending frame order\n", path, lineno);
+fail:
+    free(inputs);
+    fclose(f);
+    return 1;
+}
+
+/*
+ * Restore the job's VM from a snapshot file, mapped rather than read.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+static int load_snapshot(farm_worker_t *w, const char *path)
+{
+    uint16_t *snap;
+    size_t snap_sz;
+
+    if(load_file(path, &snap, &snap_sz) != 0) {
+        LOG_ERROR("Could not load snapshot \"%s\"\n", path);
+        return 1;
+    }
+    int ret = ch8_snapshot_load(&w->vm, w->base, snap, snap_sz);
+    unload_file(snap, snap_sz);
+    if(ret != 0) {
+        LOG_ERROR("\"%s\" is not a valid snapshot of this ROM\n", path);
+    }
+
+    return ret;
+}
+
+static int save_snapshot(farm_worker_t *w, const char *path)
+{
+    size_t size = ch8_snapshot_save(&w->vm, w->base, w->snap, sizeof(w->snap));
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) {
+        LOG_ERROR("Could not open \"%s\" for writing\n", path);
+        return 1;
+    }
+    size_t written = fwrite(w->snap, 1, size, f);
+    if(fclose(f) != 0 || written != size) {
+        LOG_ERROR("Error writing snapshot \"%s\"\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Execute one frame worth of instructions, same as the emulator does
+ * between two vblanks.
+ */
+static void run_frame(farm_worker_t *w, uint32_t cycles)
+{
+    ch8_t *vm = &w->vm;
+    uint64_t end = vm->cycles + cycles;
+
+    ch8_tick_timers(vm);
+
+    if(w->engine == CH8_ENGINE_INTERP || w->engine == CH8_ENGINE_CACHED) {
+        void (*tick)(ch8_t *vm) = w->engine == CH8_ENGINE_CACHED ? ch8_tick_cached : ch8_tick;
+        while(vm->cycles < end) {
+            tick(vm);
+        }
+        return;
+    }
+
+    while(vm->cycles < end) {
+        if(ch8_run(vm, end - vm->cycles) == CH8_EXIT_KEYWAIT) {
+            /*
+             * keys only change between frames, account the rest of the
+             * frame as spent in Fx0A so every engine ends up with the
+             * same cycle count.
+             */
+            vm->idle_cycles += end - vm->cycles;
+            vm->cycles = end;
+        }
+    }
+}
+
+static void run_job(farm_worker_t *w, farm_job_t *job)
+{
+    farm_t *farm = w->farm;
+    farm_input_t *inputs = NULL;
+    uint32_t input_count = 0, next_input = 0;
+    uint16_t *rom;
+    size_t rom_sz;
+    double t_start = time_ms();
+
+    if(load_file(job->rom, &rom, &rom_sz) != 0) {
+        LOG_ERROR("Could not load ROM \"%s\"\n", job->rom);
+        return;
+    }
+    if(rom_sz > VM_RAM_SIZE - VM_EXEC_START_ADDR) {
+        LOG_ERROR("ROM \"%s\" does not fit in memory\n", job->rom);
+        unload_file(rom, rom_sz);
+        return;
+    }
+    if(job->input[0] != '\0' && load_inputs(job->input, &inputs, &input_count) != 0) {
+        unload_file(rom, rom_sz);
+        return;
+    }
+
+    ch8_load(&w->vm, rom, rom_sz);
+    ch8_seed(&w->vm, farm->seed);
+    unload_file(rom, rom_sz);
+    memcpy(w->base, w->vm.ram, sizeof(w->base));
+    if(job->start[0] != '\0' && load_snapshot(w, job->start) != 0) {
+        free(inputs);
+        return;
+    }
+    uint64_t start_cycles = w->vm.cycles;
+    uint64_t start_idle = w->vm.idle_cycles;
+    if(w->engine == CH8_ENGINE_CACHED || w->engine == CH8_ENGINE_THREADED) {
+        ch8_dcache_attach(&w->vm, &w->dcache);
+    }
+    if(w->engine == CH8_ENGINE_JIT) {
+        ch8_jit_attach(&w->vm, &w->jit);
+    }
+
+    for(uint32_t frame = 0; frame < job->frames; ++frame) {
+        while(next_input < input_count && inputs[next_input].frame <= frame) {
+            for(uint8_t k = 0; k < VM_KEY_COUNT; ++k) {
+                w->vm.keys[k] = (inputs[next_input].keys >> k) & 1;
+            }
+            next_input += 1;
+        }
+        run_frame(w, farm->freq_mult);
+    }
+
+    free(inputs);
+
+    if(job->save[0] != '\0' && save_snapshot(w, job->save) != 0) {
+        return;
+    }
+
+    job->hash = ch8_hash(&w->vm);
+    job->cycles = w->vm.cycles - start_cycles;
+    job->idle_cycles = w->vm.idle_cycles - start_idle;
+    job->ms = time_ms() - t_start;
+    job->ok = true;
+}
+
+static bool pop_own(farm_deque_t *dq, uint32_t *job)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->head < dq->tail) {
+        *job = dq->head++;
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return found;
+}
+
+static bool steal(farm_deque_t *dq, uint32_t *job)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->head < dq->tail) {
+        *job = --dq->tail;
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return found;
+}
+
+static void *worker_main(void *arg)
+{
+    farm_worker_t *w = arg;
+    farm_t *farm = w->farm;
+    uint32_t job;
+
+    for(;;) {
+        if(pop_own(&farm->deques[w->id], &job)) {
+            run_job(w, &farm->jobs[job]);
+            continue;
+        }
+
+        /* jobs never spawn jobs, so once every deque is empty we are done */
+        bool stolen = false;
+        for(int i = 1; i < farm->workers && !stolen; ++i) {
+            stolen = steal(&farm->deques[(w->id + i) % farm->workers], &job);
+        }
+        if(!stolen) {
+            break;
+        }
+        w->steals += 1;
+        run_job(w, &farm->jobs[job]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse the job file into a malloc'd array.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+static int load_jobs(const char *path, farm_job_t **out, uint32_t *count)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        LOG_ERROR("Could not open job file \"%s\"\n", path);
+        return 1;
+    }
+
+    farm_job_t *jobs = NULL;
+    uint32_t n = 0, cap = 0;
+    char line[FARM_LINE_MAX];
+    uint32_t lineno = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char rom[FARM_PATH_MAX], input[FARM_PATH_MAX];
+        char start[FARM_PATH_MAX], save[FARM_PATH_MAX];
+        unsigned long frames;
+        int fields;
+
+        lineno += 1;
+        input[0] = start[0] = save[0] = '\0';
+        fields = sscanf(line, " %255s %lu %255s %255s %255s", rom, &frames, input, start, save);
+        if(fields <= 0 || rom[0] == '#') {
+            continue;
+        }
+        if(fields < 2) {
+            LOG_ERROR("%s:%u: expected \"ROM FRAMES [INPUT [START [SAVE]]]\"\n", path, lineno);
+            free(jobs);
+            fclose(f);
+            return 1;
+        }
+
+        if(n == cap) {
+            cap = cap ? cap * 2 : 64;
+            farm_job_t *grown = realloc(jobs, cap * sizeof(*jobs));
+            if(grown == NULL) {
+                LOG_ERROR("Error allocating memory\n");
+                free(jobs);
+                fclose(f);
+                return 1;
+            }
+            jobs = grown;
+        }
+        memset(&jobs[n], 0, sizeof(jobs[n]));
+        strcpy(jobs[n].rom, rom);
+        /* - skips an optional field */
+        strcpy(jobs[n].input, strcmp(input, "-") ? input : "");
+        strcpy(jobs[n].start, strcmp(start, "-") ? start : "");
+        strcpy(jobs[n].save, strcmp(save, "-") ? save : "");
+        jobs[n].frames = frames;
+        n += 1;
+    }
+
+    fclose(f);
+    *out = jobs;
+    *count = n;
+    return 0;
+}
+
+static int cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+int farm_loop(const char *jobs_file, int threads, int freq_mult, ch8_engine_e engine,
+              uint64_t seed)
+{
+    farm_t farm = {
+        .workers = threads > 0 ? threads : cpu_count(),
+        .freq_mult = freq_mult,
+        .engine = engine,
+        .seed = seed
+    };
+
+    if(load_jobs(jobs_file, &farm.jobs, &farm.job_count) != 0) {
+        return 1;
+    }
+    if(farm.job_count == 0) {
+        LOG_ERROR("No jobs in \"%s\"\n", jobs_file);
+        free(farm.jobs);
+        return 1;
+    }
+    if((uint32_t)farm.workers > farm.job_count) {
+        farm.workers = farm.job_count;
+    }
+
+    farm.deques = calloc(farm.workers, sizeof(*farm.deques));
+    farm_worker_t *workers = calloc(farm.workers, sizeof(*workers));
+    if(farm.deques == NULL || workers == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        free(farm.deques);
+        free(workers);
+        free(farm.jobs);
+        return 1;
+    }
+
+    /* contiguous shares, the remainder goes to the first workers */
+    uint32_t share = farm.job_count / farm.workers;
+    uint32_t extra = farm.job_count % farm.workers;
+    uint32_t next = 0;
+    for(int i = 0; i < farm.workers; ++i) {
+        farm_deque_t *dq = &farm.deques[i];
+        pthread_mutex_init(&dq->lock, NULL);
+        dq->head = next;
+        next += share + ((uint32_t)i < extra ? 1 : 0);
+        dq->tail = next;
+    }
+
+    double t_start = time_ms();
+
+    int started = 0;
+    for(int i = 0; i < farm.workers; ++i) {
+        farm_worker_t *w = &workers[i];
+        w->farm = &farm;
+        w->id = i;
+        w->engine = engine;
+        if(engine == CH8_ENGINE_JIT && ch8_jit_init(&w->jit) != 0) {
+            w->engine = CH8_ENGINE_THREADED;
+        }
+        if(pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            LOG_ERROR("Could not start worker %d\n", i);
+            break;
+        }
+        started += 1;
+    }
+    if(started == 0) {
+        /* run everything on this thread rather than giving up */
+        workers[0].farm = &farm;
+        worker_main(&workers[0]);
+    }
+
+    uint32_t steals = 0;
+    for(int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for(int i = 0; i < farm.workers; ++i) {
+        steals += workers[i].steals;
+        if(workers[i].engine == CH8_ENGINE_JIT) {
+            ch8_jit_free(&workers[i].jit);
+        }
+        pthread_mutex_destroy(&farm.deques[i].lock);
+    }
+
+    double t_total = time_ms() - t_start;
+
+    uint32_t failed = 0;
+    uint64_t cycles = 0, idle_cycles = 0;
+    printf("%-6s %-16s %10s %12s %12s %10s  %s\n", "job", "hash", "frames", "cycles", "idle",
+           "ms", "rom");
+    for(uint32_t i = 0; i < farm.job_count; ++i) {
+        farm_job_t *job = &farm.jobs[i];
+        if(!job->ok) {
+            printf("%-6u %-16s %10u %12s %12s %10s  %s\n", i, "FAILED", job->frames, "-", "-", "-",
+                   job->rom);
+            failed += 1;
+            continue;
+        }
+        printf("%-6u %016llx %10u %12llu %12llu %10.3f  %s\n", i, (unsigned long long)job->hash,
+               job->frames, (unsigned long long)job->cycles, (unsigned long long)job->idle_cycles,
+               job->ms, job->rom);
+        cycles += job->cycles;
+        idle_cycles += job->idle_cycles;
+    }
+    printf("%u jobs, %u failed, %d workers, %u steals, %.3f ms, %.2f MIPS, %.1f%% idle\n",
+           farm.job_count, failed, farm.workers, steals, t_total,
+           t_total > 0 ? cycles / t_total / 1000.0 : 0.0,
+           cycles > 0 ? 100.0 * idle_cycles / cycles : 0.0);
+
+    free(workers);
+    free(farm.deques);
+    free(farm.jobs);
+
+    return failed != 0;
+}
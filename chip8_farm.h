@@ -0,0 +1,55 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_FARM_H
+#define CHIP8_FARM_H
+
+#include <stdint.h>
+#include "chip8.h"
+
+/*
+ * Run a list of jobs without a window on a pool of worker threads and
+ * print the final state hash and timing of every job.
+ *
+ * The job file has one job per line, empty lines and lines starting
+ * with # are ignored:
+ *  ROM FRAMES [INPUT [START [SAVE]]]
+ * where - leaves out an optional field. START is a snapshot of the ROM
+ * to continue from instead of booting it, SAVE is where to write one
+ * when the job is done. Snapshots store RAM as a delta against the ROM.
+ *
+ * The optional input script has one keypad change per line, the mask is
+ * held from that frame on until the next line, frames count from the
+ * start of the job:
+ *  FRAME KEYMASK
+ * where bit n of KEYMASK is key n. Frames must be in ascending order.
+ *
+ * Params:
+ *  jobs_file   - path to the job file,
+ *  threads     - amount of worker threads, 0 for one per CPU,
+ *  freq_mult   - instructions executed per 60hz frame,
+ *  engine      - execution engine used by every worker,
+ *  seed        - RND seed of every job.
+ *
+ * Returns
+ *  0 if all jobs ran, nonzero otherwise.
+ */
+int farm_loop(const char *jobs_file, int threads, int freq_mult, ch8_engine_e engine,
+              uint64_t seed);
+
+#endif // CHIP8_FARM_H
@@ -0,0 +1,449 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Basic block recompiler for x86-64.
+ *
+ * Straight-line runs of register and timer instructions are translated
+ * into native code that works on the ch8_t passed in rdi (SysV ABI).
+ * Everything else (jumps, calls, skips, DRW, key waits, memory stores)
+ * ends the block and is run by the threaded core, so the native code never
+ * has to deal with control flow or self modifying code.
+ */
+
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_ops.h"
+#include "log.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>   // mmap()
+
+/* worst case bytes emitted for a single instruction, plus the epilogue */
+#define JIT_OP_MAX_SZ   48
+
+#define OFF_V(reg)  (int32_t)(offsetof(ch8_t, v) + (reg))
+#define OFF_VF      OFF_V(0xF)
+#define OFF_I       (int32_t)offsetof(ch8_t, i)
+#define OFF_PC      (int32_t)offsetof(ch8_t, pc)
+#define OFF_DT      (int32_t)offsetof(ch8_t, tim_delay)
+#define OFF_ST      (int32_t)offsetof(ch8_t, tim_sound)
+
+/* x86 register numbers */
+#define AL  0
+#define CL  1
+
+/* condition codes for SETcc */
+#define CC_B    0x2
+#define CC_A    0x7
+
+typedef struct {
+    uint8_t *p;
+} emit_t;
+
+static void emit8(emit_t *e, uint8_t b)
+{
+    *e->p++ = b;
+}
+
+static void emit16(emit_t *e, uint16_t w)
+{
+    memcpy(e->p, &w, 2);
+    e->p += 2;
+}
+
+static void emit32(emit_t *e, uint32_t d)
+{
+    memcpy(e->p, &d, 4);
+    e->p += 4;
+}
+
+/* ModRM for [rdi + disp32] */
+static void emit_mem(emit_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x80 | (reg << 3) | 7);
+    emit32(e, disp);
+}
+
+/* mov r8, [rdi + off] */
+static void emit_load(emit_t *e, uint8_t reg, int32_t off)
+{
+    emit8(e, 0x8A);
+    emit_mem(e, reg, off);
+}
+
+/* mov [rdi + off], r8 */
+static void emit_store(emit_t *e, uint8_t reg, int32_t off)
+{
+    emit8(e, 0x88);
+    emit_mem(e, reg, off);
+}
+
+/* mov byte [rdi + off], imm8 */
+static void emit_store_imm(emit_t *e, int32_t off, uint8_t imm)
+{
+    emit8(e, 0xC6);
+    emit_mem(e, 0, off);
+    emit8(e, imm);
+}
+
+/* add byte [rdi + off], imm8 */
+static void emit_add_imm(emit_t *e, int32_t off, uint8_t imm)
+{
+    emit8(e, 0x80);
+    emit_mem(e, 0, off);
+    emit8(e, imm);
+}
+
+/* <op> [rdi + off], al or <op> al, [rdi + off] depending on opcode */
+static void emit_alu(emit_t *e, uint8_t opcode, int32_t off)
+{
+    emit8(e, opcode);
+    emit_mem(e, AL, off);
+}
+
+#define ALU_ADD_AL_M    0x02
+#define ALU_OR_M_AL     0x08
+#define ALU_AND_M_AL    0x20
+#define ALU_SUB_M_AL    0x28
+#define ALU_SUB_AL_M    0x2A
+#define ALU_XOR_M_AL    0x30
+#define ALU_CMP_AL_M    0x3A
+
+/* setcc cl */
+static void emit_setcc_cl(emit_t *e, uint8_t cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | cc);
+    emit8(e, 0xC1);
+}
+
+/* movzx eax, byte [rdi + off] */
+static void emit_movzx_eax(emit_t *e, int32_t off)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit_mem(e, AL, off);
+}
+
+/*
+ * Emit native code for one instruction.
+ *
+ * Returns
+ *  false if the instruction ends the block.
+ */
+static bool emit_op(emit_t *e, uint16_t opcode)
+{
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t y = (opcode & 0x00F0) >> 4;
+    uint8_t kk = opcode & 0x00FF;
+    uint16_t nnn = opcode & 0x0FFF;
+
+    /*
+     * Flags are written before the result like in chip8_ops.h, which
+     * matters when VF is also an operand.
+     */
+    switch(ch8_decode(opcode)) {
+        case CH8_OP_NOP:
+            break;
+        case CH8_OP_LD_VI:
+            emit_store_imm(e, OFF_V(x), kk);
+            break;
+        case CH8_OP_ADD_VI:
+            emit_add_imm(e, OFF_V(x), kk);
+            break;
+        case CH8_OP_LD_VV:
+            emit_load(e, AL, OFF_V(y));
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_OR:
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_OR_M_AL, OFF_V(x));
+            break;
+        case CH8_OP_AND:
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_AND_M_AL, OFF_V(x));
+            break;
+        case CH8_OP_XOR:
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_XOR_M_AL, OFF_V(x));
+            break;
+        case CH8_OP_ADD_VV:
+            emit_load(e, AL, OFF_V(x));
+            emit_alu(e, ALU_ADD_AL_M, OFF_V(y));
+            emit_setcc_cl(e, CC_B);
+            emit_store(e, CL, OFF_VF);
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_SUB:
+            emit_load(e, AL, OFF_V(x));
+            emit_alu(e, ALU_CMP_AL_M, OFF_V(y));
+            emit_setcc_cl(e, CC_A);
+            emit_store(e, CL, OFF_VF);
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_SUB_M_AL, OFF_V(x));
+            break;
+        case CH8_OP_SHR:
+            emit_load(e, AL, OFF_V(x));
+            emit8(e, 0x24); emit8(e, 0x01);                 // and al, 1
+            emit_store(e, AL, OFF_VF);
+            emit_load(e, AL, OFF_V(x));
+            emit8(e, 0xD0); emit8(e, 0xE8);                 // shr al, 1
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_SUBN:
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_CMP_AL_M, OFF_V(x));
+            emit_setcc_cl(e, CC_A);
+            emit_store(e, CL, OFF_VF);
+            emit_load(e, AL, OFF_V(y));
+            emit_alu(e, ALU_SUB_AL_M, OFF_V(x));
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_SHL:
+            emit_load(e, AL, OFF_V(x));
+            emit8(e, 0xC0); emit8(e, 0xE8); emit8(e, 0x07); // shr al, 7
+            emit_store(e, AL, OFF_VF);
+            emit_load(e, AL, OFF_V(x));
+            emit8(e, 0xD0); emit8(e, 0xE0);                 // shl al, 1
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_LD_I:
+            emit8(e, 0x66); emit8(e, 0xC7);                 // mov word [I], nnn
+            emit_mem(e, 0, OFF_I);
+            emit16(e, nnn);
+            break;
+        case CH8_OP_LD_VDT:
+            emit_load(e, AL, OFF_DT);
+            emit_store(e, AL, OFF_V(x));
+            break;
+        case CH8_OP_LD_DTV:
+            emit_load(e, AL, OFF_V(x));
+            emit_store(e, AL, OFF_DT);
+            break;
+        case CH8_OP_LD_STV:
+            emit_load(e, AL, OFF_V(x));
+            emit_store(e, AL, OFF_ST);
+            break;
+        case CH8_OP_ADD_IV:
+            emit_movzx_eax(e, OFF_V(x));
+            emit8(e, 0x66); emit8(e, 0x01);                 // add word [I], ax
+            emit_mem(e, AL, OFF_I);
+            break;
+        case CH8_OP_LD_FV:
+            emit_movzx_eax(e, OFF_V(x));
+            emit8(e, 0x6B); emit8(e, 0xC0);                 // imul eax, eax, 5
+            emit8(e, VM_FONT_H);
+            emit8(e, 0x66); emit8(e, 0x89);                 // mov word [I], ax
+            emit_mem(e, AL, OFF_I);
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static void compile(ch8_jit_t *jit, const ch8_t *vm, uint16_t start)
+{
+    if(jit->code_used + JIT_MAX_BLOCK * JIT_OP_MAX_SZ > JIT_CODE_SZ) {
+        ch8_jit_flush(jit);
+    }
+
+    uint8_t *entry = jit->code + jit->code_used;
+    uint8_t count = 0;
+    uint16_t pc = start;
+    emit_t emit = { entry };
+    emit_t *e = &emit;
+
+    mprotect(jit->code, JIT_CODE_SZ, PROT_READ | PROT_WRITE);
+
+    bool impure = false;
+    while(count < JIT_MAX_BLOCK && pc < VM_RAM_SIZE - 1) {
+        uint16_t opcode = (vm->ram[pc] << 8) | vm->ram[pc + 1];
+        if(!emit_op(e, opcode)) {
+            break;
+        }
+        impure = impure || idle_impure(ch8_decode(opcode));
+        count += 1;
+        pc += 2;
+    }
+
+    /* block covers [start, pc + 1], including the terminating opcode */
+    for(uint32_t p = start >> JIT_PAGE_SHIFT; p <= (uint32_t)(pc + 1) >> JIT_PAGE_SHIFT; ++p) {
+        if(p < 64) {
+            jit->code_pages |= (uint64_t)1 << p;
+        }
+    }
+
+    if(count == 0) {
+        mprotect(jit->code, JIT_CODE_SZ, PROT_READ | PROT_EXEC);
+        jit->block_len[start] = JIT_NO_BLOCK;
+        return;
+    }
+
+    /* epilogue: vm->pc = pc; return count */
+    emit8(e, 0x66); emit8(e, 0xC7);
+    emit_mem(e, 0, OFF_PC);
+    emit16(e, pc);
+    emit8(e, 0xB8);
+    emit32(e, count);
+    emit8(e, 0xC3);
+
+    mprotect(jit->code, JIT_CODE_SZ, PROT_READ | PROT_EXEC);
+
+    jit->code_used = e->p - jit->code;
+    jit->blocks[start] = (uint32_t (*)(ch8_t *))(uintptr_t)entry;
+    jit->block_len[start] = count;
+    ch8_bpoint_set(jit->block_impure, start, impure);
+}
+
+int ch8_jit_init(ch8_jit_t *jit)
+{
+    memset(jit, 0, sizeof(*jit));
+
+    /* never writable and executable at once, see compile() */
+    void *mem = mmap(NULL, JIT_CODE_SZ, PROT_READ | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        LOG_ERROR("Error allocating executable memory\n");
+        return 1;
+    }
+
+    jit->code = mem;
+
+    return 0;
+}
+
+void ch8_jit_free(ch8_jit_t *jit)
+{
+    if(jit->code != NULL) {
+        munmap(jit->code, JIT_CODE_SZ);
+        jit->code = NULL;
+    }
+}
+
+#else
+
+static void compile(ch8_jit_t *jit, const ch8_t *vm, uint16_t start)
+{
+    jit->block_len[start] = JIT_NO_BLOCK;
+}
+
+int ch8_jit_init(ch8_jit_t *jit)
+{
+    memset(jit, 0, sizeof(*jit));
+    LOG_ERROR("Recompiler is not supported on this host\n");
+    return 1;
+}
+
+void ch8_jit_free(ch8_jit_t *jit)
+{
+}
+
+#endif
+
+void ch8_jit_flush(ch8_jit_t *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->block_len, 0, sizeof(jit->block_len));
+    memset(jit->block_impure, 0, sizeof(jit->block_impure));
+    jit->code_used = 0;
+    jit->code_pages = 0;
+}
+
+void ch8_jit_attach(ch8_t *vm, ch8_jit_t *jit)
+{
+    vm->jit = jit;
+    if(jit != NULL) {
+        ch8_jit_flush(jit);
+    }
+}
+
+/*
+ * Test for breakpoints in the middle of a block, a breakpoint on the
+ * address after the block is checked after running it.
+ */
+static bool bpoint_in_block(const uint8_t *bp, uint16_t start, uint8_t len)
+{
+    for(uint8_t i = 1; i < len; ++i) {
+        if(ch8_bpoint_test(bp, start + i * 2)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ch8_exit_e ch8_run_jit(ch8_t *vm, uint32_t cycles)
+{
+    ch8_jit_t *jit = vm->jit;
+    if(jit == NULL || jit->code == NULL) {
+        return ch8_run_threaded(vm, cycles);
+    }
+
+    const uint8_t *bp = vm->bpoints;
+    idle_t idle = IDLE_INIT;
+    uint32_t n = 0;
+    while(n < cycles) {
+        uint16_t pc = vm->pc;
+
+        if(pc < VM_RAM_SIZE) {
+            if(jit->block_len[pc] == 0) {
+                compile(jit, vm, pc);
+            }
+            /* only enter blocks that fit in the remaining budget */
+            uint8_t len = jit->block_len[pc];
+            if(jit->blocks[pc] != NULL && len <= cycles - n &&
+               (bp == NULL || !bpoint_in_block(bp, pc, len))) {
+                jit->blocks[pc](vm);
+                vm->cycles += len;
+                n += len;
+                if(ch8_bpoint_test(jit->block_impure, pc)) {
+                    idle.impure = n;
+                }
+                if(bp != NULL && ch8_bpoint_test(bp, vm->pc)) {
+                    return CH8_EXIT_BREAKPOINT;
+                }
+                continue;
+            }
+        }
+
+        ch8_form_e form = pc < VM_RAM_SIZE - 1 ? ch8_decode(ch8_get_op(vm)) : CH8_OP_INVALID;
+        ch8_exit_e ret = ch8_run_threaded(vm, 1);
+        n += 1;
+        if(ret != CH8_EXIT_CYCLES) {
+            return ret;
+        }
+
+        if(idle_impure(form)) {
+            idle.impure = n;
+        } else if(form == CH8_OP_JP && vm->pc <= pc) {
+            uint32_t skip = idle_jump(vm, &idle, pc, n, cycles - n);
+            n += skip;
+            vm->cycles += skip;
+            vm->idle_cycles += skip;
+        }
+    }
+
+    return CH8_EXIT_CYCLES;
+}
@@ -0,0 +1,107 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The triple buffer keeps the slot in the middle and a new frame flag in
+ * one byte. Publishing swaps the producer's slot into the middle with the
+ * flag set, taking a frame swaps the consumer's slot in with the flag
+ * clear, so neither side ever waits for the other or sees a slot that is
+ * being written.
+ *
+ * The queue is the usual ring with free running head and tail counters,
+ * each only written by its own side.
+ *
+ * Both use the GCC __atomic builtins, the build is C99.
+ */
+
+#include "chip8_mailbox.h"
+#include <assert.h>
+#include <string.h>
+
+#define TBUF_INDEX  0x03
+#define TBUF_FRESH  0x04
+
+#define QUEUE_MASK  (MAILBOX_QUEUE_SIZE - 1)
+
+void mailbox_tbuf_init(mailbox_tbuf_t *t)
+{
+    assert(t != NULL);
+
+    memset(t, 0, sizeof(*t));
+    t->back = 0;
+    t->state = 1;
+    t->front = 2;
+}
+
+mailbox_frame_t *mailbox_tbuf_back(mailbox_tbuf_t *t)
+{
+    return &t->slots[t->back];
+}
+
+void mailbox_tbuf_publish(mailbox_tbuf_t *t)
+{
+    uint8_t prev = __atomic_exchange_n(&t->state, t->back | TBUF_FRESH, __ATOMIC_ACQ_REL);
+    t->back = prev & TBUF_INDEX;
+}
+
+const mailbox_frame_t *mailbox_tbuf_latest(mailbox_tbuf_t *t)
+{
+    if(!(__atomic_load_n(&t->state, __ATOMIC_RELAXED) & TBUF_FRESH)) {
+        return NULL;
+    }
+
+    uint8_t prev = __atomic_exchange_n(&t->state, t->front, __ATOMIC_ACQ_REL);
+    t->front = prev & TBUF_INDEX;
+
+    return &t->slots[t->front];
+}
+
+void mailbox_queue_init(mailbox_queue_t *q)
+{
+    assert(q != NULL);
+
+    memset(q, 0, sizeof(*q));
+}
+
+bool mailbox_queue_push(mailbox_queue_t *q, const mailbox_event_t *ev)
+{
+    uint32_t tail = q->tail;
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if(tail - head == MAILBOX_QUEUE_SIZE) {
+        return false;
+    }
+    q->events[tail & QUEUE_MASK] = *ev;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool mailbox_queue_pop(mailbox_queue_t *q, mailbox_event_t *ev)
+{
+    uint32_t head = q->head;
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    if(head == tail) {
+        return false;
+    }
+    *ev = q->events[head & QUEUE_MASK];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
@@ -0,0 +1,118 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_MAILBOX_H
+#define CHIP8_MAILBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chip8.h"
+
+/*
+ * Lock-free handoff between the emulation thread and the render thread,
+ * see chip8_mailbox.c. Each structure has exactly one producer and one
+ * consumer thread.
+ */
+
+/* keeps the fields of each side off the other side's cache line */
+#define MAILBOX_PAD 64
+
+typedef struct {
+    uint64_t vram[VM_SCREEN_HEIGHT];
+} mailbox_frame_t;
+
+/*
+ * Triple buffer of frames. The producer always has a slot to draw into
+ * and the consumer always gets the newest complete frame, frames that
+ * are never picked up are overwritten.
+ */
+typedef struct {
+    mailbox_frame_t slots[3];
+    /* index of the slot in the middle, and whether it holds a new frame */
+    uint8_t state;
+    uint8_t pad0[MAILBOX_PAD];
+    uint8_t back;   // producer's slot
+    uint8_t pad1[MAILBOX_PAD];
+    uint8_t front;  // consumer's slot
+} mailbox_tbuf_t;
+
+typedef enum {
+    MAILBOX_KEY,        // key is pressed or released
+    MAILBOX_TURBO,
+    MAILBOX_REWIND,
+    MAILBOX_RESET
+} mailbox_event_e;
+
+typedef struct {
+    uint8_t type;
+    uint8_t key;
+    uint8_t state;
+} mailbox_event_t;
+
+/* power of two */
+#define MAILBOX_QUEUE_SIZE 256
+
+/*
+ * Bounded single producer single consumer queue of input events.
+ */
+typedef struct {
+    mailbox_event_t events[MAILBOX_QUEUE_SIZE];
+    uint32_t tail;  // written by the producer
+    uint8_t pad[MAILBOX_PAD];
+    uint32_t head;  // written by the consumer
+} mailbox_queue_t;
+
+void mailbox_tbuf_init(mailbox_tbuf_t *t);
+
+/*
+ * The slot the producer fills in next.
+ */
+mailbox_frame_t *mailbox_tbuf_back(mailbox_tbuf_t *t);
+
+/*
+ * Hand the filled in slot to the consumer and take another one.
+ */
+void mailbox_tbuf_publish(mailbox_tbuf_t *t);
+
+/*
+ * Take the newest frame published since the last call.
+ *
+ * Returns
+ *  the frame, valid until the next call, or NULL if there is no new one.
+ */
+const mailbox_frame_t *mailbox_tbuf_latest(mailbox_tbuf_t *t);
+
+void mailbox_queue_init(mailbox_queue_t *q);
+
+/*
+ * Add an event to the queue.
+ *
+ * Returns
+ *  false if the queue is full.
+ */
+bool mailbox_queue_push(mailbox_queue_t *q, const mailbox_event_t *ev);
+
+/*
+ * Take the oldest event from the queue.
+ *
+ * Returns
+ *  false if the queue is empty.
+ */
+bool mailbox_queue_pop(mailbox_queue_t *q, mailbox_event_t *ev);
+
+#endif // CHIP8_MAILBOX_H
@@ -16,17 +16,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <stdio.h>
 #include <stdint.h>
-#include <string.h>
-#include <stdlib.h>
-#include "log.h"
 #include "chip8.h"
-
-#define UNKNOWN_OP(opcode) LOG_ERROR("UNKNOWN OPCODE %04X\n", opcode)
-
-#define SETVF vm->v[0xF] = 1
-#define CLRVF vm->v[0xF] = 0
+#include "chip8_ops.h"
 
 static void ops_x0(ch8_t *vm, uint16_t opcode)
 {
@@ -34,10 +26,10 @@ static void ops_x0(ch8_t *vm, uint16_t opcode)
         case 0xE:
             switch(opcode & 0x000F) {
                 case 0x0:
-                    memset(vm->vram, 0, VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT);
+                    op_cls(vm);
                     break;
                 case 0xE:
-                    vm->pc = vm->stack[--vm->sp];
+                    op_ret(vm);
                     break;
             }
             break;
@@ -51,116 +43,70 @@ static void ops_x0(ch8_t *vm, uint16_t opcode)
 
 static void jp(ch8_t *vm, uint16_t opcode)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    vm->pc = addr - 2;
+    op_jp(vm, OP_NNN(opcode));
 }
 
 static void call(ch8_t *vm, uint16_t opcode)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    vm->stack[vm->sp++] = vm->pc;
-    vm->pc = addr - 2;
+    op_call(vm, OP_NNN(opcode));
 }
 
 static void se_vi(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    if(vm->v[reg] == imm) {
-        vm->pc += 2;
-    }
+    op_se_vi(vm, OP_X(opcode), OP_KK(opcode));
 }
 
 static void sne_vi(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    if(vm->v[reg] != imm) {
-        vm->pc += 2;
-    }
+    op_sne_vi(vm, OP_X(opcode), OP_KK(opcode));
 }
 
 static void se_vv(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    if(vm->v[rega] == vm->v[regb]) {
-        vm->pc += 2;
-    }
+    op_se_vv(vm, OP_X(opcode), OP_Y(opcode));
 }
 
 static void ld_vi(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    vm->v[reg] = imm;
+    op_ld_vi(vm, OP_X(opcode), OP_KK(opcode));
 }
 
 static void add(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    vm->v[reg] += imm;
+    op_add_vi(vm, OP_X(opcode), OP_KK(opcode));
 }
 
 static void ops_x8(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    uint16_t result;
+    uint8_t rega = OP_X(opcode);
+    uint8_t regb = OP_Y(opcode);
     switch(opcode & 0x000F) {
         case 0:
-            vm->v[rega] = vm->v[regb];
+            op_ld_vv(vm, rega, regb);
             break;
         case 1:
-            vm->v[rega] |= vm->v[regb];
+            op_or(vm, rega, regb);
             break;
         case 2:
-            vm->v[rega] &= vm->v[regb];
+            op_and(vm, rega, regb);
             break;
         case 3:
-            vm->v[rega] ^= vm->v[regb];
+            op_xor(vm, rega, regb);
             break;
         case 4:
-            result = vm->v[rega] + vm->v[regb];
-            if(result > 0xFF) {
-                SETVF;
-            } else {
-                CLRVF;
-            }
-            vm->v[rega] = result;
+            op_add_vv(vm, rega, regb);
             break;
         case 5:
-            if(vm->v[rega] > vm->v[regb]) {
-                SETVF;
-            } else {
-                CLRVF;
-            }
-            vm->v[rega] -= vm->v[regb];
+            op_sub(vm, rega, regb);
             break;
         case 6:
-            if(vm->v[rega] & 1) {
-                SETVF;
-            } else {
-                CLRVF;
-            }
-            vm->v[rega] = vm->v[rega] >> 1;
+            op_shr(vm, rega);
             break;
         case 7:
-            if(vm->v[regb] > vm->v[rega]) {
-                SETVF;
-            } else {
-                CLRVF;
-            }
-            vm->v[rega] = vm->v[regb] - vm->v[rega];
+            op_subn(vm, rega, regb);
             break;
         case 0xE:
-            if(vm->v[rega] & 0x80) {
-                SETVF;
-            } else {
-                CLRVF;
-            }
-            vm->v[rega] = vm->v[rega] << 1;
+            op_shl(vm, rega);
             break;
         default:
             UNKNOWN_OP(opcode);
@@ -170,69 +116,38 @@ static void ops_x8(ch8_t *vm, uint16_t opcode)
 
 static void sne_vv(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    if(vm->v[rega] != vm->v[regb]) {
-        vm->pc += 2;
-    }
+    op_sne_vv(vm, OP_X(opcode), OP_Y(opcode));
 }
 
 static void ld_i(ch8_t *vm, uint16_t opcode)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    vm->i = addr;
+    op_ld_i(vm, OP_NNN(opcode));
 }
 
 static void jp_v(ch8_t *vm, uint16_t opcode)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    vm->pc = vm->v[0] + addr - 2;
+    op_jp_v0(vm, OP_NNN(opcode));
 }
 
 static void rnd(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    vm->v[reg] = rand() & imm;
+    op_rnd(vm, OP_X(opcode), OP_KK(opcode));
 }
 
 static void drw(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t x = vm->v[(opcode & 0x0F00) >> 8];
-    uint8_t y = vm->v[(opcode & 0x00F0) >> 4];
-    uint8_t bval = (opcode & 0x000F);
-
-    // zero collision reg
-    vm->v[0xF] = 0;
-
-    for(uint8_t iy = 0; iy < bval; ++iy) {
-        uint8_t sprite = vm->ram[vm->i + iy];
-        for(uint8_t ix = 0; ix < 8; ++ix) {
-            if(sprite & (0x80 >> ix)) {
-                uint16_t vram_off = ((x + ix) + ((y + iy) * VM_SCREEN_WIDTH)) % 2048;
-                vm->v[0xF] |= vm->vram[vram_off] & 1;
-                vm->vram[vram_off] = ~vm->vram[vram_off];
-            }
-        }
-    }
-
-    vm->vram_updated = true;
+    op_drw(vm, OP_X(opcode), OP_Y(opcode), OP_N(opcode));
 }
 
 static void skip(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t key = vm->v[reg];
+    uint8_t reg = OP_X(opcode);
     switch(opcode & 0xFF) {
         case 0x9E:
-            if(vm->keys[key]) {
-                vm->pc += 2;
-            }
+            op_skp(vm, reg);
             break;
         case 0xA1:
-            if(vm->keys[key] == 0) {
-                vm->pc += 2;
-            }
+            op_sknp(vm, reg);
             break;
         default:
             UNKNOWN_OP(opcode);
@@ -242,48 +157,34 @@ static void skip(ch8_t *vm, uint16_t opcode)
 
 static void ops_xF(ch8_t *vm, uint16_t opcode)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
+    uint8_t reg = OP_X(opcode);
     switch(opcode & 0xFF) {
         case 0x07:
-            vm->v[reg] = vm->tim_delay;
+            op_ld_vdt(vm, reg);
             break;
         case 0x0A:
-            /*
-             * decrement PC so we'll loop, doing it here
-             * for simplicity. if a key is found then it'll
-             * be incremented to break out of the loop.
-             */
-            vm->pc -= 2;
-            for(uint8_t i = 0; i < VM_KEY_COUNT; ++i) {
-                if(vm->keys[i] != 0) {
-                    vm->v[reg] = i;
-                    vm->pc += 2;
-                    break;
-                }
-            }
+            op_ld_vk(vm, reg);
             break;
         case 0x15:
-            vm->tim_delay = vm->v[reg];
+            op_ld_dtv(vm, reg);
             break;
         case 0x18:
-            vm->tim_sound = vm->v[reg];
+            op_ld_stv(vm, reg);
             break;
         case 0x1E:
-            vm->i += vm->v[reg];
+            op_add_iv(vm, reg);
             break;
         case 0x29:
-            vm->i = vm->v[reg] * VM_FONT_H;
+            op_ld_fv(vm, reg);
             break;
         case 0x33:
-            vm->ram[vm->i] = vm->v[reg] / 100;
-            vm->ram[vm->i + 1] = (vm->v[reg] / 10) % 10;
-            vm->ram[vm->i + 2] = vm->v[reg] % 10;
+            op_ld_bv(vm, reg);
             break;
         case 0x55:
-            memcpy(vm->ram + vm->i, vm->v, reg + 1);
+            op_ld_memv(vm, reg);
             break;
         case 0x65:
-            memcpy(vm->v, vm->ram + vm->i, reg + 1);
+            op_ld_vmem(vm, reg);
             break;
         default:
             UNKNOWN_OP(opcode);
@@ -291,7 +192,7 @@ static void ops_xF(ch8_t *vm, uint16_t opcode)
     }
 }
 
-static void (*ch8_opcode_lut[16])(ch8_t *vm, uint16_t opcode) = {
+static void (*const ch8_opcode_lut[16])(ch8_t *vm, uint16_t opcode) = {
     ops_x0,       // 0x0xxx
     jp,           // 0x1xxx
     call,         // 0x2xxx
@@ -315,3 +216,100 @@ void ch8_exec(ch8_t *vm, uint16_t opcode)
     uint8_t op_index = opcode >> 12;
     (*ch8_opcode_lut[op_index])(vm, opcode);
 }
+
+ch8_form_e ch8_decode(uint16_t opcode)
+{
+    switch(opcode >> 12) {
+        case 0x0:
+            switch((opcode & 0xF0) >> 4) {
+                case 0xE:
+                    switch(opcode & 0x000F) {
+                        case 0x0:
+                            return CH8_OP_CLS;
+                        case 0xE:
+                            return CH8_OP_RET;
+                    }
+                    return CH8_OP_NOP;
+                case 0x0:
+                    return CH8_OP_NOP;
+            }
+            return CH8_OP_INVALID;
+        case 0x1:
+            return CH8_OP_JP;
+        case 0x2:
+            return CH8_OP_CALL;
+        case 0x3:
+            return CH8_OP_SE_VI;
+        case 0x4:
+            return CH8_OP_SNE_VI;
+        case 0x5:
+            return CH8_OP_SE_VV;
+        case 0x6:
+            return CH8_OP_LD_VI;
+        case 0x7:
+            return CH8_OP_ADD_VI;
+        case 0x8:
+            switch(opcode & 0x000F) {
+                case 0x0:
+                    return CH8_OP_LD_VV;
+                case 0x1:
+                    return CH8_OP_OR;
+                case 0x2:
+                    return CH8_OP_AND;
+                case 0x3:
+                    return CH8_OP_XOR;
+                case 0x4:
+                    return CH8_OP_ADD_VV;
+                case 0x5:
+                    return CH8_OP_SUB;
+                case 0x6:
+                    return CH8_OP_SHR;
+                case 0x7:
+                    return CH8_OP_SUBN;
+                case 0xE:
+                    return CH8_OP_SHL;
+            }
+            return CH8_OP_INVALID;
+        case 0x9:
+            return CH8_OP_SNE_VV;
+        case 0xA:
+            return CH8_OP_LD_I;
+        case 0xB:
+            return CH8_OP_JP_V0;
+        case 0xC:
+            return CH8_OP_RND;
+        case 0xD:
+            return CH8_OP_DRW;
+        case 0xE:
+            switch(opcode & 0xFF) {
+                case 0x9E:
+                    return CH8_OP_SKP;
+                case 0xA1:
+                    return CH8_OP_SKNP;
+            }
+            return CH8_OP_INVALID;
+        case 0xF:
+            switch(opcode & 0xFF) {
+                case 0x07:
+                    return CH8_OP_LD_VDT;
+                case 0x0A:
+                    return CH8_OP_LD_VK;
+                case 0x15:
+                    return CH8_OP_LD_DTV;
+                case 0x18:
+                    return CH8_OP_LD_STV;
+                case 0x1E:
+                    return CH8_OP_ADD_IV;
+                case 0x29:
+                    return CH8_OP_LD_FV;
+                case 0x33:
+                    return CH8_OP_LD_BV;
+                case 0x55:
+                    return CH8_OP_LD_MEMV;
+                case 0x65:
+                    return CH8_OP_LD_VMEM;
+            }
+            return CH8_OP_INVALID;
+    }
+    return CH8_OP_INVALID;
+}
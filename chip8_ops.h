@@ -0,0 +1,399 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Instruction semantics shared by all of the execution engines.
+ * Internal to the core, not part of the public API.
+ *
+ * Like ch8_exec, the primitives leave PC pointing at the executed
+ * instruction, the caller is responsible for advancing it by 2.
+ */
+
+#ifndef CHIP8_OPS_H
+#define CHIP8_OPS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "log.h"
+#include "chip8.h"
+
+#define OP_X(opcode)    (((opcode) & 0x0F00) >> 8)
+#define OP_Y(opcode)    (((opcode) & 0x00F0) >> 4)
+#define OP_N(opcode)    ((opcode) & 0x000F)
+#define OP_KK(opcode)   ((opcode) & 0x00FF)
+#define OP_NNN(opcode)  ((opcode) & 0x0FFF)
+
+#define UNKNOWN_OP(opcode) LOG_ERROR("UNKNOWN OPCODE %04X\n", opcode)
+
+#define SETVF vm->v[0xF] = 1
+#define CLRVF vm->v[0xF] = 0
+
+static inline void op_cls(ch8_t *vm)
+{
+    for(uint8_t row = 0; row < VM_SCREEN_HEIGHT; ++row) {
+        if(vm->vram[row] != 0) {
+            vm->vram_dirty |= (uint32_t)1 << row;
+        }
+    }
+    memset(vm->vram, 0, sizeof(vm->vram));
+}
+
+static inline void op_ret(ch8_t *vm)
+{
+    vm->pc = vm->stack[--vm->sp];
+}
+
+static inline void op_jp(ch8_t *vm, uint16_t addr)
+{
+    vm->pc = addr - 2;
+}
+
+static inline void op_call(ch8_t *vm, uint16_t addr)
+{
+    vm->stack[vm->sp++] = vm->pc;
+    vm->pc = addr - 2;
+}
+
+static inline void op_se_vi(ch8_t *vm, uint8_t reg, uint8_t imm)
+{
+    if(vm->v[reg] == imm) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_sne_vi(ch8_t *vm, uint8_t reg, uint8_t imm)
+{
+    if(vm->v[reg] != imm) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_se_vv(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    if(vm->v[rega] == vm->v[regb]) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_ld_vi(ch8_t *vm, uint8_t reg, uint8_t imm)
+{
+    vm->v[reg] = imm;
+}
+
+static inline void op_add_vi(ch8_t *vm, uint8_t reg, uint8_t imm)
+{
+    vm->v[reg] += imm;
+}
+
+static inline void op_ld_vv(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    vm->v[rega] = vm->v[regb];
+}
+
+static inline void op_or(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    vm->v[rega] |= vm->v[regb];
+}
+
+static inline void op_and(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    vm->v[rega] &= vm->v[regb];
+}
+
+static inline void op_xor(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    vm->v[rega] ^= vm->v[regb];
+}
+
+static inline void op_add_vv(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    uint16_t result = vm->v[rega] + vm->v[regb];
+    if(result > 0xFF) {
+        SETVF;
+    } else {
+        CLRVF;
+    }
+    vm->v[rega] = result;
+}
+
+static inline void op_sub(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    if(vm->v[rega] > vm->v[regb]) {
+        SETVF;
+    } else {
+        CLRVF;
+    }
+    vm->v[rega] -= vm->v[regb];
+}
+
+static inline void op_shr(ch8_t *vm, uint8_t rega)
+{
+    if(vm->v[rega] & 1) {
+        SETVF;
+    } else {
+        CLRVF;
+    }
+    vm->v[rega] = vm->v[rega] >> 1;
+}
+
+static inline void op_subn(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    if(vm->v[regb] > vm->v[rega]) {
+        SETVF;
+    } else {
+        CLRVF;
+    }
+    vm->v[rega] = vm->v[regb] - vm->v[rega];
+}
+
+static inline void op_shl(ch8_t *vm, uint8_t rega)
+{
+    if(vm->v[rega] & 0x80) {
+        SETVF;
+    } else {
+        CLRVF;
+    }
+    vm->v[rega] = vm->v[rega] << 1;
+}
+
+static inline void op_sne_vv(ch8_t *vm, uint8_t rega, uint8_t regb)
+{
+    if(vm->v[rega] != vm->v[regb]) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_ld_i(ch8_t *vm, uint16_t addr)
+{
+    vm->i = addr;
+}
+
+static inline void op_jp_v0(ch8_t *vm, uint16_t addr)
+{
+    vm->pc = vm->v[0] + addr - 2;
+}
+
+/*
+ * splitmix64, the state is a plain counter so every seed including 0
+ * gives a full period sequence.
+ */
+static inline uint64_t rng_next(ch8_t *vm)
+{
+    uint64_t z = (vm->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline void op_rnd(ch8_t *vm, uint8_t reg, uint8_t imm)
+{
+    vm->v[reg] = (rng_next(vm) >> 56) & imm;
+}
+
+static inline void op_drw(ch8_t *vm, uint8_t rega, uint8_t regb, uint8_t bval)
+{
+    uint8_t x = vm->v[rega];
+    uint8_t y = vm->v[regb];
+    uint64_t collision = 0;
+    uint32_t dirty = 0;
+
+    for(uint8_t iy = 0; iy < bval; ++iy) {
+        uint64_t sprite = vm->ram[vm->i + iy];
+        /*
+         * pixels are addressed linearly, so a sprite going over the
+         * right edge continues on the next row.
+         */
+        uint16_t pos = ((y + iy) * VM_SCREEN_WIDTH + x) % (VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT);
+        uint8_t row = pos / VM_SCREEN_WIDTH;
+        uint8_t col = pos % VM_SCREEN_WIDTH;
+
+        if(sprite == 0) {
+            continue;
+        }
+
+        if(col <= VM_SCREEN_WIDTH - 8) {
+            uint64_t bits = sprite << (VM_SCREEN_WIDTH - 8 - col);
+            collision |= vm->vram[row] & bits;
+            vm->vram[row] ^= bits;
+            dirty |= (uint32_t)1 << row;
+        } else {
+            uint8_t next = (row + 1) % VM_SCREEN_HEIGHT;
+            uint64_t head = sprite >> (col - (VM_SCREEN_WIDTH - 8));
+            uint64_t tail = sprite << (2 * VM_SCREEN_WIDTH - 8 - col);
+            collision |= (vm->vram[row] & head) | (vm->vram[next] & tail);
+            vm->vram[row] ^= head;
+            vm->vram[next] ^= tail;
+            dirty |= (head ? (uint32_t)1 << row : 0) | (tail ? (uint32_t)1 << next : 0);
+        }
+    }
+
+    vm->v[0xF] = collision != 0;
+    vm->vram_dirty |= dirty;
+}
+
+/* only the low nibble selects a key, like on the COSMAC VIP */
+static inline void op_skp(ch8_t *vm, uint8_t reg)
+{
+    if(vm->keys[vm->v[reg] & 0xF]) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_sknp(ch8_t *vm, uint8_t reg)
+{
+    if(vm->keys[vm->v[reg] & 0xF] == 0) {
+        vm->pc += 2;
+    }
+}
+
+static inline void op_ld_vdt(ch8_t *vm, uint8_t reg)
+{
+    vm->v[reg] = vm->tim_delay;
+}
+
+static inline void op_ld_vk(ch8_t *vm, uint8_t reg)
+{
+    /*
+     * decrement PC so we'll loop, doing it here
+     * for simplicity. if a key is found then it'll
+     * be incremented to break out of the loop.
+     */
+    vm->pc -= 2;
+    for(uint8_t i = 0; i < VM_KEY_COUNT; ++i) {
+        if(vm->keys[i] != 0) {
+            vm->v[reg] = i;
+            vm->pc += 2;
+            break;
+        }
+    }
+}
+
+static inline void op_ld_dtv(ch8_t *vm, uint8_t reg)
+{
+    vm->tim_delay = vm->v[reg];
+}
+
+static inline void op_ld_stv(ch8_t *vm, uint8_t reg)
+{
+    vm->tim_sound = vm->v[reg];
+}
+
+static inline void op_add_iv(ch8_t *vm, uint8_t reg)
+{
+    vm->i += vm->v[reg];
+}
+
+static inline void op_ld_fv(ch8_t *vm, uint8_t reg)
+{
+    vm->i = vm->v[reg] * VM_FONT_H;
+}
+
+static inline void op_ld_bv(ch8_t *vm, uint8_t reg)
+{
+    vm->ram[vm->i] = vm->v[reg] / 100;
+    vm->ram[vm->i + 1] = (vm->v[reg] / 10) % 10;
+    vm->ram[vm->i + 2] = vm->v[reg] % 10;
+    ch8_invalidate(vm, vm->i, 3);
+}
+
+static inline void op_ld_memv(ch8_t *vm, uint8_t reg)
+{
+    memcpy(vm->ram + vm->i, vm->v, reg + 1);
+    ch8_invalidate(vm, vm->i, reg + 1);
+}
+
+static inline void op_ld_vmem(ch8_t *vm, uint8_t reg)
+{
+    memcpy(vm->v, vm->ram + vm->i, reg + 1);
+}
+
+/*
+ * Idle loop detector, lives for one ch8_run call. Timers and keys can't
+ * change during a call, so a loop that reaches its backward jump twice
+ * with the same registers and without anything but register writes in
+ * between will keep doing so until the call returns.
+ */
+typedef struct {
+    uint16_t pc;        // address of the last backward jump taken
+    uint64_t at;        // instruction count when it was taken
+    uint64_t impure;    // instruction count of the last impure instruction
+    uint8_t v[16];
+    uint16_t i;
+    uint8_t sp;
+} idle_t;
+
+#define IDLE_INIT { 0xFFFF, 0, 0, { 0 }, 0, 0 }
+
+/*
+ * Instructions writing state other than V, I and PC. CLS, DRW and
+ * waiting key reads end the run anyway.
+ */
+static inline bool idle_impure(ch8_form_e form)
+{
+    switch(form) {
+        case CH8_OP_CLS:
+        case CH8_OP_RET:
+        case CH8_OP_CALL:
+        case CH8_OP_RND:
+        case CH8_OP_DRW:
+        case CH8_OP_LD_VK:
+        case CH8_OP_LD_DTV:
+        case CH8_OP_LD_STV:
+        case CH8_OP_LD_BV:
+        case CH8_OP_LD_MEMV:
+        case CH8_OP_INVALID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Call after taking a backward jump.
+ *
+ * Params:
+ *  jp      - address of the jump,
+ *  now     - instruction count including the jump,
+ *  left    - instructions left in the budget.
+ *
+ * Returns
+ *  amount of instructions that can be skipped, a whole number of loop
+ *  iterations.
+ */
+static inline uint32_t idle_jump(const ch8_t *vm, idle_t *d, uint16_t jp, uint64_t now,
+                                 uint32_t left)
+{
+    if(d->pc == jp && d->impure < d->at && d->i == vm->i && d->sp == vm->sp &&
+       memcmp(d->v, vm->v, sizeof(d->v)) == 0) {
+        uint64_t len = now - d->at;
+        uint32_t skip = left / len * len;
+        d->at = now + skip;
+        return skip;
+    }
+
+    d->pc = jp;
+    d->at = now;
+    memcpy(d->v, vm->v, sizeof(d->v));
+    d->i = vm->i;
+    d->sp = vm->sp;
+    return 0;
+}
+
+#endif // CHIP8_OPS_H
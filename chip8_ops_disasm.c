@@ -16,233 +16,309 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <stdio.h>
+/*
+ * Table driven disassembler. Every opcode maps to a mnemonic template
+ * through the first nibble and, for the groups that need it, a second
+ * table on the low bits. Templates hold placeholder bytes for the
+ * operands, which are expanded by hand as hex or decimal digits.
+ */
+
 #include <stdint.h>
-#include "log.h"
+#include <stddef.h>
+#include "chip8.h"
+
+/* template placeholders, as string pieces and as characters */
+#define T_X     "\x01"  // Vx register, one hex digit
+#define T_Y     "\x02"  // Vy register, one hex digit
+#define T_KK    "\x03"  // byte immediate, decimal
+#define T_N     "\x04"  // nibble immediate, decimal
+#define T_NNN   "\x05"  // address, four hex digits
+
+#define P_X     '\x01'
+#define P_Y     '\x02'
+#define P_KK    '\x03'
+#define P_N     '\x04'
+#define P_NNN   '\x05'
+
+typedef enum {
+    D_UNKNOWN,
+    D_NOP, D_CLS, D_RET, D_JP, D_CALL, D_SE_VI, D_SNE_VI, D_SE_VV, D_LD_VI, D_ADD_VI,
+    D_LD_VV, D_OR, D_AND, D_XOR, D_ADD_VV, D_SUB, D_SHR, D_SUBN, D_SHL, D_SNE_VV,
+    D_LD_I, D_JP_V0, D_RND, D_DRW, D_SKP, D_SKNP, D_LD_VDT, D_LD_VK, D_LD_DTV, D_LD_STV,
+    D_ADD_IV, D_LD_FV, D_LD_BV, D_LD_IV, D_LD_VI_MEM,
+    D_COUNT
+} dis_e;
+
+static const char *const templates[D_COUNT] = {
+    [D_UNKNOWN]     = "UNKNOWN",
+    [D_NOP]         = "NOP",
+    [D_CLS]         = "CLS",
+    [D_RET]         = "RET",
+    [D_JP]          = "JP 0x" T_NNN,
+    [D_CALL]        = "CALL 0x" T_NNN,
+    [D_SE_VI]       = "SE V" T_X ", " T_KK,
+    [D_SNE_VI]      = "SNE V" T_X ", " T_KK,
+    [D_SE_VV]       = "SE V" T_X ", V" T_Y,
+    [D_LD_VI]       = "LD V" T_X ", " T_KK,
+    [D_ADD_VI]      = "ADD V" T_X ", " T_KK,
+    [D_LD_VV]       = "LD V" T_X ", V" T_Y,
+    [D_OR]          = "OR V" T_X ", V" T_Y,
+    [D_AND]         = "AND V" T_X ", V" T_Y,
+    [D_XOR]         = "XOR V" T_X ", V" T_Y,
+    [D_ADD_VV]      = "ADD V" T_X ", V" T_Y,
+    [D_SUB]         = "SUB V" T_X ", V" T_Y,
+    [D_SHR]         = "SHR V" T_X ", V" T_Y,
+    [D_SUBN]        = "SUBN V" T_X ", V" T_Y,
+    [D_SHL]         = "SHL V" T_X ", V" T_Y,
+    [D_SNE_VV]      = "SNE V" T_X ", V" T_Y,
+    [D_LD_I]        = "LD I, 0x" T_NNN,
+    [D_JP_V0]       = "JP V0, " T_NNN,
+    [D_RND]         = "RND V" T_X ", " T_KK,
+    [D_DRW]         = "DRW V" T_X ", V" T_Y ", " T_N,
+    [D_SKP]         = "SKP V" T_X,
+    [D_SKNP]        = "SKNP V" T_X,
+    [D_LD_VDT]      = "LD V" T_X ", DT",
+    [D_LD_VK]       = "LD V" T_X ", K",
+    [D_LD_DTV]      = "LD DT, V" T_X,
+    [D_LD_STV]      = "LD ST, V" T_X,
+    [D_ADD_IV]      = "ADD I, V" T_X,
+    [D_LD_FV]       = "LD F, V" T_X,
+    [D_LD_BV]       = "LD B, V" T_X,
+    [D_LD_IV]       = "LD [I], V" T_X,
+    [D_LD_VI_MEM]   = "LD V" T_X ", [I]"
+};
 
-#define DISASM_BUF_SZ 32
+/* 0 marks a group decoded through the second level tables */
+static const uint8_t ops_hi[16] = {
+    0, D_JP, D_CALL, D_SE_VI, D_SNE_VI, D_SE_VV, D_LD_VI, D_ADD_VI,
+    0, D_SNE_VV, D_LD_I, D_JP_V0, D_RND, D_DRW, 0, 0
+};
 
-#define SETTXT(...)         snprintf(g_disasm_buf, DISASM_BUF_SZ, __VA_ARGS__)
-#define UNKNOWN_OP(opcode)  SETTXT("UNKNOWN"); LOG_ERROR("UNKNOWN OPCODE %04X", opcode)
+/* 0x0xxx by the low byte */
+static const uint8_t ops_x0[256] = {
+    [0x00] = D_NOP, [0x01] = D_NOP, [0x02] = D_NOP, [0x03] = D_NOP,
+    [0x04] = D_NOP, [0x05] = D_NOP, [0x06] = D_NOP, [0x07] = D_NOP,
+    [0x08] = D_NOP, [0x09] = D_NOP, [0x0A] = D_NOP, [0x0B] = D_NOP,
+    [0x0C] = D_NOP, [0x0D] = D_NOP, [0x0E] = D_NOP, [0x0F] = D_NOP,
+    [0xE0] = D_CLS, [0xEE] = D_RET
+};
 
-static char g_disasm_buf[DISASM_BUF_SZ];
+/* 0x8xxx by the low nibble */
+static const uint8_t ops_x8[16] = {
+    D_LD_VV, D_OR, D_AND, D_XOR, D_ADD_VV, D_SUB, D_SHR, D_SUBN,
+    D_UNKNOWN, D_UNKNOWN, D_UNKNOWN, D_UNKNOWN, D_UNKNOWN, D_UNKNOWN, D_SHL, D_UNKNOWN
+};
 
-static void ops_x0(uint16_t opcode)
+/* 0xExxx by the low byte */
+static const uint8_t ops_xE[256] = {
+    [0x9E] = D_SKP, [0xA1] = D_SKNP
+};
+
+/* 0xFxxx by the low byte */
+static const uint8_t ops_xF[256] = {
+    [0x07] = D_LD_VDT, [0x0A] = D_LD_VK, [0x15] = D_LD_DTV, [0x18] = D_LD_STV,
+    [0x1E] = D_ADD_IV, [0x29] = D_LD_FV, [0x33] = D_LD_BV, [0x55] = D_LD_IV,
+    [0x65] = D_LD_VI_MEM
+};
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+static inline uint8_t dis_lookup(uint16_t opcode)
 {
-    switch((opcode & 0xF0) >> 4) {
-        case 0xE:
-            switch(opcode & 0x000F) {
-                case 0x0:
-                    SETTXT("CLS");
-                    break;
-                case 0xE:
-                    SETTXT("RET");
-                    break;
-            }
-            break;
+    switch(opcode >> 12) {
         case 0x0:
-            SETTXT("NOP");
-            break;
+            return ops_x0[opcode & 0xFF];
+        case 0x8:
+            return ops_x8[opcode & 0xF];
+        case 0xE:
+            return ops_xE[opcode & 0xFF];
+        case 0xF:
+            return ops_xF[opcode & 0xFF];
         default:
-            UNKNOWN_OP(opcode);
-            break;
+            return ops_hi[opcode >> 12];
     }
 }
 
-static void jp(uint16_t opcode)
+/* write n as decimal, returns the amount of digits */
+static inline size_t put_dec(char *out, uint8_t n)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    SETTXT("JP 0x%04X", addr);
+    if(n >= 100) {
+        out[0] = '0' + n / 100;
+        out[1] = '0' + n / 10 % 10;
+        out[2] = '0' + n % 10;
+        return 3;
+    }
+    if(n >= 10) {
+        out[0] = '0' + n / 10;
+        out[1] = '0' + n % 10;
+        return 2;
+    }
+    out[0] = '0' + n;
+    return 1;
 }
 
-static void call(uint16_t opcode)
+static inline size_t put_hex4(char *out, uint16_t n)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    SETTXT("CALL 0x%04X", addr);
+    out[0] = hex_digits[(n >> 12) & 0xF];
+    out[1] = hex_digits[(n >> 8) & 0xF];
+    out[2] = hex_digits[(n >> 4) & 0xF];
+    out[3] = hex_digits[n & 0xF];
+    return 4;
 }
 
-static void se_vi(uint16_t opcode)
+/*
+ * Expand the template of opcode into out, which has room for at least
+ * CH8_DISASM_MAX characters. Not zero terminated.
+ */
+static inline size_t dis_expand(uint16_t opcode, char *out)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    SETTXT("SE V%X, %u", reg, imm);
-}
+    const char *t = templates[dis_lookup(opcode)];
+    size_t len = 0;
 
-static void sne_vi(uint16_t opcode)
-{
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    SETTXT("SNE V%X, %u", reg, imm);
-}
+    for(; *t != '\0'; ++t) {
+        if(*t > P_NNN) {
+            out[len++] = *t;
+            continue;
+        }
+        switch(*t) {
+            case P_X:
+                out[len++] = hex_digits[(opcode >> 8) & 0xF];
+                break;
+            case P_Y:
+                out[len++] = hex_digits[(opcode >> 4) & 0xF];
+                break;
+            case P_KK:
+                len += put_dec(out + len, opcode & 0xFF);
+                break;
+            case P_N:
+                len += put_dec(out + len, opcode & 0xF);
+                break;
+            case P_NNN:
+                len += put_hex4(out + len, opcode & 0xFFF);
+                break;
+        }
+    }
 
-static void se_vv(uint16_t opcode)
-{
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    SETTXT("SE V%X, V%X", rega, regb);
+    return len;
 }
 
-static void ld_vi(uint16_t opcode)
+size_t ch8_disassemble_r(uint16_t opcode, char *buf, size_t len)
 {
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    SETTXT("LD V%X, %u", reg, imm);
-}
+    char tmp[CH8_DISASM_MAX];
 
-static void add(uint16_t opcode)
-{
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    SETTXT("ADD V%X, %u", reg, imm);
-}
+    if(len == 0) {
+        return 0;
+    }
+    if(len >= CH8_DISASM_MAX) {
+        size_t n = dis_expand(opcode, buf);
+        buf[n] = '\0';
+        return n;
+    }
 
-static void ops_x8(uint16_t opcode)
-{
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    switch(opcode & 0x000F) {
-        case 0:
-            SETTXT("LD V%X, V%X", rega, regb);
-            break;
-        case 1:
-            SETTXT("OR V%X, V%X", rega, regb);
-            break;
-        case 2:
-            SETTXT("AND V%X, V%X", rega, regb);
-            break;
-        case 3:
-            SETTXT("XOR V%X, V%X", rega, regb);
-            break;
-        case 4:
-            SETTXT("ADD V%X, V%X", rega, regb);
-            break;
-        case 5:
-            SETTXT("SUB V%X, V%X", rega, regb);
-            break;
-        case 6:
-            SETTXT("SHR V%X, V%X", rega, regb);
-            break;
-        case 7:
-            SETTXT("SUBN V%X, V%X", rega, regb);
-            break;
-        case 0xE:
-            SETTXT("SHL V%X, V%X", rega, regb);
-            break;
-        default:
-            UNKNOWN_OP(opcode);
-            break;
+    /* too small for the longest mnemonic, cut it short */
+    size_t n = dis_expand(opcode, tmp);
+    if(n > len - 1) {
+        n = len - 1;
     }
-}
+    for(size_t i = 0; i < n; ++i) {
+        buf[i] = tmp[i];
+    }
+    buf[n] = '\0';
 
-static void sne_vv(uint16_t opcode)
-{
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    SETTXT("SNE V%X, V%X", rega, regb);
+    return n;
 }
 
-static void ld_i(uint16_t opcode)
+const char *ch8_disassemble(uint16_t opcode, char *buf)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    SETTXT("LD I, 0x%04X", addr);
+    ch8_disassemble_r(opcode, buf, CH8_DISASM_MAX);
+    return buf;
 }
 
-static void jp_v(uint16_t opcode)
+size_t ch8_disassemble_block(const uint8_t *code, size_t code_sz, uint16_t addr,
+                             unsigned flags, char *out, size_t out_sz, size_t *consumed)
 {
-    uint16_t addr = opcode & 0x0FFF;
-    SETTXT("JP V0, %04X", addr);
-}
+    size_t ofs = 0, len = 0;
 
-static void rnd(uint16_t opcode)
-{
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    uint8_t imm = opcode & 0x00FF;
-    SETTXT("RND V%X, %u", reg, imm);
-}
+    while(ofs + 2 <= code_sz && out_sz - len >= CH8_DISASM_LINE_MAX) {
+        uint16_t opcode = (code[ofs] << 8) | code[ofs + 1];
+        char *line = out + len;
+        size_t n = 0;
 
-static void drw(uint16_t opcode)
-{
-    uint8_t rega = (opcode & 0x0F00) >> 8;
-    uint8_t regb = (opcode & 0x00F0) >> 4;
-    uint8_t bytes = (opcode & 0x000F);
-    SETTXT("DRW V%X, V%X, %u", rega, regb, bytes);
-}
+        if(flags & CH8_DISASM_ADDR) {
+            n += put_hex4(line, addr);
+            line[n++] = ':';
+            for(int i = 0; i < 4; ++i) {
+                line[n++] = ' ';
+            }
+        }
+        if(flags & CH8_DISASM_BYTES) {
+            line[n++] = hex_digits[code[ofs] >> 4];
+            line[n++] = hex_digits[code[ofs] & 0xF];
+            line[n++] = ' ';
+            line[n++] = hex_digits[code[ofs + 1] >> 4];
+            line[n++] = hex_digits[code[ofs + 1] & 0xF];
+            for(int i = 0; i < 4; ++i) {
+                line[n++] = ' ';
+            }
+        }
+        n += dis_expand(opcode, line + n);
+        line[n++] = '\n';
 
-static void skip(uint16_t opcode)
-{
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    switch(opcode & 0xFF) {
-        case 0x9E:
-            SETTXT("SKP V%X", reg);
-            break;
-        case 0xA1:
-            SETTXT("SKNP V%X", reg);
-            break;
-        default:
-            UNKNOWN_OP(opcode);
-            break;
+        len += n;
+        ofs += 2;
+        addr += 2;
     }
-}
 
-static void ops_xF(uint16_t opcode)
-{
-    uint8_t reg = (opcode & 0x0F00) >> 8;
-    switch(opcode & 0xFF) {
-        case 0x07:
-            SETTXT("LD V%X, DT", reg);
-            break;
-        case 0x0A:
-            SETTXT("LD V%X, K", reg);
-            break;
-        case 0x15:
-            SETTXT("LD DT, V%X", reg);
-            break;
-        case 0x18:
-            SETTXT("LD ST, V%X", reg);
-            break;
-        case 0x1E:
-            SETTXT("ADD I, V%X", reg);
-            break;
-        case 0x29:
-            SETTXT("LD F, V%X", reg);
-            break;
-        case 0x33:
-            SETTXT("LD B, V%X", reg);
-            break;
-        case 0x55:
-            SETTXT("LD [I], V%X", reg);
-            break;
-        case 0x65:
-            SETTXT("LD V%X, [I]", reg);
-            break;
-        default:
-            UNKNOWN_OP(opcode);
-            break;
+    if(consumed != NULL) {
+        *consumed = ofs;
     }
+
+    return len;
 }
 
-static void (*ch8_opcode_lut[16])(uint16_t opcode) = {
-    ops_x0,       // 0x0xxx
-    jp,           // 0x1xxx
-    call,         // 0x2xxx
-    se_vi,        // 0x3xxx
-    sne_vi,       // 0x4xxx
-    se_vv,        // 0x5xxx
-    ld_vi,        // 0x6xxx
-    add,          // 0x7xxx
-    ops_x8,       // 0x8xxx
-    sne_vv,       // 0x9xxx
-    ld_i,         // 0xAxxx
-    jp_v,         // 0xBxxx
-    rnd,          // 0xCxxx
-    drw,          // 0xDxxx
-    skip,         // 0xExxx
-    ops_xF        // 0xFxxx
+static const char *const form_names[CH8_OP_COUNT] = {
+    [CH8_OP_INVALID] = "unknown",
+    [CH8_OP_NOP] = "0nnn NOP",
+    [CH8_OP_CLS] = "00E0 CLS",
+    [CH8_OP_RET] = "00EE RET",
+    [CH8_OP_JP] = "1nnn JP",
+    [CH8_OP_CALL] = "2nnn CALL",
+    [CH8_OP_SE_VI] = "3xkk SE",
+    [CH8_OP_SNE_VI] = "4xkk SNE",
+    [CH8_OP_SE_VV] = "5xy0 SE",
+    [CH8_OP_LD_VI] = "6xkk LD",
+    [CH8_OP_ADD_VI] = "7xkk ADD",
+    [CH8_OP_LD_VV] = "8xy0 LD",
+    [CH8_OP_OR] = "8xy1 OR",
+    [CH8_OP_AND] = "8xy2 AND",
+    [CH8_OP_XOR] = "8xy3 XOR",
+    [CH8_OP_ADD_VV] = "8xy4 ADD",
+    [CH8_OP_SUB] = "8xy5 SUB",
+    [CH8_OP_SHR] = "8xy6 SHR",
+    [CH8_OP_SUBN] = "8xy7 SUBN",
+    [CH8_OP_SHL] = "8xyE SHL",
+    [CH8_OP_SNE_VV] = "9xy0 SNE",
+    [CH8_OP_LD_I] = "Annn LD I",
+    [CH8_OP_JP_V0] = "Bnnn JP V0",
+    [CH8_OP_RND] = "Cxkk RND",
+    [CH8_OP_DRW] = "Dxyn DRW",
+    [CH8_OP_SKP] = "Ex9E SKP",
+    [CH8_OP_SKNP] = "ExA1 SKNP",
+    [CH8_OP_LD_VDT] = "Fx07 LD DT",
+    [CH8_OP_LD_VK] = "Fx0A LD K",
+    [CH8_OP_LD_DTV] = "Fx15 LD DT",
+    [CH8_OP_LD_STV] = "Fx18 LD ST",
+    [CH8_OP_ADD_IV] = "Fx1E ADD I",
+    [CH8_OP_LD_FV] = "Fx29 LD F",
+    [CH8_OP_LD_BV] = "Fx33 LD B",
+    [CH8_OP_LD_MEMV] = "Fx55 LD [I]",
+    [CH8_OP_LD_VMEM] = "Fx65 LD [I]"
 };
 
-const char *ch8_disassemble(uint16_t opcode)
+const char *ch8_form_name(ch8_form_e form)
 {
-    uint8_t op_index = opcode >> 12;
-    (*ch8_opcode_lut[op_index])(opcode);
-    return g_disasm_buf;
+    if(form >= CH8_OP_COUNT) {
+        return form_names[CH8_OP_INVALID];
+    }
+    return form_names[form];
 }
@@ -0,0 +1,167 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame pacing on absolute CLOCK_MONOTONIC deadlines with
+ * clock_nanosleep, relative sleeps would drift by the time spent
+ * running each frame.
+ *
+ * When the host falls behind, up to PACER_MAX_CATCHUP frames are run
+ * back to back so the timers stay at 60 Hz on average. Falling further
+ * behind than that, after a suspend or under a debugger, drops the
+ * missed frames and starts the schedule over from the current time
+ * instead of running fast for seconds.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_pacer.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // clock_nanosleep()
+
+#include "log.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void pacer_init(pacer_t *p, uint32_t hz, uint32_t ips)
+{
+    assert(p != NULL);
+    assert(hz > 0);
+
+    memset(p, 0, sizeof(*p));
+    p->hz = hz;
+    p->ips = ips;
+    p->period_ns = NS_PER_SEC / hz;
+    p->deadline = now_ns();
+    p->interval_min = UINT64_MAX;
+}
+
+uint32_t pacer_cycles(pacer_t *p)
+{
+    p->carry += p->ips % p->hz;
+    uint32_t cycles = p->ips / p->hz;
+    if(p->carry >= p->hz) {
+        p->carry -= p->hz;
+        cycles += 1;
+    }
+
+    return cycles;
+}
+
+uint32_t pacer_due(pacer_t *p, uint64_t now)
+{
+    if(now < p->deadline) {
+        return 0;
+    }
+
+    uint64_t behind = now - p->deadline;
+    uint32_t due = 1;
+    if(behind >= p->period_ns) {
+        /* past the deadline of the frame after as well */
+        p->late += 1;
+        uint64_t missed = behind / p->period_ns;
+        if(missed >= PACER_MAX_CATCHUP) {
+            p->dropped += missed - (PACER_MAX_CATCHUP - 1);
+            p->deadline = now;
+            missed = PACER_MAX_CATCHUP - 1;
+        } else {
+            p->deadline += missed * p->period_ns;
+        }
+        p->caught_up += missed;
+        due += missed;
+    }
+    p->deadline += p->period_ns;
+    p->frames += due;
+
+    if(p->last_start != 0) {
+        uint64_t interval = now - p->last_start;
+        p->intervals += 1;
+        p->interval_sum += interval;
+        p->jitter_sum += interval > p->period_ns ? interval - p->period_ns
+                                                 : p->period_ns - interval;
+        if(interval < p->interval_min) {
+            p->interval_min = interval;
+        }
+        if(interval > p->interval_max) {
+            p->interval_max = interval;
+        }
+    }
+    p->last_start = now;
+
+    return due;
+}
+
+uint32_t pacer_wait(pacer_t *p)
+{
+    uint32_t due;
+    uint64_t now = now_ns();
+
+    while((due = pacer_due(p, now)) == 0) {
+        struct timespec ts = {
+            .tv_sec = p->deadline / NS_PER_SEC,
+            .tv_nsec = p->deadline % NS_PER_SEC
+        };
+        uint64_t deadline = p->deadline;
+        int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        now = now_ns();
+        if(err != 0 && err != EINTR) {
+            /* can't sleep, don't spin either */
+            LOG_ERROR("clock_nanosleep failed: %d\n", err);
+            now = deadline;
+        } else if(now >= deadline) {
+            uint64_t lag = now - deadline;
+            p->waits += 1;
+            p->lag_sum += lag;
+            if(lag > p->lag_max) {
+                p->lag_max = lag;
+            }
+        }
+    }
+
+    return due;
+}
+
+void pacer_report(const pacer_t *p)
+{
+    if(p->intervals == 0) {
+        return;
+    }
+
+    double mean = (double)p->interval_sum / p->intervals;
+    double jitter = (double)p->jitter_sum / p->intervals;
+
+    LOG("Pacer: %llu frames at %u Hz, %u instructions/s\n", (unsigned long long)p->frames,
+        p->hz, p->ips);
+    LOG("Pacer: frame time %.3f ms mean, %.3f..%.3f ms, %.3f ms jitter\n",
+        mean / 1e6, p->interval_min / 1e6, p->interval_max / 1e6, jitter / 1e6);
+    LOG("Pacer: wakeup %.1f us late on average, %.1f us at most\n",
+        p->waits > 0 ? p->lag_sum / 1e3 / p->waits : 0.0, p->lag_max / 1e3);
+    LOG("Pacer: fell behind %llu times, %llu frames caught up, %llu dropped\n",
+        (unsigned long long)p->late, (unsigned long long)p->caught_up,
+        (unsigned long long)p->dropped);
+}
@@ -0,0 +1,101 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_PACER_H
+#define CHIP8_PACER_H
+
+#include <stdint.h>
+
+/* frames run back to back to catch up before the schedule is reset */
+#define PACER_MAX_CATCHUP 4
+
+/*
+ * Fixed step frame scheduler. Frames start on absolute deadlines one
+ * period apart, so time spent in a frame and sleeping late don't add up
+ * over a run, and the instructions per second are spread over the frames
+ * with the remainder carried, so the rate is exact over a second even
+ * when it isn't a multiple of the frame rate.
+ */
+typedef struct {
+    uint64_t period_ns;
+    /* start of the next frame, CLOCK_MONOTONIC */
+    uint64_t deadline;
+    uint32_t ips;
+    uint32_t hz;
+    /* instructions owed to the next frames, in 1/hz units */
+    uint32_t carry;
+    /* Statistics */
+    uint64_t frames;
+    uint64_t caught_up;
+    uint64_t dropped;
+    uint64_t late;
+    /* wakeups from sleep and how far past the deadline they were */
+    uint64_t waits;
+    uint64_t lag_sum;
+    uint64_t lag_max;
+    /* time between frame starts and how far it was off the period */
+    uint64_t last_start;
+    uint64_t intervals;
+    uint64_t interval_sum;
+    uint64_t interval_min;
+    uint64_t interval_max;
+    uint64_t jitter_sum;
+} pacer_t;
+
+/*
+ * Start a schedule with the first frame due now.
+ *
+ * Params:
+ *  hz      - frames per second,
+ *  ips     - instructions per second.
+ */
+void pacer_init(pacer_t *p, uint32_t hz, uint32_t ips);
+
+/*
+ * Instructions to execute in the next frame.
+ */
+uint32_t pacer_cycles(pacer_t *p);
+
+/*
+ * Sleep until the next frame is due.
+ *
+ * Returns
+ *  number of frames due, more than 1 if the host fell behind and frames
+ *  have to be run back to back to catch up.
+ */
+uint32_t pacer_wait(pacer_t *p);
+
+/*
+ * Account the frames due at a point in time, what pacer_wait does after
+ * waking up.
+ *
+ * Params:
+ *  now     - CLOCK_MONOTONIC time in nanoseconds.
+ *
+ * Returns
+ *  number of frames due, 0 if the next frame isn't due yet.
+ */
+uint32_t pacer_due(pacer_t *p, uint64_t now);
+
+/*
+ * Log the frame time statistics. Jitter is the mean difference between
+ * the time from one frame start to the next and the period.
+ */
+void pacer_report(const pacer_t *p);
+
+#endif // CHIP8_PACER_H
@@ -0,0 +1,202 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Execution profiler. The VM is run in spans between sample points and
+ * at each point the instruction about to execute is counted by address
+ * and by form, and the call stack by the subroutines it went through.
+ * With an interval of CH8_PROFILE_EXACT every instruction is a sample,
+ * longer intervals give the same picture at a fraction of the cost.
+ *
+ * The engines are left alone, profiling only changes how often the
+ * caller comes back from ch8_run.
+ */
+
+#include "chip8.h"
+#include <assert.h>
+#include <string.h>
+
+/* keep the stack table at most this full, probes get long after it */
+#define STACKS_LOAD (CH8_PROFILE_STACKS * 3 / 4)
+
+void ch8_profile_init(ch8_profile_t *prof, const ch8_t *vm, uint32_t interval)
+{
+    assert(prof != NULL);
+    assert(vm != NULL);
+
+    memset(prof, 0, sizeof(*prof));
+    prof->interval = interval ? interval : CH8_PROFILE_EXACT;
+    prof->next = vm->cycles;
+}
+
+/* stack[k] is the address of the CALL, its operand is the subroutine */
+static inline uint16_t stack_frame(const ch8_t *vm, uint8_t k)
+{
+    uint16_t addr = vm->stack[k];
+    if(addr + 1 >= VM_RAM_SIZE) {
+        return 0;
+    }
+    return ((vm->ram[addr] & 0xF) << 8) | vm->ram[addr + 1];
+}
+
+static void sample_stack(ch8_profile_t *prof, const ch8_t *vm, uint64_t weight)
+{
+    uint16_t frames[VM_STACK_SIZE];
+    uint8_t depth = vm->sp < VM_STACK_SIZE ? vm->sp : VM_STACK_SIZE;
+
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for(uint8_t k = 0; k < depth; ++k) {
+        frames[k] = stack_frame(vm, k);
+        hash = (hash ^ frames[k]) * 16777619u;
+    }
+
+    uint32_t slot = hash % CH8_PROFILE_STACKS;
+    for(;;) {
+        ch8_profile_stack_t *s = &prof->stacks[slot];
+        if(s->count == 0) {
+            break;
+        }
+        if(s->hash == hash && s->depth == depth &&
+           memcmp(s->frames, frames, depth * sizeof(frames[0])) == 0) {
+            s->count += weight;
+            return;
+        }
+        slot = (slot + 1) % CH8_PROFILE_STACKS;
+    }
+
+    if(prof->stack_count >= STACKS_LOAD) {
+        prof->stacks_lost += weight;
+        return;
+    }
+
+    ch8_profile_stack_t *s = &prof->stacks[slot];
+    s->count = weight;
+    s->hash = hash;
+    s->depth = depth;
+    memcpy(s->frames, frames, depth * sizeof(frames[0]));
+    prof->stack_count += 1;
+}
+
+void ch8_profile_sample(ch8_profile_t *prof, const ch8_t *vm)
+{
+    assert(prof != NULL);
+    assert(vm != NULL);
+
+    if(vm->cycles < prof->next) {
+        return;
+    }
+
+    uint64_t weight = (vm->cycles - prof->next) / prof->interval + 1;
+    prof->next += weight * prof->interval;
+    prof->samples += weight;
+
+    uint16_t pc = vm->pc;
+    if(pc + 1 < VM_RAM_SIZE) {
+        prof->hits[pc] += weight;
+        prof->forms[ch8_decode((vm->ram[pc] << 8) | vm->ram[pc + 1])] += weight;
+    } else {
+        prof->forms[CH8_OP_INVALID] += weight;
+    }
+
+    sample_stack(prof, vm, weight);
+}
+
+uint32_t ch8_profile_span(const ch8_profile_t *prof, const ch8_t *vm, uint32_t cycles)
+{
+    assert(prof != NULL);
+    assert(vm != NULL);
+
+    if(prof->next <= vm->cycles) {
+        return cycles ? 1 : 0;
+    }
+    if(prof->next - vm->cycles < cycles) {
+        return prof->next - vm->cycles;
+    }
+    return cycles;
+}
+
+ch8_exit_e ch8_profile_run(ch8_profile_t *prof, ch8_t *vm, uint32_t cycles)
+{
+    assert(prof != NULL);
+    assert(vm != NULL);
+
+    uint64_t end = vm->cycles + cycles;
+    ch8_exit_e ret = CH8_EXIT_CYCLES;
+
+    while(vm->cycles < end) {
+        ch8_profile_sample(prof, vm);
+        ret = ch8_run(vm, ch8_profile_span(prof, vm, end - vm->cycles));
+        if(ret != CH8_EXIT_CYCLES) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+uint32_t ch8_profile_hot(const ch8_profile_t *prof, uint16_t *addrs, uint32_t max)
+{
+    assert(prof != NULL);
+    assert(addrs != NULL || max == 0);
+
+    uint32_t count = 0;
+
+    /* insertion into the sorted output, max is a screenful at most */
+    for(uint32_t addr = 0; addr < VM_RAM_SIZE; ++addr) {
+        uint64_t hits = prof->hits[addr];
+        if(hits == 0) {
+            continue;
+        }
+        if(count == max && (max == 0 || prof->hits[addrs[max - 1]] >= hits)) {
+            continue;
+        }
+
+        uint32_t k = count < max ? count++ : max - 1;
+        while(k > 0 && prof->hits[addrs[k - 1]] < hits) {
+            addrs[k] = addrs[k - 1];
+            k -= 1;
+        }
+        addrs[k] = addr;
+    }
+
+    return count;
+}
+
+int ch8_profile_write_collapsed(const ch8_profile_t *prof, FILE *f)
+{
+    assert(prof != NULL);
+    assert(f != NULL);
+
+    for(uint32_t slot = 0; slot < CH8_PROFILE_STACKS; ++slot) {
+        const ch8_profile_stack_t *s = &prof->stacks[slot];
+        if(s->count == 0) {
+            continue;
+        }
+        fputs("start", f);
+        for(uint8_t k = 0; k < s->depth; ++k) {
+            fprintf(f, ";sub_%03X", s->frames[k]);
+        }
+        fprintf(f, " %llu\n", (unsigned long long)s->count);
+    }
+    if(prof->stacks_lost) {
+        fprintf(f, "start;[lost] %llu\n", (unsigned long long)prof->stacks_lost);
+    }
+
+    return ferror(f) ? -1 : 0;
+}
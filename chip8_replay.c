@@ -0,0 +1,430 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Input logs make a session reproducible from nothing but the ROM. Key
+ * changes and timer ticks are the only things that feed into the VM from
+ * outside, so they are stamped with the instruction count instead of the
+ * wall clock and a replay runs as fast as the engines allow.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_replay.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>       // clock_gettime()
+
+#include "chip8.h"
+#include "log.h"
+
+#define INPUT_LOG_VERSION 1
+#define INPUT_LINE_MAX 128
+
+static double time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+typedef struct {
+    ch8_t vm;
+    ch8_dcache_t dcache;
+    ch8_jit_t jit;
+} replay_t;
+
+/* make room for one more element */
+static int grow(void **arr, uint32_t *cap, uint32_t count, size_t elem_sz)
+{
+    if(count < *cap) {
+        return 0;
+    }
+
+    uint32_t new_cap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*arr, new_cap * elem_sz);
+    if(grown == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        return 1;
+    }
+    *arr = grown;
+    *cap = new_cap;
+
+    return 0;
+}
+
+void input_log_init(input_log_t *log, const ch8_t *vm, uint64_t seed)
+{
+    assert(log != NULL);
+    assert(vm != NULL);
+
+    memset(log, 0, sizeof(*log));
+    log->seed = seed;
+    log->start_hash = ch8_hash(vm);
+}
+
+void input_log_free(input_log_t *log)
+{
+    assert(log != NULL);
+
+    free(log->keys);
+    free(log->frames);
+    log->keys = NULL;
+    log->frames = NULL;
+    log->key_count = log->key_cap = 0;
+    log->frame_count = log->frame_cap = 0;
+}
+
+int input_log_key(input_log_t *log, uint64_t cycles, uint8_t key, uint8_t state)
+{
+    assert(log != NULL);
+    assert(key < VM_KEY_COUNT);
+
+    if(grow((void **)&log->keys, &log->key_cap, log->key_count, sizeof(*log->keys)) != 0) {
+        return 1;
+    }
+    log->keys[log->key_count].cycles = cycles;
+    log->keys[log->key_count].key = key;
+    log->keys[log->key_count].state = state;
+    log->key_count += 1;
+
+    return 0;
+}
+
+int input_log_frame(input_log_t *log, uint64_t cycles, uint32_t len)
+{
+    assert(log != NULL);
+
+    if(log->frame_count > 0) {
+        input_frame_t *last = &log->frames[log->frame_count - 1];
+        if(last->len == len) {
+            return 0;
+        }
+        if(last->cycles == cycles) {
+            last->len = len;
+            return 0;
+        }
+    } else if(len == 0) {
+        return 0;
+    }
+
+    if(grow((void **)&log->frames, &log->frame_cap, log->frame_count, sizeof(*log->frames)) != 0) {
+        return 1;
+    }
+    log->frames[log->frame_count].cycles = cycles;
+    log->frames[log->frame_count].len = len;
+    log->frame_count += 1;
+
+    return 0;
+}
+
+void input_log_truncate(input_log_t *log, uint64_t cycles)
+{
+    assert(log != NULL);
+
+    while(log->key_count > 0 && log->keys[log->key_count - 1].cycles >= cycles) {
+        log->key_count -= 1;
+    }
+    while(log->frame_count > 0 && log->frames[log->frame_count - 1].cycles >= cycles) {
+        log->frame_count -= 1;
+    }
+}
+
+int input_log_from_timeline(input_log_t *log, const ch8_timeline_t *tl, uint64_t cycles)
+{
+    assert(log != NULL);
+    assert(tl != NULL);
+
+    if(tl->ckpt_count == 0 || tl->ckpts[0].cycles != 0) {
+        return 1;
+    }
+    for(uint32_t i = 1; i < tl->ckpt_count && tl->ckpts[i].cycles <= cycles; ++i) {
+        if(tl->ckpts[i].pinned) {
+            return 1;
+        }
+    }
+
+    /* the first checkpoint is the ROM as loaded, seeded at 0 or not at all */
+    ch8_t start;
+    memset(&start, 0, sizeof(start));
+    if(ch8_snapshot_load(&start, tl->base, tl->ckpts[0].snap, tl->ckpts[0].len) != 0) {
+        return 1;
+    }
+    input_log_init(log, &start, start.rng);
+
+    for(uint32_t i = 0; i < tl->event_count && tl->events[i].cycles <= cycles; ++i) {
+        const ch8_key_event_t *ev = &tl->events[i];
+        if(input_log_key(log, ev->cycles, ev->key, ev->state) != 0) {
+            input_log_free(log);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void input_log_end(input_log_t *log, const ch8_t *vm)
+{
+    assert(log != NULL);
+    assert(vm != NULL);
+
+    log->end_cycles = vm->cycles;
+    log->end_hash = ch8_hash(vm);
+}
+
+int input_log_save(const input_log_t *log, const char *path)
+{
+    assert(log != NULL);
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        LOG_ERROR("Could not open \"%s\" for writing\n", path);
+        return 1;
+    }
+
+    fprintf(f, "hnc8-input %d\n", INPUT_LOG_VERSION);
+    fprintf(f, "seed 0x%llx\n", (unsigned long long)log->seed);
+    fprintf(f, "start %016llx\n", (unsigned long long)log->start_hash);
+
+    /* merge both event lists, frames go first at the same point */
+    uint32_t k = 0, fr = 0;
+    while(k < log->key_count || fr < log->frame_count) {
+        if(fr < log->frame_count &&
+           (k == log->key_count || log->frames[fr].cycles <= log->keys[k].cycles)) {
+            fprintf(f, "%llu frame %u\n", (unsigned long long)log->frames[fr].cycles,
+                    log->frames[fr].len);
+            fr += 1;
+        } else {
+            fprintf(f, "%llu key %u %u\n", (unsigned long long)log->keys[k].cycles,
+                    log->keys[k].key, log->keys[k].state);
+            k += 1;
+        }
+    }
+
+    fprintf(f, "end %llu %016llx\n", (unsigned long long)log->end_cycles,
+            (unsigned long long)log->end_hash);
+
+    if(ferror(f) || fclose(f) != 0) {
+        LOG_ERROR("Error writing input log \"%s\"\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+int input_log_load(input_log_t *log, const char *path)
+{
+    assert(log != NULL);
+
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        LOG_ERROR("Could not open input log \"%s\"\n", path);
+        return 1;
+    }
+
+    memset(log, 0, sizeof(*log));
+
+    char line[INPUT_LINE_MAX];
+    uint32_t lineno = 0;
+    bool header = false, end = false;
+    uint64_t last = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long a, b;
+        unsigned int key, state, len;
+        int version;
+        char *p = line;
+
+        lineno += 1;
+        while(*p == ' ' || *p == '\t') {
+            p += 1;
+        }
+        if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+        if(end) {
+            goto bad_line;
+        }
+
+        if(!header) {
+            if(sscanf(p, "hnc8-input %d", &version) != 1 || version != INPUT_LOG_VERSION) {
+                LOG_ERROR("\"%s\" is not a version %d input log\n", path, INPUT_LOG_VERSION);
+                goto fail;
+            }
+            header = true;
+        } else if(sscanf(p, "seed %llx", &a) == 1) {
+            log->seed = a;
+        } else if(sscanf(p, "start %llx", &a) == 1) {
+            log->start_hash = a;
+        } else if(sscanf(p, "end %llu %llx", &a, &b) == 2) {
+            if(a < last) {
+                goto bad_line;
+            }
+            log->end_cycles = a;
+            log->end_hash = b;
+            end = true;
+        } else if(sscanf(p, "%llu key %u %u", &a, &key, &state) == 3) {
+            if(a < last || key >= VM_KEY_COUNT || state > 1 ||
+               input_log_key(log, a, key, state) != 0) {
+                goto bad_line;
+            }
+            last = a;
+        } else if(sscanf(p, "%llu frame %u", &a, &len) == 2) {
+            if(a < last || input_log_frame(log, a, len) != 0) {
+                goto bad_line;
+            }
+            last = a;
+        } else {
+            goto bad_line;
+        }
+    }
+
+    fclose(f);
+    if(!end) {
+        LOG_ERROR("%s: missing the \"end\" line\n", path);
+        input_log_free(log);
+        return 1;
+    }
+
+    return 0;
+
+bad_line:
+    LOG_ERROR("%s:%u: invalid line\n", path, lineno);
+fail:
+    input_log_free(log);
+    fclose(f);
+    return 1;
+}
+
+/* apply the key changes due at the current point */
+static void apply_keys(const input_log_t *log, ch8_t *vm, uint32_t *next)
+{
+    while(*next < log->key_count && log->keys[*next].cycles <= vm->cycles) {
+        vm->keys[log->keys[*next].key] = log->keys[*next].state;
+        *next += 1;
+    }
+}
+
+static void run_until(const input_log_t *log, ch8_t *vm, uint64_t stop, uint32_t *next_key)
+{
+    while(vm->cycles < stop) {
+        apply_keys(log, vm, next_key);
+
+        uint64_t end = stop;
+        if(*next_key < log->key_count && log->keys[*next_key].cycles < end) {
+            end = log->keys[*next_key].cycles;
+        }
+        if(end - vm->cycles > UINT32_MAX) {
+            end = vm->cycles + UINT32_MAX;
+        }
+
+        if(ch8_run(vm, end - vm->cycles) == CH8_EXIT_KEYWAIT) {
+            /* Fx0A spins without changing anything until the next key change */
+            vm->idle_cycles += end - vm->cycles;
+            vm->cycles = end;
+        }
+    }
+}
+
+int input_log_replay(const input_log_t *log, ch8_t *vm)
+{
+    assert(log != NULL);
+    assert(vm != NULL);
+
+    uint32_t next_key = 0, next_frame = 0;
+    uint32_t len = 0;
+
+    while(vm->cycles < log->end_cycles) {
+        uint64_t stop = log->end_cycles;
+
+        /* length changes take effect at the start of a frame */
+        while(next_frame < log->frame_count && log->frames[next_frame].cycles <= vm->cycles) {
+            len = log->frames[next_frame].len;
+            next_frame += 1;
+        }
+        if(len > 0) {
+            ch8_tick_timers(vm);
+            if(vm->cycles + len < stop) {
+                stop = vm->cycles + len;
+            }
+        } else if(next_frame < log->frame_count && log->frames[next_frame].cycles < stop) {
+            stop = log->frames[next_frame].cycles;
+        }
+
+        run_until(log, vm, stop, &next_key);
+    }
+    apply_keys(log, vm, &next_key);
+
+    return vm->cycles == log->end_cycles && ch8_hash(vm) == log->end_hash ? 0 : 1;
+}
+
+int replay_loop(const char *log_file, const uint16_t *rom, uint16_t rom_sz,
+                ch8_engine_e engine)
+{
+    input_log_t log;
+
+    if(input_log_load(&log, log_file) != 0) {
+        return 1;
+    }
+    replay_t *rp = calloc(1, sizeof(*rp));
+    if(rp == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        input_log_free(&log);
+        return 1;
+    }
+    ch8_t *vm = &rp->vm;
+    if(engine == CH8_ENGINE_JIT && ch8_jit_init(&rp->jit) != 0) {
+        LOG_ERROR("Falling back to the threaded core\n");
+        engine = CH8_ENGINE_THREADED;
+    }
+
+    ch8_load(vm, rom, rom_sz);
+    ch8_seed(vm, log.seed);
+    int ret = 1;
+    if(ch8_hash(vm) != log.start_hash) {
+        LOG_ERROR("\"%s\" was recorded with a different ROM\n", log_file);
+        goto out;
+    }
+    if(engine == CH8_ENGINE_CACHED || engine == CH8_ENGINE_THREADED) {
+        ch8_dcache_attach(vm, &rp->dcache);
+    }
+    if(engine == CH8_ENGINE_JIT) {
+        ch8_jit_attach(vm, &rp->jit);
+    }
+
+    double t_start = time_ms();
+    ret = input_log_replay(&log, vm);
+    double t_total = time_ms() - t_start;
+
+    printf("%llu instructions, %u key changes in %.3f ms, %.2f MIPS\n",
+           (unsigned long long)vm->cycles, log.key_count, t_total,
+           t_total > 0 ? vm->cycles / t_total / 1000.0 : 0.0);
+    printf("final state %016llx, recorded %016llx: %s\n", (unsigned long long)ch8_hash(vm),
+           (unsigned long long)log.end_hash, ret == 0 ? "OK" : "MISMATCH");
+
+out:
+    if(engine == CH8_ENGINE_JIT) {
+        ch8_jit_free(&rp->jit);
+    }
+    input_log_free(&log);
+    free(rp);
+
+    return ret;
+}
@@ -0,0 +1,151 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_REPLAY_H
+#define CHIP8_REPLAY_H
+
+#include <stdint.h>
+#include "chip8.h"
+
+/* frame length from instruction count cycles on */
+typedef struct {
+    uint64_t cycles;
+    uint32_t len;
+} input_frame_t;
+
+/*
+ * Everything needed to replay a session from the ROM: the seed, every
+ * key change and the instructions executed per 60hz frame, stamped with
+ * the instruction count they happened at.
+ */
+typedef struct {
+    uint64_t seed;
+    /* ch8_hash right after loading and seeding */
+    uint64_t start_hash;
+    /* both ordered by cycles */
+    ch8_key_event_t *keys;
+    uint32_t key_count;
+    uint32_t key_cap;
+    input_frame_t *frames;
+    uint32_t frame_count;
+    uint32_t frame_cap;
+    /* final state of the recorded session */
+    uint64_t end_cycles;
+    uint64_t end_hash;
+} input_log_t;
+
+/*
+ * Start an empty log for a VM that was just loaded and seeded.
+ */
+void input_log_init(input_log_t *log, const ch8_t *vm, uint64_t seed);
+
+/*
+ * Release memory allocated by the log.
+ */
+void input_log_free(input_log_t *log);
+
+/*
+ * Log a key change made before instruction number cycles + 1.
+ *
+ * Returns
+ *  0 on success, nonzero if memory could not be allocated.
+ */
+int input_log_key(input_log_t *log, uint64_t cycles, uint8_t key, uint8_t state);
+
+/*
+ * Log the length of the frame starting at cycles, only changes are
+ * stored. Timers tick once at the start of every frame, a length of 0
+ * runs without frames and never ticks them.
+ *
+ * Returns
+ *  0 on success, nonzero if memory could not be allocated.
+ */
+int input_log_frame(input_log_t *log, uint64_t cycles, uint32_t len);
+
+/*
+ * Forget everything logged at or after cycles, for when the VM went
+ * back in time.
+ */
+void input_log_truncate(input_log_t *log, uint64_t cycles);
+
+/*
+ * Build a log from the key changes of a debugger history up to cycles.
+ *
+ * Returns
+ *  0 on success, nonzero if the history does not reach back to the
+ *  load, holds edits other than keys or memory could not be allocated.
+ */
+int input_log_from_timeline(input_log_t *log, const ch8_timeline_t *tl, uint64_t cycles);
+
+/*
+ * Mark the current state of the VM as the end of the session.
+ */
+void input_log_end(input_log_t *log, const ch8_t *vm);
+
+/*
+ * Write the log as text.
+ *
+ * The format is line based, empty lines and lines starting with # are
+ * ignored:
+ *  hnc8-input 1
+ *  seed SEED
+ *  start HASH
+ *  CYCLES frame LEN
+ *  CYCLES key KEY STATE
+ *  end CYCLES HASH
+ * with the events in ascending cycle order.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+int input_log_save(const input_log_t *log, const char *path);
+
+/*
+ * Read a log written by input_log_save.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+int input_log_load(input_log_t *log, const char *path);
+
+/*
+ * Replay a log on a VM that was loaded and seeded the same way as the
+ * recorded one, as fast as the engines go.
+ *
+ * Returns
+ *  0 if the VM ends up in the recorded final state, nonzero otherwise.
+ */
+int input_log_replay(const input_log_t *log, ch8_t *vm);
+
+/*
+ * Replay an input log against a ROM without a window and report the
+ * speed and whether the final state matches.
+ *
+ * Params:
+ *  log_file    - path to the input log,
+ *  rom         - the ROM the log was recorded with,
+ *  rom_sz      - size of the ROM in bytes,
+ *  engine      - execution engine.
+ *
+ * Returns
+ *  0 if the final state matches, nonzero otherwise.
+ */
+int replay_loop(const char *log_file, const uint16_t *rom, uint16_t rom_sz,
+                ch8_engine_e engine);
+
+#endif // CHIP8_REPLAY_H
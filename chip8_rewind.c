@@ -0,0 +1,230 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rewind history. The newest frame is kept as a full snapshot, every
+ * older frame is stored as the XOR of its snapshot with the next one,
+ * run length encoded. XOR-ing the newest delta into the full snapshot
+ * steps it back one frame, so frames are restored newest first and the
+ * oldest ones can be dropped without touching the others.
+ *
+ * Deltas are a sequence of tokens:
+ *  u16 zeros   - unchanged bytes to skip,
+ *  u16 count   - changed bytes that follow,
+ *  count bytes of XOR values.
+ * In the ring every delta is framed by its length on both sides, so it
+ * can be found from either end.
+ */
+
+#include "chip8.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* shorter runs of unchanged bytes are cheaper to store as XOR values */
+#define RLE_MIN_ZEROS   4
+#define ENTRY_FRAME     2
+
+static void ring_write(ch8_rewind_t *rw, uint32_t pos, const uint8_t *src, uint32_t len)
+{
+    uint32_t first = rw->ring_sz - pos;
+    if(first > len) {
+        first = len;
+    }
+    memcpy(rw->ring + pos, src, first);
+    memcpy(rw->ring, src + first, len - first);
+}
+
+static void ring_read(const ch8_rewind_t *rw, uint32_t pos, uint8_t *dst, uint32_t len)
+{
+    uint32_t first = rw->ring_sz - pos;
+    if(first > len) {
+        first = len;
+    }
+    memcpy(dst, rw->ring + pos, first);
+    memcpy(dst + first, rw->ring, len - first);
+}
+
+static uint32_t ring_add(const ch8_rewind_t *rw, uint32_t pos, uint32_t n)
+{
+    return (pos + n) % rw->ring_sz;
+}
+
+static uint32_t ring_sub(const ch8_rewind_t *rw, uint32_t pos, uint32_t n)
+{
+    return (pos + rw->ring_sz - n) % rw->ring_sz;
+}
+
+static uint16_t read_len(const ch8_rewind_t *rw, uint32_t pos)
+{
+    uint8_t b[ENTRY_FRAME];
+    ring_read(rw, pos, b, ENTRY_FRAME);
+    return b[0] | (b[1] << 8);
+}
+
+static void put_token(uint8_t *out, uint16_t zeros, uint16_t count)
+{
+    out[0] = zeros;
+    out[1] = zeros >> 8;
+    out[2] = count;
+    out[3] = count >> 8;
+}
+
+/*
+ * Encode a ^ b into out, leaving room for the length in front.
+ *
+ * Returns
+ *  length of the encoded delta.
+ */
+static uint32_t delta_encode(const uint8_t *a, const uint8_t *b, uint32_t len, uint8_t *out)
+{
+    uint32_t o = 0, pos = 0;
+
+    while(pos < len) {
+        uint32_t zeros = 0;
+        /* most of the state is unchanged, skip it a word at a time */
+        while(pos + zeros + 8 <= len && memcmp(a + pos + zeros, b + pos + zeros, 8) == 0) {
+            zeros += 8;
+        }
+        while(pos + zeros < len && a[pos + zeros] == b[pos + zeros]) {
+            zeros += 1;
+        }
+        pos += zeros;
+        if(pos == len) {
+            break;
+        }
+
+        /* changed bytes up to the next long enough unchanged run */
+        uint32_t end = pos, same = 0;
+        while(end < len && same < RLE_MIN_ZEROS) {
+            same = a[end] == b[end] ? same + 1 : 0;
+            end += 1;
+        }
+        if(same == RLE_MIN_ZEROS) {
+            end -= same;
+        }
+
+        put_token(out + o, zeros, end - pos);
+        o += 4;
+        while(pos < end) {
+            out[o++] = a[pos] ^ b[pos];
+            pos += 1;
+        }
+    }
+
+    return o;
+}
+
+static void delta_apply(uint8_t *img, const uint8_t *delta, uint32_t len)
+{
+    uint32_t o = 0, pos = 0;
+
+    while(o < len) {
+        pos += delta[o] | (delta[o + 1] << 8);
+        uint16_t count = delta[o + 2] | (delta[o + 3] << 8);
+        o += 4;
+        for(uint16_t i = 0; i < count; ++i) {
+            img[pos++] ^= delta[o++];
+        }
+    }
+}
+
+int ch8_rewind_init(ch8_rewind_t *rw, uint32_t budget)
+{
+    assert(rw != NULL);
+
+    memset(rw, 0, sizeof(*rw));
+    rw->ring = malloc(budget);
+    if(rw->ring == NULL) {
+        return 1;
+    }
+    rw->ring_sz = budget;
+    /* fault the pages in now instead of during the first frames */
+    memset(rw->ring, 0, budget);
+
+    return 0;
+}
+
+void ch8_rewind_free(ch8_rewind_t *rw)
+{
+    assert(rw != NULL);
+
+    free(rw->ring);
+    rw->ring = NULL;
+    rw->ring_sz = 0;
+}
+
+void ch8_rewind_push(ch8_rewind_t *rw, const ch8_t *vm)
+{
+    assert(rw != NULL);
+    assert(vm != NULL);
+
+    uint8_t *prev = rw->frames[rw->cur];
+    uint8_t *next = rw->frames[rw->cur ^ 1];
+
+    ch8_snapshot_save(vm, NULL, next, CH8_SNAPSHOT_MAX);
+    if(!rw->valid) {
+        rw->valid = true;
+        rw->cur ^= 1;
+        return;
+    }
+
+    uint32_t len = delta_encode(prev, next, CH8_SNAPSHOT_MAX, rw->delta + ENTRY_FRAME);
+    uint32_t entry = len + 2 * ENTRY_FRAME;
+    rw->cur ^= 1;
+
+    if(entry > rw->ring_sz) {
+        /* can't hold even one frame, history ends here */
+        rw->head = rw->tail = rw->used = rw->count = 0;
+        return;
+    }
+    while(rw->used + entry > rw->ring_sz) {
+        uint32_t oldest = read_len(rw, rw->tail) + 2 * ENTRY_FRAME;
+        rw->tail = ring_add(rw, rw->tail, oldest);
+        rw->used -= oldest;
+        rw->count -= 1;
+    }
+
+    rw->delta[0] = rw->delta[entry - 2] = len;
+    rw->delta[1] = rw->delta[entry - 1] = len >> 8;
+    ring_write(rw, rw->head, rw->delta, entry);
+    rw->head = ring_add(rw, rw->head, entry);
+    rw->used += entry;
+    rw->count += 1;
+}
+
+int ch8_rewind_pop(ch8_rewind_t *rw, ch8_t *vm)
+{
+    assert(rw != NULL);
+    assert(vm != NULL);
+
+    if(rw->count == 0) {
+        return 1;
+    }
+
+    uint16_t len = read_len(rw, ring_sub(rw, rw->head, ENTRY_FRAME));
+    uint32_t entry = len + 2 * ENTRY_FRAME;
+    rw->head = ring_sub(rw, rw->head, entry);
+    rw->used -= entry;
+    rw->count -= 1;
+
+    ring_read(rw, ring_add(rw, rw->head, ENTRY_FRAME), rw->delta, len);
+    delta_apply(rw->frames[rw->cur], rw->delta, len);
+
+    return ch8_snapshot_load(vm, NULL, rw->frames[rw->cur], CH8_SNAPSHOT_MAX);
+}
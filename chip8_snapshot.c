@@ -0,0 +1,237 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Save states. A snapshot is a little endian byte image with every
+ * field at a fixed, naturally aligned offset, so a mapped file can be
+ * handed to ch8_snapshot_load without parsing it into anything first:
+ *
+ *  0    magic "HC8S"
+ *  4    u16 version
+ *  6    u16 flags
+ *  8    u64 checksum of version, flags and bytes 16 to size
+ *  16   u32 size of the whole snapshot
+ *  20   u32 reserved, 0
+ *  24   u64 checksum of the base RAM image, 0 without SNAP_RAM_DELTA
+ *  32   u64 cycles
+ *  40   u64 idle_cycles
+ *  48   u64 rng
+ *  56   u16 i, u16 pc, u8 sp, u8 tim_delay, u8 tim_sound, u8 reserved
+ *  64   u8 v[16]
+ *  80   u8 keys[16]
+ *  96   u16 stack[16]
+ *  128  u64 vram[32]
+ *  384  u64 mask of stored RAM blocks, bit n is block n
+ *  392  stored RAM blocks of SNAP_BLOCK bytes in address order
+ *
+ * Without SNAP_RAM_DELTA every block is stored. With it only the blocks
+ * that differ from the base image are, usually a handful of variables
+ * next to the ROM.
+ */
+
+#include "chip8.h"
+#include <assert.h>
+#include <string.h>
+
+#define SNAP_MAGIC      "HC8S"
+#define SNAP_VERSION    1
+#define SNAP_RAM_DELTA  0x0001
+
+#define SNAP_BLOCK      64
+#define SNAP_BLOCKS     (VM_RAM_SIZE / SNAP_BLOCK)
+#define SNAP_OFS_MASK   384
+#define SNAP_OFS_RAM    CH8_SNAPSHOT_HDR
+
+#define SNAP_SEED       0x6A09E667F3BCC908ULL
+#define SNAP_PRIME      0x9E3779B97F4A7C15ULL
+
+static inline void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static inline void put32(uint8_t *p, uint32_t val)
+{
+    put16(p, val);
+    put16(p + 2, val >> 16);
+}
+
+static inline void put64(uint8_t *p, uint64_t val)
+{
+    put32(p, val);
+    put32(p + 4, val >> 32);
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+/* hash len bytes a word at a time, len is a multiple of 8 */
+static uint64_t checksum(uint64_t h, const uint8_t *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i += 8) {
+        h = (h ^ get64(buf + i)) * SNAP_PRIME;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+size_t ch8_snapshot_save(const ch8_t *vm, const uint8_t *base, void *buf, size_t buf_sz)
+{
+    assert(vm != NULL);
+    assert(buf != NULL);
+
+    uint8_t *out = buf;
+    uint16_t flags = base != NULL ? SNAP_RAM_DELTA : 0;
+    uint64_t mask = 0;
+    size_t size = SNAP_OFS_RAM;
+
+    for(uint8_t b = 0; b < SNAP_BLOCKS; ++b) {
+        uint16_t ofs = b * SNAP_BLOCK;
+        if(base == NULL || memcmp(vm->ram + ofs, base + ofs, SNAP_BLOCK) != 0) {
+            mask |= (uint64_t)1 << b;
+            size += SNAP_BLOCK;
+        }
+    }
+    if(buf_sz < size) {
+        return 0;
+    }
+
+    memcpy(out, SNAP_MAGIC, 4);
+    put16(out + 4, SNAP_VERSION);
+    put16(out + 6, flags);
+    put32(out + 16, size);
+    put32(out + 20, 0);
+    put64(out + 24, base != NULL ? checksum(SNAP_SEED, base, VM_RAM_SIZE) : 0);
+    put64(out + 32, vm->cycles);
+    put64(out + 40, vm->idle_cycles);
+    put64(out + 48, vm->rng);
+    put16(out + 56, vm->i);
+    put16(out + 58, vm->pc);
+    out[60] = vm->sp;
+    out[61] = vm->tim_delay;
+    out[62] = vm->tim_sound;
+    out[63] = 0;
+    memcpy(out + 64, vm->v, 16);
+    memcpy(out + 80, vm->keys, VM_KEY_COUNT);
+    for(uint8_t i = 0; i < VM_STACK_SIZE; ++i) {
+        put16(out + 96 + 2 * i, vm->stack[i]);
+    }
+    for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+        put64(out + 128 + 8 * y, vm->vram[y]);
+    }
+    put64(out + SNAP_OFS_MASK, mask);
+
+    uint8_t *ram = out + SNAP_OFS_RAM;
+    for(uint8_t b = 0; b < SNAP_BLOCKS; ++b) {
+        if(mask & ((uint64_t)1 << b)) {
+            memcpy(ram, vm->ram + b * SNAP_BLOCK, SNAP_BLOCK);
+            ram += SNAP_BLOCK;
+        }
+    }
+
+    put64(out + 8, checksum(SNAP_SEED ^ ((uint64_t)SNAP_VERSION << 16 | flags),
+                            out + 16, size - 16));
+
+    return size;
+}
+
+int ch8_snapshot_load(ch8_t *vm, const uint8_t *base, const void *buf, size_t buf_sz)
+{
+    assert(vm != NULL);
+    assert(buf != NULL);
+
+    const uint8_t *in = buf;
+
+    if(buf_sz < SNAP_OFS_RAM || memcmp(in, SNAP_MAGIC, 4) != 0 || get16(in + 4) != SNAP_VERSION) {
+        return 1;
+    }
+
+    uint16_t flags = get16(in + 6);
+    uint32_t size = get32(in + 16);
+    uint64_t mask = get64(in + SNAP_OFS_MASK);
+    size_t expect = SNAP_OFS_RAM;
+    for(uint8_t b = 0; b < SNAP_BLOCKS; ++b) {
+        if(mask & ((uint64_t)1 << b)) {
+            expect += SNAP_BLOCK;
+        }
+    }
+    if((flags & ~SNAP_RAM_DELTA) || size != expect || size > buf_sz) {
+        return 1;
+    }
+    if(checksum(SNAP_SEED ^ ((uint64_t)SNAP_VERSION << 16 | flags), in + 16, size - 16) !=
+       get64(in + 8)) {
+        return 1;
+    }
+    if(flags & SNAP_RAM_DELTA) {
+        if(base == NULL || checksum(SNAP_SEED, base, VM_RAM_SIZE) != get64(in + 24)) {
+            return 1;
+        }
+    } else if(mask != UINT64_MAX) {
+        return 1;
+    }
+
+    vm->cycles = get64(in + 32);
+    vm->idle_cycles = get64(in + 40);
+    vm->rng = get64(in + 48);
+    vm->i = get16(in + 56);
+    vm->pc = get16(in + 58);
+    vm->sp = in[60];
+    vm->tim_delay = in[61];
+    vm->tim_sound = in[62];
+    memcpy(vm->v, in + 64, 16);
+    memcpy(vm->keys, in + 80, VM_KEY_COUNT);
+    for(uint8_t i = 0; i < VM_STACK_SIZE; ++i) {
+        vm->stack[i] = get16(in + 96 + 2 * i);
+    }
+    for(uint8_t y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+        vm->vram[y] = get64(in + 128 + 8 * y);
+    }
+    vm->vram_dirty = UINT32_MAX;
+
+    /* only blocks that actually change are copied and invalidated */
+    const uint8_t *ram = in + SNAP_OFS_RAM;
+    for(uint8_t b = 0; b < SNAP_BLOCKS; ++b) {
+        uint16_t ofs = b * SNAP_BLOCK;
+        const uint8_t *src;
+        if(mask & ((uint64_t)1 << b)) {
+            src = ram;
+            ram += SNAP_BLOCK;
+        } else {
+            src = base + ofs;
+        }
+        if(memcmp(vm->ram + ofs, src, SNAP_BLOCK) != 0) {
+            memcpy(vm->ram + ofs, src, SNAP_BLOCK);
+            ch8_invalidate(vm, ofs, SNAP_BLOCK);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Threaded interpreter core. Every decoded opcode form gets its own
+ * label and every label ends in its own indirect jump to the next
+ * form, so there is no central dispatch branch and no call per
+ * instruction. Uses GCC/Clang computed goto where available and falls
+ * back to a plain switch otherwise.
+ *
+ * Exit reasons other than breakpoints are only checked in the labels of
+ * the instructions that can cause them.
+ */
+
+#include <stdint.h>
+#include "chip8.h"
+#include "chip8_ops.h"
+
+#if defined(__GNUC__) && !defined(HNC8_NO_COMPUTED_GOTO)
+#   define HNC8_COMPUTED_GOTO
+/* labels as values are a GNU extension */
+#   pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static inline const ch8_dop_t *fetch(ch8_t *vm, ch8_dop_t *scratch)
+{
+    if(vm->dcache != NULL && vm->pc < VM_RAM_SIZE) {
+        ch8_dop_t *op = &vm->dcache->ops[vm->pc];
+        if(op->fn == NULL) {
+            ch8_decode_op(ch8_get_op(vm), op);
+        }
+        return op;
+    }
+
+    ch8_decode_op(ch8_get_op(vm), scratch);
+    return scratch;
+}
+
+#define CHECK_BPOINT \
+    if(bp != NULL && ch8_bpoint_test(bp, vm->pc)) { \
+        ret = CH8_EXIT_BREAKPOINT; \
+        goto done; \
+    }
+
+/* for instructions that keep a loop from being idle */
+#define NEXT_IMPURE \
+    idle.impure = n; \
+    NEXT
+
+#define EXIT(reason) \
+    ret = reason; \
+    goto stop
+
+#ifdef HNC8_COMPUTED_GOTO
+#   define TARGET(form) l_##form:
+#   define NEXT \
+    vm->pc += 2; \
+    CHECK_BPOINT \
+    if(n == cycles) goto done; \
+    n += 1; \
+    op = fetch(vm, &scratch); \
+    goto *labels[op->form]
+#else
+#   define TARGET(form) case CH8_OP_##form:
+#   define NEXT \
+    vm->pc += 2; \
+    CHECK_BPOINT \
+    continue
+#endif
+
+ch8_exit_e ch8_run_threaded(ch8_t *vm, uint32_t cycles)
+{
+#ifdef HNC8_COMPUTED_GOTO
+    static const void *const labels[CH8_OP_COUNT] = {
+        [CH8_OP_INVALID] = &&l_INVALID,
+        [CH8_OP_NOP]     = &&l_NOP,
+        [CH8_OP_CLS]     = &&l_CLS,
+        [CH8_OP_RET]     = &&l_RET,
+        [CH8_OP_JP]      = &&l_JP,
+        [CH8_OP_CALL]    = &&l_CALL,
+        [CH8_OP_SE_VI]   = &&l_SE_VI,
+        [CH8_OP_SNE_VI]  = &&l_SNE_VI,
+        [CH8_OP_SE_VV]   = &&l_SE_VV,
+        [CH8_OP_LD_VI]   = &&l_LD_VI,
+        [CH8_OP_ADD_VI]  = &&l_ADD_VI,
+        [CH8_OP_LD_VV]   = &&l_LD_VV,
+        [CH8_OP_OR]      = &&l_OR,
+        [CH8_OP_AND]     = &&l_AND,
+        [CH8_OP_XOR]     = &&l_XOR,
+        [CH8_OP_ADD_VV]  = &&l_ADD_VV,
+        [CH8_OP_SUB]     = &&l_SUB,
+        [CH8_OP_SHR]     = &&l_SHR,
+        [CH8_OP_SUBN]    = &&l_SUBN,
+        [CH8_OP_SHL]     = &&l_SHL,
+        [CH8_OP_SNE_VV]  = &&l_SNE_VV,
+        [CH8_OP_LD_I]    = &&l_LD_I,
+        [CH8_OP_JP_V0]   = &&l_JP_V0,
+        [CH8_OP_RND]     = &&l_RND,
+        [CH8_OP_DRW]     = &&l_DRW,
+        [CH8_OP_SKP]     = &&l_SKP,
+        [CH8_OP_SKNP]    = &&l_SKNP,
+        [CH8_OP_LD_VDT]  = &&l_LD_VDT,
+        [CH8_OP_LD_VK]   = &&l_LD_VK,
+        [CH8_OP_LD_DTV]  = &&l_LD_DTV,
+        [CH8_OP_LD_STV]  = &&l_LD_STV,
+        [CH8_OP_ADD_IV]  = &&l_ADD_IV,
+        [CH8_OP_LD_FV]   = &&l_LD_FV,
+        [CH8_OP_LD_BV]   = &&l_LD_BV,
+        [CH8_OP_LD_MEMV] = &&l_LD_MEMV,
+        [CH8_OP_LD_VMEM] = &&l_LD_VMEM
+    };
+#endif
+    const uint8_t *bp = vm->bpoints;
+    ch8_exit_e ret = CH8_EXIT_CYCLES;
+    ch8_dop_t scratch;
+    const ch8_dop_t *op;
+    idle_t idle = IDLE_INIT;
+    uint32_t skip;
+    uint16_t pc;
+    uint32_t n = 0;
+
+    for(;;) {
+        if(n == cycles) {
+            goto done;
+        }
+        n += 1;
+        op = fetch(vm, &scratch);
+
+#ifdef HNC8_COMPUTED_GOTO
+        goto *labels[op->form];
+#else
+        switch(op->form) {
+#endif
+        TARGET(INVALID)  UNKNOWN_OP(op->opcode);               EXIT(CH8_EXIT_INVALID);
+        TARGET(NOP)                                             NEXT;
+        TARGET(CLS)      op_cls(vm);                            EXIT(CH8_EXIT_VRAM);
+        TARGET(RET)      op_ret(vm);                            NEXT_IMPURE;
+        TARGET(JP)
+            pc = vm->pc;
+            op_jp(vm, op->nnn);
+            if(op->nnn <= pc) {
+                skip = idle_jump(vm, &idle, pc, n, cycles - n);
+                n += skip;
+                vm->idle_cycles += skip;
+            }
+            NEXT;
+        TARGET(CALL)     op_call(vm, op->nnn);                  NEXT_IMPURE;
+        TARGET(SE_VI)    op_se_vi(vm, op->x, op->kk);           NEXT;
+        TARGET(SNE_VI)   op_sne_vi(vm, op->x, op->kk);          NEXT;
+        TARGET(SE_VV)    op_se_vv(vm, op->x, op->y);            NEXT;
+        TARGET(LD_VI)    op_ld_vi(vm, op->x, op->kk);           NEXT;
+        TARGET(ADD_VI)   op_add_vi(vm, op->x, op->kk);          NEXT;
+        TARGET(LD_VV)    op_ld_vv(vm, op->x, op->y);            NEXT;
+        TARGET(OR)       op_or(vm, op->x, op->y);               NEXT;
+        TARGET(AND)      op_and(vm, op->x, op->y);              NEXT;
+        TARGET(XOR)      op_xor(vm, op->x, op->y);              NEXT;
+        TARGET(ADD_VV)   op_add_vv(vm, op->x, op->y);           NEXT;
+        TARGET(SUB)      op_sub(vm, op->x, op->y);              NEXT;
+        TARGET(SHR)      op_shr(vm, op->x);                     NEXT;
+        TARGET(SUBN)     op_subn(vm, op->x, op->y);             NEXT;
+        TARGET(SHL)      op_shl(vm, op->x);                     NEXT;
+        TARGET(SNE_VV)   op_sne_vv(vm, op->x, op->y);           NEXT;
+        TARGET(LD_I)     op_ld_i(vm, op->nnn);                  NEXT;
+        TARGET(JP_V0)    op_jp_v0(vm, op->nnn);                 NEXT;
+        TARGET(RND)      op_rnd(vm, op->x, op->kk);             NEXT_IMPURE;
+        TARGET(DRW)      op_drw(vm, op->x, op->y, op->kk & 0xF); EXIT(CH8_EXIT_VRAM);
+        TARGET(SKP)      op_skp(vm, op->x);                     NEXT;
+        TARGET(SKNP)     op_sknp(vm, op->x);                    NEXT;
+        TARGET(LD_VDT)   op_ld_vdt(vm, op->x);                  NEXT;
+        TARGET(LD_VK)
+            pc = vm->pc;
+            op_ld_vk(vm, op->x);
+            if(vm->pc != pc) {
+                EXIT(CH8_EXIT_KEYWAIT);
+            }
+            NEXT;
+        TARGET(LD_DTV)   op_ld_dtv(vm, op->x);                  NEXT_IMPURE;
+        TARGET(LD_STV)   op_ld_stv(vm, op->x);                  NEXT_IMPURE;
+        TARGET(ADD_IV)   op_add_iv(vm, op->x);                  NEXT;
+        TARGET(LD_FV)    op_ld_fv(vm, op->x);                   NEXT;
+        TARGET(LD_BV)    op_ld_bv(vm, op->x);                   NEXT_IMPURE;
+        TARGET(LD_MEMV)  op_ld_memv(vm, op->x);                 NEXT_IMPURE;
+        TARGET(LD_VMEM)  op_ld_vmem(vm, op->x);                 NEXT;
+#ifndef HNC8_COMPUTED_GOTO
+        }
+#endif
+    }
+
+stop:
+    vm->pc += 2;
+    CHECK_BPOINT
+done:
+    vm->cycles += n;
+    return ret;
+}
@@ -0,0 +1,364 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Execution history for reverse debugging. Forward execution through
+ * ch8_timeline_run stores a checkpoint every TL_INTERVAL instructions,
+ * key changes are logged with the instruction count they happened at
+ * and edits to the state get a pinned checkpoint of their own. Any
+ * earlier point can then be rebuilt by restoring the last checkpoint
+ * before it and re-executing at most TL_INTERVAL instructions, which
+ * gives the same result because nothing else feeds into the VM.
+ *
+ * When the checkpoint array fills up every other checkpoint of the
+ * older half is dropped, so the recent past stays dense and the cost
+ * of a reverse step does not grow with the length of the history.
+ */
+
+#include "chip8.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TL_INTERVAL 1024
+
+/* last checkpoint at or before cycles, ckpts[0] must not be after it */
+static uint32_t ckpt_at(const ch8_timeline_t *tl, uint64_t cycles)
+{
+    uint32_t lo = 0, hi = tl->ckpt_count;
+
+    while(hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(tl->ckpts[mid].cycles <= cycles) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* first event after cycles */
+static uint32_t event_after(const ch8_timeline_t *tl, uint64_t cycles)
+{
+    uint32_t lo = 0, hi = tl->event_count;
+
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(tl->events[mid].cycles <= cycles) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int save_checkpoint(ch8_timeline_t *tl, ch8_checkpoint_t *ck, const ch8_t *vm)
+{
+    size_t len = ch8_snapshot_save(vm, tl->base, tl->snap, sizeof(tl->snap));
+    uint8_t *snap = malloc(len);
+    if(snap == NULL) {
+        return 1;
+    }
+    memcpy(snap, tl->snap, len);
+
+    free(ck->snap);
+    ck->snap = snap;
+    ck->len = len;
+    ck->cycles = vm->cycles;
+
+    return 0;
+}
+
+static void load_checkpoint(const ch8_timeline_t *tl, ch8_t *vm, uint32_t ck)
+{
+    ch8_snapshot_load(vm, tl->base, tl->ckpts[ck].snap, tl->ckpts[ck].len);
+}
+
+/* drop every other checkpoint of the older half, edits are kept */
+static void thin(ch8_timeline_t *tl)
+{
+    uint32_t half = tl->ckpt_count / 2;
+    uint32_t out = 1;
+    bool drop = true;
+
+    for(uint32_t i = 1; i < tl->ckpt_count; ++i) {
+        ch8_checkpoint_t *ck = &tl->ckpts[i];
+        if(i < half && !ck->pinned) {
+            drop = !drop;
+            if(!drop) {
+                free(ck->snap);
+                continue;
+            }
+        }
+        tl->ckpts[out++] = *ck;
+    }
+
+    if(out == tl->ckpt_count) {
+        /* nothing but edits, the history starts later from now on */
+        free(tl->ckpts[0].snap);
+        memmove(&tl->ckpts[0], &tl->ckpts[1], (out - 1) * sizeof(tl->ckpts[0]));
+        out -= 1;
+    }
+    tl->ckpt_count = out;
+}
+
+/* append a checkpoint, or replace the newest one if it is at the same point */
+static int add_checkpoint(ch8_timeline_t *tl, const ch8_t *vm, bool pinned)
+{
+    if(tl->ckpt_count > 0) {
+        ch8_checkpoint_t *last = &tl->ckpts[tl->ckpt_count - 1];
+        if(last->cycles == vm->cycles) {
+            last->pinned |= pinned;
+            return save_checkpoint(tl, last, vm);
+        }
+    }
+    if(tl->ckpt_count == CH8_TIMELINE_CKPTS) {
+        thin(tl);
+    }
+
+    ch8_checkpoint_t *ck = &tl->ckpts[tl->ckpt_count];
+    ck->snap = NULL;
+    ck->pinned = pinned;
+    if(save_checkpoint(tl, ck, vm) != 0) {
+        return 1;
+    }
+    tl->ckpt_count += 1;
+
+    return 0;
+}
+
+/* forget everything recorded after cycles, it is about to be rewritten */
+static void truncate_after(ch8_timeline_t *tl, uint64_t cycles)
+{
+    while(tl->ckpt_count > 1 && tl->ckpts[tl->ckpt_count - 1].cycles > cycles) {
+        tl->ckpt_count -= 1;
+        free(tl->ckpts[tl->ckpt_count].snap);
+    }
+    tl->event_count = event_after(tl, cycles);
+}
+
+static void apply_events(const ch8_timeline_t *tl, ch8_t *vm, uint32_t *ev)
+{
+    while(*ev < tl->event_count && tl->events[*ev].cycles == vm->cycles) {
+        vm->keys[tl->events[*ev].key] = tl->events[*ev].state;
+        *ev += 1;
+    }
+}
+
+/*
+ * Re-execute up to cycles with the key changes logged on the way.
+ *
+ * Returns
+ *  the last instruction count before cycles at which PC was on a
+ *  breakpoint of bp, UINT64_MAX if there was none.
+ */
+static uint64_t replay(const ch8_timeline_t *tl, ch8_t *vm, uint64_t cycles, const uint8_t *bp)
+{
+    const uint8_t *bpoints = vm->bpoints;
+    uint32_t ev = event_after(tl, vm->cycles);
+    uint64_t hit = UINT64_MAX;
+
+    vm->bpoints = bp;
+    if(bp != NULL && vm->cycles < cycles && ch8_bpoint_test(bp, vm->pc)) {
+        hit = vm->cycles;
+    }
+    while(vm->cycles < cycles) {
+        uint64_t stop = cycles;
+        if(ev < tl->event_count && tl->events[ev].cycles < stop) {
+            stop = tl->events[ev].cycles;
+        }
+        if(stop - vm->cycles > UINT32_MAX) {
+            stop = vm->cycles + UINT32_MAX;
+        }
+        if(ch8_run(vm, stop - vm->cycles) == CH8_EXIT_BREAKPOINT && vm->cycles < cycles) {
+            hit = vm->cycles;
+        }
+        apply_events(tl, vm, &ev);
+    }
+    vm->bpoints = bpoints;
+
+    return hit;
+}
+
+int ch8_timeline_init(ch8_timeline_t *tl, const ch8_t *vm)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+
+    memset(tl, 0, sizeof(*tl));
+    memcpy(tl->base, vm->ram, VM_RAM_SIZE);
+
+    return add_checkpoint(tl, vm, true);
+}
+
+void ch8_timeline_free(ch8_timeline_t *tl)
+{
+    assert(tl != NULL);
+
+    for(uint32_t i = 0; i < tl->ckpt_count; ++i) {
+        free(tl->ckpts[i].snap);
+    }
+    free(tl->events);
+    tl->ckpt_count = 0;
+    tl->events = NULL;
+    tl->event_count = tl->event_cap = 0;
+}
+
+ch8_exit_e ch8_timeline_run(ch8_timeline_t *tl, ch8_t *vm, uint32_t cycles)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+
+    uint64_t end = vm->cycles + cycles;
+    uint32_t ck = ckpt_at(tl, vm->cycles);
+    uint32_t ev = event_after(tl, vm->cycles);
+    ch8_exit_e ret = CH8_EXIT_CYCLES;
+
+    while(vm->cycles < end) {
+        uint64_t stop;
+        if(ck + 1 < tl->ckpt_count) {
+            /* going over recorded history again */
+            stop = tl->ckpts[ck + 1].cycles;
+        } else {
+            stop = tl->ckpts[ck].cycles + TL_INTERVAL;
+            if(stop <= vm->cycles) {
+                stop = vm->cycles + TL_INTERVAL;
+            }
+        }
+        if(ev < tl->event_count && tl->events[ev].cycles < stop) {
+            stop = tl->events[ev].cycles;
+        }
+        if(stop > end) {
+            stop = end;
+        }
+
+        ret = ch8_run(vm, stop - vm->cycles);
+        apply_events(tl, vm, &ev);
+
+        if(ck + 1 < tl->ckpt_count && tl->ckpts[ck + 1].cycles == vm->cycles) {
+            ck += 1;
+            /* the state was edited here, re-execution can't know how */
+            if(tl->ckpts[ck].pinned) {
+                load_checkpoint(tl, vm, ck);
+            }
+        } else if(ck + 1 == tl->ckpt_count && vm->cycles >= tl->ckpts[ck].cycles + TL_INTERVAL) {
+            add_checkpoint(tl, vm, false);
+            ck = tl->ckpt_count - 1;
+        }
+
+        if(ret != CH8_EXIT_CYCLES) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+int ch8_timeline_key(ch8_timeline_t *tl, ch8_t *vm, uint8_t key, uint8_t state)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+    assert(key < VM_KEY_COUNT);
+
+    truncate_after(tl, vm->cycles);
+    vm->keys[key] = state;
+
+    if(tl->event_count == tl->event_cap) {
+        uint32_t cap = tl->event_cap ? tl->event_cap * 2 : 64;
+        ch8_key_event_t *grown = realloc(tl->events, cap * sizeof(*grown));
+        if(grown == NULL) {
+            return add_checkpoint(tl, vm, true);
+        }
+        tl->events = grown;
+        tl->event_cap = cap;
+    }
+    tl->events[tl->event_count].cycles = vm->cycles;
+    tl->events[tl->event_count].key = key;
+    tl->events[tl->event_count].state = state;
+    tl->event_count += 1;
+
+    /* checkpoints include every key change up to their own point */
+    if(tl->ckpts[tl->ckpt_count - 1].cycles == vm->cycles) {
+        return add_checkpoint(tl, vm, false);
+    }
+
+    return 0;
+}
+
+int ch8_timeline_edit(ch8_timeline_t *tl, const ch8_t *vm)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+
+    truncate_after(tl, vm->cycles);
+
+    return add_checkpoint(tl, vm, true);
+}
+
+int ch8_timeline_seek(ch8_timeline_t *tl, ch8_t *vm, uint64_t cycles)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+
+    if(cycles < tl->ckpts[0].cycles) {
+        return 1;
+    }
+
+    load_checkpoint(tl, vm, ckpt_at(tl, cycles));
+    replay(tl, vm, cycles, NULL);
+
+    return 0;
+}
+
+int ch8_timeline_reverse_continue(ch8_timeline_t *tl, ch8_t *vm)
+{
+    assert(tl != NULL);
+    assert(vm != NULL);
+
+    const uint8_t *bp = vm->bpoints;
+    uint64_t now = vm->cycles;
+
+    if(bp == NULL) {
+        load_checkpoint(tl, vm, 0);
+        return 1;
+    }
+
+    /* search backwards one checkpoint interval at a time */
+    for(uint32_t ck = ckpt_at(tl, now);; --ck) {
+        uint64_t end = now;
+        if(ck + 1 < tl->ckpt_count && tl->ckpts[ck + 1].cycles < now) {
+            end = tl->ckpts[ck + 1].cycles;
+        }
+
+        load_checkpoint(tl, vm, ck);
+        uint64_t hit = replay(tl, vm, end, bp);
+        if(hit != UINT64_MAX) {
+            ch8_timeline_seek(tl, vm, hit);
+            return 0;
+        }
+        if(ck == 0) {
+            break;
+        }
+    }
+
+    load_checkpoint(tl, vm, 0);
+
+    return 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Trace files start with TRACE_MAGIC followed by records of
+ * TRACE_REC_SIZE bytes, 16 bit fields little endian:
+ *  pc, opcode, i, vx, vy, vf, kind
+ * The records are converted to that layout by the writer thread, the
+ * emulation thread only copies the struct into the ring.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_trace.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>       // nanosleep()
+
+#include "log.h"
+
+#define TRACE_MAGIC     "HNC8TRC1"
+#define TRACE_MAGIC_SZ  8
+/* how long the writer sleeps when the ring is empty */
+#define TRACE_IDLE_NS   1000000
+
+/* registers shown for each form when decoding */
+#define SHOW_X  (1 << 0)
+#define SHOW_Y  (1 << 1)
+#define SHOW_F  (1 << 2)
+#define SHOW_I  (1 << 3)
+
+static const uint8_t form_regs[CH8_OP_COUNT] = {
+    [CH8_OP_SE_VI] = SHOW_X,
+    [CH8_OP_SNE_VI] = SHOW_X,
+    [CH8_OP_SE_VV] = SHOW_X | SHOW_Y,
+    [CH8_OP_LD_VI] = SHOW_X,
+    [CH8_OP_ADD_VI] = SHOW_X,
+    [CH8_OP_LD_VV] = SHOW_X | SHOW_Y,
+    [CH8_OP_OR] = SHOW_X | SHOW_Y,
+    [CH8_OP_AND] = SHOW_X | SHOW_Y,
+    [CH8_OP_XOR] = SHOW_X | SHOW_Y,
+    [CH8_OP_ADD_VV] = SHOW_X | SHOW_Y | SHOW_F,
+    [CH8_OP_SUB] = SHOW_X | SHOW_Y | SHOW_F,
+    [CH8_OP_SHR] = SHOW_X | SHOW_Y | SHOW_F,
+    [CH8_OP_SUBN] = SHOW_X | SHOW_Y | SHOW_F,
+    [CH8_OP_SHL] = SHOW_X | SHOW_Y | SHOW_F,
+    [CH8_OP_SNE_VV] = SHOW_X | SHOW_Y,
+    [CH8_OP_LD_I] = SHOW_I,
+    [CH8_OP_RND] = SHOW_X,
+    [CH8_OP_DRW] = SHOW_X | SHOW_Y | SHOW_F | SHOW_I,
+    [CH8_OP_SKP] = SHOW_X,
+    [CH8_OP_SKNP] = SHOW_X,
+    [CH8_OP_LD_VDT] = SHOW_X,
+    [CH8_OP_LD_VK] = SHOW_X,
+    [CH8_OP_LD_DTV] = SHOW_X,
+    [CH8_OP_LD_STV] = SHOW_X,
+    [CH8_OP_ADD_IV] = SHOW_X | SHOW_I,
+    [CH8_OP_LD_FV] = SHOW_X | SHOW_I,
+    [CH8_OP_LD_BV] = SHOW_X | SHOW_I,
+    [CH8_OP_LD_MEMV] = SHOW_X | SHOW_I,
+    [CH8_OP_LD_VMEM] = SHOW_X | SHOW_I
+};
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static void pack(const trace_rec_t *rec, uint8_t *p)
+{
+    put_u16(p, rec->pc);
+    put_u16(p + 2, rec->opcode);
+    put_u16(p + 4, rec->i);
+    p[6] = rec->vx;
+    p[7] = rec->vy;
+    p[8] = rec->vf;
+    p[9] = rec->kind;
+}
+
+static void unpack(const uint8_t *p, trace_rec_t *rec)
+{
+    rec->pc = get_u16(p);
+    rec->opcode = get_u16(p + 2);
+    rec->i = get_u16(p + 4);
+    rec->vx = p[6];
+    rec->vy = p[7];
+    rec->vf = p[8];
+    rec->kind = p[9];
+}
+
+static void *trace_writer(void *arg)
+{
+    trace_t *t = arg;
+
+    for(;;) {
+        uint32_t head = t->head;
+        uint32_t tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+
+        if(head == tail) {
+            if(!__atomic_load_n(&t->running, __ATOMIC_ACQUIRE)) {
+                /* records put before stopping are visible now */
+                if(__atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) == head) {
+                    break;
+                }
+                continue;
+            }
+            struct timespec ts = { .tv_sec = 0, .tv_nsec = TRACE_IDLE_NS };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        /* up to the end of the ring or of the buffer, whichever is first */
+        uint32_t n = tail - head;
+        uint32_t to_end = TRACE_RING_SIZE - (head & (TRACE_RING_SIZE - 1));
+        if(n > to_end) {
+            n = to_end;
+        }
+        if(n > sizeof(t->buf) / TRACE_REC_SIZE) {
+            n = sizeof(t->buf) / TRACE_REC_SIZE;
+        }
+        const trace_rec_t *recs = &t->recs[head & (TRACE_RING_SIZE - 1)];
+        for(uint32_t k = 0; k < n; ++k) {
+            pack(&recs[k], t->buf + k * TRACE_REC_SIZE);
+        }
+        __atomic_store_n(&t->head, head + n, __ATOMIC_RELEASE);
+        fwrite(t->buf, TRACE_REC_SIZE, n, t->f);
+    }
+
+    return NULL;
+}
+
+int trace_open(trace_t *t, const char *path)
+{
+    assert(t != NULL);
+    assert(path != NULL);
+
+    memset(t, 0, sizeof(*t));
+    t->recs = malloc(TRACE_RING_SIZE * sizeof(*t->recs));
+    if(t->recs == NULL) {
+        LOG_ERROR("Error allocating memory\n");
+        return 1;
+    }
+    t->f = fopen(path, "wb");
+    if(t->f == NULL) {
+        LOG_ERROR("Could not open \"%s\" for writing\n", path);
+        free(t->recs);
+        return 1;
+    }
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SZ, t->f);
+
+    t->running = 1;
+    if(pthread_create(&t->thread, NULL, trace_writer, t) != 0) {
+        LOG_ERROR("Could not start the trace writer\n");
+        fclose(t->f);
+        free(t->recs);
+        return 1;
+    }
+
+    return 0;
+}
+
+int trace_close(trace_t *t)
+{
+    assert(t != NULL);
+
+    __atomic_store_n(&t->running, 0, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+
+    int ret = ferror(t->f);
+    if(fclose(t->f) != 0) {
+        ret = 1;
+    }
+    free(t->recs);
+
+    return ret;
+}
+
+int trace_decode(const char *path, FILE *out)
+{
+    assert(path != NULL);
+    assert(out != NULL);
+
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) {
+        LOG_ERROR("Could not open trace \"%s\"\n", path);
+        return 1;
+    }
+
+    char magic[TRACE_MAGIC_SZ];
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+       memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SZ) != 0) {
+        LOG_ERROR("\"%s\" is not a trace\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    uint8_t p[TRACE_REC_SIZE];
+    while(fread(p, 1, sizeof(p), f) == sizeof(p)) {
+        trace_rec_t rec;
+        unpack(p, &rec);
+
+        if(rec.kind == TRACE_FRAME) {
+            uint64_t frame = rec.pc | ((uint64_t)rec.opcode << 16) | ((uint64_t)rec.i << 32);
+            fprintf(out, "; frame %llu\n", (unsigned long long)frame);
+            continue;
+        }
+
+        char dis[CH8_DISASM_MAX];
+        ch8_disassemble_r(rec.opcode, dis, sizeof(dis));
+        uint8_t regs = form_regs[ch8_decode(rec.opcode)];
+        fprintf(out, regs ? "%04X:    %04X    %-20s" : "%04X:    %04X    %s",
+                rec.pc, rec.opcode, dis);
+
+        if(regs & SHOW_X) {
+            fprintf(out, " V%X=%02X", (rec.opcode >> 8) & 0xF, rec.vx);
+        }
+        if(regs & SHOW_Y) {
+            fprintf(out, " V%X=%02X", (rec.opcode >> 4) & 0xF, rec.vy);
+        }
+        if(regs & SHOW_F) {
+            fprintf(out, " VF=%02X", rec.vf);
+        }
+        if(regs & SHOW_I) {
+            fprintf(out, " I=%03X", rec.i);
+        }
+        fputc('\n', out);
+    }
+
+    int ret = ferror(f) || ferror(out);
+    fclose(f);
+
+    return ret;
+}
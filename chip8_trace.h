@@ -0,0 +1,138 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>      // sched_yield()
+#include "chip8.h"
+
+/* records held in memory, power of two */
+#define TRACE_RING_SIZE     (1 << 16)
+/* bytes per record in a trace file */
+#define TRACE_REC_SIZE      10
+
+typedef enum {
+    TRACE_INSN,     // an instruction was executed
+    TRACE_FRAME     // a frame starts, pc, opcode and i hold the frame number
+} trace_kind_e;
+
+/*
+ * One executed instruction and the registers it may have changed, taken
+ * right after executing it.
+ */
+typedef struct {
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t i;
+    uint8_t vx;
+    uint8_t vy;
+    uint8_t vf;
+    uint8_t kind;
+} trace_rec_t;
+
+/*
+ * Binary instruction trace. The emulation thread appends records to a
+ * ring buffer and a writer thread drains it to a file, so tracing costs
+ * the core a few stores per instruction and no formatting or I/O.
+ */
+typedef struct {
+    trace_rec_t *recs;
+    uint32_t tail;      // written by the emulation thread
+    uint64_t stalls;    // times the ring was full
+    uint8_t pad[64];
+    uint32_t head;      // written by the writer thread
+    int running;
+    FILE *f;
+    pthread_t thread;
+    uint8_t buf[4096 * TRACE_REC_SIZE];
+} trace_t;
+
+/*
+ * Create a trace file and start the thread writing it.
+ *
+ * Returns
+ *  0 on success, nonzero on error.
+ */
+int trace_open(trace_t *t, const char *path);
+
+/*
+ * Write out what is left in the ring and close the trace.
+ *
+ * Returns
+ *  0 on success, nonzero if the trace could not be written completely.
+ */
+int trace_close(trace_t *t);
+
+/*
+ * Append a record, waiting for the writer if the ring is full rather
+ * than leaving a hole in the trace.
+ */
+static inline void trace_put(trace_t *t, const trace_rec_t *rec)
+{
+    uint32_t tail = t->tail;
+
+    while(tail - __atomic_load_n(&t->head, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        t->stalls += 1;
+        sched_yield();
+    }
+    t->recs[tail & (TRACE_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&t->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Record the instruction just executed from pc.
+ */
+static inline void trace_insn(trace_t *t, const ch8_t *vm, uint16_t pc, uint16_t opcode)
+{
+    trace_rec_t rec = {
+        .pc = pc,
+        .opcode = opcode,
+        .i = vm->i,
+        .vx = vm->v[(opcode >> 8) & 0xF],
+        .vy = vm->v[(opcode >> 4) & 0xF],
+        .vf = vm->v[0xF],
+        .kind = TRACE_INSN
+    };
+    trace_put(t, &rec);
+}
+
+static inline void trace_frame(trace_t *t, uint64_t frame)
+{
+    trace_rec_t rec = {
+        .pc = frame & 0xFFFF,
+        .opcode = (frame >> 16) & 0xFFFF,
+        .i = (frame >> 32) & 0xFFFF,
+        .kind = TRACE_FRAME
+    };
+    trace_put(t, &rec);
+}
+
+/*
+ * Write a trace file as text, one instruction per line with the
+ * registers it uses.
+ *
+ * Returns
+ *  0 on success, nonzero if the file is not a trace or can't be read.
+ */
+int trace_decode(const char *path, FILE *out);
+
+#endif // CHIP8_TRACE_H
@@ -42,6 +42,7 @@ int load_file(const char *filename, uint16_t **ptr, size_t *size)
     *ptr = mmap(0, *size, PROT_READ, MAP_PRIVATE, input_fd, 0);
     if(*ptr == MAP_FAILED) {
         LOG_ERROR("Error reading input file\n");
+        close(input_fd);
         return 1;
     }
 
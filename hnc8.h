@@ -0,0 +1,35 @@
+/*
+ * hnc8
+ * Copyright (C) 2019 hundinui
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Public interface of libhnc8: the VM core and its engines, snapshots,
+ * rewinding, execution history, the disassembler and ROM loading.
+ *
+ * The library keeps no state of its own. Every VM, engine cache and
+ * history is owned by the caller, so any number of them can be used
+ * side by side, one thread per VM. The JIT only lives on x86-64 Linux,
+ * elsewhere ch8_jit_init fails and callers use the threaded core.
+ */
+
+#ifndef HNC8_H
+#define HNC8_H
+
+#include "chip8.h"
+#include "file.h"
+
+#endif // HNC8_H
@@ -21,17 +21,22 @@
 #include <stdlib.h>
 #include <getopt.h>     // getopt()
 #include <stdbool.h>
+#include <time.h>
 
 #include "chip8.h"
 #include "log.h"
 #include "chip8_dbg_server.h"
 #include "chip8_emu.h"
+#include "chip8_corpus.h"
+#include "chip8_farm.h"
+#include "chip8_replay.h"
+#include "chip8_trace.h"
 #include "file.h"
 
 const char *usage_general = "\
 Usage: %s [OPTION]... FILE\n\n\
 Options:\n\
-\t-m MODE\t\tselect operation mode\n\t\t\t  valid modes are \"emu\", \"server\" and \"disasm\"\n\
+\t-m MODE\t\tselect operation mode\n\t\t\t  valid modes are \"emu\", \"server\", \"disasm\",\n\t\t\t  \"farm\", \"replay\", \"corpus\" and \"trace\"\n\
 \t-h\t\toutput this help message and exit\n\
 \t-v\t\toutput version information and exit\n\
 \n";
@@ -40,17 +45,46 @@ const char *usage_disasm = "\
 Disassembler options:\n\
 \t-a\t\toutput addresses with disassembly\n\
 \t-i\t\toutput raw instructions with disassembly\n\
+\t-c FORMAT\tfollow control flow from the entry point instead of\n\t\t\t  disassembling linearly, FORMAT is \"asm\" for\n\t\t\t  labelled assembly or \"dot\" for a Graphviz graph\n\
 \n";
 
 const char *usage_emu = "\
 Emulator options:\n\
-\t-f INT\t\tclock multiplier for core\n\
+\t-e ENGINE\texecution engine\n\t\t\t  valid engines are \"interp\", \"cache\",\n\t\t\t  \"threaded\" and \"jit\"\n\
+\t-t INT\t\tinstructions per second (default: 60 times -f)\n\
+\t-f INT\t\tinstructions per 60hz frame (default: 2)\n\
+\t-r INT\t\tseed for the RND instruction (default: current time)\n\
+\t-w INT\t\trewind memory in KiB, 0 disables it (default: 4096)\n\
+\t-l FILE\t\trecord key presses to an input log\n\
+\t-T FILE\t\twrite a binary trace of every instruction, read it\n\t\t\t  back with -m trace\n\
+\t-P INT\t\tprofile every INT-th instruction, 1 counts them all,\n\t\t\t  the profile is printed at exit\n\
+\t-F FILE\t\twrite the profiled call stacks for flamegraph.pl,\n\t\t\t  profiles every instruction unless -P says otherwise\n\
 \t-s DBL\t\tdisplay scale multiplier\n\
 \n";
 
 const char *usage_server = "\
 Server options:\n\
 \t-p\t\tlisten port (default: 8888)\n\
+\t-j INT\t\tworker threads for long commands (default: one per CPU)\n\
+\n";
+
+const char *usage_farm = "\
+Farm options (FILE is a job list, also takes -e, -f and -r):\n\
+\t-j INT\t\tworker threads (default: one per CPU)\n\
+\n";
+
+const char *usage_replay = "\
+Replay options (FILE is the ROM, also takes -e):\n\
+\t-l FILE\t\tinput log to replay\n\
+\n";
+
+const char *usage_corpus = "\
+Corpus options (FILE is a directory or ROM list, also takes -a, -i, -c and -j):\n\
+\t-o PATH\t\twrite the disassembly of every ROM to a directory,\n\t\t\t  or to an archive if PATH is not a directory\n\
+\n";
+
+const char *usage_trace = "\
+Trace mode: FILE is a trace written with -T, printed as text\n\
 \n";
 
 const char *version_text = "\
@@ -67,6 +101,10 @@ static void print_usage(const char *exe_name)
     printf("%s", usage_disasm);
     printf("%s", usage_emu);
     printf("%s", usage_server);
+    printf("%s", usage_farm);
+    printf("%s", usage_replay);
+    printf("%s", usage_corpus);
+    printf("%s", usage_trace);
 }
 
 static void print_version(void)
@@ -74,10 +112,40 @@ static void print_version(void)
     printf(version_text, HNC8_VERSION);
 }
 
+/* recursive traversal disassembly of a ROM, as assembly or DOT */
+static int disasm_cfg(const uint16_t *rom, size_t rom_sz, bool dot, const char *name)
+{
+    ch8_t *vm = calloc(1, sizeof(ch8_t));
+    ch8_cfg_t *cfg = calloc(1, sizeof(ch8_cfg_t));
+    if(vm == NULL || cfg == NULL) {
+        LOG_ERROR("Out of memory\n");
+        free(vm);
+        free(cfg);
+        return 1;
+    }
+
+    if(rom_sz > VM_RAM_SIZE - VM_EXEC_START_ADDR) {
+        rom_sz = VM_RAM_SIZE - VM_EXEC_START_ADDR;
+    }
+    ch8_load(vm, rom, rom_sz);
+    ch8_cfg_build(cfg, vm->ram, VM_EXEC_START_ADDR, VM_EXEC_START_ADDR + rom_sz);
+
+    int ret = dot ? ch8_cfg_write_dot(cfg, vm->ram, name, stdout)
+                  : ch8_cfg_write_asm(cfg, vm->ram, stdout);
+
+    free(cfg);
+    free(vm);
+    return ret != 0;
+}
+
 typedef enum {
     MODE_DISASM,
     MODE_EMULATOR,
-    MODE_DEBUG
+    MODE_DEBUG,
+    MODE_FARM,
+    MODE_REPLAY,
+    MODE_CORPUS,
+    MODE_TRACE
 } mode_e;
 
 int main(int argc, char **argv)
@@ -86,11 +154,23 @@ int main(int argc, char **argv)
     mode_e mode = MODE_EMULATOR;
     bool opt_da_addr = false;
     bool opt_da_instr = false;
+    const char *opt_da_cfg = NULL;
     int opt_dbg_port = 8888;
     double opt_emu_scale = 10.0;
     int opt_emu_freq_mult = 2;
+    uint32_t opt_emu_ips = 0;
+    ch8_engine_e opt_emu_engine = CH8_ENGINE_INTERP;
+    uint64_t opt_emu_seed = 0;
+    bool opt_emu_seed_set = false;
+    uint32_t opt_emu_rewind = 4096;
+    int opt_farm_threads = 0;
+    const char *opt_input_log = NULL;
+    const char *opt_corpus_out = NULL;
+    const char *opt_trace = NULL;
+    uint32_t opt_profile = 0;
+    const char *opt_stacks = NULL;
 
-    while((opt = getopt(argc, argv, "hvm:aip:s:f:")) != -1) {
+    while((opt = getopt(argc, argv, "hvm:aic:p:s:f:t:e:r:w:j:l:o:T:P:F:")) != -1) {
         switch(opt) {
             /* General options */
             case ':':
@@ -117,6 +197,22 @@ int main(int argc, char **argv)
                         mode = MODE_DEBUG;
                         LOG_DEBUG("Debug Server mode\n");
                         break;
+                    case 'f': /* headless batch mode */
+                        mode = MODE_FARM;
+                        LOG_DEBUG("Farm mode\n");
+                        break;
+                    case 'r': /* headless input log replay */
+                        mode = MODE_REPLAY;
+                        LOG_DEBUG("Replay mode\n");
+                        break;
+                    case 'c': /* parallel disassembly of many ROMs */
+                        mode = MODE_CORPUS;
+                        LOG_DEBUG("Corpus mode\n");
+                        break;
+                    case 't': /* trace to text */
+                        mode = MODE_TRACE;
+                        LOG_DEBUG("Trace mode\n");
+                        break;
                     default:
                         print_usage(argv[0]);
                         LOG_ERROR("Invalid mode: %s\n", optarg);
@@ -132,6 +228,14 @@ int main(int argc, char **argv)
                 LOG_DEBUG("Outputting instructions in disasm\n");
                 opt_da_instr = true;
                 break;
+            case 'c':
+                if(optarg[0] != 'a' && optarg[0] != 'd') {
+                    print_usage(argv[0]);
+                    LOG_ERROR("Invalid control flow format: %s\n", optarg);
+                    return 1;
+                }
+                opt_da_cfg = optarg;
+                break;
             /* Debug server options */
             case 'p':
                 opt_dbg_port = (uint16_t)strtol(optarg, NULL, 10);
@@ -145,12 +249,72 @@ int main(int argc, char **argv)
                 opt_emu_freq_mult = strtol(optarg, NULL, 10);
                 LOG_DEBUG("Frequency multiplier set to %d\n", opt_emu_scale);
                 break;
+            case 't':
+                opt_emu_ips = strtoul(optarg, NULL, 10);
+                LOG_DEBUG("Instructions per second set to %u\n", opt_emu_ips);
+                break;
+            case 'r':
+                opt_emu_seed = strtoull(optarg, NULL, 0);
+                opt_emu_seed_set = true;
+                LOG_DEBUG("Seed set to %llu\n", (unsigned long long)opt_emu_seed);
+                break;
+            case 'w':
+                opt_emu_rewind = strtoul(optarg, NULL, 10);
+                LOG_DEBUG("Rewind memory set to %u KiB\n", opt_emu_rewind);
+                break;
+            case 'T':
+                opt_trace = optarg;
+                LOG_DEBUG("Trace set to %s\n", opt_trace);
+                break;
+            case 'P':
+                opt_profile = strtoul(optarg, NULL, 10);
+                LOG_DEBUG("Profile interval set to %u\n", opt_profile);
+                break;
+            case 'F':
+                opt_stacks = optarg;
+                LOG_DEBUG("Call stack output set to %s\n", opt_stacks);
+                break;
+            case 'l':
+                opt_input_log = optarg;
+                LOG_DEBUG("Input log set to %s\n", opt_input_log);
+                break;
+            /* Farm specific options */
+            case 'j':
+                opt_farm_threads = strtol(optarg, NULL, 10);
+                LOG_DEBUG("Worker threads set to %d\n", opt_farm_threads);
+                break;
+            /* Corpus specific options */
+            case 'o':
+                opt_corpus_out = optarg;
+                LOG_DEBUG("Corpus output set to %s\n", opt_corpus_out);
+                break;
+            case 'e':
+                switch(optarg[0]) {
+                    case 'i': /* plain interpreter */
+                        opt_emu_engine = CH8_ENGINE_INTERP;
+                        break;
+                    case 'c': /* decoded instruction cache */
+                        opt_emu_engine = CH8_ENGINE_CACHED;
+                        break;
+                    case 't': /* threaded core */
+                        opt_emu_engine = CH8_ENGINE_THREADED;
+                        break;
+                    case 'j': /* basic block recompiler */
+                        opt_emu_engine = CH8_ENGINE_JIT;
+                        break;
+                    default:
+                        print_usage(argv[0]);
+                        LOG_ERROR("Invalid engine: %s\n", optarg);
+                        return 1;
+                }
+                LOG_DEBUG("Engine set to %s\n", optarg);
+                break;
         }
     }
 
     /* break out to debug mode here because we don't want to load a file yet */
     if(mode == MODE_DEBUG) {
-        dbg_server_loop(opt_dbg_port);
+        dbg_server_loop(opt_dbg_port, opt_farm_threads);
         return 0;
     }
 
@@ -161,6 +325,36 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    /* jobs load their own ROMs, runs are reproducible unless -r says otherwise */
+    if(mode == MODE_FARM) {
+        return farm_loop(argv[optind], opt_farm_threads, opt_emu_freq_mult,
+                         opt_emu_engine, opt_emu_seed);
+    }
+
+    if(mode == MODE_TRACE) {
+        return trace_decode(argv[optind], stdout);
+    }
+
+    if(mode == MODE_CORPUS) {
+        corpus_format_e format = CORPUS_DISASM;
+        if(opt_da_cfg != NULL) {
+            format = opt_da_cfg[0] == 'd' ? CORPUS_DOT : CORPUS_ASM;
+        }
+        unsigned flags = (opt_da_addr ? CH8_DISASM_ADDR : 0) |
+                         (opt_da_instr ? CH8_DISASM_BYTES : 0);
+        return corpus_loop(argv[optind], opt_farm_threads, opt_corpus_out, format, flags);
+    }
+
+    if(mode == MODE_REPLAY && opt_input_log == NULL) {
+        print_usage(argv[0]);
+        LOG_ERROR("Please specify the input log to replay with -l\n");
+        return 1;
+    }
+
+    if(!opt_emu_seed_set) {
+        opt_emu_seed = time(NULL);
+    }
+
     size_t input_sz;
     uint16_t *input_mem;
     if(load_file(argv[optind], &input_mem, &input_sz) != 0) {
@@ -169,27 +363,51 @@ int main(int argc, char **argv)
 
     LOG_DEBUG("Loaded ROM %s, size %hu bytes\n", argv[optind], input_sz);
 
+    int ret = 0;
     switch(mode) {
-        case MODE_DISASM:
-            for(uint16_t i = 0; i < input_sz; ++i) {
-                uint8_t op_h = input_mem[i] & 0xFF;
-                uint8_t op_l = (input_mem[i] & 0xFF00) >> 8;
-                uint16_t opcode = (op_h << 8) | op_l;
-
-                if(opt_da_addr) printf("%04X:    ", i + VM_EXEC_START_ADDR);
-                if(opt_da_instr) printf("%02X %02X    ", op_h, op_l);
-                printf("%s\n", ch8_disassemble(opcode));
+        case MODE_DISASM: {
+            if(opt_da_cfg != NULL) {
+                ret = disasm_cfg(input_mem, input_sz, opt_da_cfg[0] == 'd', argv[optind]);
+                break;
+            }
+            char out[16384];
+            unsigned flags = (opt_da_addr ? CH8_DISASM_ADDR : 0) |
+                             (opt_da_instr ? CH8_DISASM_BYTES : 0);
+            const uint8_t *code = (const uint8_t *)input_mem;
+            size_t done = 0;
+            while(done + 2 <= input_sz) {
+                size_t consumed;
+                size_t len = ch8_disassemble_block(code + done, input_sz - done,
+                                                   VM_EXEC_START_ADDR + done, flags,
+                                                   out, sizeof(out), &consumed);
+                fwrite(out, 1, len, stdout);
+                done += consumed;
             }
             break;
+        }
         case MODE_EMULATOR:
-            emu_loop(input_mem, input_sz, opt_emu_scale, opt_emu_freq_mult);
+            if(opt_emu_ips == 0) {
+                opt_emu_ips = opt_emu_freq_mult * VM_TIMER_HZ;
+            }
+            if(opt_stacks != NULL && opt_profile == 0) {
+                opt_profile = CH8_PROFILE_EXACT;
+            }
+            emu_loop(input_mem, input_sz, opt_emu_scale, opt_emu_ips,
+                     opt_emu_engine, opt_emu_seed, opt_emu_rewind * 1024, opt_input_log,
+                     opt_trace, opt_profile, opt_stacks);
+            break;
+        case MODE_REPLAY:
+            ret = replay_loop(opt_input_log, input_mem, input_sz, opt_emu_engine);
             break;
         case MODE_DEBUG:
+        case MODE_FARM:
+        case MODE_CORPUS:
+        case MODE_TRACE:
             LOG_ERROR("this should not happen\n");
             break;
     }
 
     unload_file(input_mem, input_sz);
 
-    return 0;
+    return ret;
 }
@@ -20,8 +20,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "../chip8.h"
+#include "../chip8_mailbox.h"
+#include "../chip8_pacer.h"
+#include "../chip8_replay.h"
+#include "../chip8_trace.h"
 
 #define COL_RST "\033[0m"
 #define COL_RED "\033[1;31m"
@@ -62,6 +68,273 @@ static const uint8_t ram_zero[VM_RAM_SIZE] = { 0 };
 
 static int failed_tests_count = 0;
 
+static ch8_dcache_t dcache;
+static ch8_jit_t jit;
+static uint8_t bpoints[VM_BPOINTS_SZ];
+
+#define BATCH_LANES 40
+static ch8_batch_t batch;
+static ch8_t lanes_ref[BATCH_LANES];
+static ch8_t lanes_vm[BATCH_LANES];
+
+static ch8_rewind_t history;
+static ch8_timeline_t timeline;
+static uint64_t timeline_hashes[5000];
+static input_log_t input_log;
+
+/*
+ * Self modifying test program, overwrites the instruction at 0x206
+ * with ADD V0, 5 after executing it once.
+ */
+static const uint8_t rom_smc[] = {
+    0xA2, 0x06, // LD I, 0x206
+    0x60, 0x70, // LD V0, 0x70
+    0x61, 0x05, // LD V1, 0x05
+    0x62, 0x01, // LD V2, 1
+    0xF1, 0x55, // LD [I], V1
+    0x12, 0x06  // JP 0x206
+};
+
+/*
+ * Loops over most of the instruction set, register values keep
+ * changing between iterations.
+ */
+static const uint8_t rom_ops[] = {
+    0x60, 0x05, // 0x200 LD V0, 5
+    0x61, 0xFB, // 0x202 LD V1, 0xFB
+    0x80, 0x14, // 0x204 ADD V0, V1
+    0x8F, 0x14, // 0x206 ADD VF, V1
+    0x80, 0x15, // 0x208 SUB V0, V1
+    0x81, 0x07, // 0x20A SUBN V1, V0
+    0x82, 0x06, // 0x20C SHR V2
+    0x81, 0x0E, // 0x20E SHL V1
+    0x8F, 0x06, // 0x210 SHR VF
+    0x83, 0x12, // 0x212 AND V3, V1
+    0x83, 0x11, // 0x214 OR V3, V1
+    0x84, 0x03, // 0x216 XOR V4, V0
+    0x74, 0x07, // 0x218 ADD V4, 7
+    0x22, 0x30, // 0x21A CALL 0x230
+    0x34, 0x03, // 0x21C SE V4, 3
+    0x44, 0x00, // 0x21E SNE V4, 0
+    0x50, 0x10, // 0x220 SE V0, V1
+    0x90, 0x10, // 0x222 SNE V0, V1
+    0xA3, 0x00, // 0x224 LD I, 0x300
+    0xF4, 0x33, // 0x226 LD B, V4
+    0xF2, 0x65, // 0x228 LD V2, [I]
+    0xF0, 0x1E, // 0x22A ADD I, V0
+    0x12, 0x04, // 0x22C JP 0x204
+    0x00, 0x00, // 0x22E
+    0xF4, 0x29, // 0x230 LD F, V4
+    0xD0, 0x15, // 0x232 DRW V0, V1, 5
+    0x8F, 0x40, // 0x234 LD VF, V4
+    0xF3, 0x15, // 0x236 LD DT, V3
+    0xF5, 0x07, // 0x238 LD V5, DT
+    0xF6, 0x18, // 0x23A LD ST, V6
+    0xA3, 0x40, // 0x23C LD I, 0x340
+    0xF7, 0x55, // 0x23E LD [I], V7
+    0x00, 0xEE  // 0x240 RET
+};
+
+/*
+ * Lanes take one of two paths depending on RND and meet again at 0x20C,
+ * VF is used as an operand.
+ */
+static const uint8_t rom_diverge[] = {
+    0xC0, 0x01, // 0x200 RND V0, 1
+    0x30, 0x00, // 0x202 SE V0, 0
+    0x12, 0x0A, // 0x204 JP 0x20A
+    0x71, 0x01, // 0x206 ADD V1, 1
+    0x12, 0x0C, // 0x208 JP 0x20C
+    0x72, 0x01, // 0x20A ADD V2, 1
+    0x83, 0x14, // 0x20C ADD V3, V1
+    0x8F, 0x24, // 0x20E ADD VF, V2
+    0x83, 0xF5, // 0x210 SUB V3, VF
+    0x12, 0x00  // 0x212 JP 0x200
+};
+
+/*
+ * Waits for the delay timer to run out, then counts in V1.
+ */
+static const uint8_t rom_delay[] = {
+    0x63, 0x05, // 0x200 LD V3, 5
+    0xF3, 0x15, // 0x202 LD DT, V3
+    0xF0, 0x07, // 0x204 LD V0, DT
+    0x30, 0x00, // 0x206 SE V0, 0
+    0x12, 0x04, // 0x208 JP 0x204
+    0x71, 0x01, // 0x20A ADD V1, 1
+    0x12, 0x0A  // 0x20C JP 0x20A
+};
+
+/*
+ * Counts key 3 presses in V1 and mixes RND into V3.
+ */
+static const uint8_t rom_keys[] = {
+    0x60, 0x03, // 0x200 LD V0, 3
+    0xE0, 0xA1, // 0x202 SKNP V0
+    0x71, 0x01, // 0x204 ADD V1, 1
+    0xC2, 0xFF, // 0x206 RND V2, 0xFF
+    0x83, 0x24, // 0x208 ADD V3, V2
+    0x12, 0x02  // 0x20A JP 0x202
+};
+
+/*
+ * Run rom_keys for 5000 instructions through the timeline, pressing key
+ * 3 for a while and editing V5 on the way, and hash every step.
+ */
+static void timeline_record(ch8_t *vm)
+{
+    ch8_load(vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+    ch8_seed(vm, 3);
+    ch8_timeline_init(&timeline, vm);
+    for(uint32_t c = 0; c < 5000; ++c) {
+        if(c == 1000 || c == 2500) {
+            ch8_timeline_key(&timeline, vm, 3, c == 1000);
+        }
+        if(c == 3000) {
+            vm->v[5] = 0x55;
+            ch8_timeline_edit(&timeline, vm);
+        }
+        timeline_hashes[c] = ch8_hash(vm);
+        ch8_timeline_run(&timeline, vm, 1);
+    }
+}
+
+/*
+ * Waits for a key, then for the delay timer, and mixes RND into V4.
+ */
+static const uint8_t rom_wait[] = {
+    0xF0, 0x0A, // 0x200 LD V0, K
+    0x61, 0x05, // 0x202 LD V1, 5
+    0xF1, 0x15, // 0x204 LD DT, V1
+    0xF2, 0x07, // 0x206 LD V2, DT
+    0x32, 0x00, // 0x208 SE V2, 0
+    0x12, 0x06, // 0x20A JP 0x206
+    0xC3, 0xFF, // 0x20C RND V3, 0xFF
+    0x84, 0x34, // 0x20E ADD V4, V3
+    0x12, 0x00  // 0x210 JP 0x200
+};
+
+/* a subroutine drawing a sprite that follows the code, and a word of data that is never run */
+static const uint8_t rom_cfg[] = {
+    0x22, 0x0A, // 0x200 CALL 0x20A
+    0x3A, 0x01, // 0x202 SE VA, 1
+    0x12, 0x02, // 0x204 JP 0x202
+    0x12, 0x06, // 0x206 JP 0x206
+    0xFF, 0xFF, // 0x208 data
+    0xA2, 0x10, // 0x20A LD I, 0x210
+    0xD0, 0x13, // 0x20C DRW V0, V1, 3
+    0x00, 0xEE, // 0x20E RET
+    0x18, 0x3C, 0x18, 0x00 // 0x210 sprite
+};
+
+static ch8_cfg_t cfg;
+static ch8_profile_t prof;
+
+#define MAILBOX_TEST_FRAMES 20000
+#define MAILBOX_TEST_EVENTS 100000
+static mailbox_tbuf_t tbuf;
+static mailbox_queue_t queue;
+static trace_t trace;
+
+/* publishes frames with every row set to the frame number */
+static void *tbuf_producer(void *arg)
+{
+    (void)arg;
+    for(uint64_t i = 1; i <= MAILBOX_TEST_FRAMES; ++i) {
+        mailbox_frame_t *frame = mailbox_tbuf_back(&tbuf);
+        for(int y = 0; y < VM_SCREEN_HEIGHT; ++y) {
+            frame->vram[y] = i;
+        }
+        mailbox_tbuf_publish(&tbuf);
+    }
+    return NULL;
+}
+
+static void *queue_producer(void *arg)
+{
+    (void)arg;
+    for(uint32_t i = 0; i < MAILBOX_TEST_EVENTS; ++i) {
+        mailbox_event_t ev = { .type = MAILBOX_KEY, .key = i & 0xFF, .state = (i >> 8) & 0xFF };
+        while(!mailbox_queue_push(&queue, &ev)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Play rom_wait the way the emulator does for 600 frames with the plain
+ * interpreter, holding key 5 now and then and speeding up for a while,
+ * and log the session.
+ */
+static void input_record(ch8_t *vm)
+{
+    ch8_load(vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+    ch8_seed(vm, 7);
+    input_log_init(&input_log, vm, 7);
+    for(uint32_t frame = 0; frame < 600; ++frame) {
+        uint8_t state = frame % 50 < 3;
+        if(vm->keys[5] != state) {
+            vm->keys[5] = state;
+            input_log_key(&input_log, vm->cycles, 5, state);
+        }
+        uint32_t len = frame >= 200 && frame < 300 ? 100 : 10;
+        input_log_frame(&input_log, vm->cycles, len);
+        ch8_tick_timers(vm);
+        for(uint32_t i = 0; i < len; ++i) {
+            ch8_tick(vm);
+        }
+    }
+    input_log_end(&input_log, vm);
+}
+
+/*
+ * Run ref through ch8_tick and vm through ch8_run for the same amount
+ * of frames, then compare everything but the idle counter.
+ */
+static int idle_matches(ch8_t *vm, ch8_t *ref, uint32_t frames, uint32_t cycles)
+{
+    for(uint32_t f = 0; f < frames; ++f) {
+        ch8_tick_timers(ref);
+        ch8_tick_timers(vm);
+        for(uint32_t c = 0; c < cycles; ++c) {
+            ch8_tick(ref);
+        }
+        uint64_t end = vm->cycles + cycles;
+        while(vm->cycles < end) {
+            ch8_run(vm, end - vm->cycles);
+        }
+    }
+
+    ch8_t cmp = *vm;
+    cmp.dcache = NULL;
+    cmp.jit = NULL;
+    cmp.idle_cycles = 0;
+    return memcmp(&cmp, ref, sizeof(cmp)) == 0;
+}
+
+/*
+ * Run every lane through ch8_tick_timers and ch8_tick and through the
+ * batch, then compare.
+ */
+static int batch_matches(uint32_t frames, uint32_t cycles)
+{
+    memcpy(lanes_vm, lanes_ref, sizeof(lanes_ref));
+    for(uint32_t l = 0; l < BATCH_LANES; ++l) {
+        for(uint32_t f = 0; f < frames; ++f) {
+            ch8_tick_timers(&lanes_ref[l]);
+            for(uint32_t c = 0; c < cycles; ++c) {
+                ch8_tick(&lanes_ref[l]);
+            }
+        }
+    }
+
+    ch8_batch_init(&batch, lanes_vm, BATCH_LANES);
+    ch8_batch_run(&batch, frames, cycles);
+
+    return memcmp(lanes_vm, lanes_ref, sizeof(lanes_ref)) == 0;
+}
+
 int main(void)
 {
     printf("Running hnc8 instruction set tests...\n\n");
@@ -71,11 +344,12 @@ int main(void)
         TEST(
             name = "CLS";
 
-            const size_t vr_sz = VM_SCREEN_WIDTH * VM_SCREEN_HEIGHT;
-            memset(vm.vram, 0, vr_sz);
+            memset(vm.vram, 0xFF, sizeof(vm.vram));
+            vm.vram[3] = 0;
             ch8_exec(&vm, 0x00E0);
 
-            EXPECT(memcmp(vm.vram, ram_zero, vr_sz) == 0);
+            EXPECT(memcmp(vm.vram, ram_zero, sizeof(vm.vram)) == 0);
+            EXPECT(vm.vram_dirty == ~((uint32_t)1 << 3));
         );
         TEST(
             name = "RET";
@@ -354,6 +628,49 @@ int main(void)
 
             EXPECT(vm.v[0] != 0);
         );
+        TEST(
+            name = "RND mask";
+
+            ch8_seed(&vm, 1);
+            for(int i = 0; i < 64; ++i) {
+                ch8_exec(&vm, 0xC00A);
+                EXPECT((vm.v[0] & ~0x0A) == 0);
+            }
+        );
+        TEST(
+            name = "RND seed is reproducible";
+
+            ch8_t a, b;
+            ch8_init(&a);
+            ch8_init(&b);
+            ch8_seed(&a, 0x1234);
+            ch8_seed(&b, 0x1234);
+            int same = 1;
+            for(int i = 0; i < 64; ++i) {
+                ch8_exec(&a, 0xC0FF);
+                ch8_exec(&b, 0xC0FF);
+                same &= a.v[0] == b.v[0];
+            }
+
+            EXPECT(same);
+        );
+        TEST(
+            name = "RND VMs are independent";
+
+            ch8_t a, b;
+            ch8_init(&a);
+            ch8_init(&b);
+            ch8_seed(&a, 1);
+            ch8_seed(&b, 2);
+            int same = 1;
+            for(int i = 0; i < 8; ++i) {
+                ch8_exec(&a, 0xC0FF);
+                ch8_exec(&b, 0xC0FF);
+                same &= a.v[0] == b.v[0];
+            }
+
+            EXPECT(!same);
+        );
     }
 
     {
@@ -361,10 +678,44 @@ int main(void)
         TEST(
             name = "DRW";
 
-            vm.v[0] = 0x00;
-            ch8_exec(&vm, 0xD0FF);
+            ch8_init(&vm);
+            vm.v[0] = 1;
+            vm.v[1] = 2;
+            ch8_exec(&vm, 0xF029);
+            ch8_exec(&vm, 0xD015);
+
+            /* top row of the "1" glyph is 0x20 */
+            EXPECT(vm.vram[2] == (uint64_t)0x20 << 55);
+            EXPECT(ch8_vram_pixel(&vm, 3, 2));
+            EXPECT(!ch8_vram_pixel(&vm, 2, 2));
+            EXPECT(vm.v[0xF] == 0);
+            EXPECT(vm.vram_dirty == 0x7C);
+        );
 
-            EXPECT(0);
+        TEST(
+            name = "DRW collision";
+
+            ch8_init(&vm);
+            ch8_exec(&vm, 0xD015);
+            ch8_exec(&vm, 0xD015);
+
+            EXPECT(vm.v[0xF] == 1);
+            EXPECT(memcmp(vm.vram, ram_zero, sizeof(vm.vram)) == 0);
+        );
+
+        TEST(
+            name = "DRW wraps into next row";
+
+            ch8_init(&vm);
+            vm.v[0] = 60;
+            vm.v[1] = 31;
+            vm.ram[0x300] = 0xFF;
+            vm.i = 0x300;
+            ch8_exec(&vm, 0xD011);
+
+            EXPECT(vm.vram[31] == 0xF);
+            EXPECT(vm.vram[0] == (uint64_t)0xF << 60);
+            EXPECT(vm.vram_dirty == (1 | (uint32_t)1 << 31));
         );
     }
 
@@ -380,6 +731,16 @@ int main(void)
             EXPECT(vm.pc == 2);
         );
 
+        TEST(
+            name = "SKP key out of range";
+
+            vm.v[0] = 0x13;
+            vm.keys[3] = 1;
+            ch8_exec(&vm, 0xE09E);
+
+            EXPECT(vm.pc == 2);
+        );
+
         TEST(
             name = "SKNP";
 
@@ -487,6 +848,1097 @@ int main(void)
         );
     }
 
+    {
+        TESTGROUP("Decoded cache");
+        TEST(
+            name = "Matches interpreter";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_dcache_attach(&vm, &dcache);
+
+            for(int i = 0; i < 64; ++i) {
+                ch8_tick(&ref);
+                ch8_tick_cached(&vm);
+                vm.dcache = NULL;
+                EXPECT(memcmp(&ref, &vm, sizeof(vm)) == 0);
+                vm.dcache = &dcache;
+            }
+        );
+
+        TEST(
+            name = "Invalidate on LD [I], Vx";
+
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_dcache_attach(&vm, &dcache);
+
+            for(int i = 0; i < 7; ++i) {
+                ch8_tick_cached(&vm);
+            }
+
+            EXPECT(vm.v[0] == 0x75);
+        );
+    }
+
+    {
+        TESTGROUP("Threaded core");
+        TEST(
+            name = "Single steps match interpreter";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_dcache_attach(&vm, &dcache);
+
+            for(int i = 0; i < 1000; ++i) {
+                ch8_tick(&ref);
+                ch8_run_threaded(&vm, 1);
+                vm.dcache = NULL;
+                EXPECT(memcmp(&ref, &vm, sizeof(vm)) == 0);
+                vm.dcache = &dcache;
+            }
+        );
+
+        TEST(
+            name = "Batch matches interpreter";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+
+            for(int i = 0; i < 10000; ++i) {
+                ch8_tick(&ref);
+            }
+            EXPECT(ch8_run_threaded(&vm, 10000) == CH8_EXIT_CYCLES);
+            EXPECT(vm.cycles == 10000);
+
+            EXPECT(memcmp(&ref, &vm, sizeof(vm)) == 0);
+        );
+    }
+
+    {
+        TESTGROUP("Recompiler");
+        TEST(
+            name = "Lockstep with interpreter";
+
+            ch8_t ref;
+            ch8_jit_init(&jit);
+            ch8_load(&ref, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_jit_attach(&vm, &jit);
+
+            /* vary the budget so blocks get split at every offset */
+            for(uint32_t i = 0; i < 2000; ++i) {
+                uint32_t budget = 1 + i % 17;
+                for(uint32_t j = 0; j < budget; ++j) {
+                    ch8_tick(&ref);
+                }
+                while(vm.cycles < ref.cycles) {
+                    ch8_run_jit(&vm, ref.cycles - vm.cycles);
+                }
+                vm.jit = NULL;
+                EXPECT(memcmp(&ref, &vm, sizeof(vm)) == 0);
+                vm.jit = &jit;
+            }
+        );
+
+        TEST(
+            name = "Invalidate on LD [I], Vx";
+
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_jit_attach(&vm, &jit);
+
+            EXPECT(ch8_run_jit(&vm, 7) == CH8_EXIT_CYCLES);
+            EXPECT(vm.v[0] == 0x75);
+
+            ch8_jit_free(&jit);
+        );
+    }
+
+    {
+        TESTGROUP("Run exit reasons");
+        TEST(
+            name = "Cycle budget";
+
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_CYCLES);
+            EXPECT(vm.cycles == 100);
+        );
+
+        TEST(
+            name = "Breakpoint";
+
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            memset(bpoints, 0, sizeof(bpoints));
+            ch8_bpoint_set(bpoints, 0x20A, true);
+            vm.bpoints = bpoints;
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_BREAKPOINT);
+            EXPECT(vm.pc == 0x20A);
+            EXPECT(vm.cycles == 5);
+
+            /* continuing steps over the breakpoint it stopped on */
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_BREAKPOINT);
+            EXPECT(vm.pc == 0x20A);
+            EXPECT(vm.cycles == 8);
+        );
+
+        TEST(
+            name = "Framebuffer changed";
+
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_VRAM);
+            EXPECT(vm.pc == 0x234);
+        );
+
+        TEST(
+            name = "Key wait";
+
+            const uint8_t rom[] = { 0xF3, 0x0A };
+            ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_KEYWAIT);
+            EXPECT(vm.pc == 0x200);
+            EXPECT(vm.cycles == 1);
+
+            vm.keys[5] = 1;
+            EXPECT(ch8_run(&vm, 1) == CH8_EXIT_CYCLES);
+            EXPECT(vm.pc == 0x202);
+            EXPECT(vm.v[3] == 5);
+        );
+
+        TEST(
+            name = "Invalid opcode";
+
+            const uint8_t rom[] = { 0x00, 0x00, 0xFF, 0xFF };
+            ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_INVALID);
+            EXPECT(vm.pc == 0x204);
+        );
+
+        TEST(
+            name = "Breakpoint inside recompiled block";
+
+            ch8_jit_init(&jit);
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_jit_attach(&vm, &jit);
+            memset(bpoints, 0, sizeof(bpoints));
+            ch8_bpoint_set(bpoints, 0x20C, true);
+            vm.bpoints = bpoints;
+
+            EXPECT(ch8_run(&vm, 100) == CH8_EXIT_BREAKPOINT);
+            EXPECT(vm.pc == 0x20C);
+            EXPECT(vm.cycles == 6);
+
+            ch8_jit_free(&jit);
+        );
+    }
+
+    {
+        TESTGROUP("Framebuffer");
+        TEST(
+            name = "Dirty row spans";
+
+            uint32_t dirty = 0x8000000F | (0x3 << 8);
+            uint8_t first, rows;
+
+            EXPECT(ch8_vram_next_span(&dirty, &first, &rows));
+            EXPECT(first == 0 && rows == 4);
+            EXPECT(ch8_vram_next_span(&dirty, &first, &rows));
+            EXPECT(first == 8 && rows == 2);
+            EXPECT(ch8_vram_next_span(&dirty, &first, &rows));
+            EXPECT(first == 31 && rows == 1);
+            EXPECT(!ch8_vram_next_span(&dirty, &first, &rows));
+        );
+
+        TEST(
+            name = "Unpack rows";
+
+            uint8_t out[VM_SCREEN_WIDTH * 2];
+            vm.vram[4] = (uint64_t)1 << 63;
+            vm.vram[5] = 1;
+            ch8_vram_unpack_rows(&vm, out, 4, 2);
+
+            EXPECT(out[0] == 0xFF && out[1] == 0x00);
+            EXPECT(out[2 * VM_SCREEN_WIDTH - 1] == 0xFF);
+            EXPECT(out[2 * VM_SCREEN_WIDTH - 2] == 0x00);
+        );
+    }
+
+    {
+        TESTGROUP("Idle loops");
+        TEST(
+            name = "Delay timer poll";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_delay, sizeof(rom_delay));
+            ch8_load(&vm, (const uint16_t *)rom_delay, sizeof(rom_delay));
+            ch8_dcache_attach(&vm, &dcache);
+
+            /* DT is set to 5 in the first frame and reaches 0 in the sixth */
+            EXPECT(idle_matches(&vm, &ref, 5, 500));
+            EXPECT(vm.idle_cycles > 4 * 490);
+            EXPECT(vm.v[1] == 0);
+
+            /* timer ran out, the counting loop is not idle */
+            uint64_t idle = vm.idle_cycles;
+            EXPECT(idle_matches(&vm, &ref, 4, 500));
+            EXPECT(vm.v[1] != 0);
+            EXPECT(vm.idle_cycles == idle);
+        );
+        TEST(
+            name = "Delay timer poll, recompiler";
+
+            ch8_t ref;
+            ch8_jit_init(&jit);
+            ch8_load(&ref, (const uint16_t *)rom_delay, sizeof(rom_delay));
+            ch8_load(&vm, (const uint16_t *)rom_delay, sizeof(rom_delay));
+            ch8_jit_attach(&vm, &jit);
+
+            EXPECT(idle_matches(&vm, &ref, 8, 500));
+            EXPECT(vm.idle_cycles > 3 * 490);
+            ch8_jit_free(&jit);
+        );
+        TEST(
+            name = "Jump to self";
+
+            ch8_t ref;
+            const uint8_t rom[] = { 0x60, 0x01, 0x12, 0x02 };
+            ch8_load(&ref, (const uint16_t *)rom, sizeof(rom));
+            ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+
+            EXPECT(idle_matches(&vm, &ref, 1, 1001));
+            EXPECT(vm.idle_cycles == 998);
+        );
+        TEST(
+            name = "RND is not idle";
+
+            ch8_t ref;
+            const uint8_t rom[] = { 0xC0, 0x01, 0x12, 0x00 };
+            ch8_load(&ref, (const uint16_t *)rom, sizeof(rom));
+            ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+
+            EXPECT(idle_matches(&vm, &ref, 1, 1000));
+            EXPECT(vm.idle_cycles == 0);
+        );
+    }
+
+    {
+        TESTGROUP("Batch");
+        TEST(
+            name = "Lane count";
+
+            EXPECT(ch8_batch_init(&batch, lanes_vm, 0) != 0);
+            EXPECT(ch8_batch_init(&batch, lanes_vm, CH8_BATCH_MAX + 1) != 0);
+            EXPECT(ch8_batch_init(&batch, lanes_vm, 1) == 0);
+        );
+        TEST(
+            name = "Lockstep matches ch8_tick";
+
+            for(uint32_t l = 0; l < BATCH_LANES; ++l) {
+                ch8_load(&lanes_ref[l], (const uint16_t *)rom_ops, sizeof(rom_ops));
+                for(uint8_t r = 2; r < 8; ++r) {
+                    lanes_ref[l].v[r] = l * r;
+                }
+            }
+
+            EXPECT(batch_matches(10, 50));
+            EXPECT(batch.lockstep > 0);
+        );
+        TEST(
+            name = "Divergent lanes";
+
+            for(uint32_t l = 0; l < BATCH_LANES; ++l) {
+                ch8_load(&lanes_ref[l], (const uint16_t *)rom_diverge, sizeof(rom_diverge));
+                ch8_seed(&lanes_ref[l], l);
+            }
+
+            EXPECT(batch_matches(4, 100));
+            EXPECT(batch.lockstep > 0);
+            EXPECT(batch.scalar > 0);
+        );
+    }
+
+    {
+        TESTGROUP("Disassembler");
+        TEST(
+            name = "Results live in the caller's buffer";
+
+            char a[CH8_DISASM_MAX], b[CH8_DISASM_MAX];
+            const char *da = ch8_disassemble(0xD125, a);
+            const char *db = ch8_disassemble(0xA2F0, b);
+            EXPECT(da == a && db == b);
+            EXPECT(strcmp(a, "DRW V1, V2, 5") == 0);
+            EXPECT(strcmp(b, "LD I, 0x02F0") == 0);
+        );
+        TEST(
+            name = "Every form";
+
+            char buf[CH8_DISASM_MAX];
+            EXPECT(strcmp(ch8_disassemble(0x00E0, buf), "CLS") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x00EE, buf), "RET") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x0005, buf), "NOP") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x00E5, buf), "UNKNOWN") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x1234, buf), "JP 0x0234") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x3AFF, buf), "SE VA, 255") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x7B09, buf), "ADD VB, 9") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x8CDE, buf), "SHL VC, VD") == 0);
+            EXPECT(strcmp(ch8_disassemble(0x8CD8, buf), "UNKNOWN") == 0);
+            EXPECT(strcmp(ch8_disassemble(0xB12A, buf), "JP V0, 012A") == 0);
+            EXPECT(strcmp(ch8_disassemble(0xDEFF, buf), "DRW VE, VF, 15") == 0);
+            EXPECT(strcmp(ch8_disassemble(0xE3A1, buf), "SKNP V3") == 0);
+            EXPECT(strcmp(ch8_disassemble(0xF465, buf), "LD V4, [I]") == 0);
+            EXPECT(strcmp(ch8_disassemble(0xF4FF, buf), "UNKNOWN") == 0);
+        );
+        TEST(
+            name = "Small buffers are cut short";
+
+            char buf[8];
+            EXPECT(ch8_disassemble_r(0xDEFF, buf, sizeof(buf)) == 7);
+            EXPECT(strcmp(buf, "DRW VE,") == 0);
+            EXPECT(ch8_disassemble_r(0xDEFF, buf, 0) == 0);
+        );
+        TEST(
+            name = "Whole blocks";
+
+            char out[CH8_DISASM_LINE_MAX + 30];
+            size_t done;
+            size_t len = ch8_disassemble_block(rom_keys, sizeof(rom_keys), 0x200,
+                                               CH8_DISASM_ADDR | CH8_DISASM_BYTES,
+                                               out, sizeof(out), &done);
+            const char *expect = "0200:    60 03    LD V0, 3\n"
+                                 "0202:    E0 A1    SKNP V0\n";
+            EXPECT(done == 4);
+            EXPECT(len == strlen(expect) && memcmp(out, expect, len) == 0);
+
+            /* a trailing odd byte is left over */
+            len = ch8_disassemble_block(rom_keys, 3, 0x200, 0, out, sizeof(out), &done);
+            EXPECT(done == 2 && len == 9 && memcmp(out, "LD V0, 3\n", 9) == 0);
+        );
+    }
+
+    {
+        TESTGROUP("Control flow");
+        TEST(
+            name = "Code and data are told apart";
+
+            ch8_load(&vm, (const uint16_t *)rom_cfg, sizeof(rom_cfg));
+            ch8_cfg_build(&cfg, vm.ram, 0x200, 0x200 + sizeof(rom_cfg));
+            EXPECT(cfg.insn_count == 7);
+            EXPECT(cfg.sub_count == 1);
+            EXPECT(cfg.map[0x20A] & CH8_CFG_SUB);
+            EXPECT(!(cfg.map[0x208] & CH8_CFG_CODE));
+            EXPECT((cfg.map[0x210] & (CH8_CFG_REF | CH8_CFG_SPRITE)) == (CH8_CFG_REF | CH8_CFG_SPRITE));
+            EXPECT(cfg.map[0x212] & CH8_CFG_SPRITE);
+            EXPECT(!(cfg.map[0x213] & CH8_CFG_SPRITE));
+        );
+        TEST(
+            name = "Writes into code";
+
+            static const uint8_t rom[] = {
+                0xA2, 0x06, // 0x200 LD I, 0x206
+                0xF1, 0x55, // 0x202 LD [I], V1
+                0x12, 0x06, // 0x204 JP 0x206
+                0x12, 0x06  // 0x206 JP 0x206
+            };
+            ch8_load(&vm, (const uint16_t *)rom, sizeof(rom));
+            ch8_cfg_build(&cfg, vm.ram, 0x200, 0x200 + sizeof(rom));
+            EXPECT((cfg.map[0x206] & (CH8_CFG_CODE | CH8_CFG_WRITE)) == (CH8_CFG_CODE | CH8_CFG_WRITE));
+            EXPECT((cfg.map[0x207] & (CH8_CFG_CODE | CH8_CFG_WRITE)) == (CH8_CFG_CODE | CH8_CFG_WRITE));
+            EXPECT(!(cfg.map[0x208] & CH8_CFG_WRITE));
+            EXPECT(!(cfg.map[0x210] & CH8_CFG_WRITE));
+        );
+        TEST(
+            name = "Basic blocks";
+
+            ch8_load(&vm, (const uint16_t *)rom_cfg, sizeof(rom_cfg));
+            ch8_cfg_build(&cfg, vm.ram, 0x200, 0x200 + sizeof(rom_cfg));
+            EXPECT(cfg.block_count == 5);
+            const ch8_block_t *b = cfg.blocks;
+            EXPECT(b[0].start == 0x200 && b[0].flags == CH8_BLOCK_CALL && b[0].call == 0x20A);
+            EXPECT(b[0].succ_count == 1 && b[0].succ[0] == 0x202);
+            EXPECT(b[1].start == 0x202 && b[1].flags == CH8_BLOCK_SKIP);
+            EXPECT(b[1].succ_count == 2 && b[1].succ[0] == 0x204 && b[1].succ[1] == 0x206);
+            EXPECT(b[2].succ_count == 1 && b[2].succ[0] == 0x202);
+            EXPECT(b[3].succ_count == 1 && b[3].succ[0] == 0x206);
+            EXPECT(b[4].start == 0x20A && b[4].end == 0x210 && b[4].flags == CH8_BLOCK_RET);
+            EXPECT(b[4].succ_count == 0);
+        );
+        TEST(
+            name = "Assembly and DOT output";
+
+            ch8_load(&vm, (const uint16_t *)rom_cfg, sizeof(rom_cfg));
+            ch8_cfg_build(&cfg, vm.ram, 0x200, 0x200 + sizeof(rom_cfg));
+            char out[2048];
+            FILE *f = tmpfile();
+            EXPECT(f != NULL);
+            EXPECT(ch8_cfg_write_asm(&cfg, vm.ram, f) == 0);
+            rewind(f);
+            size_t len = fread(out, 1, sizeof(out) - 1, f);
+            out[len] = '\0';
+            EXPECT(strstr(out, "\nsub_20A:\n") != NULL);
+            EXPECT(strstr(out, "CALL 0x020A") != NULL && strstr(out, "; sub_20A") != NULL);
+            EXPECT(strstr(out, "db 0xFF, 0xFF\n") != NULL);
+            EXPECT(strstr(out, "\nspr_210:\n") != NULL && strstr(out, "; ...##...") != NULL);
+
+            fclose(f);
+            f = tmpfile();
+            EXPECT(f != NULL);
+            EXPECT(ch8_cfg_write_dot(&cfg, vm.ram, "cfg", f) == 0);
+            rewind(f);
+            len = fread(out, 1, sizeof(out) - 1, f);
+            out[len] = '\0';
+            EXPECT(strncmp(out, "digraph \"cfg\" {\n", 16) == 0);
+            EXPECT(strstr(out, "b0202 -> b0206 [label=\"skip\"];") != NULL);
+            EXPECT(strstr(out, "b0200 -> b020A [style=dashed label=\"call\"];") != NULL);
+            fclose(f);
+        );
+    }
+
+    {
+        TESTGROUP("State hash");
+        TEST(
+            name = "Attachments and dirty rows are ignored";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_dcache_attach(&vm, &dcache);
+            vm.vram_dirty = 0xFF;
+
+            EXPECT(ch8_hash(&vm) == ch8_hash(&ref));
+        );
+        TEST(
+            name = "State changes change the hash";
+
+            ch8_t ref;
+            ch8_load(&ref, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            uint64_t h = ch8_hash(&vm);
+            vm.ram[VM_RAM_SIZE - 1] ^= 1;
+            EXPECT(ch8_hash(&vm) != h);
+            ch8_seed(&ref, 1);
+            EXPECT(ch8_hash(&ref) != h);
+        );
+    }
+
+    {
+        TESTGROUP("Snapshots");
+        TEST(
+            name = "Full snapshot round trip";
+
+            ch8_t ref;
+            uint8_t snap[CH8_SNAPSHOT_MAX];
+            ch8_load(&ref, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            ch8_seed(&ref, 7);
+            for(int t = 0; t < 300; ++t) {
+                ch8_tick(&ref);
+            }
+            ref.keys[3] = 1;
+
+            size_t size = ch8_snapshot_save(&ref, NULL, snap, sizeof(snap));
+            EXPECT(size == CH8_SNAPSHOT_MAX);
+            ch8_init(&vm);
+            EXPECT(ch8_snapshot_load(&vm, NULL, snap, size) == 0);
+            EXPECT(ch8_hash(&vm) == ch8_hash(&ref));
+            EXPECT(vm.vram_dirty == UINT32_MAX);
+
+            for(int t = 0; t < 300; ++t) {
+                ch8_tick(&ref);
+                ch8_tick(&vm);
+            }
+            EXPECT(ch8_hash(&vm) == ch8_hash(&ref));
+        );
+        TEST(
+            name = "Delta snapshot under the recompiler";
+
+            ch8_t ref;
+            uint8_t base[VM_RAM_SIZE];
+            uint8_t snap[CH8_SNAPSHOT_MAX];
+            ch8_jit_init(&jit);
+            ch8_load(&ref, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            memcpy(base, ref.ram, sizeof(base));
+            for(int t = 0; t < 4; ++t) {
+                ch8_tick(&ref);
+            }
+
+            /* saved before the program patches itself */
+            size_t size = ch8_snapshot_save(&ref, base, snap, sizeof(snap));
+            EXPECT(size == CH8_SNAPSHOT_HDR);
+
+            ch8_load(&vm, (const uint16_t *)rom_smc, sizeof(rom_smc));
+            ch8_jit_attach(&vm, &jit);
+            ch8_run(&vm, 20);
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size) == 0);
+            EXPECT(ch8_hash(&vm) == ch8_hash(&ref));
+
+            for(int t = 0; t < 20; ++t) {
+                ch8_tick(&ref);
+            }
+            ch8_run(&vm, 20);
+            EXPECT(ch8_hash(&vm) == ch8_hash(&ref));
+
+            size = ch8_snapshot_save(&vm, base, snap, sizeof(snap));
+            EXPECT(size == CH8_SNAPSHOT_HDR + 64);
+            ch8_jit_free(&jit);
+        );
+        TEST(
+            name = "Bad snapshots are rejected";
+
+            uint8_t base[VM_RAM_SIZE];
+            uint8_t snap[CH8_SNAPSHOT_MAX];
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            memcpy(base, vm.ram, sizeof(base));
+            vm.ram[0x300] = 1;
+
+            EXPECT(ch8_snapshot_save(&vm, base, snap, CH8_SNAPSHOT_HDR) == 0);
+            size_t size = ch8_snapshot_save(&vm, base, snap, sizeof(snap));
+            uint64_t h = ch8_hash(&vm);
+
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size - 1) != 0);
+            EXPECT(ch8_snapshot_load(&vm, NULL, snap, size) != 0);
+            base[0x200] ^= 1;
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size) != 0);
+            base[0x200] ^= 1;
+            snap[200] ^= 1;
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size) != 0);
+            snap[200] ^= 1;
+            snap[6] ^= 1;
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size) != 0);
+            snap[6] ^= 1;
+            EXPECT(ch8_hash(&vm) == h);
+            EXPECT(ch8_snapshot_load(&vm, base, snap, size) == 0);
+        );
+    }
+
+    {
+        TESTGROUP("Rewind");
+        TEST(
+            name = "Step back through every frame";
+
+            uint64_t hashes[50];
+            ch8_rewind_init(&history, 64 * 1024);
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            for(int f = 0; f < 50; ++f) {
+                ch8_tick_timers(&vm);
+                ch8_run(&vm, 37);
+                hashes[f] = ch8_hash(&vm);
+                ch8_rewind_push(&history, &vm);
+            }
+
+            EXPECT(history.count == 49);
+            bool same = true;
+            for(int f = 48; f >= 0; --f) {
+                same = same && ch8_rewind_pop(&history, &vm) == 0 && ch8_hash(&vm) == hashes[f];
+            }
+            EXPECT(same);
+            EXPECT(ch8_rewind_pop(&history, &vm) != 0);
+            EXPECT(ch8_hash(&vm) == hashes[0]);
+            ch8_rewind_free(&history);
+        );
+        TEST(
+            name = "Budget drops the oldest frames";
+
+            uint64_t hashes[200];
+            ch8_rewind_init(&history, 4096);
+            ch8_load(&vm, (const uint16_t *)rom_ops, sizeof(rom_ops));
+            for(int f = 0; f < 200; ++f) {
+                ch8_tick_timers(&vm);
+                ch8_run(&vm, 37);
+                hashes[f] = ch8_hash(&vm);
+                ch8_rewind_push(&history, &vm);
+            }
+
+            uint32_t held = history.count;
+            EXPECT(held > 10 && held < 199);
+            EXPECT(history.used <= 4096);
+
+            /* history continues from a rewound frame */
+            EXPECT(ch8_rewind_pop(&history, &vm) == 0);
+            EXPECT(ch8_rewind_pop(&history, &vm) == 0);
+            EXPECT(ch8_hash(&vm) == hashes[197]);
+            ch8_tick_timers(&vm);
+            ch8_run(&vm, 37);
+            EXPECT(ch8_hash(&vm) == hashes[198]);
+            ch8_rewind_push(&history, &vm);
+            EXPECT(ch8_rewind_pop(&history, &vm) == 0);
+            EXPECT(ch8_hash(&vm) == hashes[197]);
+
+            uint32_t popped = 0;
+            while(ch8_rewind_pop(&history, &vm) == 0) {
+                popped += 1;
+            }
+            EXPECT(popped == held - 2);
+            EXPECT(ch8_hash(&vm) == hashes[199 - held]);
+            ch8_rewind_free(&history);
+        );
+    }
+
+    {
+        TESTGROUP("Timeline");
+        TEST(
+            name = "Seek matches the recorded run";
+
+            timeline_record(&vm);
+            bool same = true;
+            for(int c = 4999; c > 0; c -= 7) {
+                same = same && ch8_timeline_seek(&timeline, &vm, c) == 0 &&
+                       ch8_hash(&vm) == timeline_hashes[c];
+            }
+            EXPECT(same);
+            EXPECT(ch8_timeline_seek(&timeline, &vm, 0) == 0);
+            EXPECT(ch8_hash(&vm) == timeline_hashes[0]);
+            EXPECT(vm.v[5] == 0);
+            ch8_timeline_free(&timeline);
+        );
+        TEST(
+            name = "Running again replays keys and edits";
+
+            timeline_record(&vm);
+            uint64_t end = ch8_hash(&vm);
+            ch8_timeline_seek(&timeline, &vm, 500);
+            ch8_timeline_run(&timeline, &vm, 4500);
+            EXPECT(ch8_hash(&vm) == end);
+            EXPECT(vm.v[5] == 0x55);
+
+            /* a key change rewrites what comes after it */
+            ch8_timeline_seek(&timeline, &vm, 2000);
+            ch8_timeline_key(&timeline, &vm, 3, 0);
+            ch8_timeline_run(&timeline, &vm, 3000);
+            EXPECT(ch8_hash(&vm) != end);
+            EXPECT(vm.v[5] == 0);
+            ch8_timeline_free(&timeline);
+        );
+        TEST(
+            name = "Reverse continue";
+
+            timeline_record(&vm);
+            memset(bpoints, 0, sizeof(bpoints));
+            ch8_bpoint_set(bpoints, 0x204, true);
+            vm.bpoints = bpoints;
+
+            /* key 3 was held from 1000 to 2500, the last ADD ran just before */
+            EXPECT(ch8_timeline_reverse_continue(&timeline, &vm) == 0);
+            EXPECT(vm.pc == 0x204);
+            EXPECT(vm.cycles < 2500 && vm.cycles > 2490);
+            EXPECT(ch8_hash(&vm) == timeline_hashes[vm.cycles]);
+            uint64_t hit = vm.cycles;
+            EXPECT(ch8_timeline_reverse_continue(&timeline, &vm) == 0);
+            EXPECT(vm.cycles == hit - 5);
+
+            ch8_timeline_seek(&timeline, &vm, 990);
+            EXPECT(ch8_timeline_reverse_continue(&timeline, &vm) != 0);
+            EXPECT(vm.cycles == 0);
+            vm.bpoints = NULL;
+            ch8_timeline_free(&timeline);
+        );
+        TEST(
+            name = "Long histories stay bounded";
+
+            ch8_load(&vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+            ch8_timeline_init(&timeline, &vm);
+            while(vm.cycles < 3000000) {
+                ch8_timeline_run(&timeline, &vm, 3000000 - vm.cycles);
+            }
+            uint64_t h = ch8_hash(&vm);
+            ch8_timeline_run(&timeline, &vm, 1);
+
+            EXPECT(timeline.ckpt_count <= CH8_TIMELINE_CKPTS);
+            EXPECT(vm.cycles - timeline.ckpts[timeline.ckpt_count - 1].cycles <= 1024);
+            EXPECT(ch8_timeline_seek(&timeline, &vm, 3000000) == 0);
+            EXPECT(ch8_hash(&vm) == h);
+            ch8_timeline_free(&timeline);
+        );
+    }
+
+    {
+        TESTGROUP("Input log");
+        TEST(
+            name = "Replay matches the recording on every engine";
+
+            input_record(&vm);
+            EXPECT(input_log.frame_count == 3);
+            EXPECT(vm.v[4] != 0);
+
+            ch8_load(&vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+            ch8_seed(&vm, 7);
+            EXPECT(input_log_replay(&input_log, &vm) == 0);
+
+            ch8_load(&vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+            ch8_seed(&vm, 7);
+            ch8_dcache_attach(&vm, &dcache);
+            EXPECT(input_log_replay(&input_log, &vm) == 0);
+
+            if(ch8_jit_init(&jit) == 0) {
+                ch8_load(&vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+                ch8_seed(&vm, 7);
+                ch8_jit_attach(&vm, &jit);
+                EXPECT(input_log_replay(&input_log, &vm) == 0);
+                ch8_jit_free(&jit);
+            }
+
+            /* another seed goes elsewhere */
+            ch8_load(&vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+            ch8_seed(&vm, 8);
+            EXPECT(input_log_replay(&input_log, &vm) != 0);
+            input_log_free(&input_log);
+        );
+        TEST(
+            name = "Going back forgets the future";
+
+            input_record(&vm);
+            uint64_t end = input_log.end_cycles;
+            input_log_truncate(&input_log, 2000);
+            EXPECT(input_log.keys[input_log.key_count - 1].cycles < 2000);
+            EXPECT(input_log.frames[input_log.frame_count - 1].cycles < 2000);
+            EXPECT(input_log.frame_count == 1);
+
+            /* unchanged lengths are not logged again */
+            input_log_frame(&input_log, 2000, 10);
+            EXPECT(input_log.frame_count == 1);
+            input_log_frame(&input_log, 2000, 20);
+            EXPECT(input_log.frame_count == 2);
+            EXPECT(end > 2000);
+            input_log_free(&input_log);
+        );
+        TEST(
+            name = "Save and load round trip";
+
+            const char *path = "hnc8_test_input.log";
+            input_record(&vm);
+            input_log_t loaded;
+            EXPECT(input_log_save(&input_log, path) == 0);
+            EXPECT(input_log_load(&loaded, path) == 0);
+            remove(path);
+            EXPECT(loaded.seed == 7);
+            EXPECT(loaded.start_hash == input_log.start_hash);
+            EXPECT(loaded.key_count == input_log.key_count);
+            EXPECT(loaded.frame_count == input_log.frame_count);
+            bool same = true;
+            for(uint32_t i = 0; i < loaded.key_count; ++i) {
+                same = same && loaded.keys[i].cycles == input_log.keys[i].cycles &&
+                       loaded.keys[i].key == input_log.keys[i].key &&
+                       loaded.keys[i].state == input_log.keys[i].state;
+            }
+            EXPECT(same);
+            EXPECT(loaded.end_cycles == input_log.end_cycles);
+            EXPECT(loaded.end_hash == input_log.end_hash);
+
+            ch8_load(&vm, (const uint16_t *)rom_wait, sizeof(rom_wait));
+            ch8_seed(&vm, loaded.seed);
+            EXPECT(input_log_replay(&loaded, &vm) == 0);
+            input_log_free(&loaded);
+            input_log_free(&input_log);
+        );
+        TEST(
+            name = "Debugger history as a log";
+
+            timeline_record(&vm);
+            /* the V5 edit at 3000 can't be replayed */
+            EXPECT(input_log_from_timeline(&input_log, &timeline, 4999) != 0);
+            EXPECT(input_log_from_timeline(&input_log, &timeline, 2999) == 0);
+            EXPECT(input_log.key_count == 2);
+            EXPECT(input_log.seed == 3);
+
+            ch8_timeline_seek(&timeline, &vm, 2999);
+            input_log_end(&input_log, &vm);
+            ch8_load(&vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+            ch8_seed(&vm, input_log.seed);
+            EXPECT(ch8_hash(&vm) == input_log.start_hash);
+            EXPECT(input_log_replay(&input_log, &vm) == 0);
+            EXPECT(ch8_hash(&vm) == timeline_hashes[2999]);
+            input_log_free(&input_log);
+            ch8_timeline_free(&timeline);
+        );
+    }
+
+    {
+        TESTGROUP("Pacer");
+        TEST(
+            name = "Instructions per second are exact";
+
+            pacer_t pacer;
+            pacer_init(&pacer, 60, 500);
+            uint32_t total = 0, lo = UINT32_MAX, hi = 0;
+            for(int f = 0; f < 60 * 3; ++f) {
+                uint32_t c = pacer_cycles(&pacer);
+                total += c;
+                lo = c < lo ? c : lo;
+                hi = c > hi ? c : hi;
+            }
+            EXPECT(total == 1500);
+            EXPECT(lo == 8 && hi == 9);
+        );
+        TEST(
+            name = "Deadlines";
+
+            pacer_t pacer;
+            pacer_init(&pacer, 60, 600);
+            uint64_t t0 = pacer.deadline, period = pacer.period_ns;
+            EXPECT(pacer_due(&pacer, t0) == 1);
+            EXPECT(pacer_due(&pacer, t0 + period / 2) == 0);
+            /* waking late doesn't move the schedule */
+            EXPECT(pacer_due(&pacer, t0 + period + period / 3) == 1);
+            EXPECT(pacer.deadline == t0 + 2 * period);
+            EXPECT(pacer.late == 0);
+        );
+        TEST(
+            name = "Catching up and dropping frames";
+
+            pacer_t pacer;
+            pacer_init(&pacer, 60, 600);
+            uint64_t t0 = pacer.deadline, period = pacer.period_ns;
+            EXPECT(pacer_due(&pacer, t0) == 1);
+            EXPECT(pacer_due(&pacer, t0 + 3 * period + 10) == 3);
+            EXPECT(pacer.deadline == t0 + 4 * period);
+            EXPECT(pacer.caught_up == 2 && pacer.dropped == 0);
+
+            /* a long stall starts the schedule over */
+            uint64_t t1 = t0 + 100 * period;
+            EXPECT(pacer_due(&pacer, t1) == PACER_MAX_CATCHUP);
+            EXPECT(pacer.deadline == t1 + period);
+            EXPECT(pacer.dropped == 96 - PACER_MAX_CATCHUP + 1);
+            EXPECT(pacer.frames == 1 + 3 + PACER_MAX_CATCHUP);
+        );
+        TEST(
+            name = "Sleeping to the deadline";
+
+            pacer_t pacer;
+            pacer_init(&pacer, 1000, 1000);
+            uint32_t frames = 0;
+            while(frames < 20) {
+                frames += pacer_wait(&pacer);
+            }
+            EXPECT(pacer.frames == frames);
+            EXPECT(pacer.intervals > 0 && pacer.interval_min > 0);
+        );
+    }
+
+    {
+        TESTGROUP("Mailbox");
+        TEST(
+            name = "Triple buffer hands over the newest frame";
+
+            mailbox_tbuf_init(&tbuf);
+            EXPECT(mailbox_tbuf_latest(&tbuf) == NULL);
+            for(uint64_t i = 1; i <= 3; ++i) {
+                mailbox_tbuf_back(&tbuf)->vram[0] = i;
+                mailbox_tbuf_publish(&tbuf);
+            }
+            const mailbox_frame_t *frame = mailbox_tbuf_latest(&tbuf);
+            EXPECT(frame != NULL && frame->vram[0] == 3);
+            EXPECT(mailbox_tbuf_latest(&tbuf) == NULL);
+            /* the producer never gets the slot being read */
+            EXPECT(mailbox_tbuf_back(&tbuf) != frame);
+            mailbox_tbuf_back(&tbuf)->vram[0] = 4;
+            mailbox_tbuf_publish(&tbuf);
+            EXPECT(mailbox_tbuf_back(&tbuf) != frame);
+            EXPECT(frame->vram[0] == 3);
+            frame = mailbox_tbuf_latest(&tbuf);
+            EXPECT(frame != NULL && frame->vram[0] == 4);
+        );
+        TEST(
+            name = "Triple buffer across threads";
+
+            pthread_t producer;
+            mailbox_tbuf_init(&tbuf);
+            EXPECT(pthread_create(&producer, NULL, tbuf_producer, NULL) == 0);
+            uint64_t last = 0;
+            bool torn = false, ordered = true;
+            while(last < MAILBOX_TEST_FRAMES) {
+                const mailbox_frame_t *frame = mailbox_tbuf_latest(&tbuf);
+                if(frame == NULL) {
+                    sched_yield();
+                    continue;
+                }
+                for(int y = 1; y < VM_SCREEN_HEIGHT; ++y) {
+                    torn = torn || frame->vram[y] != frame->vram[0];
+                }
+                ordered = ordered && frame->vram[0] > last;
+                last = frame->vram[0];
+            }
+            pthread_join(producer, NULL);
+            EXPECT(!torn && ordered);
+        );
+        TEST(
+            name = "Input queue";
+
+            mailbox_event_t ev = { .type = MAILBOX_KEY };
+            mailbox_queue_init(&queue);
+            EXPECT(!mailbox_queue_pop(&queue, &ev));
+            bool pushed = true;
+            for(int i = 0; i < MAILBOX_QUEUE_SIZE; ++i) {
+                ev.key = i & 0xF;
+                ev.state = i & 1;
+                pushed = pushed && mailbox_queue_push(&queue, &ev);
+            }
+            EXPECT(pushed);
+            EXPECT(!mailbox_queue_push(&queue, &ev));
+            bool popped = true;
+            for(int i = 0; i < MAILBOX_QUEUE_SIZE; ++i) {
+                popped = popped && mailbox_queue_pop(&queue, &ev) &&
+                         ev.key == (i & 0xF) && ev.state == (i & 1);
+            }
+            EXPECT(popped);
+            EXPECT(!mailbox_queue_pop(&queue, &ev));
+        );
+        TEST(
+            name = "Input queue across threads";
+
+            pthread_t producer;
+            mailbox_queue_init(&queue);
+            EXPECT(pthread_create(&producer, NULL, queue_producer, NULL) == 0);
+            uint32_t n = 0;
+            bool ordered = true;
+            while(n < MAILBOX_TEST_EVENTS) {
+                mailbox_event_t ev;
+                if(!mailbox_queue_pop(&queue, &ev)) {
+                    sched_yield();
+                    continue;
+                }
+                ordered = ordered && ev.key == (n & 0xFF) && ev.state == ((n >> 8) & 0xFF);
+                n += 1;
+            }
+            pthread_join(producer, NULL);
+            EXPECT(ordered);
+        );
+    }
+
+    {
+        TESTGROUP("Trace");
+        TEST(
+            name = "Records decode to text";
+
+            const char *path = "hnc8_test.trace";
+            ch8_load(&vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+            EXPECT(trace_open(&trace, path) == 0);
+            trace_frame(&trace, 0x123456789ULL);
+            for(int k = 0; k < 3; ++k) {
+                uint16_t pc = vm.pc, op = ch8_get_op(&vm);
+                ch8_tick(&vm);
+                trace_insn(&trace, &vm, pc, op);
+            }
+            EXPECT(trace_close(&trace) == 0);
+
+            char out[512];
+            FILE *f = tmpfile();
+            EXPECT(f != NULL);
+            EXPECT(trace_decode(path, f) == 0);
+            remove(path);
+            rewind(f);
+            size_t len = fread(out, 1, sizeof(out) - 1, f);
+            out[len] = '\0';
+            fclose(f);
+            const char *expect = "; frame 4886718345\n"
+                                 "0200:    6003    LD V0, 3             V0=03\n"
+                                 "0202:    E0A1    SKNP V0              V0=03\n"
+                                 "0206:    C2FF    RND V2, 255          V2=";
+            EXPECT(strncmp(out, expect, strlen(expect)) == 0);
+        );
+        TEST(
+            name = "More records than the ring holds";
+
+            const char *path = "hnc8_test.trace";
+            ch8_load(&vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+            EXPECT(trace_open(&trace, path) == 0);
+            uint32_t n = TRACE_RING_SIZE * 3 + 7;
+            for(uint32_t k = 0; k < n; ++k) {
+                uint16_t pc = vm.pc, op = ch8_get_op(&vm);
+                ch8_tick(&vm);
+                trace_insn(&trace, &vm, pc, op);
+            }
+            EXPECT(trace_close(&trace) == 0);
+
+            FILE *f = tmpfile();
+            EXPECT(f != NULL);
+            EXPECT(trace_decode(path, f) == 0);
+            remove(path);
+            rewind(f);
+            uint32_t lines = 0;
+            int c;
+            while((c = fgetc(f)) != EOF) {
+                lines += c == '\n';
+            }
+            fclose(f);
+            EXPECT(lines == n);
+        );
+        TEST(
+            name = "Not a trace";
+
+            const char *path = "hnc8_test.trace";
+            FILE *f = fopen(path, "wb");
+            EXPECT(f != NULL);
+            fputs("HNC8TRC0 not a trace", f);
+            fclose(f);
+            EXPECT(trace_decode(path, stdout) != 0);
+            remove(path);
+        );
+    }
+
+    {
+        TESTGROUP("Profiler");
+        TEST(
+            name = "Exact profile counts every instruction";
+
+            ch8_load(&vm, (const uint16_t *)rom_cfg, sizeof(rom_cfg));
+            ch8_profile_init(&prof, &vm, CH8_PROFILE_EXACT);
+            while(vm.cycles < 10) {
+                ch8_profile_run(&prof, &vm, 10 - vm.cycles);
+            }
+            EXPECT(prof.samples == 10);
+            EXPECT(prof.hits[0x200] == 1 && prof.hits[0x20C] == 1);
+            EXPECT(prof.hits[0x202] == 3 && prof.hits[0x204] == 3);
+            EXPECT(prof.forms[CH8_OP_JP] == 3 && prof.forms[CH8_OP_CALL] == 1);
+
+            uint16_t hot[3];
+            EXPECT(ch8_profile_hot(&prof, hot, 3) == 3);
+            EXPECT(hot[0] == 0x202 && hot[1] == 0x204 && hot[2] == 0x200);
+        );
+        TEST(
+            name = "Collapsed call stacks";
+
+            char out[256];
+            FILE *f = tmpfile();
+            EXPECT(f != NULL);
+            EXPECT(ch8_profile_write_collapsed(&prof, f) == 0);
+            rewind(f);
+            size_t len = fread(out, 1, sizeof(out) - 1, f);
+            out[len] = '\0';
+            fclose(f);
+            EXPECT(prof.stack_count == 2);
+            EXPECT(strstr(out, "start 7\n") != NULL);
+            EXPECT(strstr(out, "start;sub_20A 3\n") != NULL);
+        );
+        TEST(
+            name = "Sampling every Nth instruction";
+
+            ch8_load(&vm, (const uint16_t *)rom_cfg, sizeof(rom_cfg));
+            ch8_profile_init(&prof, &vm, 4);
+            while(vm.cycles < 1000) {
+                ch8_profile_run(&prof, &vm, 1000 - vm.cycles);
+            }
+            EXPECT(prof.samples == 250);
+            EXPECT(prof.hits[0x202] + prof.hits[0x204] >= 248);
+        );
+        TEST(
+            name = "Skipped cycles keep their weight";
+
+            ch8_load(&vm, (const uint16_t *)rom_keys, sizeof(rom_keys));
+            ch8_profile_init(&prof, &vm, 4);
+            ch8_profile_sample(&prof, &vm);
+            vm.cycles += 40;
+            ch8_profile_sample(&prof, &vm);
+            ch8_profile_sample(&prof, &vm);
+            EXPECT(prof.samples == 11);
+            EXPECT(prof.hits[vm.pc] == 11);
+            EXPECT(ch8_profile_span(&prof, &vm, 100) == 4);
+        );
+    }
+
     int count = __COUNTER__;
     printf("\nSuccessfully ran %i/%i tests\n", count - failed_tests_count, count);
 